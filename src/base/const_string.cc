@@ -100,6 +100,18 @@ ConstString::ConstString(ConstString& str, size_t size)
   : internals_(str.internals_),
     size_(std::min(size, str.size())) {}
 
+ConstString::ConstString(ConstString& str, size_t offset, size_t size)
+    : size_(std::min(size, str.size() - std::min(offset, str.size()))) {
+  auto internals = str.CollapseRope();
+  DCHECK(internals->string || !str.size());
+
+  // The slice shares the ownership of the whole buffer.
+  internals_.reset(new Internal{
+      .medium = internals->medium,
+      .string = {internals->string, internals->string.get() +
+                                        std::min(offset, str.size())}});
+}
+
 ConstString::ConstString(const String& str)
     : internals_(
           new Internal{.string = {new char[str.size() + 1], CharArrayDeleter},
@@ -472,6 +484,35 @@ ConstString ConstString::Hash(ui8 output_size) const {
   return Immutable(buf, std::min<ui8>(16u, output_size));
 }
 
+void ConstString::ForEachSegment(const SegmentVisitor& visitor) const {
+  VisitSegments(visitor, size_);
+}
+
+size_t ConstString::VisitSegments(const SegmentVisitor& visitor,
+                                  size_t limit) const {
+  limit = std::min(limit, size_);
+
+  // The string may be a prefix of the shared internals.
+  auto internals = internals_;
+  if (internals->rope.empty()) {
+    if (limit) {
+      DCHECK(internals->string);
+      visitor(internals->string.get(), limit);
+    }
+    return limit;
+  }
+
+  size_t visited = 0;
+  for (const auto& str : internals->rope) {
+    if (visited == limit) {
+      break;
+    }
+    visited += str.VisitSegments(visitor, limit - visited);
+  }
+
+  return visited;
+}
+
 ConstString::ConstString(const char* WEAK_PTR str, size_t size, bool null_end)
     : internals_(
           new Internal{.string = {str, NoopDeleter}, .null_end = null_end}),
@@ -61,6 +61,7 @@ class ConstString {
   ConstString(const Rope& rope, size_t hint_size);   // 0-copy
 
   ConstString(ConstString& str, size_t size);        // 0-copy
+  ConstString(ConstString& str, size_t offset, size_t size);  // 0-copy
   explicit ConstString(const String& str);           // 1-copy
   static ConstString WrapString(const String& str);  // 0-copy
 
@@ -88,6 +89,11 @@ class ConstString {
 
   ConstString Hash(ui8 output_size = 16) const;  // 0-copy
 
+  using SegmentVisitor = Fn<void(const char* segment, size_t size)>;
+  void ForEachSegment(const SegmentVisitor& visitor) const;  // 0-copy
+  // Visits the contiguous parts of the string in order - the rope isn't
+  // collapsed.
+
  private:
   struct Internal {
     SharedPtr<String> medium;
@@ -102,6 +108,9 @@ class ConstString {
   InternalPtr CollapseRope();
   InternalPtr NullTerminate();
 
+  size_t VisitSegments(const SegmentVisitor& visitor, size_t limit) const;
+  // Returns the number of visited characters - not more than |limit|.
+
   InternalPtr internals_ = InternalPtr(new Internal);
 
   size_t size_ = 0;
@@ -19,6 +19,23 @@ TEST(ConstStringTest, PrefixConstructor) {
   EXPECT_EQ("abcdef"_l, prefix_too_large.string_copy(false));
 }
 
+TEST(ConstStringTest, SliceConstructor) {
+  ConstString string("abcdef"_l);
+
+  ConstString slice(string, 2, 3);
+  EXPECT_EQ(3u, slice.size());
+  EXPECT_EQ("cde"_l, slice.string_copy(false));
+  EXPECT_STREQ("cde", slice.c_str());
+
+  ConstString slice_too_large(string, 4, 10);
+  EXPECT_EQ(2u, slice_too_large.size());
+  EXPECT_EQ("ef"_l, slice_too_large.string_copy(false));
+
+  ConstString rope(ConstString::Rope{"ab"_l, "cd"_l});
+  ConstString rope_slice(rope, 1, 2);
+  EXPECT_EQ("bc"_l, rope_slice.string_copy(false));
+}
+
 TEST(ConstStringTest, Find) {
   ConstString string("cdabcdcef"_l);
   EXPECT_EQ(4u, string.find("cdc"));
@@ -59,6 +76,18 @@ TEST(ConstStringTest, EmptyString) {
   EXPECT_STREQ("", empty3.c_str());
 }
 
+TEST(ConstStringTest, ForEachSegment) {
+  ConstString rope(ConstString::Rope{
+      "All your"_l, ConstString::Rope{" base"_l, " are"_l}, " belong to us"_l});
+  ConstString prefix(rope, 15);
+
+  List<String> segments;
+  prefix.ForEachSegment([&segments](const char* segment, size_t size) {
+    segments.emplace_back(segment, size);
+  });
+  EXPECT_EQ((List<String>{"All your", " base", " a"}), segments);
+}
+
 // TODO: write a lot of tests.
 
 }  // namespace base
@@ -7,6 +7,8 @@ namespace base {
 
 class File final : public Data {
  public:
+  using Writer = Fn<bool(NativeType fd, String* error)>;
+
   explicit File(const String& path);  // Open read-only file
 
   using Handle::Close;
@@ -27,12 +29,19 @@ class File final : public Data {
             String* error = nullptr);
 
   bool CopyInto(const String& dst_path, String* error = nullptr);
+  // Tries to make a reflink at first, then falls back to in-kernel copy.
+  bool LinkInto(const String& dst_path, String* error = nullptr);
+  // Falls back to |CopyInto()|, if the hard-link can't be made.
 
   static ui64 Size(const String& path, String* error = nullptr);
   static bool Read(const String& path, Immutable* output,
                    String* error = nullptr);
   static bool Write(const String& path, Immutable input,
                     String* error = nullptr);
+  static bool Write(const String& path, ui64 size, const Writer& writer,
+                    String* error = nullptr);
+  // The |writer| fills the file, that is already allocated for |size| bytes,
+  // through the native handle.
   static bool Hash(const String& path, Immutable* output,
                    const List<Literal>& skip_list = List<Literal>(),
                    String* error = nullptr);
@@ -46,7 +55,7 @@ class File final : public Data {
   static bool Delete(const String& path, String* error = nullptr);
 
  private:
-  File(const String& path, ui64 size);  // Open truncated write-only file
+  File(const String& path, ui64 size);  // Open truncated file for writing
   bool Close(String* error = nullptr);
 
   String error_;
@@ -2,6 +2,7 @@
 
 #include <base/assert.h>
 #include <base/c_utils.h>
+#include <base/hasher.h>
 #include <base/string_utils.h>
 
 #include <fcntl.h>
@@ -9,7 +10,10 @@
 #include <sys/stat.h>
 
 #if defined(OS_LINUX)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
 #include <sys/sendfile.h>
+#include <sys/syscall.h>
 #elif defined(OS_MACOSX)
 #include <copyfile.h>
 #endif
@@ -137,16 +141,17 @@ bool File::Hash(Immutable* output, const List<Literal>& skip_list,
     return false;
   }
 
-  for (const char* skip : skip_list) {
-    if (tmp_output.find(skip) != String::npos) {
-      if (error) {
-        error->assign("Skip-list hit: " + String(skip));
-      }
-      return false;
+  // The skip-list is searched in the same pass over the contents.
+  Hasher hasher(Hasher::XXH3_TREE, skip_list);
+  hasher.Update(tmp_output);
+  if (!hasher.skipped().empty()) {
+    if (error) {
+      error->assign("Skip-list hit: " + String(hasher.skipped().front()));
     }
+    return false;
   }
 
-  output->assign(base::Hexify(tmp_output.Hash()));
+  output->assign(base::Hexify(hasher.Digest()));
   return true;
 }
 
@@ -169,16 +174,39 @@ bool File::CopyInto(const String& dst_path, String* error) {
 
   bool result = false;
 #if defined(OS_LINUX)
-  size_t total_bytes = 0;
+  // The reflink shares the extents, so there is no copy at all - if the
+  // filesystem supports it.
+#if defined(FICLONE)
+  result = ioctl(dst.native(), FICLONE, native()) == 0;
+#endif
+
+  loff_t total_bytes = 0;
   ssize_t size = 0;
-  while (total_bytes < src_size) {
-    size = sendfile(dst.native(), native(), nullptr, src_size - total_bytes);
+
+#if defined(__NR_copy_file_range)
+  // Works across the filesystems since Linux 5.3 only, so fall back silently.
+  while (!result && total_bytes < static_cast<loff_t>(src_size)) {
+    loff_t dst_offset = total_bytes;
+    size = syscall(__NR_copy_file_range, native(), &total_bytes, dst.native(),
+                   &dst_offset, src_size - total_bytes, 0u);
     if (size <= 0) {
       break;
     }
-    total_bytes += size;
   }
-  result = (total_bytes == src_size);
+#endif
+
+  while (!result && total_bytes < static_cast<loff_t>(src_size)) {
+    if (lseek(dst.native(), total_bytes, SEEK_SET) == -1) {
+      break;
+    }
+    size = sendfile(dst.native(), native(), &total_bytes,
+                    src_size - total_bytes);
+    if (size <= 0) {
+      break;
+    }
+  }
+
+  result = result || (total_bytes == static_cast<loff_t>(src_size));
 #elif defined(OS_MACOSX)
   if (fcopyfile(native(), dst.native(), nullptr, COPYFILE_ALL) != 0) {
     GetLastError(error);
@@ -197,6 +225,27 @@ bool File::CopyInto(const String& dst_path, String* error) {
   return result;
 }
 
+bool File::LinkInto(const String& dst_path, String* error) {
+  DCHECK(IsValid());
+
+#if defined(OS_LINUX)
+  // The hard-link to an open file can be made through the "/proc" without
+  // additional capabilities - unless the file is already unlinked.
+  const String proc_path = "/proc/self/fd/" + std::to_string(native());
+  auto Link = [&proc_path, &dst_path]() {
+    return linkat(AT_FDCWD, proc_path.c_str(), AT_FDCWD, dst_path.c_str(),
+                  AT_SYMLINK_FOLLOW) == 0;
+  };
+
+  if (Link() ||
+      (errno == EEXIST && unlink(dst_path.c_str()) == 0 && Link())) {
+    return true;
+  }
+#endif
+
+  return CopyInto(dst_path, error);
+}
+
 // static
 ui64 File::Size(const String& path, String* error) {
   File file(path);
@@ -271,6 +320,31 @@ bool File::Write(const String& path, Immutable input, String* error) {
   return total_bytes == input.size();
 }
 
+// static
+bool File::Write(const String& path, ui64 size, const Writer& writer,
+                 String* error) {
+  // Force unlinking of |path|, since it may be hard-linked with other places.
+  if (unlink(path.c_str()) == -1 && errno != ENOENT) {
+    GetLastError(error);
+    return false;
+  }
+
+  File dst(path, size);
+
+  if (!dst.IsValid()) {
+    dst.GetCreationError(error);
+    return false;
+  }
+
+  if (!writer(dst.native(), error)) {
+    dst.Handle::Close();
+    Delete(path + ".tmp");
+    return false;
+  }
+
+  return dst.Close(error);
+}
+
 // static
 bool File::Copy(const String& src_path, const String& dst_path, String* error) {
   File src(src_path);
@@ -325,7 +399,8 @@ File::File(const String& path, ui64 size)
         // "split-dwarf" option, see
         // https://sourceware.org/bugzilla/show_bug.cgi?id=971
         const auto mode = mode_t(S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-        const auto flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        // The read access is required to map the file for writing.
+        const auto flags = O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC;
         const String tmp_path = path + ".tmp";
         return open(tmp_path.c_str(), flags, mode);
       }()),
@@ -81,7 +81,7 @@ TEST(FileTest, Size) {
 
 TEST(FileTest, Hash) {
   const auto content = "All your base are belong to us"_l;
-  const auto expected_hash = "c9e92e37df1e856cbd0abffe104225b8"_l;
+  const auto expected_hash = "9e151b8e2355be3709a223b3c693fd10"_l;
   const base::TemporaryDir temp_dir;
   const String file_path = String(temp_dir) + "/file";
 
@@ -193,5 +193,55 @@ TEST(FileTest, Link) {
   EXPECT_EQ(inode, st.st_ino);
 }
 
+TEST(FileTest, LinkInto) {
+  const auto expected_content = "All your base are belong to us"_l;
+  const TemporaryDir temp_dir;
+  const String file1 = String(temp_dir) + "/1";
+  const String file2 = String(temp_dir) + "/2";
+
+  ASSERT_TRUE(File::Write(file1, expected_content));
+  ASSERT_TRUE(File::Write(file2, "Nothing lasts forever"_l));
+
+  File file(file1);
+  String error;
+  ASSERT_TRUE(file.LinkInto(file2, &error)) << error;
+
+  struct stat st1, st2;
+  ASSERT_EQ(0, stat(file1.c_str(), &st1));
+  ASSERT_EQ(0, stat(file2.c_str(), &st2));
+  EXPECT_EQ(st1.st_ino, st2.st_ino);
+
+  // The file is already unlinked - so it's copied instead.
+  ASSERT_TRUE(File::Delete(file1));
+  ASSERT_TRUE(File::Delete(file2));
+  ASSERT_TRUE(file.LinkInto(file2, &error)) << error;
+
+  Immutable content;
+  ASSERT_TRUE(File::Read(file2, &content, &error)) << error;
+  EXPECT_EQ(expected_content, content);
+}
+
+TEST(FileTest, WriteWithWriter) {
+  const TemporaryDir temp_dir;
+  const String file_path = String(temp_dir) + "/1";
+
+  String error;
+  EXPECT_FALSE(File::Write(file_path, 3, [](int, String* error) {
+    error->assign("Failed");
+    return false;
+  }, &error));
+  EXPECT_EQ("Failed", error);
+  EXPECT_FALSE(File::Exists(file_path));
+  EXPECT_FALSE(File::Exists(file_path + ".tmp"));
+
+  ASSERT_TRUE(File::Write(file_path, 3, [](int fd, String*) {
+    return write(fd, "abc", 3) == 3;
+  }, &error)) << error;
+
+  Immutable content;
+  ASSERT_TRUE(File::Read(file_path, &content, &error)) << error;
+  EXPECT_EQ("abc"_l, content);
+}
+
 }  // namespace base
 }  // namespace dist_clang
@@ -15,6 +15,10 @@ ui64 CalculateDirectorySize(const String& path, String* error = nullptr);
 
 Pair<time_t /* unix timestamp, nanoseconds */> GetModificationTime(
     const String& path, String* error = nullptr);
+Pair<time_t /* unix timestamp, nanoseconds */> GetChangeTime(
+    const String& path, String* error = nullptr);
+// Unlike the modification time, the change time of the inode can't be set
+// back by the user.
 
 // This function returns the path to an object with the least recent
 // modification time. It may be regular file, directory or any other kind of
@@ -96,6 +96,25 @@ Pair<time_t> GetModificationTime(const String& path, String* error) {
   return {time_spec.tv_sec, time_spec.tv_nsec};
 }
 
+Pair<time_t> GetChangeTime(const String& path, String* error) {
+  struct stat buffer;
+  if (stat(path.c_str(), &buffer) == -1) {
+    GetLastError(error);
+    return {0, 0};
+  }
+
+  struct timespec time_spec;
+#if defined(OS_MACOSX)
+  time_spec = buffer.st_ctimespec;
+#elif defined(OS_LINUX)
+  time_spec = buffer.st_ctim;
+#else
+#pragma message "Don't know how to get change time on this platform!"
+  NOTREACHED();
+#endif
+  return {time_spec.tv_sec, time_spec.tv_nsec};
+}
+
 bool GetLeastRecentPath(const String& path, String& result, const char* regex,
                         String* error) {
   DIR* dir = opendir(path.c_str());
@@ -0,0 +1,304 @@
+#include <base/hasher.h>
+
+#include <base/assert.h>
+#include <base/thread.h>
+
+#include <third_party/xxhash/exported/xxhash.h>
+
+#include STL(algorithm)
+
+#include <string.h>
+
+namespace dist_clang {
+namespace base {
+
+namespace {
+
+// The skip-list is searched in the same blocks, that are hashed right after -
+// while they are still in the CPU cache.
+const size_t kScanBlockSize = 64 * 1024;
+
+// Starting the threads costs more than hashing a few chunks.
+const ui64 kMinParallelChunks = 4;
+const ui32 kMaxTreeThreads = 8;
+
+Immutable MakeDigest(XXH128_hash_t hash, ui8 output_size) {
+  XXH128_canonical_t canonical;
+  XXH128_canonicalFromHash(&canonical, hash);
+
+  char* buf = new char[sizeof(canonical.digest)];
+  memcpy(buf, canonical.digest, sizeof(canonical.digest));
+  return Immutable(buf, std::min<ui8>(sizeof(canonical.digest), output_size));
+}
+
+void AppendCanonical(XXH128_hash_t hash, String* output) {
+  XXH128_canonical_t canonical;
+  XXH128_canonicalFromHash(&canonical, hash);
+  output->append(reinterpret_cast<const char*>(canonical.digest),
+                 sizeof(canonical.digest));
+}
+
+}  // namespace
+
+Hasher::Hasher(Engine engine, const List<Literal>& skip_list)
+    : engine_(engine), pending_(skip_list) {
+  for (const auto& literal : pending_) {
+    max_literal_size_ = std::max(max_literal_size_, literal.size());
+  }
+
+  if (engine_ != MURMUR3) {
+    state_ = XXH3_createState();
+    CHECK(state_);
+    XXH3_128bits_reset(state_);
+  }
+}
+
+Hasher::~Hasher() {
+  if (state_) {
+    XXH3_freeState(state_);
+  }
+}
+
+void Hasher::Update(const char* data, size_t size) {
+  if (!size) {
+    return;
+  }
+
+  if (engine_ == MURMUR3) {
+    Scan(data, size);
+    copies_.emplace_back(data, size);
+    rope_.push_back(Immutable::WrapString(copies_.back()));
+    return;
+  }
+
+  UpdateSpans({{data, size}});
+}
+
+void Hasher::Update(const Immutable& str) {
+  if (str.empty()) {
+    return;
+  }
+
+  if (engine_ == MURMUR3) {
+    str.ForEachSegment(
+        [this](const char* data, size_t size) { Scan(data, size); });
+    rope_.push_back(str);
+    return;
+  }
+
+  List<Span> spans;
+  str.ForEachSegment([&spans](const char* data, size_t size) {
+    spans.emplace_back(data, size);
+  });
+  UpdateSpans(spans);
+}
+
+Immutable Hasher::Digest(ui8 output_size) {
+  if (engine_ == MURMUR3) {
+    return Immutable(rope_).Hash(output_size);
+  }
+
+  XXH128_hash_t hash = XXH3_128bits_digest(state_);
+  if (!chunk_hashes_.empty()) {
+    AppendCanonical(hash, &chunk_hashes_);
+    hash = XXH3_128bits_withSeed(chunk_hashes_.data(), chunk_hashes_.size(),
+                                 total_size_);
+  }
+
+  return MakeDigest(hash, output_size);
+}
+
+// static
+Immutable Hasher::Hash(const Immutable& str, ui8 output_size, Engine engine) {
+  if (engine == MURMUR3) {
+    return str.Hash(output_size);
+  }
+
+  // Most of the hashed strings are small and contiguous - don't allocate the
+  // state for them.
+  if (engine == XXH3 || str.size() <= kTreeChunkSize) {
+    List<Span> spans;
+    str.ForEachSegment([&spans](const char* data, size_t size) {
+      spans.emplace_back(data, size);
+    });
+    if (spans.size() <= 1) {
+      return MakeDigest(spans.empty() ? XXH3_128bits(nullptr, 0)
+                                      : XXH3_128bits(spans.front().first,
+                                                     spans.front().second),
+                        output_size);
+    }
+  }
+
+  Hasher hasher(engine);
+  hasher.Update(str);
+  return hasher.Digest(output_size);
+}
+
+void Hasher::UpdateSpans(const List<Span>& spans) {
+  ui64 size = 0;
+  for (const auto& span : spans) {
+    size += span.second;
+  }
+
+  // The rest of the current chunk is hashed in place, and the last chunk stays
+  // in the state - it may be the last one of the whole contents.
+  ui64 head = size, chunks = 0;
+  if (engine_ == XXH3_TREE) {
+    head = std::min(size, kTreeChunkSize - chunk_size_);
+    if (size > head) {
+      chunks = (size - head - 1) / kTreeChunkSize;
+    }
+    if (chunks < kMinParallelChunks) {
+      head = size;
+      chunks = 0;
+    }
+  }
+  const ui64 tail = head + chunks * kTreeChunkSize;
+
+  ui64 offset = 0;
+  for (const auto& span : spans) {
+    const ui64 begin = offset, end = offset + span.second;
+    offset = end;
+
+    // The skip-list is searched sequentially in the parallel part.
+    if (begin < head) {
+      Feed(span.first, std::min(end, head) - begin);
+    }
+    if (chunks && begin < tail && end > head && !pending_.empty()) {
+      const ui64 from = std::max(begin, head), to = std::min(end, tail);
+      Scan(span.first + (from - begin), to - from);
+    }
+    if (chunks && end > tail && begin <= tail) {
+      FeedChunks(spans, head, chunks);
+    }
+    if (end > tail) {
+      const ui64 from = std::max(begin, tail);
+      Feed(span.first + (from - begin), end - from);
+    }
+  }
+}
+
+void Hasher::Scan(const char* data, size_t size) {
+  if (pending_.empty() || !size) {
+    return;
+  }
+
+  // The literal may start in the previous contents.
+  if (!border_.empty()) {
+    const String border =
+        border_ + String(data, std::min(size, max_literal_size_ - 1));
+    for (auto it = pending_.begin(); it != pending_.end();) {
+      if (border.find(*it) != String::npos) {
+        skipped_.push_back(*it);
+        it = pending_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  for (auto it = pending_.begin(); it != pending_.end();) {
+    if (memmem(data, size, *it, it->size())) {
+      skipped_.push_back(*it);
+      it = pending_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  if (pending_.empty()) {
+    return;
+  }
+
+  const size_t keep = max_literal_size_ - 1;
+  if (size >= keep) {
+    border_.assign(data + size - keep, keep);
+  } else {
+    border_.append(data, size);
+    if (border_.size() > keep) {
+      border_.erase(0, border_.size() - keep);
+    }
+  }
+}
+
+void Hasher::Feed(const char* data, size_t size) {
+  while (size) {
+    size_t part = std::min(size, kScanBlockSize);
+    if (engine_ == XXH3_TREE) {
+      if (chunk_size_ == kTreeChunkSize) {
+        FlushChunk();
+      }
+      part = std::min<ui64>(part, kTreeChunkSize - chunk_size_);
+    }
+
+    Scan(data, part);
+    XXH3_128bits_update(state_, data, part);
+    chunk_size_ += part;
+    total_size_ += part;
+    data += part;
+    size -= part;
+  }
+}
+
+void Hasher::FeedChunks(const List<Span>& spans, ui64 offset, ui64 chunks) {
+  DCHECK(engine_ == XXH3_TREE);
+
+  if (chunk_size_) {
+    FlushChunk();
+  }
+
+  // Split the spans by the chunk boundaries.
+  Vector<List<Span>> parts(chunks);
+  ui64 begin = 0;
+  for (const auto& span : spans) {
+    const ui64 end = begin + span.second;
+    for (ui64 from = std::max(begin, offset);
+         from < end && from < offset + chunks * kTreeChunkSize;) {
+      const ui64 chunk = (from - offset) / kTreeChunkSize;
+      const ui64 to = std::min(end, offset + (chunk + 1) * kTreeChunkSize);
+      parts[chunk].emplace_back(span.first + (from - begin), to - from);
+      from = to;
+    }
+    begin = end;
+  }
+
+  Vector<XXH128_hash_t> hashes(chunks);
+  const ui32 threads = std::min<ui64>(
+      chunks, std::min(kMaxTreeThreads,
+                       std::max(1u, std::thread::hardware_concurrency())));
+  auto worker = [&parts, &hashes, threads](ui32 first) {
+    XXH3_state_t* state = XXH3_createState();
+    CHECK(state);
+    for (ui64 i = first; i < parts.size(); i += threads) {
+      XXH3_128bits_reset(state);
+      for (const auto& part : parts[i]) {
+        XXH3_128bits_update(state, part.first, part.second);
+      }
+      hashes[i] = XXH3_128bits_digest(state);
+    }
+    XXH3_freeState(state);
+  };
+
+  Vector<Thread> workers;
+  for (ui32 i = 1; i < threads; ++i) {
+    workers.emplace_back("Hash Tree Worker"_l, worker, i);
+  }
+  worker(0);
+  for (auto& thread : workers) {
+    thread.join();
+  }
+
+  for (const auto& hash : hashes) {
+    AppendCanonical(hash, &chunk_hashes_);
+  }
+  total_size_ += chunks * kTreeChunkSize;
+}
+
+void Hasher::FlushChunk() {
+  AppendCanonical(XXH3_128bits_digest(state_), &chunk_hashes_);
+  XXH3_128bits_reset(state_);
+  chunk_size_ = 0;
+}
+
+}  // namespace base
+}  // namespace dist_clang
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <base/const_string.h>
+
+struct XXH3_state_s;
+
+namespace dist_clang {
+namespace base {
+
+// Streaming hash of the contents - up to 128 bits.
+//
+// The engines give different hashes of the same contents - so the persistent
+// hashes, e.g. the cache keys, should change their version with the engine.
+class Hasher {
+ public:
+  enum Engine : ui8 {
+    MURMUR3 = 1,
+    // The legacy |ConstString::Hash()| - the contents are collected and hashed
+    // at once.
+
+    XXH3 = 2,
+    // The 128-bit XXH3 from xxHash - uses SSE2, AVX2 or NEON, where available.
+
+    XXH3_TREE = 3,
+    // The XXH3 of the hashes of |kTreeChunkSize| chunks - the chunks of a big
+    // input are hashed on a few cores. The input not bigger than a chunk has
+    // the same hash as with |XXH3|.
+  };
+
+  enum : ui64 { kTreeChunkSize = 1024 * 1024 };
+
+  explicit Hasher(Engine engine = XXH3_TREE,
+                  const List<Literal>& skip_list = List<Literal>());
+  ~Hasher();
+
+  Hasher(const Hasher&) = delete;
+  Hasher& operator=(const Hasher&) = delete;
+
+  void Update(const char* data, size_t size);
+  void Update(const Immutable& str);  // 0-copy
+  // The rope is hashed segment by segment - without collapsing it.
+
+  Immutable Digest(ui8 output_size = 16);
+  // Should be called once - after all updates.
+
+  inline const List<Literal>& skipped() const { return skipped_; }
+  // The literals of the skip-list, that are found in the contents. The search
+  // is fused with hashing, and sees the literals across the segments.
+
+  static Immutable Hash(const Immutable& str, ui8 output_size = 16,
+                        Engine engine = XXH3_TREE);
+
+ private:
+  using Span = Pair<const char*, size_t>;
+
+  void UpdateSpans(const List<Span>& spans);
+  void Scan(const char* data, size_t size);
+  void Feed(const char* data, size_t size);
+  void FeedChunks(const List<Span>& spans, ui64 offset, ui64 chunks);
+  // Hashes the |chunks| whole chunks starting at |offset| of |spans| in
+  // parallel.
+  void FlushChunk();
+
+  const Engine engine_;
+
+  List<Literal> pending_, skipped_;
+  size_t max_literal_size_ = 0;
+  String border_;
+  // The tail of the previous contents - for the literals across the segments.
+
+  Immutable::Rope rope_;
+  List<String> copies_;
+  // The contents for |MURMUR3|.
+
+  XXH3_state_s* state_ = nullptr;
+  ui64 chunk_size_ = 0, total_size_ = 0;
+  String chunk_hashes_;
+  // The canonical hashes of the full chunks for |XXH3_TREE|. The last full
+  // chunk is flushed only when the next one starts.
+};
+
+}  // namespace base
+}  // namespace dist_clang
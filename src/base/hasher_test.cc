@@ -0,0 +1,102 @@
+#include <base/hasher.h>
+
+#include <third_party/gtest/exported/include/gtest/gtest.h>
+
+namespace dist_clang {
+namespace base {
+
+namespace {
+
+Immutable MakeRope(const String& str, size_t piece) {
+  Immutable::Rope rope;
+  for (size_t i = 0; i < str.size(); i += piece) {
+    rope.emplace_back(str.substr(i, piece));
+  }
+  return Immutable(rope);
+}
+
+}  // namespace
+
+TEST(HasherTest, RopeHasSameHash) {
+  String str;
+  for (ui32 i = 0; i < 10000; ++i) {
+    str += std::to_string(i);
+  }
+  const Immutable flat(str), rope = MakeRope(str, 333);
+
+  for (auto engine : {Hasher::MURMUR3, Hasher::XXH3, Hasher::XXH3_TREE}) {
+    EXPECT_EQ(Hasher::Hash(flat, 16, engine), Hasher::Hash(rope, 16, engine))
+        << "engine " << engine;
+
+    Hasher hasher(engine);
+    hasher.Update(str.data(), 100);
+    hasher.Update(str.data() + 100, str.size() - 100);
+    EXPECT_EQ(Hasher::Hash(flat, 16, engine), hasher.Digest())
+        << "engine " << engine;
+  }
+
+  EXPECT_EQ(flat.Hash(), Hasher::Hash(flat, 16, Hasher::MURMUR3));
+  EXPECT_NE(Hasher::Hash(flat, 16, Hasher::MURMUR3),
+            Hasher::Hash(flat, 16, Hasher::XXH3));
+  EXPECT_EQ(4u, Hasher::Hash(flat, 4).size());
+}
+
+TEST(HasherTest, TreeHash) {
+  // The small inputs have the same hash as with the plain engine.
+  const Immutable small("some small input"_l);
+  EXPECT_EQ(Hasher::Hash(small, 16, Hasher::XXH3),
+            Hasher::Hash(small, 16, Hasher::XXH3_TREE));
+
+  // The hash doesn't depend on how the input is split - and whether the
+  // chunks are hashed in parallel.
+  String str(Hasher::kTreeChunkSize * 6 + 12345, 'a');
+  for (size_t i = 0; i < str.size(); i += 101) {
+    str[i] = 'a' + i % 26;
+  }
+  const Immutable flat(str);
+  const auto expected = Hasher::Hash(flat, 16, Hasher::XXH3_TREE);
+  EXPECT_NE(Hasher::Hash(flat, 16, Hasher::XXH3), expected);
+  EXPECT_EQ(expected, Hasher::Hash(MakeRope(str, 100000), 16,
+                                   Hasher::XXH3_TREE));
+
+  Hasher hasher(Hasher::XXH3_TREE);
+  hasher.Update(str.data(), 777);
+  hasher.Update(MakeRope(str.substr(777, Hasher::kTreeChunkSize * 5), 54321));
+  hasher.Update(str.data() + 777 + Hasher::kTreeChunkSize * 5,
+                str.size() - 777 - Hasher::kTreeChunkSize * 5);
+  EXPECT_EQ(expected, hasher.Digest());
+
+  // Exactly one chunk is still hashed as a whole.
+  const Immutable chunk(str.substr(0, Hasher::kTreeChunkSize));
+  EXPECT_EQ(Hasher::Hash(chunk, 16, Hasher::XXH3),
+            Hasher::Hash(chunk, 16, Hasher::XXH3_TREE));
+}
+
+TEST(HasherTest, SkipList) {
+  const List<Literal> skip_list = {"__DATE__"_l, "__TIME__"_l};
+
+  {
+    Hasher hasher(Hasher::XXH3, skip_list);
+    hasher.Update(MakeRope("const char* date = __DATE__;", 3));
+    ASSERT_EQ(1u, hasher.skipped().size());
+    EXPECT_EQ("__DATE__"_l, hasher.skipped().front());
+  }
+
+  {
+    Hasher hasher(Hasher::XXH3_TREE, skip_list);
+    hasher.Update("#define X __TI", 14);
+    hasher.Update("ME", 2);
+    hasher.Update("__ __DATE_", 10);
+    ASSERT_EQ(1u, hasher.skipped().size());
+    EXPECT_EQ("__TIME__"_l, hasher.skipped().front());
+  }
+
+  {
+    Hasher hasher(Hasher::MURMUR3, skip_list);
+    hasher.Update(MakeRope("int main() { return 0; }", 5));
+    EXPECT_TRUE(hasher.skipped().empty());
+  }
+}
+
+}  // namespace base
+}  // namespace dist_clang
@@ -37,7 +37,11 @@ class LockedQueue {
 
   // Returns |false| only when this queue is closed or when the capacity is
   // exceeded.
-  bool Push(T obj) THREAD_SAFE {
+  bool Push(T obj) THREAD_SAFE { return TryPush(obj); }
+
+  // Like |Push()|, but the |obj| is moved from only on success - so the caller
+  // may route it elsewhere.
+  bool TryPush(T& obj) THREAD_SAFE {
     if (closed_) {
       return false;
     }
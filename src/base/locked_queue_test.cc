@@ -43,6 +43,22 @@ TEST(LockedQueueTest, ExceedCapacity) {
   queue.Close();
 }
 
+TEST(LockedQueueTest, TryPushKeepsObject) {
+  LockedQueue<UniquePtr<int>> queue(1);
+  UniquePtr<int> first(new int(1)), second(new int(2));
+
+  ASSERT_TRUE(queue.TryPush(first));
+  EXPECT_FALSE(!!first);
+  ASSERT_FALSE(queue.TryPush(second));
+  ASSERT_TRUE(!!second);
+  EXPECT_EQ(2, *second);
+
+  queue.Close();
+  ASSERT_FALSE(queue.TryPush(second));
+  EXPECT_TRUE(!!second);
+  ASSERT_TRUE(!!queue.Pop());
+}
+
 TEST(LockedQueueTest, CloseQueue) {
   LockedQueue<int> queue;
   LockedQueue<int>::Optional actual;
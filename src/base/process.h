@@ -34,9 +34,11 @@ FORWARD_TEST(EmitterTest, StoreSimpleCacheForRemoteResult);
 FORWARD_TEST(EmitterTest, StoreSimpleCacheForLocalResultWithAndWithoutBlacklist);
 FORWARD_TEST(EmitterTest, StoreDirectCacheForLocalResult);
 FORWARD_TEST(EmitterTest, StoreDirectCacheForRemoteResult);
+FORWARD_TEST(EmitterTest, StoreDependCacheForLocalResult);
 FORWARD_TEST(EmitterTest, UpdateConfiguration);
 FORWARD_TEST(EmitterTest, HitDirectCacheFromTwoLocations);
 FORWARD_TEST(EmitterTest, DontHitDirectCacheFromTwoRelativeSources);
+FORWARD_TEST(EmitterTest, PreprocessOtherUserInProcess);
 }  // namespace daemon
 
 namespace base {
@@ -106,9 +108,11 @@ class Process
   FRIEND_TEST(daemon::EmitterTest, StoreSimpleCacheForLocalResultWithAndWithoutBlacklist);
   FRIEND_TEST(daemon::EmitterTest, StoreDirectCacheForLocalResult);
   FRIEND_TEST(daemon::EmitterTest, StoreDirectCacheForRemoteResult);
+  FRIEND_TEST(daemon::EmitterTest, StoreDependCacheForLocalResult);
   FRIEND_TEST(daemon::EmitterTest, UpdateConfiguration);
   FRIEND_TEST(daemon::EmitterTest, HitDirectCacheFromTwoLocations);
   FRIEND_TEST(daemon::EmitterTest, DontHitDirectCacheFromTwoRelativeSources);
+  FRIEND_TEST(daemon::EmitterTest, PreprocessOtherUserInProcess);
 };
 
 }  // namespace base
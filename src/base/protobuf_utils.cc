@@ -4,11 +4,22 @@
 #include <base/file/file.h>
 #include <base/logging.h>
 #include <third_party/protobuf/exported/src/google/protobuf/io/zero_copy_stream_impl.h>
+#include <third_party/protobuf/exported/src/google/protobuf/message.h>
 #include <third_party/protobuf/exported/src/google/protobuf/text_format.h>
 
 #include <base/using_log.h>
 
 namespace dist_clang {
+
+namespace {
+
+// The text format can't start with the zero byte. The last byte is the version
+// of the binary format.
+const char kBinaryMagic[] = "\0PB\1";
+const size_t kBinaryMagicSize = sizeof(kBinaryMagic) - 1;
+
+}  // namespace
+
 namespace base {
 
 template <>
@@ -21,10 +32,33 @@ Log& Log::operator<<(const google::protobuf::Message& info) {
 }
 
 bool LoadFromFile(const String& path, google::protobuf::Message* message,
-                  String* error) {
+                  String* error, bool* is_binary) {
   Immutable contents;
-  if (!File::Read(path, &contents, error) ||
-      !google::protobuf::TextFormat::ParseFromString(contents, message)) {
+  if (!File::Read(path, &contents, error)) {
+    message->Clear();
+    return false;
+  }
+
+  const bool binary =
+      contents.size() >= kBinaryMagicSize &&
+      !memcmp(contents.data(), kBinaryMagic, kBinaryMagicSize);
+  if (is_binary) {
+    *is_binary = binary;
+  }
+
+  if (binary) {
+    if (!message->ParseFromArray(contents.data() + kBinaryMagicSize,
+                                 contents.size() - kBinaryMagicSize)) {
+      message->Clear();
+      if (error) {
+        error->assign("Failed to parse binary message from " + path);
+      }
+      return false;
+    }
+    return true;
+  }
+
+  if (!google::protobuf::TextFormat::ParseFromString(contents, message)) {
     message->Clear();
 
     if (!contents.empty()) {
@@ -37,14 +71,21 @@ bool LoadFromFile(const String& path, google::protobuf::Message* message,
 }
 
 bool SaveToFile(const String& path, const google::protobuf::Message& message,
-                String* error) {
+                String* error, bool binary) {
   String output;
-  if (!google::protobuf::TextFormat::PrintToString(message, &output) ||
-      !File::Write(path, Immutable(output), error)) {
+  if (binary) {
+    output.assign(kBinaryMagic, kBinaryMagicSize);
+    if (!message.AppendToString(&output)) {
+      if (error) {
+        error->assign("Failed to serialize message for " + path);
+      }
+      return false;
+    }
+  } else if (!google::protobuf::TextFormat::PrintToString(message, &output)) {
     return false;
   }
 
-  return true;
+  return File::Write(path, std::move(output), error);
 }
 
 }  // namespace base
@@ -17,10 +17,13 @@ namespace base {
 template <>
 Log& Log::operator<<(const google::protobuf::Message& info);
 
+// Both text and binary formats are loaded. The binary format is the versioned
+// magic prefix followed by the wire-format message - it's much faster to parse
+// and smaller, but not human-readable.
 bool LoadFromFile(const String& path, google::protobuf::Message* message,
-                  String* error = nullptr);
+                  String* error = nullptr, bool* is_binary = nullptr);
 bool SaveToFile(const String& path, const google::protobuf::Message& message,
-                String* error = nullptr);
+                String* error = nullptr, bool binary = false);
 
 }  // namespace base
 }  // namespace dist_clang
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <base/locked_list.h>
+
+namespace dist_clang {
+namespace base {
+
+// The set of |LockedList|s, where every thread appends to its own shard - so
+// the concurrent producers don't contend on the same tail. The order of
+// elements is kept only within the elements appended by the same thread.
+template <class T, size_t Shards = 16>
+class ShardedList {
+ public:
+  using Optional = typename LockedList<T>::Optional;
+
+  void Append(const T& obj) THREAD_SAFE { shards_[ThreadShard()].Append(obj); }
+  void Append(T&& obj) THREAD_SAFE {
+    shards_[ThreadShard()].Append(std::move(obj));
+  }
+
+  Optional Pop() THREAD_UNSAFE {
+    for (; pop_shard_ < Shards; ++pop_shard_) {
+      if (auto obj = shards_[pop_shard_].Pop()) {
+        return obj;
+      }
+    }
+    return Optional();
+  }
+
+ private:
+  static size_t ThreadShard() {
+    static Atomic<size_t> next_shard = {0};
+    thread_local const size_t shard = next_shard++ % Shards;
+    return shard;
+  }
+
+  LockedList<T> shards_[Shards];
+  size_t pop_shard_ = 0;
+};
+
+}  // namespace base
+}  // namespace dist_clang
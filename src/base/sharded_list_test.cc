@@ -0,0 +1,48 @@
+#include <base/sharded_list.h>
+
+#include <third_party/gtest/exported/include/gtest/gtest.h>
+
+#include STL(thread)
+
+namespace dist_clang {
+namespace base {
+
+TEST(ShardedListTest, BasicUsage) {
+  ShardedList<int> list;
+  ShardedList<int>::Optional actual;
+
+  for (int i = 1; i < 10; ++i) {
+    list.Append(i);
+  }
+  for (int i = 1; i < 10; ++i) {
+    ASSERT_TRUE(!!(actual = list.Pop()));
+    EXPECT_EQ(i, *actual);
+  }
+  EXPECT_FALSE(list.Pop());
+}
+
+TEST(ShardedListTest, MultiThreadedAppend) {
+  const int kThreads = 8, kElements = 1000;
+  ShardedList<int, 4> list;
+
+  List<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&list, t] {
+      for (int i = 0; i < kElements; ++i) {
+        list.Append(t * kElements + i);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  HashSet<int> popped;
+  while (auto actual = list.Pop()) {
+    EXPECT_TRUE(popped.insert(*actual).second);
+  }
+  EXPECT_EQ(static_cast<size_t>(kThreads * kElements), popped.size());
+}
+
+}  // namespace base
+}  // namespace dist_clang
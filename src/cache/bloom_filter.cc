@@ -0,0 +1,60 @@
+#include <cache/bloom_filter.h>
+
+#include <perf/stat_service.h>
+
+namespace dist_clang {
+namespace cache {
+
+namespace {
+
+const ui64 kMinCapacity = 1024;
+
+}  // namespace
+
+BloomFilter::BloomFilter(ui64 capacity)
+    : capacity_(std::max(kMinCapacity, capacity)),
+      words_((capacity_ * kBitsPerKey + 63) / 64) {
+  STAT(CACHE_FILTER_ALLOCATED, Size());
+}
+
+BloomFilter::~BloomFilter() {
+  STAT(CACHE_FILTER_RELEASED, Size());
+}
+
+void BloomFilter::Add(const String& key) {
+  bool is_new = false;
+  ForEachBit(key, [this, &is_new](ui64 word, ui64 mask) {
+    if (!(words_[word].fetch_or(mask, std::memory_order_relaxed) & mask)) {
+      is_new = true;
+    }
+    return true;
+  });
+  if (is_new) {
+    ++count_;
+  }
+}
+
+bool BloomFilter::MayContain(const String& key) const {
+  return ForEachBit(key, [this](ui64 word, ui64 mask) {
+    return (words_[word].load(std::memory_order_relaxed) & mask) != 0;
+  });
+}
+
+template <class F>
+bool BloomFilter::ForEachBit(const String& key, F&& func) const {
+  // The double hashing gives all bit positions from a single hash of key.
+  const ui64 hash = std::hash<String>()(key);
+  const ui64 h1 = hash & 0xFFFFFFFF, h2 = (hash >> 32) | 1;
+  const ui64 bits = words_.size() * 64;
+
+  for (ui32 i = 0; i < kHashes; ++i) {
+    const ui64 bit = (h1 + i * h2) % bits;
+    if (!func(bit / 64, ui64(1) << (bit % 64))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace cache
+}  // namespace dist_clang
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <base/aliases.h>
+#include <base/attributes.h>
+
+namespace dist_clang {
+namespace cache {
+
+// Probabilistic set of the cache keys - to answer the definite misses without
+// touching the filesystem. The keys can't be removed, so the filter is
+// rebuilt from scratch, when it gets stale.
+//
+// The bits are set and tested atomically without locks: a concurrent |Add()|
+// may be not visible yet, but a key is never lost after |Add()| returns.
+class BloomFilter {
+ public:
+  explicit BloomFilter(ui64 capacity);
+  // |capacity| is the number of keys, for which the false positive rate is
+  // about 1%. The rate grows, if there are more keys.
+  ~BloomFilter();
+
+  void Add(const String& key) THREAD_SAFE;
+  bool MayContain(const String& key) const THREAD_SAFE;
+
+  inline ui64 Count() const { return count_; }
+  // The number of added keys - without the ones, that the filter already
+  // seemed to contain.
+  inline ui64 Capacity() const { return capacity_; }
+  inline ui64 Size() const { return words_.size() * sizeof(ui64); }
+  // in bytes.
+
+ private:
+  enum : ui32 { kBitsPerKey = 10, kHashes = 7 };
+
+  template <class F>
+  bool ForEachBit(const String& key, F&& func) const;
+  // Stops and returns |false|, when |func| returns |false| for some bit.
+
+  const ui64 capacity_;
+  Vector<Atomic<ui64>> words_;
+  Atomic<ui64> count_ = {0};
+};
+
+}  // namespace cache
+}  // namespace dist_clang
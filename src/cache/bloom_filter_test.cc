@@ -0,0 +1,55 @@
+#include <cache/bloom_filter.h>
+
+#include <third_party/gtest/exported/include/gtest/gtest.h>
+
+namespace dist_clang {
+namespace cache {
+
+TEST(BloomFilterTest, NoFalseNegatives) {
+  BloomFilter filter(100);
+
+  for (ui32 i = 0; i < 1000; ++i) {
+    filter.Add("key" + std::to_string(i));
+  }
+  EXPECT_GE(1000u, filter.Count());
+
+  // Overfilled filter gives more false positives - but never misses a key.
+  for (ui32 i = 0; i < 1000; ++i) {
+    EXPECT_TRUE(filter.MayContain("key" + std::to_string(i)));
+  }
+}
+
+TEST(BloomFilterTest, FalsePositiveRate) {
+  const ui32 keys = 10000;
+  BloomFilter filter(keys);
+  EXPECT_LE(keys * 10 / 8, filter.Size());
+
+  for (ui32 i = 0; i < keys; ++i) {
+    filter.Add("key" + std::to_string(i));
+  }
+
+  ui32 false_positives = 0;
+  for (ui32 i = 0; i < keys; ++i) {
+    if (filter.MayContain("other" + std::to_string(i))) {
+      ++false_positives;
+    }
+  }
+  EXPECT_GT(keys * 3 / 100, false_positives);
+}
+
+TEST(BloomFilterTest, SkipDuplicatesInCount) {
+  BloomFilter filter(100);
+
+  for (ui32 i = 0; i < 10; ++i) {
+    filter.Add("key" + std::to_string(i));
+  }
+  EXPECT_EQ(10u, filter.Count());
+
+  for (ui32 i = 0; i < 10; ++i) {
+    filter.Add("key" + std::to_string(i));
+  }
+  EXPECT_EQ(10u, filter.Count());
+}
+
+}  // namespace cache
+}  // namespace dist_clang
@@ -0,0 +1,381 @@
+#include <cache/codec.h>
+
+#include <base/assert.h>
+#include <base/c_utils.h>
+
+#include <third_party/lz4/exported/lib/lz4.h>
+#include <third_party/lz4/exported/lib/lz4hc.h>
+#include <third_party/snappy/exported/snappy.h>
+#include <third_party/zstd/exported/lib/zstd.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace dist_clang {
+namespace cache {
+
+namespace {
+
+// The LZ4 block doesn't keep the size of the original data - so we prepend it.
+using LZ4Header = ui64;
+
+bool WriteAll(int fd, const char* data, size_t size, String* error) {
+  while (size) {
+    const ssize_t written = write(fd, data, size);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      base::GetLastError(error);
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+// Maps the allocated output file and lets |decompress| fill it.
+bool DecompressMapped(const String& output_path, ui64 size,
+                      const Fn<bool(char* output)>& decompress,
+                      String* error) {
+  return base::File::Write(
+      output_path, size, [size, &decompress](int fd, String* error) {
+        if (!size) {
+          return true;
+        }
+
+        if (ftruncate(fd, size) == -1) {
+          base::GetLastError(error);
+          return false;
+        }
+
+        void* map =
+            mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+          base::GetLastError(error);
+          return false;
+        }
+
+        const bool result = decompress(static_cast<char*>(map));
+        munmap(map, size);
+
+        if (!result && error) {
+          error->assign("Decompression failed");
+        }
+        return result;
+      }, error);
+}
+
+}  // namespace
+
+proto::Compression CodecPolicy::Choose(ui64 size) const {
+  if (large_size && size >= large_size) {
+    return large_compression;
+  }
+  return compression;
+}
+
+bool Compress(const proto::Compression& compression, Immutable input,
+              Immutable* output, String* error) {
+  DCHECK(output);
+
+  switch (compression.codec()) {
+    case proto::NONE: {
+      output->assign(input);
+      return true;
+    }
+
+    case proto::SNAPPY: {
+      String compressed;
+      snappy::Compress(input.data(), input.size(), &compressed);
+      output->assign(Immutable(std::move(compressed)));
+      return true;
+    }
+
+    case proto::LZ4: {
+      if (input.size() > LZ4_MAX_INPUT_SIZE) {
+        if (error) {
+          error->assign("Input is too large for LZ4");
+        }
+        return false;
+      }
+
+      const int bound = LZ4_compressBound(input.size());
+      UniquePtr<char[]> buffer(new char[sizeof(LZ4Header) + bound]);
+      const LZ4Header header = input.size();
+      memcpy(buffer.get(), &header, sizeof(header));
+
+      char* dst = buffer.get() + sizeof(header);
+      const int size =
+          compression.level()
+              ? LZ4_compress_HC(input.data(), dst, input.size(), bound,
+                                compression.level())
+              : LZ4_compress_default(input.data(), dst, input.size(), bound);
+      if (size <= 0) {
+        if (error) {
+          error->assign("LZ4 compression failed");
+        }
+        return false;
+      }
+
+      output->assign(Immutable(buffer, sizeof(header) + size));
+      return true;
+    }
+
+    case proto::ZSTD: {
+      const size_t bound = ZSTD_compressBound(input.size());
+      UniquePtr<char[]> buffer(new char[bound]);
+      const int level =
+          compression.level() ? compression.level() : ZSTD_CLEVEL_DEFAULT;
+
+      const size_t size =
+          ZSTD_compress(buffer.get(), bound, input.data(), input.size(), level);
+      if (ZSTD_isError(size)) {
+        if (error) {
+          error->assign(ZSTD_getErrorName(size));
+        }
+        return false;
+      }
+
+      output->assign(Immutable(buffer, size));
+      return true;
+    }
+  }
+
+  if (error) {
+    error->assign("Unknown codec " + std::to_string(compression.codec()));
+  }
+  return false;
+}
+
+bool Decompress(proto::Codec codec, Immutable input, Immutable* output,
+                String* error) {
+  DCHECK(output);
+
+  switch (codec) {
+    case proto::NONE: {
+      output->assign(input);
+      return true;
+    }
+
+    case proto::SNAPPY: {
+      String decompressed;
+      if (!snappy::Uncompress(input.data(), input.size(), &decompressed)) {
+        if (error) {
+          error->assign("Snappy decompression failed");
+        }
+        return false;
+      }
+
+      output->assign(Immutable(std::move(decompressed)));
+      return true;
+    }
+
+    case proto::LZ4: {
+      LZ4Header header;
+      if (input.size() < sizeof(header)) {
+        if (error) {
+          error->assign("LZ4 data is truncated");
+        }
+        return false;
+      }
+      memcpy(&header, input.data(), sizeof(header));
+
+      if (header > LZ4_MAX_INPUT_SIZE) {
+        if (error) {
+          error->assign("LZ4 data is malformed");
+        }
+        return false;
+      }
+
+      UniquePtr<char[]> buffer(new char[header]);
+      const int size = LZ4_decompress_safe(
+          input.data() + sizeof(header), buffer.get(),
+          input.size() - sizeof(header), header);
+      if (size < 0 || static_cast<ui64>(size) != header) {
+        if (error) {
+          error->assign("LZ4 decompression failed");
+        }
+        return false;
+      }
+
+      output->assign(Immutable(buffer, header));
+      return true;
+    }
+
+    case proto::ZSTD: {
+      const auto original_size =
+          ZSTD_getFrameContentSize(input.data(), input.size());
+      if (original_size == ZSTD_CONTENTSIZE_UNKNOWN ||
+          original_size == ZSTD_CONTENTSIZE_ERROR) {
+        if (error) {
+          error->assign("Zstd data is malformed");
+        }
+        return false;
+      }
+
+      UniquePtr<char[]> buffer(new char[original_size]);
+      const size_t size = ZSTD_decompress(buffer.get(), original_size,
+                                          input.data(), input.size());
+      if (ZSTD_isError(size) || size != original_size) {
+        if (error) {
+          error->assign(ZSTD_isError(size) ? ZSTD_getErrorName(size)
+                                           : "Zstd data is truncated");
+        }
+        return false;
+      }
+
+      output->assign(Immutable(buffer, size));
+      return true;
+    }
+  }
+
+  if (error) {
+    error->assign("Unknown codec " + std::to_string(codec));
+  }
+  return false;
+}
+
+bool DecompressInto(proto::Codec codec, base::File& input,
+                    const String& output_path, String* error) {
+  DCHECK(input.IsValid());
+
+  switch (codec) {
+    case proto::NONE:
+      return input.CopyInto(output_path, error);
+
+    case proto::SNAPPY: {
+      // The input is mapped - it doesn't take the anonymous memory.
+      Immutable compressed;
+      size_t size;
+      if (!input.Read(&compressed, error)) {
+        return false;
+      }
+      if (!snappy::GetUncompressedLength(compressed.data(), compressed.size(),
+                                         &size)) {
+        if (error) {
+          error->assign("Snappy data is malformed");
+        }
+        return false;
+      }
+
+      return DecompressMapped(output_path, size, [&](char* output) {
+        return snappy::RawUncompress(compressed.data(), compressed.size(),
+                                     output);
+      }, error);
+    }
+
+    case proto::LZ4: {
+      Immutable compressed;
+      LZ4Header header;
+      if (!input.Read(&compressed, error)) {
+        return false;
+      }
+      if (compressed.size() < sizeof(header)) {
+        if (error) {
+          error->assign("LZ4 data is truncated");
+        }
+        return false;
+      }
+      memcpy(&header, compressed.data(), sizeof(header));
+      if (header > LZ4_MAX_INPUT_SIZE) {
+        if (error) {
+          error->assign("LZ4 data is malformed");
+        }
+        return false;
+      }
+
+      return DecompressMapped(output_path, header, [&](char* output) {
+        const int size = LZ4_decompress_safe(
+            compressed.data() + sizeof(header), output,
+            compressed.size() - sizeof(header), header);
+        return size >= 0 && static_cast<ui64>(size) == header;
+      }, error);
+    }
+
+    case proto::ZSTD: {
+      const size_t in_size = ZSTD_DStreamInSize();
+      const size_t out_size = ZSTD_DStreamOutSize();
+      UniquePtr<char[]> in_buffer(new char[in_size]);
+      UniquePtr<char[]> out_buffer(new char[out_size]);
+      std::unique_ptr<ZSTD_DStream, size_t (*)(ZSTD_DStream*)> stream(
+          ZSTD_createDStream(), ZSTD_freeDStream);
+
+      // The original size is used only to preallocate the output file.
+      ssize_t read_size = pread(input.native(), in_buffer.get(), in_size, 0);
+      if (read_size == -1) {
+        base::GetLastError(error);
+        return false;
+      }
+      auto original_size =
+          ZSTD_getFrameContentSize(in_buffer.get(), read_size);
+      if (original_size == ZSTD_CONTENTSIZE_ERROR) {
+        if (error) {
+          error->assign("Zstd data is malformed");
+        }
+        return false;
+      } else if (original_size == ZSTD_CONTENTSIZE_UNKNOWN) {
+        original_size = 0;
+      }
+
+      auto decompress = [&](int fd, String* error) {
+        ZSTD_initDStream(stream.get());
+        ui64 offset = 0;
+        size_t result = 0;
+
+        while (read_size > 0) {
+          ZSTD_inBuffer in = {in_buffer.get(), static_cast<size_t>(read_size),
+                              0};
+          while (in.pos < in.size) {
+            ZSTD_outBuffer out = {out_buffer.get(), out_size, 0};
+            result = ZSTD_decompressStream(stream.get(), &out, &in);
+            if (ZSTD_isError(result)) {
+              if (error) {
+                error->assign(ZSTD_getErrorName(result));
+              }
+              return false;
+            }
+            if (!WriteAll(fd, out_buffer.get(), out.pos, error)) {
+              return false;
+            }
+          }
+
+          offset += read_size;
+          read_size = pread(input.native(), in_buffer.get(), in_size, offset);
+          if (read_size == -1) {
+            base::GetLastError(error);
+            return false;
+          }
+        }
+
+        // The non-zero result means that the frame is not complete.
+        if (result != 0) {
+          if (error) {
+            error->assign("Zstd data is truncated");
+          }
+          return false;
+        }
+
+        // The preallocated size may be bigger, if the frame is malformed.
+        const off_t size = lseek(fd, 0, SEEK_CUR);
+        if (size == -1 || ftruncate(fd, size) == -1) {
+          base::GetLastError(error);
+          return false;
+        }
+
+        return true;
+      };
+
+      return base::File::Write(output_path, original_size, decompress, error);
+    }
+  }
+
+  if (error) {
+    error->assign("Unknown codec " + std::to_string(codec));
+  }
+  return false;
+}
+
+}  // namespace cache
+}  // namespace dist_clang
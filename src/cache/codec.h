@@ -0,0 +1,33 @@
+#pragma once
+
+#include <base/const_string.h>
+#include <base/file/file.h>
+#include <cache/manifest.pb.h>
+
+namespace dist_clang {
+namespace cache {
+
+// Chooses the compression for a cached artifact by its size: the large objects
+// - usually with a debug info - compress far better with a slower codec.
+struct CodecPolicy {
+  proto::Compression Choose(ui64 size) const;
+
+  proto::Compression compression;
+  proto::Compression large_compression;
+  ui64 large_size = 0;
+  // in bytes. 0 - disables the |large_compression|.
+};
+
+bool Compress(const proto::Compression& compression, Immutable input,
+              Immutable* output, String* error = nullptr);
+bool Decompress(proto::Codec codec, Immutable input, Immutable* output,
+                String* error = nullptr);
+
+bool DecompressInto(proto::Codec codec, base::File& input,
+                    const String& output_path, String* error = nullptr);
+// Doesn't load the whole decompressed data into memory: Zstd is streamed
+// through the bounded buffers, and the block codecs decompress directly into
+// the mapped output file.
+
+}  // namespace cache
+}  // namespace dist_clang
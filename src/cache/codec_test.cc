@@ -0,0 +1,111 @@
+#include <cache/codec.h>
+
+#include <base/temporary_dir.h>
+
+#include <third_party/gtest/exported/include/gtest/gtest.h>
+
+namespace dist_clang {
+namespace cache {
+
+namespace {
+
+proto::Compression MakeCompression(proto::Codec codec, ui32 level = 0) {
+  proto::Compression compression;
+  compression.set_codec(codec);
+  compression.set_level(level);
+  return compression;
+}
+
+}  // namespace
+
+TEST(CodecTest, CompressAndDecompress) {
+  String expected_content;
+  for (int i = 0; i < 1000; ++i) {
+    expected_content += "some repetitive object code ";
+  }
+
+  for (const auto& compression :
+       {MakeCompression(proto::NONE), MakeCompression(proto::SNAPPY),
+        MakeCompression(proto::LZ4), MakeCompression(proto::LZ4, 9),
+        MakeCompression(proto::ZSTD), MakeCompression(proto::ZSTD, 19)}) {
+    SCOPED_TRACE(proto::Codec_Name(compression.codec()) + " " +
+                 std::to_string(compression.level()));
+
+    Immutable compressed, decompressed;
+    String error;
+    ASSERT_TRUE(Compress(compression, Immutable(expected_content), &compressed,
+                         &error))
+        << error;
+    if (compression.codec() != proto::NONE) {
+      EXPECT_GT(expected_content.size(), compressed.size());
+    }
+
+    ASSERT_TRUE(
+        Decompress(compression.codec(), compressed, &decompressed, &error))
+        << error;
+    EXPECT_EQ(expected_content, decompressed.string_copy());
+  }
+}
+
+TEST(CodecTest, DecompressIntoFile) {
+  const base::TemporaryDir tmp_dir;
+  const String input_path = String(tmp_dir) + "/input";
+  const String output_path = String(tmp_dir) + "/output";
+
+  String expected_content;
+  for (int i = 0; i < 100000; ++i) {
+    expected_content += "some repetitive object code ";
+  }
+
+  for (auto codec :
+       {proto::NONE, proto::SNAPPY, proto::LZ4, proto::ZSTD}) {
+    SCOPED_TRACE(proto::Codec_Name(codec));
+
+    Immutable compressed, decompressed;
+    String error;
+    ASSERT_TRUE(Compress(MakeCompression(codec), Immutable(expected_content),
+                         &compressed, &error))
+        << error;
+    ASSERT_TRUE(base::File::Write(input_path, compressed, &error)) << error;
+
+    base::File input(input_path);
+    ASSERT_TRUE(DecompressInto(codec, input, output_path, &error)) << error;
+    ASSERT_TRUE(base::File::Read(output_path, &decompressed, &error)) << error;
+    EXPECT_EQ(expected_content, decompressed.string_copy());
+  }
+}
+
+TEST(CodecTest, DecompressMalformedData) {
+  for (auto codec : {proto::LZ4, proto::ZSTD}) {
+    SCOPED_TRACE(proto::Codec_Name(codec));
+
+    Immutable output;
+    String error;
+    EXPECT_FALSE(Decompress(codec, "123"_l, &output, &error));
+    EXPECT_FALSE(error.empty());
+
+    const base::TemporaryDir tmp_dir;
+    const String input_path = String(tmp_dir) + "/input";
+    const String output_path = String(tmp_dir) + "/output";
+    ASSERT_TRUE(base::File::Write(input_path, "123"_l));
+    base::File input(input_path);
+    EXPECT_FALSE(DecompressInto(codec, input, output_path));
+    EXPECT_FALSE(base::File::Exists(output_path));
+  }
+}
+
+TEST(CodecTest, ChooseBySize) {
+  CodecPolicy policy;
+  policy.compression = MakeCompression(proto::LZ4);
+  policy.large_compression = MakeCompression(proto::ZSTD, 19);
+
+  EXPECT_EQ(proto::LZ4, policy.Choose(1u << 30).codec());
+
+  policy.large_size = 1024;
+  EXPECT_EQ(proto::LZ4, policy.Choose(1023).codec());
+  EXPECT_EQ(proto::ZSTD, policy.Choose(1024).codec());
+  EXPECT_EQ(19u, policy.Choose(1024).level());
+}
+
+}  // namespace cache
+}  // namespace dist_clang
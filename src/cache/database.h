@@ -37,6 +37,7 @@ class Database<Value> {
   virtual bool Delete(const String& key) = 0;
 
   virtual ui32 GetVersion() const = 0;
+  virtual ui64 SizeOnDisk() const = 0;
 };
 
 }  // namespace cache
@@ -97,5 +97,29 @@ bool LevelDB::Delete(const String& key) {
   return true;
 }
 
+bool LevelDB::Iterate(const Visitor& visitor) const {
+  using namespace leveldb;
+
+  if (!db_) {
+    return false;
+  }
+
+  ReadOptions options;
+  options.fill_cache = false;
+
+  UniquePtr<Iterator> it(db_->NewIterator(options));
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    visitor(it->key().ToString(), Immutable(it->value().ToString()));
+  }
+
+  if (!it->status().ok()) {
+    LOG(DB_ERROR) << "Failed to iterate database with error: "
+                  << it->status().ToString();
+    return false;
+  }
+
+  return true;
+}
+
 }  // namespace cache
 }  // namespace dist_clang
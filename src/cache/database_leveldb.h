@@ -26,7 +26,12 @@ class LevelDB : public Database<Immutable> {
     return 0;
   }
 
-  inline ui64 SizeOnDisk() const { return base::CalculateDirectorySize(path_); }
+  inline ui64 SizeOnDisk() const override {
+    return base::CalculateDirectorySize(path_);
+  }
+
+  using Visitor = Fn<void(const String& key, Immutable value)>;
+  bool Iterate(const Visitor& visitor) const THREAD_SAFE;
 
  private:
   leveldb::DB* db_ = nullptr;
@@ -0,0 +1,544 @@
+#include <cache/database_mapped.h>
+
+#include <base/assert.h>
+#include <base/c_utils.h>
+#include <base/logging.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <base/using_log.h>
+
+namespace dist_clang {
+namespace cache {
+
+namespace {
+
+const char kMagic[4] = {'D', 'C', 'M', 'T'};
+const ui32 kTableVersion = 1;
+
+int HexValue(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  } else if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  } else if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+bool ParseKey(const String& key, ui8* output) {
+  if (key.size() != MappedTable::KEY_SIZE * 2) {
+    return false;
+  }
+  for (size_t i = 0; i < MappedTable::KEY_SIZE; ++i) {
+    const int high = HexValue(key[2 * i]), low = HexValue(key[2 * i + 1]);
+    if (high == -1 || low == -1) {
+      return false;
+    }
+    output[i] = (high << 4) | low;
+  }
+  return true;
+}
+
+bool WriteAll(int fd, const char* data, size_t size, String* error) {
+  while (size) {
+    const ssize_t written = write(fd, data, size);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      base::GetLastError(error);
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+}  // namespace
+
+ui32 MappedTable::Slot::Checksum() const {
+  // FNV-1a - it's enough to detect the torn writes.
+  ui32 hash = 2166136261u;
+  auto update = [&hash](const void* data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+      hash = (hash ^ static_cast<const ui8*>(data)[i]) * 16777619u;
+    }
+  };
+  update(&state, sizeof(state));
+  update(&value_size, sizeof(value_size));
+  update(key, sizeof(key));
+  update(value, std::min<size_t>(value_size, sizeof(value)));
+  return hash;
+}
+
+MappedTable::MappedTable(const String& path, const String& name)
+    : path_(path),
+      table_path_(path + "/" + name + ".table"),
+      journal_path_(path + "/" + name + ".journal") {
+  String error;
+  CHECK(Open(INITIAL_CAPACITY, &error)) << "Failed to open table "
+                                        << table_path_ << ": " << error;
+
+  base::WorkerPool::SimpleWorker worker = [this](const base::WorkerPool& pool) {
+    while (!pool.WaitUntilShutdown(std::chrono::seconds(1))) {
+      Commit();
+    }
+  };
+  committer_->AddWorker("Direct Index Committer"_l, worker);
+
+  LOG(DB_INFO) << "Table is opened on path " << table_path_ << " with "
+               << count_ << " entries";
+}
+
+MappedTable::~MappedTable() {
+  committer_.reset();
+  Commit();
+
+  {
+    UniqueLock journal_lock(journal_mutex_);
+    String error;
+    if (!Checkpoint(&error)) {
+      LOG(DB_ERROR) << "Failed to sync table " << table_path_ << ": "
+                    << error;
+    }
+  }
+
+  if (header_) {
+    munmap(header_, HEADER_SIZE + capacity_ * sizeof(Slot));
+  }
+  if (table_fd_ != -1) {
+    close(table_fd_);
+  }
+  if (journal_fd_ != -1) {
+    close(journal_fd_);
+  }
+}
+
+bool MappedTable::Set(const String& key, const Immutable& value) {
+  Slot record = {};
+  if (!ParseKey(key, record.key) || value.size() > MAX_VALUE_SIZE) {
+    LOG(DB_ERROR) << "Can't set " << key << " => " << value
+                  << ": wrong key or value size";
+    return false;
+  }
+
+  record.state = FULL;
+  record.value_size = value.size();
+  memcpy(record.value, value.data(), value.size());
+  record.checksum = record.Checksum();
+
+  UniqueLock lock(mutex_);
+  if (!ApplyLocked(record)) {
+    return false;
+  }
+  pending_.push_back(record);
+
+  LOG(DB_VERBOSE) << "Table set " << key << " => " << value;
+  return true;
+}
+
+bool MappedTable::Get(const String& key, Immutable* value) const {
+  DCHECK(value);
+
+  ui8 binary_key[KEY_SIZE];
+  if (!ParseKey(key, binary_key)) {
+    return false;
+  }
+
+  UniqueLock lock(mutex_);
+  const Slot* slot = FindLocked(binary_key, nullptr);
+  if (!slot) {
+    return false;
+  }
+
+  value->assign(Immutable(String(slot->value, slot->value_size)));
+  return true;
+}
+
+bool MappedTable::Delete(const String& key) {
+  Slot record = {};
+  if (!ParseKey(key, record.key)) {
+    return false;
+  }
+
+  record.state = DELETED;
+  record.checksum = record.Checksum();
+
+  UniqueLock lock(mutex_);
+  ApplyLocked(record);
+  pending_.push_back(record);
+
+  LOG(DB_VERBOSE) << "Table delete " << key;
+  return true;
+}
+
+ui64 MappedTable::SizeOnDisk() const {
+  struct stat table_stat, journal_stat;
+  ui64 size = 0;
+  if (stat(table_path_.c_str(), &table_stat) == 0) {
+    size += table_stat.st_size;
+  }
+  if (stat(journal_path_.c_str(), &journal_stat) == 0) {
+    size += journal_stat.st_size;
+  }
+  return size;
+}
+
+bool MappedTable::Commit() {
+  UniqueLock journal_lock(journal_mutex_);
+
+  Vector<Slot> records;
+  {
+    UniqueLock lock(mutex_);
+    records.swap(pending_);
+  }
+  if (records.empty()) {
+    return true;
+  }
+
+  // The single write and sync for the whole group of changes.
+  String error;
+  const ui64 size = records.size() * sizeof(Slot);
+  if (!WriteAll(journal_fd_, reinterpret_cast<const char*>(records.data()),
+                size, &error) ||
+      fdatasync(journal_fd_) == -1) {
+    if (error.empty()) {
+      base::GetLastError(&error);
+    }
+    LOG(DB_ERROR) << "Failed to write journal " << journal_path_ << ": "
+                  << error;
+    return false;
+  }
+  journal_size_ += size;
+
+  if (journal_size_ > MAX_JOURNAL_SIZE && !Checkpoint(&error)) {
+    LOG(DB_ERROR) << "Failed to sync table " << table_path_ << ": " << error;
+    return false;
+  }
+
+  return true;
+}
+
+bool MappedTable::Open(ui64 capacity, String* error) {
+  table_fd_ = open(table_path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (table_fd_ == -1) {
+    base::GetLastError(error);
+    return false;
+  }
+
+  journal_fd_ = open(journal_path_.c_str(),
+                     O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (journal_fd_ == -1) {
+    base::GetLastError(error);
+    return false;
+  }
+
+  struct stat buffer;
+  if (fstat(table_fd_, &buffer) == -1) {
+    base::GetLastError(error);
+    return false;
+  }
+
+  Header header = {};
+  if (buffer.st_size >= static_cast<off_t>(HEADER_SIZE) &&
+      pread(table_fd_, &header, sizeof(header), 0) == sizeof(header) &&
+      !memcmp(header.magic, kMagic, sizeof(kMagic)) &&
+      header.version == kTableVersion && header.capacity &&
+      !(header.capacity & (header.capacity - 1)) &&
+      static_cast<ui64>(buffer.st_size) ==
+          HEADER_SIZE + header.capacity * sizeof(Slot)) {
+    capacity = header.capacity;
+  } else {
+    if (buffer.st_size) {
+      LOG(DB_WARNING) << "Table " << table_path_
+                      << " is malformed - creating new one";
+    }
+
+    // The journal doesn't make sense without its table.
+    if (ftruncate(table_fd_, 0) == -1 ||
+        ftruncate(table_fd_, HEADER_SIZE + capacity * sizeof(Slot)) == -1 ||
+        ftruncate(journal_fd_, 0) == -1) {
+      base::GetLastError(error);
+      return false;
+    }
+
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kTableVersion;
+    header.capacity = capacity;
+    if (pwrite(table_fd_, &header, sizeof(header), 0) != sizeof(header)) {
+      base::GetLastError(error);
+      return false;
+    }
+  }
+
+  if (!Map(table_fd_, capacity, &header_, &slots_, error)) {
+    return false;
+  }
+  capacity_ = capacity;
+
+  for (ui64 i = 0; i < capacity_; ++i) {
+    Slot& slot = slots_[i];
+    if (slot.state == EMPTY) {
+      continue;
+    }
+
+    if ((slot.state != FULL && slot.state != DELETED) ||
+        slot.checksum != slot.Checksum()) {
+      // Can't make the slot empty - it may break the probe sequence.
+      LOG(DB_WARNING) << "Table " << table_path_ << " has torn slot " << i;
+      slot.state = DELETED;
+      slot.checksum = slot.Checksum();
+    }
+
+    if (slot.state == FULL) {
+      ++count_;
+    } else {
+      ++tombstones_;
+    }
+  }
+
+  return Replay(error);
+}
+
+bool MappedTable::Map(int fd, ui64 capacity, Header** header, Slot** slots,
+                      String* error) {
+  void* map = mmap(nullptr, HEADER_SIZE + capacity * sizeof(Slot),
+                   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    base::GetLastError(error);
+    return false;
+  }
+
+  *header = static_cast<Header*>(map);
+  *slots = reinterpret_cast<Slot*>(static_cast<char*>(map) + HEADER_SIZE);
+  return true;
+}
+
+bool MappedTable::Replay(String* error) {
+  UniqueLock journal_lock(journal_mutex_);
+
+  {
+    UniqueLock lock(mutex_);
+    Slot record;
+    ui64 offset = 0, replayed = 0;
+    while (pread(journal_fd_, &record, sizeof(record), offset) ==
+           sizeof(record)) {
+      // Stop at the torn tail.
+      if ((record.state != FULL && record.state != DELETED) ||
+          record.checksum != record.Checksum()) {
+        break;
+      }
+      if (!ApplyLocked(record)) {
+        // The index may lose an entry - but not the whole table.
+        LOG(DB_WARNING) << "Failed to replay record " << replayed
+                        << " from journal " << journal_path_;
+      }
+      offset += sizeof(record);
+      ++replayed;
+    }
+
+    if (replayed) {
+      LOG(DB_INFO) << "Replayed " << replayed << " records from journal "
+                   << journal_path_;
+    }
+  }
+
+  return Checkpoint(error);
+}
+
+MappedTable::Slot* MappedTable::FindLocked(const ui8* key,
+                                           Slot** free_slot) const {
+  // The key is already a hash.
+  ui64 hash;
+  memcpy(&hash, key, sizeof(hash));
+
+  for (ui64 i = 0; i < capacity_; ++i) {
+    Slot* slot = &slots_[(hash + i) & (capacity_ - 1)];
+    if (slot->state != FULL) {
+      if (free_slot && !*free_slot) {
+        *free_slot = slot;
+      }
+      if (slot->state == EMPTY) {
+        return nullptr;
+      }
+    } else if (!memcmp(slot->key, key, KEY_SIZE)) {
+      return slot;
+    }
+  }
+
+  return nullptr;
+}
+
+bool MappedTable::ApplyLocked(const Slot& record) {
+  Slot* free_slot = nullptr;
+  Slot* slot = FindLocked(record.key, &free_slot);
+
+  // All slots are taken only after the failed rehashes.
+  if (record.state == FULL && !slot && !free_slot) {
+    if (!RehashLocked(capacity_ * 2)) {
+      return false;
+    }
+    rehash_retry_at_ = 0;
+    slot = FindLocked(record.key, &free_slot);
+  }
+
+  if (record.state == FULL) {
+    if (!slot) {
+      DCHECK(free_slot);
+      slot = free_slot;
+      if (slot->state == DELETED) {
+        --tombstones_;
+      }
+      ++count_;
+    }
+    *slot = record;
+  } else if (slot) {
+    slot->state = DELETED;
+    slot->checksum = slot->Checksum();
+    --count_;
+    ++tombstones_;
+  }
+
+  // Keep the load factor below 70% - so the probe sequences stay short. If the
+  // rehash fails, the old table is still in use - until it's full.
+  const ui64 used = count_ + tombstones_;
+  if (used * 10 >= capacity_ * 7 && used >= rehash_retry_at_) {
+    const ui64 capacity =
+        count_ * 10 >= capacity_ * 3 ? capacity_ * 2 : capacity_;
+    rehash_retry_at_ = RehashLocked(capacity) ? 0 : used + capacity_ / 32;
+  }
+
+  return true;
+}
+
+bool MappedTable::RehashLocked(ui64 capacity) {
+  String error;
+  const String tmp_path = table_path_ + ".tmp";
+  const int fd =
+      open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    base::GetLastError(&error);
+    LOG(DB_ERROR) << "Failed to create " << tmp_path << ": " << error;
+    return false;
+  }
+
+  Header* header;
+  Slot* slots;
+  // Allocate the space right away - the write to the mapping of the sparse
+  // file gets SIGBUS instead of the error, if the disk is full.
+  if (ftruncate(fd, HEADER_SIZE + capacity * sizeof(Slot)) == -1 ||
+#if defined(OS_LINUX)
+      (errno = posix_fallocate(fd, 0, HEADER_SIZE + capacity * sizeof(Slot))) ||
+#endif  // defined(OS_LINUX)
+      !Map(fd, capacity, &header, &slots, &error)) {
+    if (error.empty()) {
+      base::GetLastError(&error);
+    }
+    LOG(DB_ERROR) << "Failed to allocate " << tmp_path << ": " << error;
+    close(fd);
+    unlink(tmp_path.c_str());
+    return false;
+  }
+
+  memcpy(header->magic, kMagic, sizeof(kMagic));
+  header->version = kTableVersion;
+  header->capacity = capacity;
+
+  for (ui64 i = 0; i < capacity_; ++i) {
+    const Slot& slot = slots_[i];
+    if (slot.state != FULL) {
+      continue;
+    }
+
+    ui64 hash;
+    memcpy(&hash, slot.key, sizeof(hash));
+    for (ui64 j = 0;; ++j) {
+      Slot& new_slot = slots[(hash + j) & (capacity - 1)];
+      if (new_slot.state == EMPTY) {
+        new_slot = slot;
+        break;
+      }
+    }
+  }
+
+  // The journal stays valid: its records are idempotent.
+  const ui64 map_size = HEADER_SIZE + capacity * sizeof(Slot);
+  if (msync(header, map_size, MS_SYNC) == -1 ||
+      rename(tmp_path.c_str(), table_path_.c_str()) == -1) {
+    base::GetLastError(&error);
+    LOG(DB_ERROR) << "Failed to replace " << table_path_ << ": " << error;
+    munmap(header, map_size);
+    close(fd);
+    unlink(tmp_path.c_str());
+    return false;
+  }
+
+  // The sync in progress may still use the old mapping.
+  if (syncing_) {
+    retired_maps_.emplace_back(header_, HEADER_SIZE + capacity_ * sizeof(Slot));
+  } else {
+    munmap(header_, HEADER_SIZE + capacity_ * sizeof(Slot));
+  }
+  close(table_fd_);
+
+  LOG(DB_VERBOSE) << "Table " << table_path_ << " is rehashed from "
+                  << capacity_ << " to " << capacity << " slots";
+
+  table_fd_ = fd;
+  header_ = header;
+  slots_ = slots;
+  capacity_ = capacity;
+  tombstones_ = 0;
+  return true;
+}
+
+bool MappedTable::Checkpoint(String* error) {
+  void* map;
+  ui64 map_size;
+  {
+    UniqueLock lock(mutex_);
+    if (!header_) {
+      return true;
+    }
+    map = header_;
+    map_size = HEADER_SIZE + capacity_ * sizeof(Slot);
+    syncing_ = true;
+  }
+
+  // The journal is written under the |journal_mutex_| only, so all its records
+  // are in the synced mapping - or in the table, if it's rehashed meanwhile.
+  // The pending records stay pending: they may miss the sync.
+  const bool synced = msync(map, map_size, MS_SYNC) != -1;
+  if (!synced) {
+    base::GetLastError(error);
+  }
+
+  {
+    UniqueLock lock(mutex_);
+    syncing_ = false;
+    for (const auto& retired_map : retired_maps_) {
+      munmap(retired_map.first, retired_map.second);
+    }
+    retired_maps_.clear();
+  }
+
+  if (!synced) {
+    return false;
+  }
+  if (ftruncate(journal_fd_, 0) == -1) {
+    base::GetLastError(error);
+    return false;
+  }
+
+  journal_size_ = 0;
+  return true;
+}
+
+}  // namespace cache
+}  // namespace dist_clang
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <base/aliases.h>
+#include <base/attributes.h>
+#include <base/const_string.h>
+#include <base/worker_pool.h>
+#include <cache/database.h>
+
+#include <third_party/gtest/exported/include/gtest/gtest_prod.h>
+
+namespace dist_clang {
+namespace cache {
+
+FORWARD_TEST(MappedTableTest, KeepTableOnFailedRehash);
+FORWARD_TEST(MappedTableTest, ReplayJournal);
+
+// Memory-mapped open-addressing hash table with the fixed-size slots: the key
+// is a 128-bit hash in the hex form - it's stored in binary - and the value is
+// a short string. Used as a lightweight replacement of the LevelDB for the
+// direct cache index.
+//
+// The changes are applied to the shared mapping right away, so they survive
+// the crash of the process. To survive the crash of the system, every change
+// is also appended to the journal - the group of changes is written and synced
+// periodically, instead of the sync per change. On opening the journal is
+// replayed on top of the table, and then the table is synced and the journal
+// is truncated. The torn slots are detected by their checksums.
+class MappedTable : public Database<Immutable> {
+ public:
+  enum : ui64 {
+    KEY_SIZE = 16,
+    // in bytes - the key is passed in the hex form.
+
+    MAX_VALUE_SIZE = 56,
+    // in bytes.
+
+    INITIAL_CAPACITY = 1 << 16,
+    // in slots.
+
+    MAX_JOURNAL_SIZE = 1024 * 1024,
+    // in bytes - the table is synced when the journal grows bigger.
+  };
+
+  MappedTable(const String& path, const String& name);
+  ~MappedTable() override;
+
+  bool Set(const String& key, const Immutable& value) override THREAD_SAFE;
+  bool Get(const String& key, Immutable* value) const override THREAD_SAFE;
+  bool Delete(const String& key) override THREAD_SAFE;
+
+  inline ui32 GetVersion() const override { return 0; }
+
+  ui64 SizeOnDisk() const override THREAD_SAFE;
+
+  bool Commit() THREAD_SAFE;
+  // Writes and syncs the pending journal records. Called periodically.
+
+  inline ui64 Count() const { return count_; }
+
+ private:
+  FRIEND_TEST(MappedTableTest, KeepTableOnFailedRehash);
+  FRIEND_TEST(MappedTableTest, ReplayJournal);
+
+  enum State : ui8 {
+    EMPTY = 0,
+    FULL = 1,
+    DELETED = 2,
+  };
+
+  // Also used as the journal record.
+  struct Slot {
+    State state;
+    ui8 value_size;
+    ui16 reserved;
+    ui32 checksum;
+    ui8 key[KEY_SIZE];
+    char value[MAX_VALUE_SIZE];
+
+    ui32 Checksum() const;
+  };
+  static_assert(sizeof(Slot) == 80, "Slot should be tightly packed");
+
+  struct Header {
+    char magic[4];
+    ui32 version;
+    ui64 capacity;  // in slots, the power of 2.
+  };
+
+  enum : ui64 {
+    HEADER_SIZE = 4096,
+    // in bytes - keep the slots page-aligned.
+  };
+
+  bool Open(ui64 capacity, String* error);
+  bool Map(int fd, ui64 capacity, Header** header, Slot** slots,
+           String* error);
+  bool Create(const String& path, ui64 capacity, String* error);
+  bool Replay(String* error);
+
+  Slot* FindLocked(const ui8* key, Slot** free_slot) const;
+  bool ApplyLocked(const Slot& record);
+  // Returns |false|, if there is no free slot for the new key - when the table
+  // can't grow.
+  bool RehashLocked(ui64 capacity);
+  bool Checkpoint(String* error);
+  // Syncs the table and truncates the journal. Called under |journal_mutex_|
+  // only - the lookups go on during the sync.
+
+  const String path_;
+  const String table_path_;
+  const String journal_path_;
+
+  int table_fd_ = -1;
+  int journal_fd_ = -1;
+  Header* header_ = nullptr;
+  Slot* slots_ = nullptr;
+  ui64 capacity_ = 0;
+  ui64 count_ = 0, tombstones_ = 0;
+  ui64 rehash_retry_at_ = 0;
+  // The failed rehash is retried after a few more slots are taken.
+
+  mutable std::mutex mutex_;
+  Vector<Slot> pending_;
+  // The journal records that aren't written yet.
+  bool syncing_ = false;
+  Vector<Pair<void*, ui64>> retired_maps_;
+  // The old mappings are unmapped after the sync in progress.
+
+  std::mutex journal_mutex_;
+  ui64 journal_size_ = 0;
+
+  UniquePtr<base::WorkerPool> committer_{new base::WorkerPool(true)};
+};
+
+}  // namespace cache
+}  // namespace dist_clang
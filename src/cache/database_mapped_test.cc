@@ -0,0 +1,141 @@
+#include <cache/database_mapped.h>
+
+#include <base/file/file.h>
+#include <base/file_utils.h>
+#include <base/string_utils.h>
+#include <base/temporary_dir.h>
+
+#include <third_party/gtest/exported/include/gtest/gtest.h>
+
+namespace dist_clang {
+namespace cache {
+
+namespace {
+
+String MakeKey(ui32 i) {
+  return base::Hexify(Immutable(std::to_string(i)).Hash());
+}
+
+}  // namespace
+
+TEST(MappedTableTest, SetGetDelete) {
+  const base::TemporaryDir tmp_dir;
+  MappedTable table(tmp_dir, "direct");
+  const String key = MakeKey(1);
+  Immutable value1, value2, value3;
+
+  EXPECT_FALSE(table.Get(key, &value1));
+  ASSERT_TRUE(table.Set(key, "value"_l));
+  ASSERT_TRUE(table.Get(key, &value1));
+  EXPECT_EQ("value"_l, value1);
+
+  ASSERT_TRUE(table.Set(key, "new value"_l));
+  ASSERT_TRUE(table.Get(key, &value2));
+  EXPECT_EQ("new value"_l, value2);
+  EXPECT_EQ(1u, table.Count());
+
+  EXPECT_TRUE(table.Delete(key));
+  EXPECT_FALSE(table.Get(key, &value3));
+  EXPECT_EQ(0u, table.Count());
+
+  // Only the fixed-size keys and the short values.
+  EXPECT_FALSE(table.Set("key", "value"_l));
+  EXPECT_FALSE(table.Set(key, Immutable(String(100, 'a'))));
+}
+
+TEST(MappedTableTest, GrowAndReopen) {
+  const base::TemporaryDir tmp_dir;
+  const ui32 count = MappedTable::INITIAL_CAPACITY;
+
+  {
+    MappedTable table(tmp_dir, "direct");
+    for (ui32 i = 0; i < count; ++i) {
+      ASSERT_TRUE(table.Set(MakeKey(i), Immutable(std::to_string(i))));
+    }
+    for (ui32 i = 0; i < count; i += 2) {
+      ASSERT_TRUE(table.Delete(MakeKey(i)));
+    }
+  }
+
+  MappedTable table(tmp_dir, "direct");
+  EXPECT_EQ(count / 2, table.Count());
+  for (ui32 i = 0; i < count; ++i) {
+    Immutable value;
+    if (i % 2) {
+      ASSERT_TRUE(table.Get(MakeKey(i), &value)) << i;
+      EXPECT_EQ(std::to_string(i), value.string_copy());
+    } else {
+      EXPECT_FALSE(table.Get(MakeKey(i), &value)) << i;
+    }
+  }
+}
+
+TEST(MappedTableTest, KeepTableOnFailedRehash) {
+  const base::TemporaryDir tmp_dir;
+  const ui32 count = MappedTable::INITIAL_CAPACITY;
+  MappedTable table(tmp_dir, "direct");
+
+  // The new table can't be created in place of the directory.
+  const String tmp_path = table.table_path_ + ".tmp";
+  ASSERT_TRUE(base::CreateDirectory(tmp_path));
+
+  for (ui32 i = 0; i < count; ++i) {
+    ASSERT_TRUE(table.Set(MakeKey(i), Immutable(std::to_string(i)))) << i;
+  }
+  EXPECT_EQ(count, table.capacity_);
+  EXPECT_FALSE(table.Set(MakeKey(count), "value"_l));
+
+  Immutable value1, value2;
+  ASSERT_TRUE(table.Get(MakeKey(1), &value1));
+  EXPECT_EQ("1"_l, value1);
+
+  // The table grows, as soon as it can.
+  ASSERT_TRUE(base::RemoveEmptyDirectory(tmp_path));
+  ASSERT_TRUE(table.Set(MakeKey(count), "value"_l));
+  EXPECT_EQ(2 * count, table.capacity_);
+  ASSERT_TRUE(table.Get(MakeKey(count), &value2));
+  EXPECT_EQ("value"_l, value2);
+}
+
+TEST(MappedTableTest, ReplayJournal) {
+  const base::TemporaryDir tmp_dir;
+  const String crash_dir = String(tmp_dir) + "/crash";
+  ASSERT_TRUE(base::CreateDirectory(crash_dir));
+
+  MappedTable table(tmp_dir, "direct");
+  ASSERT_TRUE(table.Set(MakeKey(1), "value1"_l));
+  ASSERT_TRUE(table.Set(MakeKey(2), "value2"_l));
+  ASSERT_TRUE(table.Delete(MakeKey(1)));
+  ASSERT_TRUE(table.Commit());
+
+  // Emulate the system crash: the changes didn't get to the table on disk,
+  // and the last journal record is torn.
+  Immutable journal;
+  ASSERT_TRUE(base::File::Read(table.journal_path_, &journal));
+  ASSERT_EQ(3 * sizeof(MappedTable::Slot), journal.size());
+  String torn_journal = journal.string_copy();
+  torn_journal += torn_journal.substr(0, sizeof(MappedTable::Slot));
+  torn_journal[torn_journal.size() - sizeof(MappedTable::Slot) +
+               offsetof(MappedTable::Slot, key)] ^= 1;
+  ASSERT_TRUE(base::File::Write(crash_dir + "/direct.journal",
+                                Immutable(std::move(torn_journal))));
+
+  String empty_table(MappedTable::HEADER_SIZE +
+                         MappedTable::INITIAL_CAPACITY *
+                             sizeof(MappedTable::Slot),
+                     '\0');
+  memcpy(&empty_table[0], table.header_, sizeof(MappedTable::Header));
+  ASSERT_TRUE(base::File::Write(crash_dir + "/direct.table",
+                                Immutable(std::move(empty_table))));
+
+  MappedTable restored_table(crash_dir, "direct");
+  Immutable value1, value2;
+  EXPECT_EQ(1u, restored_table.Count());
+  EXPECT_FALSE(restored_table.Get(MakeKey(1), &value1));
+  ASSERT_TRUE(restored_table.Get(MakeKey(2), &value2));
+  EXPECT_EQ("value2"_l, value2);
+  EXPECT_EQ(0u, base::File::Size(crash_dir + "/direct.journal"));
+}
+
+}  // namespace cache
+}  // namespace dist_clang
@@ -33,6 +33,134 @@ bool TableExists(sqlite3* db, const String& name) {
   return res;
 }
 
+bool ColumnExists(sqlite3* db, const String& table, const String& name) {
+  sqlite3_stmt* stmt;
+  const String sql = "PRAGMA table_info(" + table + ")";
+  auto result = sqlite3_prepare_v2(db, sql.c_str(), sql.size(), &stmt, nullptr);
+  DCHECK(result == SQLITE_OK);
+
+  // The second column of the result is a column name.
+  bool res = false;
+  while (!res && sqlite3_step(stmt) == SQLITE_ROW) {
+    res = name == reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+  }
+
+  result = sqlite3_finalize(stmt);
+  if (result != SQLITE_OK) {
+    LOG(DB_ERROR) << "Failed to finalize SQL statement with error: "
+                  << sqlite3_errstr(result);
+  }
+
+  return res;
+}
+
+// The index may be opened by a few daemons at once - so the column of entries
+// is added in the write transaction, and the column, that another daemon has
+// just added, isn't an error. The |update| fills the new column in the same
+// transaction.
+void AddColumn(sqlite3* db, const String& name, const String& definition,
+               const String& update = String()) {
+  char* error = nullptr;
+  auto result = sqlite3_exec(db, "BEGIN IMMEDIATE;", nullptr, nullptr, &error);
+  CHECK(result == SQLITE_OK) << "Failed to begin migration: "
+                             << sqlite3_errstr(result) << ": " << error;
+
+  if (!ColumnExists(db, "entries", name)) {
+    const String sql =
+        "ALTER TABLE entries ADD COLUMN " + name + " " + definition + ";" +
+        update;
+    result = sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &error);
+    if (result != SQLITE_OK) {
+      CHECK(error && strstr(error, "duplicate column name"))
+          << "Failed to add column " << name << ": "
+          << sqlite3_errstr(result) << ": " << error;
+      LOG(DB_INFO) << "Column " << name << " is added by another process";
+      sqlite3_free(error);
+      sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+      return;
+    }
+  }
+
+  result = sqlite3_exec(db, "COMMIT;", nullptr, nullptr, &error);
+  CHECK(result == SQLITE_OK) << "Failed to commit migration: "
+                             << sqlite3_errstr(result) << ": " << error;
+}
+
+sqlite3_stmt* Prepare(sqlite3* db, const char* sql) {
+  sqlite3_stmt* stmt;
+  auto result = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+  CHECK(result == SQLITE_OK) << "Failed to prepare SQL statement \"" << sql
+                             << "\" with error: " << sqlite3_errmsg(db);
+  return stmt;
+}
+
+// Makes the cached statement reusable on scope exit.
+class StatementScope {
+ public:
+  explicit StatementScope(sqlite3_stmt* stmt) : stmt_(stmt) {}
+  ~StatementScope() {
+    sqlite3_reset(stmt_);
+    sqlite3_clear_bindings(stmt_);
+  }
+
+ private:
+  sqlite3_stmt* stmt_;
+};
+
+void CreateBlobsTable(sqlite3* db) {
+  char* error;
+  // FIXME: 32 is a magical constant - it's the length of the content hash.
+  auto result = sqlite3_exec(db,
+                             "CREATE TABLE IF NOT EXISTS blobs("
+                             "    hash CHAR(32) PRIMARY KEY NOT NULL,"
+                             "    size INT NOT NULL,"
+                             "    refs INT NOT NULL"
+                             ");",
+                             nullptr, nullptr, &error);
+  CHECK(result == SQLITE_OK)
+      << "Failed to create table: " << sqlite3_errstr(result) << ": " << error;
+}
+
+// The eviction order is walked by the indices - so the victims are found
+// without sorting the whole table.
+void CreateEvictionIndices(sqlite3* db) {
+  char* error;
+  auto result = sqlite3_exec(
+      db,
+      "CREATE INDEX IF NOT EXISTS mtime_idx ON entries (mtime);"
+      "CREATE INDEX IF NOT EXISTS segment_idx ON entries (segment, mtime);"
+      "CREATE INDEX IF NOT EXISTS score_idx ON entries (score, mtime);",
+      nullptr, nullptr, &error);
+  CHECK(result == SQLITE_OK)
+      << "Failed to create index: " << sqlite3_errstr(result) << ": " << error;
+}
+
+// The single row keeps the weight of a hit - see |SQLite::AgeHits()|.
+void CreateAgingTable(sqlite3* db) {
+  char* error;
+  auto result = sqlite3_exec(db,
+                             "CREATE TABLE IF NOT EXISTS aging("
+                             "    scale REAL NOT NULL"
+                             ");"
+                             "INSERT INTO aging (scale) SELECT 1.0 "
+                             "    WHERE NOT EXISTS (SELECT * FROM aging);",
+                             nullptr, nullptr, &error);
+  CHECK(result == SQLITE_OK)
+      << "Failed to create table: " << sqlite3_errstr(result) << ": " << error;
+}
+
+inline void BindText(sqlite3_stmt* stmt, int index, const String& text) {
+  sqlite3_bind_text(stmt, index, text.data(), text.size(), SQLITE_STATIC);
+}
+
+// The victims are taken in batches - the caller repeats, if they aren't
+// enough.
+const int kMaxVictims = 1000;
+
+// The scores are rescaled, when the weight of a hit gets that big - long
+// before the overflow.
+const double kMaxScale = 1e64;
+
 }  // namespace
 
 SQLite::SQLite() : path_(":memory:") {
@@ -47,16 +175,20 @@ SQLite::SQLite() : path_(":memory:") {
                         "    hash CHAR(50) PRIMARY KEY NOT NULL,"
                         "    mtime INT NOT NULL,"
                         "    size INT NOT NULL,"
-                        "    version INT NOT NULL"
+                        "    version INT NOT NULL,"
+                        "    hits INT NOT NULL DEFAULT 0,"
+                        "    shared INT NOT NULL DEFAULT 0,"
+                        "    segment INT NOT NULL DEFAULT 0,"
+                        "    score REAL"
                         ");",
                         nullptr, nullptr, &error);
   CHECK(result == SQLITE_OK)
       << "Failed to create table: " << sqlite3_errstr(result) << ": " << error;
 
-  result = sqlite3_exec(db_, "CREATE INDEX mtime_idx ON entries (mtime);",
-                        nullptr, nullptr, &error);
-  CHECK(result == SQLITE_OK)
-      << "Failed to create index: " << sqlite3_errstr(result) << ": " << error;
+  CreateEvictionIndices(db_);
+  CreateAgingTable(db_);
+  CreateBlobsTable(db_);
+  PrepareStatements();
 
   LOG(DB_INFO) << "SQLite database is created in-memory";
 }
@@ -67,35 +199,80 @@ SQLite::SQLite(const String& path, const String& name)
   CHECK(result == SQLITE_OK) << "Failed to open " << path_ << ": "
                              << sqlite3_errstr(result);
 
+  // The index may be shared by a few daemons - wait for the lock of another
+  // process, instead of failing.
+  sqlite3_busy_timeout(db_, 10000);
+
+  // The WAL journal doesn't block readers, and commits with a single sequential
+  // write - the durability of the last transactions is not critical, since the
+  // index is reconciled with the cache directory anyway.
+  char* error;
+  result = sqlite3_exec(db_,
+                        "PRAGMA journal_mode = WAL;"
+                        "PRAGMA synchronous = NORMAL;"
+                        "PRAGMA temp_store = MEMORY;"
+                        "PRAGMA mmap_size = 268435456;",
+                        nullptr, nullptr, &error);
+  if (result != SQLITE_OK) {
+    LOG(DB_WARNING) << "Failed to tune database " << path_ << ": "
+                    << sqlite3_errstr(result) << ": " << error;
+    sqlite3_free(error);
+  }
+
   if (TableExists(db_, "entries")) {
     // TODO: do migration.
+    if (!ColumnExists(db_, "entries", "hits")) {
+      AddColumn(db_, "hits", "INT NOT NULL DEFAULT 0");
+    }
+    if (!ColumnExists(db_, "entries", "shared")) {
+      AddColumn(db_, "shared", "INT NOT NULL DEFAULT 0");
+    }
+    if (!ColumnExists(db_, "entries", "segment")) {
+      // The entries, that were hit, start in the protected segment.
+      AddColumn(db_, "segment", "INT NOT NULL DEFAULT 0",
+                "UPDATE entries SET segment = hits > 0;");
+    }
+    if (!ColumnExists(db_, "entries", "score")) {
+      AddColumn(db_, "score", "REAL",
+                "UPDATE entries SET score = (hits + 1.0) / size;");
+    }
     LOG(DB_INFO) << "SQLite database is opened on path " << path_;
   } else {
-    char* error;
     // FIXME: 50 is a magical constant - it's the length of the hash string.
     result = sqlite3_exec(db_,
-                          "CREATE TABLE entries("
+                          "CREATE TABLE IF NOT EXISTS entries("
                           "    hash CHAR(50) PRIMARY KEY NOT NULL,"
                           "    mtime INT NOT NULL,"
                           "    size INT NOT NULL,"
-                          "    version INT NOT NULL"
+                          "    version INT NOT NULL,"
+                          "    hits INT NOT NULL DEFAULT 0,"
+                          "    shared INT NOT NULL DEFAULT 0,"
+                          "    segment INT NOT NULL DEFAULT 0,"
+                          "    score REAL"
                           ");",
                           nullptr, nullptr, &error);
     CHECK(result == SQLITE_OK)
         << "Failed to create table: " << sqlite3_errstr(result) << ": "
         << error;
 
-    result = sqlite3_exec(db_, "CREATE INDEX mtime_idx ON entries (mtime);",
-                          nullptr, nullptr, &error);
-    CHECK(result == SQLITE_OK)
-        << "Failed to create index: " << sqlite3_errstr(result) << ": "
-        << error;
-
     LOG(DB_INFO) << "SQLite database is created on path " << path_;
   }
+
+  CreateEvictionIndices(db_);
+  CreateAgingTable(db_);
+  CreateBlobsTable(db_);
+  PrepareStatements();
 }
 
 SQLite::~SQLite() {
+  for (auto* stmt :
+       {get_stmt_, get_prefix_stmt_, set_stmt_, delete_stmt_, touch_stmt_,
+        shared_stmt_, get_blob_stmt_, set_blob_stmt_, delete_blob_stmt_,
+        lru_victims_stmt_, slru_victims_stmt_, frequency_victims_stmt_,
+        first_stmt_, get_keys_stmt_, total_size_stmt_}) {
+    sqlite3_finalize(stmt);
+  }
+
   auto result = sqlite3_close(db_);
   if (result != SQLITE_OK) {
     LOG(DB_ERROR) << "Failed to close database: " << sqlite3_errstr(result);
@@ -105,60 +282,38 @@ SQLite::~SQLite() {
 bool SQLite::Get(const String& key, Value* value) const {
   DCHECK(value);
 
-  sqlite3_stmt* stmt;
-  const String sql =
-      "SELECT mtime, size, version FROM entries WHERE hash = '" + key + "'";
-  auto result =
-      sqlite3_prepare_v2(db_, sql.c_str(), sql.size(), &stmt, nullptr);
-  if (result != SQLITE_OK) {
-    LOG(DB_ERROR) << "Failed to prepare SQL statement with error: "
-                  << sqlite3_errmsg(db_);
-    return false;
-  }
+  UniqueLock lock(mutex_);
+  StatementScope scope(get_stmt_);
+  BindText(get_stmt_, 1, key);
 
-  bool has_entry = false;
-  result = sqlite3_step(stmt);
+  auto result = sqlite3_step(get_stmt_);
   if (result == SQLITE_ROW) {
-    std::get<MTIME>(*value) = sqlite3_column_int64(stmt, MTIME);
-    std::get<SIZE>(*value) = sqlite3_column_int64(stmt, SIZE);
-    std::get<VERSION>(*value) = sqlite3_column_int64(stmt, VERSION);
-    has_entry = true;
+    std::get<MTIME>(*value) = sqlite3_column_int64(get_stmt_, MTIME);
+    std::get<SIZE>(*value) = sqlite3_column_int64(get_stmt_, SIZE);
+    std::get<VERSION>(*value) = sqlite3_column_int64(get_stmt_, VERSION);
+    return true;
   } else if (result != SQLITE_DONE) {
     LOG(DB_ERROR) << "Failed to get " << key
                   << " with error: " << sqlite3_errstr(result);
   }
 
-  result = sqlite3_finalize(stmt);
-  if (result != SQLITE_OK) {
-    LOG(DB_ERROR) << "Failed to finalize SQL statement with error: "
-                  << sqlite3_errstr(result);
-  }
-
-  return has_entry;
+  return false;
 }
 
 bool SQLite::Set(const String& key, const Value& value) {
-  char* error;
-  const String sql =
-      "INSERT OR REPLACE INTO entries (hash, mtime, size, version) VALUES ('" +
-      key + "', " + std::to_string(std::get<MTIME>(value)) + ", " +
-      std::to_string(std::get<SIZE>(value)) + ", " +
-      std::to_string(std::get<VERSION>(value)) + ");";
-  auto result = sqlite3_exec(db_, sql.c_str(), nullptr, nullptr, &error);
-  if (result != SQLITE_OK) {
-    LOG(DB_ERROR) << sqlite3_errstr(result) << ": " << error;
-    return false;
-  }
-
-  return true;
+  UniqueLock lock(mutex_);
+  return SetLocked(key, value);
 }
 
 bool SQLite::Delete(const String& key) {
-  char* error;
-  const String sql = "DELETE FROM entries WHERE hash = '" + key + "'";
-  auto result = sqlite3_exec(db_, sql.c_str(), nullptr, nullptr, &error);
-  if (result != SQLITE_OK) {
-    LOG(DB_ERROR) << sqlite3_errstr(result) << ": " << error;
+  UniqueLock lock(mutex_);
+  StatementScope scope(delete_stmt_);
+  BindText(delete_stmt_, 1, key);
+
+  auto result = sqlite3_step(delete_stmt_);
+  if (result != SQLITE_DONE) {
+    LOG(DB_ERROR) << "Failed to delete " << key
+                  << " with error: " << sqlite3_errstr(result);
     return false;
   }
 
@@ -186,9 +341,125 @@ bool SQLite::First(Immutable* hash, Value* value) const {
   DCHECK(hash);
   DCHECK(value);
 
+  UniqueLock lock(mutex_);
+  StatementScope scope(first_stmt_);
+
+  auto result = sqlite3_step(first_stmt_);
+  if (result == SQLITE_ROW) {
+    std::get<MTIME>(*value) = sqlite3_column_int64(first_stmt_, MTIME);
+    std::get<SIZE>(*value) = sqlite3_column_int64(first_stmt_, SIZE);
+    std::get<VERSION>(*value) = sqlite3_column_int64(first_stmt_, VERSION);
+    hash->assign(String(reinterpret_cast<const char*>(
+        sqlite3_column_text(first_stmt_, MAX_FIELD_VALUE))));
+    return true;
+  } else if (result != SQLITE_DONE) {
+    LOG(DB_ERROR) << "Failed to get first entry with error: "
+                  << sqlite3_errstr(result);
+  }
+
+  return false;
+}
+
+bool SQLite::Touch(const String& key, ui64 mtime) {
+  UniqueLock lock(mutex_);
+  return TouchLocked(key, {mtime, 1}) > 0;
+}
+
+bool SQLite::Touch(const HashMap<String, Usage>& used,
+                   List<String>* missing) {
+  DCHECK(missing);
+
+  UniqueLock lock(mutex_);
+  if (!ExecLocked("SAVEPOINT batch_touch")) {
+    return false;
+  }
+
+  bool result = true;
+  for (const auto& entry : used) {
+    const int changes = TouchLocked(entry.first, entry.second);
+    if (changes == -1) {
+      result = false;
+      break;
+    } else if (changes == 0) {
+      missing->push_back(entry.first);
+    }
+  }
+
+  if (!result) {
+    ExecLocked("ROLLBACK TO batch_touch");
+  }
+  return ExecLocked("RELEASE batch_touch") && result;
+}
+
+bool SQLite::Set(const List<Pair<String, Value>>& values) {
+  UniqueLock lock(mutex_);
+  if (!ExecLocked("SAVEPOINT batch_set")) {
+    return false;
+  }
+
+  bool result = true;
+  for (const auto& entry : values) {
+    if (!SetLocked(entry.first, entry.second)) {
+      result = false;
+      break;
+    }
+  }
+
+  if (!result) {
+    ExecLocked("ROLLBACK TO batch_set");
+  }
+  return ExecLocked("RELEASE batch_set") && result;
+}
+
+bool SQLite::GetVictims(proto::Eviction order, ui64 size,
+                        List<Victim>* victims) const {
+  DCHECK(victims);
+
+  sqlite3_stmt* stmt = nullptr;
+  switch (order) {
+    case proto::LRU:
+      stmt = lru_victims_stmt_;
+      break;
+    case proto::SLRU:
+      stmt = slru_victims_stmt_;
+      break;
+    case proto::FREQUENCY:
+      stmt = frequency_victims_stmt_;
+      break;
+  }
+  DCHECK(stmt);
+
+  UniqueLock lock(mutex_);
+  StatementScope scope(stmt);
+  sqlite3_bind_int(stmt, 1, kMaxVictims);
+
+  int result = SQLITE_DONE;
+  ui64 total_size = 0;
+  while (total_size < size && (result = sqlite3_step(stmt)) == SQLITE_ROW) {
+    victims->emplace_back(
+        reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)),
+        sqlite3_column_int64(stmt, 1));
+    total_size += victims->back().second;
+  }
+  if (result != SQLITE_ROW && result != SQLITE_DONE) {
+    LOG(DB_ERROR) << "Failed to get victims with error: "
+                  << sqlite3_errstr(result);
+    return false;
+  }
+
+  return true;
+}
+
+bool SQLite::AgeHits() {
+  UniqueLock lock(mutex_);
+  // The new hits weigh twice as much as the old ones - instead of halving the
+  // hits of every row.
+  if (!ExecLocked("UPDATE aging SET scale = scale * 2")) {
+    return false;
+  }
+
   sqlite3_stmt* stmt;
-  const String sql =
-      "SELECT mtime, size, version, hash FROM entries ORDER BY mtime ASC";
+  const String sql = "SELECT scale FROM aging";
   auto result =
       sqlite3_prepare_v2(db_, sql.c_str(), sql.size(), &stmt, nullptr);
   if (result != SQLITE_OK) {
@@ -197,21 +468,12 @@ bool SQLite::First(Immutable* hash, Value* value) const {
     return false;
   }
 
-  bool has_entry = false;
+  double scale = 0;
   result = sqlite3_step(stmt);
   if (result == SQLITE_ROW) {
-    std::get<MTIME>(*value) = sqlite3_column_int64(stmt, MTIME);
-    std::get<SIZE>(*value) = sqlite3_column_int64(stmt, SIZE);
-    std::get<VERSION>(*value) = sqlite3_column_int64(stmt, VERSION);
-
-    auto column_count = sqlite3_column_count(stmt);
-    DCHECK(column_count > MAX_FIELD_VALUE);
-
-    hash->assign(String(reinterpret_cast<const char*>(
-        sqlite3_column_text(stmt, column_count - 1))));
-    has_entry = true;
-  } else if (result != SQLITE_DONE) {
-    LOG(DB_ERROR) << "Failed to get first entry with error: "
+    scale = sqlite3_column_double(stmt, 0);
+  } else {
+    LOG(DB_ERROR) << "Failed to get scale with error: "
                   << sqlite3_errstr(result);
   }
 
@@ -221,26 +483,342 @@ bool SQLite::First(Immutable* hash, Value* value) const {
                   << sqlite3_errstr(result);
   }
 
-  return has_entry;
+  // The rare rescale keeps the order of all entries.
+  if (scale < kMaxScale) {
+    return true;
+  }
+  return ExecLocked(
+      "SAVEPOINT rescale;"
+      "UPDATE entries SET score = score / (SELECT scale FROM aging);"
+      "UPDATE aging SET scale = 1.0;"
+      "RELEASE rescale;");
 }
 
-bool SQLite::BeginTransaction() {
-  char* error;
+bool SQLite::LimitProtected(ui64 size) {
+  UniqueLock lock(mutex_);
+
+  sqlite3_stmt* stmt;
+  const String sql =
+      "SELECT hash, size FROM entries WHERE segment = 1 ORDER BY mtime DESC";
   auto result =
-      sqlite3_exec(db_, "BEGIN TRANSACTION", nullptr, nullptr, &error);
+      sqlite3_prepare_v2(db_, sql.c_str(), sql.size(), &stmt, nullptr);
   if (result != SQLITE_OK) {
-    LOG(DB_ERROR) << sqlite3_errstr(result) << ": " << error;
+    LOG(DB_ERROR) << "Failed to prepare SQL statement with error: "
+                  << sqlite3_errmsg(db_);
     return false;
   }
 
+  // The most recent entries stay protected - the rest is demoted.
+  ui64 protected_size = 0;
+  List<String> demoted;
+  while ((result = sqlite3_step(stmt)) == SQLITE_ROW) {
+    protected_size += sqlite3_column_int64(stmt, 1);
+    if (protected_size > size) {
+      demoted.emplace_back(
+          reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)));
+    }
+  }
+  if (result != SQLITE_DONE) {
+    LOG(DB_ERROR) << "Failed to get protected entries with error: "
+                  << sqlite3_errstr(result);
+  }
+
+  result = sqlite3_finalize(stmt);
+  if (result != SQLITE_OK) {
+    LOG(DB_ERROR) << "Failed to finalize SQL statement with error: "
+                  << sqlite3_errstr(result);
+  }
+
+  if (demoted.empty()) {
+    return true;
+  }
+
+  stmt = Prepare(db_, "UPDATE entries SET segment = 0 WHERE hash = ?1");
+  bool demoted_all = true;
+  for (const auto& key : demoted) {
+    StatementScope scope(stmt);
+    BindText(stmt, 1, key);
+    result = sqlite3_step(stmt);
+    if (result != SQLITE_DONE) {
+      LOG(DB_ERROR) << "Failed to demote " << key
+                    << " with error: " << sqlite3_errstr(result);
+      demoted_all = false;
+      break;
+    }
+  }
+  sqlite3_finalize(stmt);
+
+  return demoted_all;
+}
+
+bool SQLite::GetKeys(const String& prefix, List<String>* keys) const {
+  DCHECK(keys);
+
+  UniqueLock lock(mutex_);
+  StatementScope scope(get_keys_stmt_);
+  BindText(get_keys_stmt_, 1, prefix);
+
+  int result;
+  while ((result = sqlite3_step(get_keys_stmt_)) == SQLITE_ROW) {
+    keys->emplace_back(
+        reinterpret_cast<const char*>(sqlite3_column_text(get_keys_stmt_, 0)));
+  }
+  if (result != SQLITE_DONE) {
+    LOG(DB_ERROR) << "Failed to get keys with error: "
+                  << sqlite3_errstr(result);
+  }
+
   return true;
 }
 
+bool SQLite::GetValues(const String& prefix,
+                       HashMap<String, Value>* values) const {
+  DCHECK(values);
+
+  UniqueLock lock(mutex_);
+  StatementScope scope(get_prefix_stmt_);
+  BindText(get_prefix_stmt_, 1, prefix);
+
+  int result;
+  while ((result = sqlite3_step(get_prefix_stmt_)) == SQLITE_ROW) {
+    Value value;
+    std::get<MTIME>(value) = sqlite3_column_int64(get_prefix_stmt_, MTIME);
+    std::get<SIZE>(value) = sqlite3_column_int64(get_prefix_stmt_, SIZE);
+    std::get<VERSION>(value) = sqlite3_column_int64(get_prefix_stmt_, VERSION);
+    values->emplace(reinterpret_cast<const char*>(sqlite3_column_text(
+                        get_prefix_stmt_, MAX_FIELD_VALUE)),
+                    value);
+  }
+  if (result != SQLITE_DONE) {
+    LOG(DB_ERROR) << "Failed to get values of " << prefix
+                  << " with error: " << sqlite3_errstr(result);
+    return false;
+  }
+
+  return true;
+}
+
+ui64 SQLite::TotalSize() const {
+  UniqueLock lock(mutex_);
+  StatementScope scope(total_size_stmt_);
+
+  ui64 size = 0;
+  auto result = sqlite3_step(total_size_stmt_);
+  if (result == SQLITE_ROW) {
+    size = sqlite3_column_int64(total_size_stmt_, 0);
+  } else {
+    LOG(DB_ERROR) << "Failed to get total size with error: "
+                  << sqlite3_errstr(result);
+  }
+
+  return size;
+}
+
+bool SQLite::SetShared(const String& key, ui64 shared) {
+  UniqueLock lock(mutex_);
+  StatementScope scope(shared_stmt_);
+  BindText(shared_stmt_, 1, key);
+  sqlite3_bind_int64(shared_stmt_, 2, shared);
+
+  auto result = sqlite3_step(shared_stmt_);
+  if (result != SQLITE_DONE) {
+    LOG(DB_ERROR) << "Failed to set shared size of " << key
+                  << " with error: " << sqlite3_errstr(result);
+    return false;
+  }
+
+  return true;
+}
+
+bool SQLite::AddBlobRef(const String& key, ui64 size, ui32* refs) {
+  DCHECK(refs);
+
+  UniqueLock lock(mutex_);
+  ui64 old_size = 0;
+  *refs = 0;
+  if (GetBlobLocked(key, &old_size, refs) && old_size != size) {
+    LOG(DB_ERROR) << "Blob " << key << " has size " << old_size
+                  << " instead of " << size;
+    return false;
+  }
+
+  StatementScope scope(set_blob_stmt_);
+  BindText(set_blob_stmt_, 1, key);
+  sqlite3_bind_int64(set_blob_stmt_, 2, size);
+  sqlite3_bind_int64(set_blob_stmt_, 3, *refs + 1);
+
+  auto result = sqlite3_step(set_blob_stmt_);
+  if (result != SQLITE_DONE) {
+    LOG(DB_ERROR) << "Failed to reference blob " << key
+                  << " with error: " << sqlite3_errstr(result);
+    return false;
+  }
+
+  ++*refs;
+  return true;
+}
+
+bool SQLite::ReleaseBlobRef(const String& key, ui64* size, ui32* refs) {
+  DCHECK(size);
+  DCHECK(refs);
+
+  UniqueLock lock(mutex_);
+  if (!GetBlobLocked(key, size, refs)) {
+    return false;
+  }
+  --*refs;
+
+  auto* stmt = *refs ? set_blob_stmt_ : delete_blob_stmt_;
+  StatementScope scope(stmt);
+  BindText(stmt, 1, key);
+  if (*refs) {
+    sqlite3_bind_int64(stmt, 2, *size);
+    sqlite3_bind_int64(stmt, 3, *refs);
+  }
+
+  auto result = sqlite3_step(stmt);
+  if (result != SQLITE_DONE) {
+    LOG(DB_ERROR) << "Failed to release blob " << key
+                  << " with error: " << sqlite3_errstr(result);
+    return false;
+  }
+
+  return true;
+}
+
+bool SQLite::BeginTransaction() {
+  UniqueLock lock(mutex_);
+  // Take the write lock right away - so the busy timeout applies, if another
+  // process holds it.
+  return ExecLocked("BEGIN IMMEDIATE TRANSACTION");
+}
+
 bool SQLite::EndTransaction() {
+  UniqueLock lock(mutex_);
+  if (ExecLocked("END TRANSACTION")) {
+    return true;
+  }
+
+  ExecLocked("ROLLBACK TRANSACTION");
+  return false;
+}
+
+bool SQLite::RollbackTransaction() {
+  UniqueLock lock(mutex_);
+  return ExecLocked("ROLLBACK TRANSACTION");
+}
+
+void SQLite::PrepareStatements() {
+  get_stmt_ = Prepare(
+      db_, "SELECT mtime, size, version FROM entries WHERE hash = ?1");
+  // The range - unlike the LIKE - is looked up in the primary key. The hashes
+  // consist of the hex digits and dashes, that are less than '~'.
+  get_prefix_stmt_ = Prepare(
+      db_,
+      "SELECT mtime, size, version, hash FROM entries "
+      "WHERE hash >= ?1 AND hash < ?1 || '~'");
+  // Keep the hits of the replaced entry. The new one is scored as a single
+  // hit - and the score is the weight of the hits per byte.
+  set_stmt_ = Prepare(
+      db_,
+      "INSERT OR REPLACE INTO entries (hash, mtime, size, version, hits, "
+      "                                shared, segment, score) "
+      "VALUES (?1, ?2, ?3, ?4, "
+      "        COALESCE((SELECT hits FROM entries WHERE hash = ?1), 0), "
+      "        COALESCE((SELECT shared FROM entries WHERE hash = ?1), 0), "
+      "        COALESCE((SELECT segment FROM entries WHERE hash = ?1), 0), "
+      "        COALESCE((SELECT score * size FROM entries WHERE hash = ?1), "
+      "                 (SELECT scale FROM aging)) / ?3)");
+  delete_stmt_ = Prepare(db_, "DELETE FROM entries WHERE hash = ?1");
+  // The hit entry is promoted to the protected segment.
+  touch_stmt_ = Prepare(
+      db_,
+      "UPDATE entries SET mtime = MAX(mtime, ?2), hits = hits + ?3, "
+      "    segment = segment OR ?3 > 0, "
+      "    score = score + ?3 * (SELECT scale FROM aging) / size "
+      "WHERE hash = ?1");
+  shared_stmt_ = Prepare(db_, "UPDATE entries SET shared = ?2 WHERE hash = ?1");
+  get_blob_stmt_ = Prepare(db_, "SELECT size, refs FROM blobs WHERE hash = ?1");
+  set_blob_stmt_ = Prepare(db_,
+                           "INSERT OR REPLACE INTO blobs (hash, size, refs) "
+                           "VALUES (?1, ?2, ?3)");
+  delete_blob_stmt_ = Prepare(db_, "DELETE FROM blobs WHERE hash = ?1");
+  // The entries with zero size are broken anyway - and go first, since the
+  // division by zero gives NULL score.
+  lru_victims_stmt_ = Prepare(
+      db_, "SELECT hash, size FROM entries ORDER BY mtime LIMIT ?1");
+  slru_victims_stmt_ = Prepare(
+      db_, "SELECT hash, size FROM entries ORDER BY segment, mtime LIMIT ?1");
+  frequency_victims_stmt_ = Prepare(
+      db_, "SELECT hash, size FROM entries ORDER BY score, mtime LIMIT ?1");
+  first_stmt_ = Prepare(
+      db_,
+      "SELECT mtime, size, version, hash FROM entries ORDER BY mtime LIMIT 1");
+  // The prefix is bound - so it's never parsed as SQL.
+  get_keys_stmt_ =
+      Prepare(db_, "SELECT hash FROM entries WHERE hash LIKE ?1 || '%'");
+  total_size_stmt_ = Prepare(
+      db_,
+      "SELECT TOTAL(size - shared) + (SELECT TOTAL(size) FROM blobs) "
+      "FROM entries");
+}
+
+bool SQLite::SetLocked(const String& key, const Value& value) {
+  StatementScope scope(set_stmt_);
+  BindText(set_stmt_, 1, key);
+  sqlite3_bind_int64(set_stmt_, 2, std::get<MTIME>(value));
+  sqlite3_bind_int64(set_stmt_, 3, std::get<SIZE>(value));
+  sqlite3_bind_int64(set_stmt_, 4, std::get<VERSION>(value));
+
+  auto result = sqlite3_step(set_stmt_);
+  if (result != SQLITE_DONE) {
+    LOG(DB_ERROR) << "Failed to set " << key
+                  << " with error: " << sqlite3_errstr(result);
+    return false;
+  }
+
+  return true;
+}
+
+int SQLite::TouchLocked(const String& key, const Usage& usage) {
+  StatementScope scope(touch_stmt_);
+  BindText(touch_stmt_, 1, key);
+  sqlite3_bind_int64(touch_stmt_, 2, usage.mtime);
+  sqlite3_bind_int64(touch_stmt_, 3, usage.hits);
+
+  auto result = sqlite3_step(touch_stmt_);
+  if (result != SQLITE_DONE) {
+    LOG(DB_ERROR) << "Failed to touch " << key
+                  << " with error: " << sqlite3_errstr(result);
+    return -1;
+  }
+
+  return sqlite3_changes(db_);
+}
+
+bool SQLite::GetBlobLocked(const String& key, ui64* size, ui32* refs) {
+  StatementScope scope(get_blob_stmt_);
+  BindText(get_blob_stmt_, 1, key);
+
+  auto result = sqlite3_step(get_blob_stmt_);
+  if (result == SQLITE_ROW) {
+    *size = sqlite3_column_int64(get_blob_stmt_, 0);
+    *refs = sqlite3_column_int64(get_blob_stmt_, 1);
+    return true;
+  } else if (result != SQLITE_DONE) {
+    LOG(DB_ERROR) << "Failed to get blob " << key
+                  << " with error: " << sqlite3_errstr(result);
+  }
+
+  return false;
+}
+
+bool SQLite::ExecLocked(const char* sql) {
   char* error;
-  auto result = sqlite3_exec(db_, "END TRANSACTION", nullptr, nullptr, &error);
+  auto result = sqlite3_exec(db_, sql, nullptr, nullptr, &error);
   if (result != SQLITE_OK) {
     LOG(DB_ERROR) << sqlite3_errstr(result) << ": " << error;
+    sqlite3_free(error);
     return false;
   }
 
@@ -2,6 +2,7 @@
 
 #include <base/aliases.h>
 #include <cache/database.h>
+#include <cache/manifest.pb.h>
 
 #undef VERSION  // FIXME: is it necessery?
 
@@ -35,15 +36,85 @@ class SQLite : public Database<size_t /* mtime */, size_t /* size */,
 
   bool First(Immutable* hash, Value* value) const;
 
+  struct Usage {
+    ui64 mtime = 0;
+    ui32 hits = 0;
+  };
+
+  bool Touch(const String& key, ui64 mtime);
+  // Updates mtime and counts a hit. Returns |false| if there is no such key.
+
+  // The batch versions apply all the rows at once, with the cached prepared
+  // statements. The missing keys are returned in |missing|.
+  bool Touch(const HashMap<String, Usage>& used, List<String>* missing);
+  bool Set(const List<Pair<String, Value>>& values);
+
+  using Victim = Pair<String /* hash */, ui64 /* size */>;
+  bool GetVictims(proto::Eviction order, ui64 size,
+                  List<Victim>* victims) const;
+  // Returns the first entries in the eviction |order| with the total |size| -
+  // or a batch of them, if there are too many.
+  bool AgeHits();
+  // The hits before the call weigh half as much in the |FREQUENCY| order. Only
+  // a single row is updated - but once in a while all scores are rescaled.
+  bool LimitProtected(ui64 size);
+  // Demotes the least recent entries of the protected segment to the probation
+  // one, until the rest of them has the total |size|.
+  bool GetKeys(const String& prefix, List<String>* keys) const;
+  bool GetValues(const String& prefix, HashMap<String, Value>* values) const;
+  // Returns all rows with the hash |prefix| in a single range query.
+  ui64 TotalSize() const;
+  // The size on disk: the shared blobs are counted only once.
+
+  bool SetShared(const String& key, ui64 shared);
+  // |shared| is the part of the entry's size, that is stored in the blobs.
+
+  // The artifacts of a few entries with the same contents are stored once -
+  // as the blobs with the reference counts.
+  bool AddBlobRef(const String& key, ui64 size, ui32* refs);
+  // Returns |false| if there is a blob with the same key and another size.
+  bool ReleaseBlobRef(const String& key, ui64* size, ui32* refs);
+  // The blob without references is deleted from the index. Returns |false| if
+  // there is no such blob.
+
   bool BeginTransaction();
   bool EndTransaction();
+  // Rolls back the transaction, if it can't be committed - e.g. another
+  // process holds the lock of the shared index past the busy timeout.
+  bool RollbackTransaction();
 
  private:
   bool Migrate() const;
 
+  void PrepareStatements();
+  bool SetLocked(const String& key, const Value& value);
+  int TouchLocked(const String& key, const Usage& usage);
+  // Returns the number of touched entries, or -1 on error.
+  bool ExecLocked(const char* sql);
+  bool GetBlobLocked(const String& key, ui64* size, ui32* refs);
+
   sqlite3* db_ = nullptr;
   const String path_;
 
+  // The cached statements are shared by all threads - and can't be used
+  // concurrently.
+  mutable std::mutex mutex_;
+  sqlite3_stmt* get_stmt_ = nullptr;
+  sqlite3_stmt* get_prefix_stmt_ = nullptr;
+  sqlite3_stmt* set_stmt_ = nullptr;
+  sqlite3_stmt* delete_stmt_ = nullptr;
+  sqlite3_stmt* touch_stmt_ = nullptr;
+  sqlite3_stmt* shared_stmt_ = nullptr;
+  sqlite3_stmt* get_blob_stmt_ = nullptr;
+  sqlite3_stmt* set_blob_stmt_ = nullptr;
+  sqlite3_stmt* delete_blob_stmt_ = nullptr;
+  sqlite3_stmt* lru_victims_stmt_ = nullptr;
+  sqlite3_stmt* slru_victims_stmt_ = nullptr;
+  sqlite3_stmt* frequency_victims_stmt_ = nullptr;
+  sqlite3_stmt* first_stmt_ = nullptr;
+  sqlite3_stmt* get_keys_stmt_ = nullptr;
+  sqlite3_stmt* total_size_stmt_ = nullptr;
+
   const ui32 kSQLiteVersion = 0;
 };
 
@@ -0,0 +1,248 @@
+#include <cache/database_sqlite.h>
+
+#include <base/const_string.h>
+#include <base/temporary_dir.h>
+#include <cache/sqlite3.h>
+
+#include <third_party/gtest/exported/include/gtest/gtest.h>
+
+namespace dist_clang {
+namespace cache {
+
+namespace {
+
+List<String> GetVictimKeys(const SQLite& database, proto::Eviction order,
+                           ui64 size) {
+  List<SQLite::Victim> victims;
+  EXPECT_TRUE(database.GetVictims(order, size, &victims));
+
+  List<String> keys;
+  for (const auto& victim : victims) {
+    keys.push_back(victim.first);
+  }
+  return keys;
+}
+
+}  // namespace
+
+TEST(SQLiteTest, EvictionOrder) {
+  SQLite database;
+  ASSERT_TRUE(database.Set("old", std::make_tuple(1, 10, 0)));
+  ASSERT_TRUE(database.Set("big", std::make_tuple(2, 100, 0)));
+  ASSERT_TRUE(database.Set("hot", std::make_tuple(3, 10, 0)));
+  ASSERT_TRUE(database.Set("new", std::make_tuple(4, 10, 0)));
+
+  ASSERT_TRUE(database.Touch("old", 5));
+  ASSERT_TRUE(database.Touch("hot", 6));
+  ASSERT_TRUE(database.Touch("hot", 7));
+  EXPECT_FALSE(database.Touch("missing", 8));
+
+  // The replacement keeps the hits.
+  ASSERT_TRUE(database.Set("hot", std::make_tuple(7, 10, 1)));
+
+  EXPECT_EQ((List<String>{"big", "new", "old", "hot"}),
+            GetVictimKeys(database, proto::LRU, 1000));
+  EXPECT_EQ((List<String>{"big", "new"}),
+            GetVictimKeys(database, proto::SLRU, 101));
+  EXPECT_EQ((List<String>{"big"}),
+            GetVictimKeys(database, proto::FREQUENCY, 100));
+  EXPECT_EQ((List<String>{"big", "new", "old"}),
+            GetVictimKeys(database, proto::FREQUENCY, 111));
+  EXPECT_TRUE(GetVictimKeys(database, proto::LRU, 0).empty());
+
+  // The least recent "old" is demoted from the protected segment.
+  ASSERT_TRUE(database.LimitProtected(10));
+  EXPECT_EQ((List<String>{"big", "new", "old"}),
+            GetVictimKeys(database, proto::SLRU, 111));
+
+  // After aging a single hit of "new" outweighs the older hit of "old".
+  ASSERT_TRUE(database.AgeHits());
+  ASSERT_TRUE(database.Touch("new", 8));
+  EXPECT_EQ((List<String>{"big", "old", "hot", "new"}),
+            GetVictimKeys(database, proto::FREQUENCY, 1000));
+
+  // The rescaled scores keep the order.
+  for (ui32 i = 0; i < 300; ++i) {
+    ASSERT_TRUE(database.AgeHits());
+  }
+  EXPECT_EQ((List<String>{"big", "old", "hot", "new"}),
+            GetVictimKeys(database, proto::FREQUENCY, 1000));
+}
+
+TEST(SQLiteTest, MigrateHits) {
+  const base::TemporaryDir tmp_dir;
+  {
+    SQLite database(tmp_dir, "index");
+  }
+
+  // The index of the previous version has neither segments, nor scores.
+  sqlite3* db;
+  const String path = String(tmp_dir) + "/index.sqlite";
+  ASSERT_EQ(SQLITE_OK, sqlite3_open(path.c_str(), &db));
+  ASSERT_EQ(SQLITE_OK,
+            sqlite3_exec(db,
+                         "DROP TABLE entries;"
+                         "CREATE TABLE entries("
+                         "    hash CHAR(50) PRIMARY KEY NOT NULL,"
+                         "    mtime INT NOT NULL,"
+                         "    size INT NOT NULL,"
+                         "    version INT NOT NULL,"
+                         "    hits INT NOT NULL DEFAULT 0,"
+                         "    shared INT NOT NULL DEFAULT 0"
+                         ");"
+                         "INSERT INTO entries VALUES ('hot', 1, 10, 0, 2, 0);"
+                         "INSERT INTO entries VALUES ('cold', 2, 10, 0, 0, 0);",
+                         nullptr, nullptr, nullptr));
+  sqlite3_close(db);
+
+  SQLite database(tmp_dir, "index");
+  EXPECT_EQ((List<String>{"cold", "hot"}),
+            GetVictimKeys(database, proto::SLRU, 20));
+  EXPECT_EQ((List<String>{"cold", "hot"}),
+            GetVictimKeys(database, proto::FREQUENCY, 20));
+}
+
+TEST(SQLiteTest, MigrateColumnsSeparately) {
+  const base::TemporaryDir tmp_dir;
+  {
+    SQLite database(tmp_dir, "index");
+  }
+
+  // The index, that has got the segments, but not the scores yet.
+  sqlite3* db;
+  const String path = String(tmp_dir) + "/index.sqlite";
+  ASSERT_EQ(SQLITE_OK, sqlite3_open(path.c_str(), &db));
+  ASSERT_EQ(SQLITE_OK,
+            sqlite3_exec(db,
+                         "DROP TABLE entries;"
+                         "CREATE TABLE entries("
+                         "    hash CHAR(50) PRIMARY KEY NOT NULL,"
+                         "    mtime INT NOT NULL,"
+                         "    size INT NOT NULL,"
+                         "    version INT NOT NULL,"
+                         "    hits INT NOT NULL DEFAULT 0,"
+                         "    shared INT NOT NULL DEFAULT 0,"
+                         "    segment INT NOT NULL DEFAULT 0"
+                         ");"
+                         "INSERT INTO entries VALUES ('hot', 1, 10, 0, 2, 0, 1);"
+                         "INSERT INTO entries VALUES ('cold', 2, 10, 0, 0, 0, "
+                         "0);",
+                         nullptr, nullptr, nullptr));
+  sqlite3_close(db);
+
+  SQLite database(tmp_dir, "index");
+  EXPECT_EQ((List<String>{"cold", "hot"}),
+            GetVictimKeys(database, proto::SLRU, 20));
+  EXPECT_EQ((List<String>{"cold", "hot"}),
+            GetVictimKeys(database, proto::FREQUENCY, 20));
+}
+
+TEST(SQLiteTest, BatchUpdate) {
+  const base::TemporaryDir tmp_dir;
+  SQLite database(tmp_dir, "index");
+
+  ASSERT_TRUE(database.Set({{"key1", std::make_tuple(1, 10, 0)},
+                            {"key2", std::make_tuple(2, 20, 0)}}));
+
+  HashMap<String, SQLite::Usage> used;
+  used["key1"] = {5, 3};
+  used["key3"] = {6, 1};
+  List<String> missing;
+  ASSERT_TRUE(database.Touch(used, &missing));
+  EXPECT_EQ(List<String>{"key3"}, missing);
+
+  SQLite::Value value;
+  ASSERT_TRUE(database.Get("key1", &value));
+  EXPECT_EQ(5u, std::get<SQLite::MTIME>(value));
+  EXPECT_EQ(10u, std::get<SQLite::SIZE>(value));
+  ASSERT_TRUE(database.Get("key2", &value));
+  EXPECT_EQ(2u, std::get<SQLite::MTIME>(value));
+  EXPECT_FALSE(database.Exists("key3"));
+
+  // The hits are counted - "key1" goes last.
+  EXPECT_EQ((List<String>{"key2", "key1"}),
+            GetVictimKeys(database, proto::SLRU, 30));
+
+  ASSERT_TRUE(database.Delete("key1"));
+  EXPECT_FALSE(database.Exists("key1"));
+  EXPECT_EQ(20u, database.TotalSize());
+}
+
+TEST(SQLiteTest, GetValuesByPrefix) {
+  SQLite database;
+  ASSERT_TRUE(database.Set("ab12-1", std::make_tuple(1, 10, 2)));
+  ASSERT_TRUE(database.Set("ab34-2", std::make_tuple(3, 30, 4)));
+  ASSERT_TRUE(database.Set("ac12-3", std::make_tuple(5, 50, 6)));
+  ASSERT_TRUE(database.Set("a-b", std::make_tuple(7, 70, 8)));
+
+  HashMap<String, SQLite::Value> values;
+  ASSERT_TRUE(database.GetValues("ab", &values));
+  ASSERT_EQ(2u, values.size());
+  EXPECT_EQ(std::make_tuple(1u, 10u, 2u), values["ab12-1"]);
+  EXPECT_EQ(std::make_tuple(3u, 30u, 4u), values["ab34-2"]);
+
+  values.clear();
+  ASSERT_TRUE(database.GetValues("b", &values));
+  EXPECT_TRUE(values.empty());
+}
+
+TEST(SQLiteTest, CachedQueries) {
+  SQLite database;
+  Immutable hash;
+  SQLite::Value value;
+  EXPECT_FALSE(database.First(&hash, &value));
+  EXPECT_EQ(0u, database.TotalSize());
+
+  ASSERT_TRUE(database.Set("ab12-1", std::make_tuple(3, 10, 2)));
+  ASSERT_TRUE(database.Set("ab34-2", std::make_tuple(1, 30, 4)));
+  ASSERT_TRUE(database.Set("ac12-3", std::make_tuple(5, 50, 6)));
+
+  // The statements are reused by the repeated calls.
+  for (ui32 i = 0; i < 2; ++i) {
+    ASSERT_TRUE(database.First(&hash, &value));
+    EXPECT_EQ("ab34-2"_l, hash);
+    EXPECT_EQ(std::make_tuple(1u, 30u, 4u), value);
+    EXPECT_EQ(90u, database.TotalSize());
+
+    List<String> keys;
+    ASSERT_TRUE(database.GetKeys("ab", &keys));
+    keys.sort();
+    EXPECT_EQ((List<String>{"ab12-1", "ab34-2"}), keys);
+  }
+
+  // The prefix isn't a part of the SQL.
+  List<String> keys;
+  ASSERT_TRUE(database.GetKeys("a' OR '1' = '1", &keys));
+  EXPECT_TRUE(keys.empty());
+  ASSERT_TRUE(database.GetKeys(String(), &keys));
+  EXPECT_EQ(3u, keys.size());
+}
+
+TEST(SQLiteTest, BlobReferences) {
+  SQLite database;
+  ui32 refs = 0;
+  ui64 size = 0;
+
+  ASSERT_TRUE(database.AddBlobRef("blob", 100, &refs));
+  EXPECT_EQ(1u, refs);
+  ASSERT_TRUE(database.AddBlobRef("blob", 100, &refs));
+  EXPECT_EQ(2u, refs);
+  EXPECT_FALSE(database.AddBlobRef("blob", 50, &refs));
+
+  // Both entries keep the blob, but it's counted only once.
+  ASSERT_TRUE(database.Set("key1", std::make_tuple(1, 110, 0)));
+  ASSERT_TRUE(database.Set("key2", std::make_tuple(2, 120, 0)));
+  ASSERT_TRUE(database.SetShared("key1", 100));
+  ASSERT_TRUE(database.SetShared("key2", 100));
+  EXPECT_EQ(130u, database.TotalSize());
+
+  ASSERT_TRUE(database.ReleaseBlobRef("blob", &size, &refs));
+  EXPECT_EQ(100u, size);
+  EXPECT_EQ(1u, refs);
+  ASSERT_TRUE(database.ReleaseBlobRef("blob", &size, &refs));
+  EXPECT_EQ(0u, refs);
+  EXPECT_FALSE(database.ReleaseBlobRef("blob", &size, &refs));
+}
+
+}  // namespace cache
+}  // namespace dist_clang
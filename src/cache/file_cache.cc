@@ -1,17 +1,27 @@
 #include <cache/file_cache.h>
 
+#include <base/c_utils.h>
 #include <base/file/file.h>
+#include <base/hasher.h>
 #include <base/logging.h>
 #include <base/protobuf_utils.h>
 #include <base/string_utils.h>
+#include <cache/hash_memo.h>
 #include <perf/stat_service.h>
 
-#include <third_party/snappy/exported/snappy.h>
-#include STL(regex)
 
 #include <clang/Basic/Version.h>
-
+#include <third_party/protobuf/exported/src/google/protobuf/io/coded_stream.h>
+#include <third_party/protobuf/exported/src/google/protobuf/io/gzip_stream.h>
+#include <third_party/protobuf/exported/src/google/protobuf/io/zero_copy_stream_impl.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include <utime.h>
 
 #include <base/using_log.h>
@@ -20,6 +30,16 @@ namespace dist_clang {
 
 namespace {
 
+// The entries are found by the keys, made with this engine - any change of the
+// key derivation or of the engine should bump the |kKeyVersion|, so the old
+// entries are never hit and just age out.
+const base::Hasher::Engine kKeyEngine = base::Hasher::XXH3_TREE;
+const Literal kKeyVersion = "2"_l;
+
+Immutable KeyHash(const Immutable& str, ui8 output_size = 16) {
+  return base::Hasher::Hash(str, output_size, kKeyEngine);
+}
+
 String ReplaceTildeInPath(const String& path) {
   if (path[0] == '~' && path[1] == '/') {
     return String(base::GetHomeDir()) + path.substr(1);
@@ -27,18 +47,113 @@ String ReplaceTildeInPath(const String& path) {
   return path;
 }
 
+// Old manifests are stored in the text format - rewrite them in the binary
+// format on the first use. Also the direct manifests are rewritten with the
+// reordered variants. The new manifest is written aside under a unique name and
+// renamed over the old one, so the concurrent readers always see either of
+// them - and the rewriters don't share a temporary file.
+void RewriteManifest(const String& path,
+                     const cache::proto::Manifest& manifest) {
+  static Atomic<ui64> rewrite_count = {0u};
+  const String tmp_path = path + ".rewrite-" + std::to_string(getpid()) + "-" +
+                          std::to_string(rewrite_count++);
+
+  String error;
+  if (!base::SaveToFile(tmp_path, manifest, &error, true) ||
+      !base::File::Move(tmp_path, path, &error)) {
+    LOG(CACHE_WARNING) << "Failed to rewrite manifest " << path << ": "
+                       << error;
+    base::File::Delete(tmp_path);
+  }
+}
+
+const char kHexDigits[] = "0123456789abcdef";
+
+// The share of the cleaned cache, that is kept by the protected segment of the
+// |SLRU| order.
+const double kProtectedShare = 0.8;
+
+// Checks that |str| matches "[a-f0-9]{32}-[a-f0-9]{8}-[a-f0-9]{8}".
+bool IsHash(Immutable str) {
+  const String hash = str;
+  if (hash.size() != 50 || hash[32] != '-' || hash[41] != '-') {
+    return false;
+  }
+  for (size_t i = 0; i < hash.size(); ++i) {
+    if (i != 32 && i != 41 && !strchr(kHexDigits, hash[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The direct manifests before the variants have a single list of headers.
+void UpgradeDirect(cache::proto::Direct* direct) {
+  if (!direct->variants_size()) {
+    auto* variant = direct->add_variants();
+    variant->mutable_headers()->Swap(direct->mutable_headers());
+    variant->mutable_stats()->Swap(direct->mutable_stats());
+  }
+}
+
+// Clears |manifest|, if there is no direct manifest on |path|.
+void LoadDirect(const String& path, cache::proto::Manifest* manifest) {
+  if (base::File::Exists(path) && base::LoadFromFile(path, manifest) &&
+      manifest->has_direct()) {
+    UpgradeDirect(manifest->mutable_direct());
+  } else {
+    manifest->Clear();
+  }
+}
+
+bool SameHeaders(const cache::proto::Direct::Variant& a,
+                 const cache::proto::Direct::Variant& b) {
+  return a.headers_size() == b.headers_size() &&
+         std::equal(a.headers().begin(), a.headers().end(),
+                    b.headers().begin());
+}
+
+// Returns |false|, if some hash of header is unknown.
+bool GetDirectHash(Immutable unhandled_hash,
+                   const cache::proto::Direct::Variant& variant,
+                   String* direct_hash) {
+  if (variant.stats_size() != variant.headers_size()) {
+    return false;
+  }
+
+  Immutable::Rope hash_rope = {unhandled_hash};
+  for (const auto& stat : variant.stats()) {
+    if (!stat.has_hash()) {
+      return false;
+    }
+    hash_rope.push_back(Immutable(stat.hash()));
+  }
+  direct_hash->assign(base::Hexify(KeyHash(Immutable(hash_rope))));
+  return true;
+}
+
+// The entry stores either all artifacts in the blobs, or none of them.
+ui64 SharedSize(const cache::proto::Manifest& manifest) {
+  const auto& v1 = manifest.v1();
+  if (v1.has_err_blob() || v1.has_obj_blob() || v1.has_dep_blob()) {
+    return v1.size();
+  }
+  return 0;
+}
+
 String HashCombine(const Immutable& source, const cache::ExtraFiles& files) {
-  if (files.empty()) {  // we want hash to be compatible with previous versions
-    return base::Hexify(source.Hash());
+  // Without extra files, the hash is just the one of the source.
+  if (files.empty()) {
+    return base::Hexify(KeyHash(source));
   }
-  Immutable::Rope hashes_string{source.Hash()};
+  Immutable::Rope hashes_string{KeyHash(source)};
   for (auto&& index_file_pair : files) {
     std::stringstream ss;
     ss << index_file_pair.first;
-    hashes_string.emplace_back(Immutable::WrapString(ss.str()).Hash(4));
-    hashes_string.emplace_back(index_file_pair.second.Hash());
+    hashes_string.emplace_back(KeyHash(Immutable::WrapString(ss.str()), 4));
+    hashes_string.emplace_back(KeyHash(index_file_pair.second));
   }
-  return base::Hexify(Immutable(hashes_string).Hash());
+  return base::Hexify(KeyHash(Immutable(hashes_string)));
 }
 
 }  // namespace
@@ -46,20 +161,86 @@ String HashCombine(const Immutable& source, const cache::ExtraFiles& files) {
 namespace cache {
 
 FileCache::FileCache(const String& path, ui64 size, bool snappy,
-                     bool store_index)
+                     bool store_index, bool mtime, bool pack)
     : path_(ReplaceTildeInPath(path)),
-      snappy_(snappy),
       store_index_(store_index),
-      max_size_(size) {}
+      mtime_(mtime),
+      use_pack_(pack),
+      max_size_(size) {
+  if (snappy) {
+    codec_policy_.compression.set_codec(proto::SNAPPY);
+  }
+}
 
 FileCache::FileCache(const String& path)
-    : FileCache(path, UNLIMITED, false, false) {}
+    : FileCache(path, UNLIMITED, false, false, false, false) {}
 
 FileCache::~FileCache() {
+  stop_reconcile_ = true;
+  reconciler_.reset();
+  promoter_.reset();
   resetter_.reset();
   new_entries_.reset();
 }
 
+// static
+bool FileCache::RestoreObject(const Entry& entry, const String& path,
+                              bool hardlink, String* error) {
+  if (!entry.object_file) {
+    return base::File::Write(path, entry.object, error);
+  }
+
+  if (entry.object_codec == proto::NONE && hardlink) {
+    return entry.object_file->LinkInto(path, error);
+  }
+  return DecompressInto(entry.object_codec, *entry.object_file, path, error);
+}
+
+void FileCache::SetCodecPolicy(const CodecPolicy& policy) {
+  codec_policy_ = policy;
+}
+
+void FileCache::SetEvictionPolicy(const EvictionPolicy& policy) {
+  DCHECK(policy.low_watermark > 0 && policy.low_watermark <= 1);
+  eviction_policy_ = policy;
+
+  if (policy.threads > 1) {
+    evictor_.reset(new base::ThreadPool(base::ThreadPool::TaskQueue::UNLIMITED,
+                                        policy.threads));
+    evictor_->Run();
+  } else {
+    evictor_.reset();
+  }
+}
+
+void FileCache::SetDirectIndex(proto::DirectIndex direct_index) {
+  DCHECK(!database_);
+  direct_index_ = direct_index;
+}
+
+void FileCache::SetHotSize(ui64 size) {
+  if (size) {
+    hot_.reset(new HotTier(size));
+  } else {
+    hot_.reset();
+  }
+}
+
+void FileCache::SetDeduplication(bool dedup) {
+  dedup_ = dedup;
+}
+
+void FileCache::SetShared(bool shared) {
+  DCHECK(!database_);
+  shared_ = shared;
+}
+
+void FileCache::AddLowerLayer(const String& path, bool promote) {
+  UniquePtr<FileCache> cache(new FileCache(path));
+  cache->read_only_ = true;
+  lower_.push_back({std::move(cache), promote});
+}
+
 bool FileCache::Run(ui64 clean_period) {
   String error;
   if (!base::CreateDirectory(path_, &error)) {
@@ -68,50 +249,87 @@ bool FileCache::Run(ui64 clean_period) {
     return false;
   }
 
-  database_.reset(new LevelDB(path_, "direct"));
-  if (store_index_) {
-    entries_.reset(new SQLite(path_, "index"));
-  } else {
-    entries_.reset(new SQLite);
-  }
+  if (shared_) {
+    if (!store_index_) {
+      LOG(CACHE_ERROR) << "Shared cache in " << path_
+                       << " requires the stored index";
+      return false;
+    }
+    if (use_pack_ || dedup_) {
+      LOG(CACHE_WARNING) << "Shared cache in " << path_
+                         << " doesn't use the pack store and deduplication";
+      use_pack_ = dedup_ = false;
+    }
 
-  CHECK(clean_period > 0);
+    auto open_lock = [this, &error](const String& name, LockFile* file) {
+      const String lock_path = path_ + "/" + name;
+      file->fd = open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      if (file->fd == -1) {
+        base::GetLastError(&error);
+        LOG(CACHE_ERROR) << "Failed to open " << lock_path << " : " << error;
+        return false;
+      }
+      return true;
+    };
+    if (!open_lock("entries.lock", &locks_file_) ||
+        !open_lock("cleaner.lock", &cleaner_file_)) {
+      return false;
+    }
+  }
 
-  entries_->BeginTransaction();
-  base::WalkDirectory(path_, [this](const String& file_path, ui64 mtime, ui64) {
-    std::regex regex("([a-f0-9]{32}-[a-f0-9]{8}-[a-f0-9]{8})\\.manifest$");
-    std::cmatch match;
-    if (!std::regex_search(file_path.c_str(), match, regex) ||
-        match.size() < 2 || !match[1].matched) {
-      return;
+  if (use_pack_) {
+    pack_.reset(new PackStore(path_ + "/pack"));
+    if (!pack_->Open(&error)) {
+      LOG(CACHE_ERROR) << "Failed to open pack store in " << path_ << " : "
+                       << error;
+      return false;
     }
+  }
 
-    auto hash = string::Hash(String(match[1]));
-    ui64 size = 0u;
-    bool from_index = false;
+  // The reference counts of blobs should survive restarts.
+  if (dedup_ && (use_pack_ || !store_index_)) {
+    LOG(CACHE_WARNING) << "Deduplication in " << path_
+                       << " requires the stored index without pack store";
+    dedup_ = false;
+  }
 
-    if (!Migrate(hash)) {
-      RemoveEntry(hash);
-    } else {
-      from_index = GetEntrySize(hash, &size);
+  // Neither index is safe to open by a few processes - the shared manifests
+  // keep the handled hash themselves.
+  if (shared_) {
+    database_.reset();
+  } else if (direct_index_ == proto::MAPPED) {
+    auto* table = new MappedTable(path_, "direct");
+    database_.reset(table);
+    if (!MigrateDirectIndex(table)) {
+      return false;
     }
+  } else {
+    database_.reset(new LevelDB(path_, "direct"));
+  }
+  if (store_index_) {
+    entries_.reset(new SQLite(path_, "index"));
+  } else {
+    entries_.reset(new SQLite);
+  }
 
-    if (size) {
-      CHECK(from_index ||
-            entries_->Set(hash.str,
-                          std::make_tuple(mtime, size, kManifestVersion)));
+  CHECK(clean_period > 0);
 
-      cache_size_ += size;
-      LOG(CACHE_INFO) << hash.str << " is considered";
-    } else {
-      // When an entry has a zero size, it's not useful even if it's correct.
-      RemoveEntry(hash);
-    }
-  });
-  entries_->EndTransaction();
+  // Trust the index to start serving immediately - the actual state of the
+  // cache directory is reconciled in background.
+  cache_size_ = entries_->TotalSize();
 
   new_entries_.reset(new EntryList, new_entries_deleter_);
 
+  if (std::any_of(lower_.begin(), lower_.end(),
+                  [](const LowerLayer& layer) { return layer.promote; })) {
+    promoter_.reset(
+        new base::ThreadPool(base::ThreadPool::TaskQueue::UNLIMITED, 1));
+    promoter_->Run();
+    promote_ = [this](const string::HandledHash& hash, const Entry& entry) {
+      promoter_->Push([this, hash, entry] { DoStore(hash, entry); });
+    };
+  }
+
   base::WorkerPool::SimpleWorker worker =
       [this, clean_period](const base::WorkerPool& pool) {
         while (!pool.WaitUntilShutdown(std::chrono::seconds(clean_period))) {
@@ -121,17 +339,258 @@ bool FileCache::Run(ui64 clean_period) {
   resetter_->AddWorker("Cache Resetter Worker"_l, worker);
   cleaner_.Run();
 
+  reconcile_start_ = Clock::now();
+  reconciler_.reset(
+      new base::ThreadPool(base::ThreadPool::TaskQueue::UNLIMITED,
+                           std::max(1u, std::thread::hardware_concurrency())));
+  reconciler_->Run();
+
+  // The filter is built from the index first - the reconciled prefixes add
+  // only the entries, which the index misses.
+  base::ThreadPool::Optional filter_built;
+  if (!shared_) {
+    filter_built = reconciler_->Push([this] {
+      std::lock_guard<std::mutex> lock(index_mutex_);
+      RebuildFilter();
+    });
+    if (filter_built) {
+      reconcile_futures_.push_back(*filter_built);
+    }
+  }
+
+  reconcile_pending_ = strlen(kHexDigits);
+  for (const char* first = kHexDigits; *first; ++first) {
+    auto future = reconciler_->Push([this, first, filter_built]() mutable {
+      if (filter_built) {
+        filter_built->Wait();
+      }
+      for (const char* second = kHexDigits; *second; ++second) {
+        if (stop_reconcile_) {
+          return;
+        }
+        Reconcile(String(first, 1) + *second);
+      }
+      if (--reconcile_pending_ == 0) {
+        filter_ready_ = true;
+        LOG(CACHE_INFO) << "Cache directory " << path_ << " is reconciled in "
+                        << std::chrono::duration_cast<std::chrono::seconds>(
+                               Clock::now() - reconcile_start_).count()
+                        << " seconds";
+      }
+    });
+    if (future) {
+      reconcile_futures_.push_back(*future);
+    } else {
+      --reconcile_pending_;
+    }
+  }
+
   return true;
 }
 
+void FileCache::Reconcile(const String& prefix) {
+  DCHECK(prefix.size() == 2);
+
+  const String dir_path = path_ + "/" + prefix[0] + "/" + prefix[1];
+  DIR* dir = opendir(dir_path.c_str());
+  const int dir_fd = dir ? dirfd(dir) : -1;
+
+  struct Found {
+    ui64 mtime, size, shared;
+  };
+  HashMap<String, Found> found;
+  HashSet<String> seen, broken;
+
+  // A single query instead of the lookup per manifest. The entries stored
+  // meanwhile are checked again in the transaction.
+  HashMap<String, SQLite::Value> indexed;
+  entries_->GetValues(prefix, &indexed);
+
+  // Uses |d_type| and |fstatat()| to avoid the path lookups for every entry.
+  while (dir && !stop_reconcile_) {
+    struct dirent* entry = readdir(dir);
+    if (!entry) {
+      break;
+    }
+
+    if (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN) {
+      continue;
+    }
+
+    const String name = entry->d_name;
+    const auto suffix = ".manifest"_l;
+    const size_t suffix_size = strlen(suffix);
+    if (name.size() <= suffix_size ||
+        name.compare(name.size() - suffix_size, suffix_size, suffix) != 0) {
+      continue;
+    }
+
+    string::Hash hash(name.substr(0, name.size() - suffix_size));
+    if (!IsHash(hash.str)) {
+      continue;
+    }
+
+    const String hash_str = hash.str;
+    seen.insert(hash_str);
+    STAT(CACHE_RECONCILE_CHECKED);
+
+    auto indexed_entry = indexed.find(hash_str);
+    if (indexed_entry != indexed.end() &&
+        std::get<SQLite::VERSION>(indexed_entry->second) == kManifestVersion) {
+      continue;
+    }
+
+    struct stat buffer;
+    if (fstatat(dir_fd, name.c_str(), &buffer, 0) == -1 ||
+        !S_ISREG(buffer.st_mode)) {
+      continue;
+    }
+
+    WriteLock lock(this, dir_path + "/" + name);
+    if (!lock) {
+      // Someone is writing the entry right now - it will get to the index
+      // anyway.
+      continue;
+    }
+
+    ui64 size = 0u, shared = 0u;
+    if (Migrate(hash)) {
+      GetEntrySize(hash, &size, &shared);
+    }
+
+    if (size) {
+      found.emplace(hash_str, Found{static_cast<ui64>(buffer.st_mtime), size,
+                                    shared});
+    } else {
+      // The index is updated only in the transaction below.
+      broken.insert(hash_str);
+    }
+  }
+
+  if (stop_reconcile_) {
+    if (dir) {
+      closedir(dir);
+    }
+    return;
+  }
+
+  std::lock_guard<std::mutex> index_lock(index_mutex_);
+  // With the shared index another process may hold the write lock past the
+  // busy timeout - then the prefix is reconciled again in the next period.
+  const bool begun = entries_->BeginTransaction();
+  bool reconciled = begun;
+  ui64 added_size = 0;
+
+  for (const auto& entry : found) {
+    if (!reconciled) {
+      break;
+    }
+
+    SQLite::Value value;
+    const bool has_entry = entries_->Get(entry.first, &value);
+    const ui64 size = has_entry ? std::get<SQLite::SIZE>(value)
+                                : entry.second.size;
+    const ui64 mtime = has_entry ? std::get<SQLite::MTIME>(value)
+                                 : entry.second.mtime;
+    if (!entries_->Set(entry.first,
+                       std::make_tuple(mtime, size, kManifestVersion)) ||
+        (!has_entry && entry.second.shared &&
+         !entries_->SetShared(entry.first, entry.second.shared))) {
+      reconciled = false;
+      break;
+    }
+    if (!has_entry) {
+      // The blobs are counted, when they are stored.
+      added_size += size - entry.second.shared;
+      LOG(CACHE_VERBOSE) << entry.first << " is considered";
+      AddToFilter(string::Hash(entry.first), true);
+    }
+    STAT(CACHE_RECONCILE_ADDED);
+  }
+
+  for (const auto& key : broken) {
+    if (!reconciled) {
+      break;
+    }
+
+    // The entry may be stored again after we've checked it.
+    string::Hash hash(key);
+    WriteLock lock(this, dir_path + "/" + key + ".manifest");
+    if (!lock) {
+      continue;
+    }
+
+    ui64 size = 0u;
+    if (Migrate(hash)) {
+      GetEntrySize(hash, &size);
+    }
+    if (!size) {
+      // When an entry has a zero size, it's not useful even if it's correct.
+      LOG(CACHE_WARNING) << "Removing broken entry " << key;
+      RemoveEntry(hash);
+      STAT(CACHE_RECONCILE_REMOVED);
+    }
+  }
+
+  for (const auto& entry : indexed) {
+    if (!reconciled) {
+      break;
+    }
+
+    const String& key = entry.first;
+    if (seen.count(key)) {
+      continue;
+    }
+
+    // The entry may be stored after we've read the directory.
+    const String manifest_name = key + ".manifest";
+    if (dir_fd != -1 &&
+        faccessat(dir_fd, manifest_name.c_str(), F_OK, 0) == 0) {
+      continue;
+    }
+
+    WriteLock lock(this, dir_path + "/" + manifest_name);
+    if (lock) {
+      LOG(CACHE_WARNING) << "Removing stale index record " << key;
+      RemoveEntry(string::Hash(key));
+      STAT(CACHE_RECONCILE_REMOVED);
+    }
+  }
+
+  if (reconciled) {
+    cache_size_ += added_size;
+    if (!CommitIndex()) {
+      unreconciled_.insert(prefix);
+    }
+  } else {
+    LOG(CACHE_ERROR) << "Failed to update the index with " << dir_path
+                     << " - will retry in the next period";
+    if (begun) {
+      entries_->RollbackTransaction();
+    }
+    unreconciled_.insert(prefix);
+  }
+
+  if (dir) {
+    closedir(dir);
+  }
+}
+
+void FileCache::WaitForReconcile() {
+  for (auto& future : reconcile_futures_) {
+    future.Wait();
+  }
+}
+
 using namespace string;
 
 // static
 HandledHash FileCache::Hash(HandledSource code, const ExtraFiles& extra_files,
                             CommandLine command_line, Version version) {
-  return HandledHash(HashCombine(code.str, extra_files) + "-" +
-                     base::Hexify(command_line.str.Hash(4)) + "-" +
-                     base::Hexify(version.str.Hash(4)));
+  return HandledHash(
+      HashCombine(code.str, extra_files) + "-" +
+      base::Hexify(KeyHash(command_line.str, 4)) + "-" +
+      base::Hexify(KeyHash(version.str + "\n"_l + kKeyVersion, 4)));
 }
 
 // static
@@ -140,59 +599,195 @@ UnhandledHash FileCache::Hash(UnhandledSource code,
                               CommandLine command_line, Version version) {
   return UnhandledHash(
       HashCombine(code.str, extra_files) + "-" +
-      base::Hexify(command_line.str.Hash(4)) + "-" +
-      base::Hexify(
-          (version.str + "\n"_l + clang::getClangFullVersion()).Hash(4)));
+      base::Hexify(KeyHash(command_line.str, 4)) + "-" +
+      base::Hexify(KeyHash(version.str + "\n"_l + clang::getClangFullVersion() +
+                           "\n"_l + kKeyVersion,
+                           4)));
 }
 
 bool FileCache::Find(HandledSource code, const ExtraFiles& extra_files,
-                     CommandLine command_line, Version version,
-                     Entry* entry) const {
-  return FindByHash(Hash(code, extra_files, command_line, version), entry);
+                     CommandLine command_line, Version version, Entry* entry,
+                     bool lazy_object) const {
+  const auto hash = Hash(code, extra_files, command_line, version);
+  return FindByHash(hash, entry, lazy_object) ||
+         FindInLowerLayers(hash, entry, lazy_object);
 }
 
 bool FileCache::Find(UnhandledSource code, const ExtraFiles& extra_files,
                      CommandLine command_line, Version version,
-                     const String& current_dir, Entry* entry) const {
+                     const String& current_dir, Entry* entry,
+                     bool lazy_object) const {
   DCHECK(entry);
 
-  auto unhandled_hash = Hash(code, extra_files, command_line, version);
+  const auto unhandled_hash = Hash(code, extra_files, command_line, version);
+  HandledHash hash;
+  if (FindHandledHash(unhandled_hash, current_dir, &hash)) {
+    return FindByHash(hash, entry, lazy_object) ||
+           FindInLowerLayers(hash, entry, lazy_object);
+  }
+
+  // The entry found by the direct lookup in a lower layer may be already in
+  // this cache.
+  for (const auto& layer : lower_) {
+    if (layer.cache->FindHandledHash(unhandled_hash, current_dir, &hash)) {
+      return FindByHash(hash, entry, lazy_object) ||
+             FindInLowerLayers(hash, entry, lazy_object);
+    }
+  }
+
+  return false;
+}
+
+bool FileCache::FindInLowerLayers(HandledHash hash, Entry* entry,
+                                  bool lazy_object) const {
+  for (const auto& layer : lower_) {
+    // The promoted entry is stored from memory.
+    const bool promote = layer.promote && promote_;
+    if (layer.cache->FindByHash(hash, entry, lazy_object && !promote)) {
+      STAT(LOWER_CACHE_HIT);
+      if (promote) {
+        promote_(hash, *entry);
+      }
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool FileCache::FindHandledHash(UnhandledHash unhandled_hash,
+                                const String& current_dir,
+                                HandledHash* hash) const {
+  DCHECK(hash);
+
+  if (!MayContain(unhandled_hash)) {
+    return false;
+  }
+
   const String manifest_path = CommonPath(unhandled_hash) + ".manifest";
-  const ReadLock lock(this, manifest_path);
+  ReadLock lock(this, manifest_path);
 
   if (!lock) {
+    CountFalsePositive(unhandled_hash);
     return false;
   }
 
   proto::Manifest manifest;
-  if (!base::LoadFromFile(manifest_path, &manifest) || !manifest.has_direct()) {
+  bool is_binary = true;
+  if (!base::LoadFromFile(manifest_path, &manifest, nullptr, &is_binary) ||
+      !manifest.has_direct()) {
     return false;
   }
+  if (!is_binary && !read_only_) {
+    RewriteManifest(manifest_path, manifest);
+  }
 
-  utime(manifest_path.c_str(), nullptr);
-  new_entries_->Append({time(nullptr), unhandled_hash});
+  Touch(unhandled_hash, manifest_path);
 
-  Immutable::Rope hash_rope = {unhandled_hash};
-  for (const auto& header : manifest.direct().headers()) {
-    Immutable header_hash;
-    const String header_path =
-        header[0] == '/' ? header : current_dir + "/" + header;
-    if (!base::File::Hash(header_path, &header_hash)) {
-      return false;
+  auto* direct = manifest.mutable_direct();
+  UpgradeDirect(direct);
+
+  // The actual hashes of headers are shared by all variants.
+  HashMap<String, Immutable> header_hashes;
+  auto hash_header = [&header_hashes](const String& path, Immutable* hash) {
+    auto it = header_hashes.find(path);
+    if (it == header_hashes.end()) {
+      Immutable header_hash;
+      if (!base::Singleton<HashMemo>::Get().Hash(path, &header_hash)) {
+        return false;
+      }
+      it = header_hashes.emplace(path, header_hash).first;
+    }
+    hash->assign(it->second);
+    return true;
+  };
+
+  // The most recent variant goes first.
+  for (int v = 0; v < direct->variants_size(); ++v) {
+    const auto& variant = direct->variants(v);
+    const bool has_stats = variant.stats_size() == variant.headers_size();
+    const bool use_stats = mtime_ && has_stats;
+
+    Immutable::Rope hash_rope = {unhandled_hash};
+    bool matches = true;
+    for (int i = 0; matches && i < variant.headers_size(); ++i) {
+      const auto& header = variant.headers(i);
+      const String header_path =
+          header[0] == '/' ? header : current_dir + "/" + header;
+
+      // Trust the recorded hash, if the header's stat data didn't change. The
+      // |ctime| can't be set back - unlike the |mtime|.
+      HashMemo::Stat stat;
+      const auto& header_stat = variant.stats(i);
+      if (use_stats && header_stat.has_ctime() &&
+          HashMemo::GetStat(header_path, &stat) &&
+          stat.size == header_stat.size() &&
+          stat.mtime == header_stat.mtime() &&
+          stat.inode == header_stat.inode() &&
+          stat.ctime == header_stat.ctime()) {
+        hash_rope.push_back(Immutable(variant.stats(i).hash()));
+        continue;
+      }
+
+      // Don't hash the rest of headers, if this one is changed.
+      Immutable header_hash;
+      matches = hash_header(header_path, &header_hash) &&
+                (!has_stats || !variant.stats(i).has_hash() ||
+                 header_hash ==
+                     Immutable::WrapString(variant.stats(i).hash()));
+      hash_rope.push_back(header_hash);
+    }
+
+    Immutable handled_hash;
+    if (!matches) {
+      continue;
+    } else if (variant.has_handled_hash()) {
+      handled_hash = Immutable(variant.handled_hash());
+    } else if (!database_ ||
+               !database_->Get(base::Hexify(KeyHash(Immutable(hash_rope))),
+                               &handled_hash)) {
+      continue;
     }
-    hash_rope.push_back(header_hash);
-  }
-  Immutable hash_with_headers = base::Hexify(Immutable(hash_rope).Hash());
-  Immutable handled_hash;
 
-  DCHECK(database_);
-  if (database_->Get(hash_with_headers, &handled_hash)) {
-    return FindByHash(HandledHash(handled_hash), entry);
+    if (v > 0 && !read_only_) {
+      lock.Unlock();
+      PromoteVariant(manifest_path, variant);
+    }
+
+    *hash = HandledHash(handled_hash);
+    return true;
   }
 
   return false;
 }
 
+void FileCache::PromoteVariant(const String& manifest_path,
+                               const proto::Direct::Variant& variant) const {
+  // The manifest may be changed since it was read - so it's read again under
+  // the write lock.
+  WriteLock lock(this, manifest_path);
+  if (!lock) {
+    return;
+  }
+
+  proto::Manifest manifest;
+  LoadDirect(manifest_path, &manifest);
+  if (!manifest.has_direct()) {
+    return;
+  }
+
+  auto* variants = manifest.mutable_direct()->mutable_variants();
+  for (int v = 1; v < variants->size(); ++v) {
+    if (SameHeaders(variants->Get(v), variant)) {
+      for (int i = v; i > 0; --i) {
+        variants->SwapElements(i, i - 1);
+      }
+      RewriteManifest(manifest_path, manifest);
+      return;
+    }
+  }
+}
+
 void FileCache::Store(UnhandledSource code, const ExtraFiles& extra_files,
                       CommandLine command_line, Version version,
                       const List<String>& headers, const String& current_dir,
@@ -201,81 +796,368 @@ void FileCache::Store(UnhandledSource code, const ExtraFiles& extra_files,
           hash);
 }
 
-void FileCache::Store(HandledSource code, const ExtraFiles& extra_files,
-                      CommandLine command_line, Version version,
-                      const Entry& entry) {
-  DoStore(Hash(code, extra_files, command_line, version), entry);
+void FileCache::Store(HandledSource code, const ExtraFiles& extra_files,
+                      CommandLine command_line, Version version,
+                      const Entry& entry) {
+  DoStore(Hash(code, extra_files, command_line, version), entry);
+}
+
+bool FileCache::FindByHash(HandledHash hash, Entry* entry, bool lazy_object,
+                           bool touch) const {
+  DCHECK(entry);
+
+  // The entry may be reused after a failed lookup.
+  entry->object_file.reset();
+
+  if (!MayContain(hash)) {
+    return false;
+  }
+
+  const String manifest_path = CommonPath(hash) + ".manifest";
+  HotTier::Entry hot_entry;
+  if (hot_ && hot_->Get(hash.str, &hot_entry)) {
+    entry->object = hot_entry.object;
+    entry->deps = hot_entry.deps;
+    entry->stderr = hot_entry.stderr;
+    entry->object_codec = proto::NONE;
+
+    if (touch) {
+      Touch(hash, manifest_path);
+    }
+    return true;
+  }
+
+  // The admitted entry is loaded into memory anyway.
+  const bool admit = hot_ && hot_->Admit(hash.str);
+  if (admit) {
+    lazy_object = false;
+  }
+
+  const ReadLock lock(this, manifest_path);
+
+  if (!lock) {
+    CountFalsePositive(hash);
+    return false;
+  }
+
+  proto::Manifest manifest;
+  bool is_binary = true;
+  if (!base::LoadFromFile(manifest_path, &manifest, nullptr, &is_binary) ||
+      !manifest.has_v1()) {
+    return false;
+  }
+  if (!is_binary && !read_only_) {
+    RewriteManifest(manifest_path, manifest);
+  }
+
+  if (touch) {
+    Touch(hash, manifest_path);
+  }
+
+  ui64 size = 0;
+  Immutable err, obj, dep;
+
+  if (manifest.v1().packed()) {
+    String error;
+    Immutable value;
+    if (!pack_ || !pack_->Get(hash.str, &value, &error)) {
+      LOG(CACHE_ERROR) << "Failed to read " << hash.str << " from pack: "
+                       << error;
+      return false;
+    }
+    size = value.size();
+
+    if (!UnpackBlobs(value, {&err, &obj, &dep})) {
+      LOG(CACHE_ERROR) << "Malformed packed entry " << hash.str;
+      return false;
+    }
+  } else {
+    if (manifest.v1().err()) {
+      const String stderr_path = manifest.v1().has_err_blob()
+                                     ? BlobPath(manifest.v1().err_blob())
+                                     : CommonPath(hash) + ".stderr";
+      if (!base::File::Read(stderr_path, &err)) {
+        return false;
+      }
+      size += err.size();
+    }
+
+    if (manifest.v1().obj()) {
+      const String object_path = manifest.v1().has_obj_blob()
+                                     ? BlobPath(manifest.v1().obj_blob())
+                                     : CommonPath(hash) + ".o";
+
+      String error;
+      if (lazy_object) {
+        // Keep the file open - so it survives the possible cleaning.
+        entry->object_file = std::make_shared<base::File>(object_path);
+        if (!entry->object_file->IsValid()) {
+          entry->object_file->GetCreationError(&error);
+          LOG(CACHE_ERROR) << "Failed to open " << object_path << " : "
+                           << error;
+          entry->object_file.reset();
+          return false;
+        }
+        size += entry->object_file->Size();
+      } else if (!base::File::Read(object_path, &obj, &error)) {
+        LOG(CACHE_ERROR) << "Failed to read " << object_path << " : " << error;
+        return false;
+      } else {
+        size += obj.size();
+      }
+    }
+
+    if (manifest.v1().dep()) {
+      const String deps_path = manifest.v1().has_dep_blob()
+                                   ? BlobPath(manifest.v1().dep_blob())
+                                   : CommonPath(hash) + ".d";
+      if (!base::File::Read(deps_path, &dep)) {
+        return false;
+      }
+      size += dep.size();
+    }
+  }
+
+  // The entries stored before the per-artifact codecs may have only the
+  // |snappy| flag for the object file.
+  const auto& v1 = manifest.v1();
+  const proto::Codec obj_codec =
+      v1.has_obj_compression() ? v1.obj_compression().codec()
+                               : (v1.snappy() ? proto::SNAPPY : proto::NONE);
+
+  String error;
+  entry->object_codec = obj_codec;
+  if ((v1.err() && !Decompress(v1.err_compression().codec(), err,
+                               &entry->stderr, &error)) ||
+      (v1.obj() && !entry->object_file &&
+       !Decompress(obj_codec, obj, &entry->object, &error)) ||
+      (v1.dep() && !Decompress(v1.dep_compression().codec(), dep,
+                               &entry->deps, &error))) {
+    LOG(CACHE_ERROR) << "Failed to unpack " << hash.str << ": " << error;
+    return false;
+  }
+
+  if (!manifest.v1().has_size() || manifest.v1().size() != size) {
+    return false;
+  }
+
+  if (admit) {
+    hot_->Put(hash.str, {entry->object, entry->deps, entry->stderr});
+  }
+
+  return true;
+}
+
+bool FileCache::Export(const BundleFilter& filter, int fd, ui64* count,
+                       String* error) {
+  using namespace google::protobuf::io;
+
+  DCHECK(count);
+  *count = 0;
+
+  // The index is complete only after the reconcile.
+  WaitForReconcile();
+  List<String> keys;
+  if (!entries_->GetKeys(String(), &keys)) {
+    if (error) {
+      error->assign("Failed to read the index");
+    }
+    return false;
+  }
+
+  FileOutputStream file_stream(fd);
+  GzipOutputStream::Options options;
+  options.format = GzipOutputStream::GZIP;
+  GzipOutputStream gzip_stream(&file_stream, options);
+
+  for (const auto& key : keys) {
+    SQLite::Value value;
+    if ((!filter.hashes.empty() && !filter.hashes.count(key)) ||
+        !entries_->Get(key, &value) ||
+        std::get<SQLite::MTIME>(value) < filter.since) {
+      continue;
+    }
+
+    proto::BundleEntry record;
+    if (!ExportEntry(string::Hash(key), &record)) {
+      continue;
+    }
+
+    {
+      CodedOutputStream coded_stream(&gzip_stream);
+      coded_stream.WriteVarint32(record.ByteSize());
+    }
+    if (!record.SerializeToZeroCopyStream(&gzip_stream)) {
+      break;
+    }
+    ++*count;
+  }
+
+  if (!gzip_stream.Close() || !file_stream.Flush()) {
+    if (error) {
+      error->assign("Failed to write bundle");
+      if (file_stream.GetErrno()) {
+        error->append(": ");
+        error->append(strerror(file_stream.GetErrno()));
+      }
+    }
+    return false;
+  }
+
+  return true;
+}
+
+bool FileCache::ExportEntry(string::Hash hash,
+                            proto::BundleEntry* record) const {
+  proto::Manifest manifest;
+  if (!base::LoadFromFile(CommonPath(hash) + ".manifest", &manifest)) {
+    return false;
+  }
+
+  if (manifest.has_v1()) {
+    Entry entry;
+    if (!FindByHash(HandledHash(hash.str), &entry, false, false)) {
+      return false;
+    }
+    record->set_stderr(entry.stderr.string_copy());
+    record->set_object(entry.object.string_copy());
+    record->set_deps(entry.deps.string_copy());
+  } else if (manifest.has_direct()) {
+    auto* direct = manifest.mutable_direct();
+    UpgradeDirect(direct);
+
+    // The stat data is meaningless on another machine.
+    for (const auto& variant : direct->variants()) {
+      String direct_hash;
+      Immutable handled_hash;
+      if (!variant.has_handled_hash() &&
+          (!database_ || !GetDirectHash(hash, variant, &direct_hash) ||
+           !database_->Get(direct_hash, &handled_hash))) {
+        continue;
+      }
+
+      auto* new_variant = record->mutable_direct()->add_variants();
+      new_variant->CopyFrom(variant);
+      if (!variant.has_handled_hash()) {
+        new_variant->set_handled_hash(handled_hash.string_copy());
+      }
+      for (auto& stat : *new_variant->mutable_stats()) {
+        stat.clear_size();
+        stat.clear_mtime();
+        stat.clear_inode();
+        stat.clear_ctime();
+      }
+    }
+
+    if (!record->direct().variants_size()) {
+      return false;
+    }
+  } else {
+    return false;
+  }
+
+  record->set_hash(hash.str.string_copy());
+  return true;
+}
+
+bool FileCache::Import(int fd, ui64* count, String* error) {
+  using namespace google::protobuf::io;
+
+  DCHECK(count);
+  *count = 0;
+
+  FileInputStream file_stream(fd);
+  GzipInputStream gzip_stream(&file_stream, GzipInputStream::GZIP);
+
+  while (true) {
+    ui32 size;
+    {
+      CodedInputStream coded_stream(&gzip_stream);
+      if (!coded_stream.ReadVarint32(&size)) {
+        break;
+      }
+    }
+
+    proto::BundleEntry record;
+    if (!record.ParseFromBoundedZeroCopyStream(&gzip_stream, size) ||
+        !IsHash(Immutable::WrapString(record.hash()))) {
+      if (error) {
+        error->assign("Malformed bundle record");
+      }
+      return false;
+    }
+
+    if (record.has_direct()) {
+      if (!ImportDirect(UnhandledHash(record.hash()), record.direct())) {
+        continue;
+      }
+    } else {
+      Entry entry;
+      entry.stderr = Immutable(std::move(*record.mutable_stderr()));
+      entry.object = Immutable(std::move(*record.mutable_object()));
+      entry.deps = Immutable(std::move(*record.mutable_deps()));
+      DoStore(HandledHash(record.hash()), entry);
+    }
+    ++*count;
+  }
+
+  if (file_stream.GetErrno() || gzip_stream.ZlibErrorMessage()) {
+    if (error) {
+      error->assign("Failed to read bundle: ");
+      error->append(file_stream.GetErrno()
+                        ? strerror(file_stream.GetErrno())
+                        : gzip_stream.ZlibErrorMessage());
+    }
+    return false;
+  }
+
+  return true;
 }
 
-bool FileCache::FindByHash(HandledHash hash, Entry* entry) const {
-  DCHECK(entry);
-
+bool FileCache::ImportDirect(UnhandledHash hash, const proto::Direct& direct) {
   const String manifest_path = CommonPath(hash) + ".manifest";
-  const ReadLock lock(this, manifest_path);
+  WriteLock lock(this, manifest_path);
 
   if (!lock) {
+    LOG(CACHE_ERROR) << "Failed to lock " << manifest_path << " for writing";
     return false;
   }
 
-  proto::Manifest manifest;
-  if (!base::LoadFromFile(manifest_path, &manifest) || !manifest.has_v1()) {
+  if (!base::CreateDirectory(SecondPath(hash))) {
+    LOG(CACHE_ERROR) << "Failed to create directory " << SecondPath(hash);
     return false;
   }
 
-  utime(manifest_path.c_str(), nullptr);
-  new_entries_->Append({time(nullptr), hash});
-
-  ui64 size = 0;
-
-  if (manifest.v1().err()) {
-    const String stderr_path = CommonPath(hash) + ".stderr";
-    if (!base::File::Read(stderr_path, &entry->stderr)) {
-      return false;
-    }
-    size += entry->stderr.size();
-  }
-
-  if (manifest.v1().obj()) {
-    const String object_path = CommonPath(hash) + ".o";
-
-    if (manifest.v1().snappy()) {
-      String error;
-
-      Immutable packed_content;
-      if (!base::File::Read(object_path, &packed_content, &error)) {
-        LOG(CACHE_ERROR) << "Failed to read " << object_path << " : " << error;
-        return false;
-      }
-      size += packed_content.size();
-
-      String object_str;
-      if (!snappy::Uncompress(packed_content.data(), packed_content.size(),
-                              &object_str)) {
-        LOG(CACHE_ERROR) << "Failed to unpack contents of " << object_path;
-        return false;
-      }
+  proto::Manifest manifest;
+  LoadDirect(manifest_path, &manifest);
+  manifest.set_version(kManifestVersion);
 
-      entry->object = std::move(object_str);
-    } else {
-      if (!base::File::Read(object_path, &entry->object)) {
-        return false;
-      }
-      size += entry->object.size();
+  // The local variants are more recent.
+  auto* variants = manifest.mutable_direct()->mutable_variants();
+  for (const auto& variant : direct.variants()) {
+    if (variants->size() < kMaxDirectVariants && variant.has_handled_hash() &&
+        std::none_of(variants->begin(), variants->end(),
+                     [&variant](const proto::Direct::Variant& local) {
+                       return SameHeaders(local, variant);
+                     })) {
+      variants->Add()->CopyFrom(variant);
     }
   }
 
-  if (manifest.v1().dep()) {
-    const String deps_path = CommonPath(hash) + ".d";
-    if (!base::File::Read(deps_path, &entry->deps)) {
-      return false;
-    }
-    size += entry->deps.size();
+  String error;
+  if (!base::SaveToFile(manifest_path, manifest, &error, true)) {
+    LOG(CACHE_ERROR) << "Failed to save manifest to " << manifest_path << ": "
+                     << error;
+    return false;
   }
 
-  return manifest.v1().has_size() && manifest.v1().size() == size;
+  AddToFilter(hash, false);
+  new_entries_->Append({time(nullptr), hash});
+  return true;
 }
 
-bool FileCache::GetEntrySize(string::Hash hash, ui64* size) const {
+bool FileCache::GetEntrySize(string::Hash hash, ui64* size,
+                             ui64* shared) const {
   DCHECK(size);
 
   const String common_path = CommonPath(hash);
@@ -295,6 +1177,9 @@ bool FileCache::GetEntrySize(string::Hash hash, ui64* size) const {
   }
 
   *size = manifest.v1().size() + base::File::Size(manifest_path);
+  if (shared) {
+    *shared = SharedSize(manifest);
+  }
   return false;
 }
 
@@ -310,12 +1195,27 @@ bool FileCache::RemoveEntry(string::Hash hash) {
   bool result = true;
   auto entry_size = has_entry ? std::get<SQLite::SIZE>(entry) : 0u;
 
+  // The blobs are accounted separately - when they are removed.
+  proto::Manifest manifest;
+  const bool has_manifest = base::LoadFromFile(manifest_path, &manifest);
+  if (has_manifest) {
+    entry_size -= std::min<ui64>(entry_size, SharedSize(manifest));
+  }
+
   if (has_entry) {
     entries_->Delete(hash.str);
   } else {
     LOG(CACHE_WARNING) << "Removing unconsidered entry: " << hash.str;
   }
 
+  if (pack_) {
+    pack_->Remove(hash.str);
+  }
+
+  if (hot_) {
+    hot_->Remove(hash.str);
+  }
+
   if (base::File::Exists(object_path)) {
     if (!base::File::Delete(object_path, &error)) {
       entry_size -= base::File::Size(object_path);
@@ -346,11 +1246,21 @@ bool FileCache::RemoveEntry(string::Hash hash) {
     LOG(CACHE_WARNING) << "Failed to delete " << manifest_path << ": " << error;
   }
 
+  if (has_manifest && !ReleaseBlobs(manifest)) {
+    result = false;
+  }
+
   if (has_entry) {
     cache_size_ -= entry_size;
     STAT(CACHE_SIZE_CLEANED, entry_size);
   }
 
+  if (!shared_) {
+    std::lock_guard<std::mutex> lock(filter_mutex_);
+    unindexed_.erase(hash.str);
+    removed_.insert(hash.str);
+  }
+
   return result;
 }
 
@@ -363,86 +1273,158 @@ void FileCache::DoStore(string::HandledHash hash, Entry entry) {
     return;
   }
 
+  if (hot_) {
+    hot_->Remove(hash.str);
+  }
+
   if (!base::CreateDirectory(SecondPath(hash))) {
     LOG(CACHE_ERROR) << "Failed to create directory " << SecondPath(hash);
     return;
   }
 
+  // The blobs of the replaced entry are released after the new ones are
+  // referenced - so the same blobs are not rewritten.
+  proto::Manifest old_manifest;
+  const bool has_old_manifest =
+      base::File::Exists(manifest_path) &&
+      base::LoadFromFile(manifest_path, &old_manifest);
+
+  // The blob references and the index records are changed in the transactions
+  // of |Clean()| and |Reconcile()| too - so only under the |index_mutex_|.
+  auto release_blobs = [this](const proto::Manifest& manifest) {
+    std::lock_guard<std::mutex> index_lock(index_mutex_);
+    ReleaseBlobs(manifest);
+  };
+  auto remove_entry = [this, &hash] {
+    std::lock_guard<std::mutex> index_lock(index_mutex_);
+    RemoveEntry(hash);
+  };
+
   proto::Manifest manifest;
   manifest.set_version(kManifestVersion);
 
-  manifest.mutable_v1()->set_err(!entry.stderr.empty());
-  if (!entry.stderr.empty()) {
-    const String stderr_path = CommonPath(hash) + ".stderr";
+  auto* v1 = manifest.mutable_v1();
+  Immutable err{true}, obj{true}, dep{true};
 
-    if (!base::File::Write(stderr_path, entry.stderr, &error)) {
-      RemoveEntry(hash);
-      LOG(CACHE_ERROR) << "Failed to save stderr to " << stderr_path << ": "
-                       << error;
-      return;
+  // The artifact is stored uncompressed, if it doesn't get smaller.
+  auto compress = [&hash](Immutable original,
+                          const proto::Compression& compression,
+                          Immutable* stored) {
+    Immutable compressed;
+    String error;
+    if (compression.codec() != proto::NONE) {
+      if (!Compress(compression, original, &compressed, &error)) {
+        LOG(CACHE_WARNING) << "Failed to compress artifact of " << hash.str
+                           << ": " << error;
+      } else if (compressed.size() < original.size()) {
+        stored->assign(compressed);
+        return true;
+      }
     }
+    stored->assign(original);
+    return false;
+  };
+
+  v1->set_err(!entry.stderr.empty());
+  v1->set_obj(!entry.object.empty());
+  v1->set_dep(!entry.deps.empty());
+
+  const auto obj_compression = codec_policy_.Choose(entry.object.size());
+  if (v1->err() &&
+      compress(entry.stderr, codec_policy_.compression, &err)) {
+    v1->mutable_err_compression()->CopyFrom(codec_policy_.compression);
+  }
+  if (v1->obj() && compress(entry.object, obj_compression, &obj)) {
+    v1->mutable_obj_compression()->CopyFrom(obj_compression);
+  }
+  if (v1->dep() && compress(entry.deps, codec_policy_.compression, &dep)) {
+    v1->mutable_dep_compression()->CopyFrom(codec_policy_.compression);
   }
 
-  ui64 object_size = 0;
+  v1->set_size(err.size() + obj.size() + dep.size());
 
-  manifest.mutable_v1()->set_obj(!entry.object.empty());
-  if (!entry.object.empty()) {
-    const String object_path = CommonPath(hash) + ".o";
+  if (pack_) {
+    Immutable value = PackBlobs({err, obj, dep});
+    if (!pack_->Put(hash.str, value, &error)) {
+      LOG(CACHE_ERROR) << "Failed to save " << hash.str << " to pack: "
+                       << error;
+      return;
+    }
 
-    if (!snappy_) {
-      object_size = entry.object.size();
+    v1->set_packed(true);
+    v1->set_size(value.size());
+  } else if (dedup_) {
+    String key;
+    bool stored = true;
+    if (v1->err() && (stored = StoreBlob(err, &key))) {
+      v1->set_err_blob(key);
+    }
+    if (stored && v1->obj() && (stored = StoreBlob(obj, &key))) {
+      v1->set_obj_blob(key);
+    }
+    if (stored && v1->dep() && (stored = StoreBlob(dep, &key))) {
+      v1->set_dep_blob(key);
+    }
 
-      if (!base::File::Write(object_path, entry.object, &error)) {
-        RemoveEntry(hash);
-        LOG(CACHE_ERROR) << "Failed to save object to " << object_path << ": "
+    if (!stored) {
+      release_blobs(manifest);
+      LOG(CACHE_ERROR) << "Failed to save blobs of " << hash.str;
+      return;
+    }
+  } else {
+    if (v1->err()) {
+      const String stderr_path = CommonPath(hash) + ".stderr";
+
+      if (!base::File::Write(stderr_path, err, &error)) {
+        remove_entry();
+        LOG(CACHE_ERROR) << "Failed to save stderr to " << stderr_path << ": "
                          << error;
         return;
       }
-    } else {
-      String packed_content;
-      if (!snappy::Compress(entry.object.data(), entry.object.size(),
-                            &packed_content)) {
-        RemoveEntry(hash);
-        LOG(CACHE_ERROR) << "Failed to pack contents for " << object_path;
-        return;
-      }
+    }
 
-      object_size = packed_content.size();
+    if (v1->obj()) {
+      const String object_path = CommonPath(hash) + ".o";
 
-      if (!base::File::Write(object_path, std::move(packed_content), &error)) {
-        RemoveEntry(hash);
-        LOG(CACHE_ERROR) << "Failed to write to " << object_path << ": "
+      if (!base::File::Write(object_path, obj, &error)) {
+        remove_entry();
+        LOG(CACHE_ERROR) << "Failed to save object to " << object_path << ": "
                          << error;
         return;
       }
-
-      manifest.mutable_v1()->set_snappy(true);
     }
-  }
 
-  manifest.mutable_v1()->set_dep(!entry.deps.empty());
-  if (!entry.deps.empty()) {
-    const String deps_path = CommonPath(hash) + ".d";
+    if (v1->dep()) {
+      const String deps_path = CommonPath(hash) + ".d";
 
-    if (!base::File::Write(deps_path, entry.deps, &error)) {
-      RemoveEntry(hash);
-      LOG(CACHE_ERROR) << "Failed to save deps to " << deps_path << ": "
-                       << error;
-      return;
+      if (!base::File::Write(deps_path, dep, &error)) {
+        remove_entry();
+        LOG(CACHE_ERROR) << "Failed to save deps to " << deps_path << ": "
+                         << error;
+        return;
+      }
     }
   }
 
-  manifest.mutable_v1()->set_size(entry.stderr.size() + object_size +
-                                  entry.deps.size());
-
-  if (!base::SaveToFile(manifest_path, manifest, &error)) {
+  if (!base::SaveToFile(manifest_path, manifest, &error, true)) {
+    std::lock_guard<std::mutex> index_lock(index_mutex_);
+    ReleaseBlobs(manifest);
+    // The old manifest may be gone already - then its blobs aren't released
+    // with the entry.
+    if (has_old_manifest && !base::File::Exists(manifest_path)) {
+      ReleaseBlobs(old_manifest);
+    }
     RemoveEntry(hash);
     LOG(CACHE_ERROR) << "Failed to save manifest to " << manifest_path << ": "
                      << error;
     return;
   }
 
-  utime(manifest_path.c_str(), nullptr);
+  if (has_old_manifest) {
+    release_blobs(old_manifest);
+  }
+
+  AddToFilter(hash, false);
   new_entries_->Append({time(nullptr), hash});
 
   LOG(CACHE_VERBOSE) << "File is cached on path " << CommonPath(hash);
@@ -452,9 +1434,9 @@ void FileCache::DoStore(UnhandledHash orig_hash, const List<String>& headers,
                         const String& current_dir, const HandledHash& hash) {
   // We have to store manifest on the path based only on the hash of unhandled
   // source code. Otherwise, we won't be able to get list of the dependent
-  // headers, while checking the direct cache. Such approach has a little
-  // drawback, because the changes in the dependent headers will make a
-  // false-positive direct cache hit, followed by true cache miss.
+  // headers, while checking the direct cache. So the manifest keeps a few
+  // recent variants of the header list - the changes in the dependent headers
+  // make a lookup check them in order of recency.
   const String manifest_path = CommonPath(orig_hash) + ".manifest";
   WriteLock lock(this, manifest_path);
 
@@ -470,85 +1452,491 @@ void FileCache::DoStore(UnhandledHash orig_hash, const List<String>& headers,
 
   Immutable::Rope hash_rope = {orig_hash};
 
+  proto::Manifest old_manifest;
+  LoadDirect(manifest_path, &old_manifest);
+
   proto::Manifest manifest;
   manifest.set_version(kManifestVersion);
+  auto* variant = manifest.mutable_direct()->add_variants();
 
   for (const auto& header : headers) {
     String error;
     Immutable header_hash;
     const String header_path =
         header[0] == '/' ? header : current_dir + "/" + header;
-    if (!base::File::Hash(header_path, &header_hash,
-                          {"__DATE__"_l, "__TIME__"_l}, &error)) {
+
+    // Get stat data before hashing - so the concurrent modification will make
+    // the stat data mismatch on lookup.
+    HashMemo::Stat stat;
+    const bool has_stat = mtime_ && HashMemo::GetStat(header_path, &stat);
+
+    if (!base::Singleton<HashMemo>::Get().Hash(
+            header_path, &header_hash, {"__DATE__"_l, "__TIME__"_l}, &error)) {
       LOG(CACHE_ERROR) << "Failed to hash " << header_path << ": " << error;
       return;
     }
     hash_rope.push_back(header_hash);
-    manifest.mutable_direct()->add_headers(header);
+    variant->add_headers(header);
+
+    // The hash is recorded always - to stop checking a variant on the first
+    // changed header.
+    auto* header_stat = variant->add_stats();
+    header_stat->set_hash(header_hash.string_copy());
+    if (has_stat && !HashMemo::IsRacy(stat)) {
+      header_stat->set_size(stat.size);
+      header_stat->set_mtime(stat.mtime);
+      header_stat->set_inode(stat.inode);
+      header_stat->set_ctime(stat.ctime);
+    }
   }
 
-  auto direct_hash = base::Hexify(Immutable(hash_rope).Hash());
-  DCHECK(database_);
-  if (!database_->Set(direct_hash, hash)) {
+  auto direct_hash = base::Hexify(KeyHash(Immutable(hash_rope)));
+
+  // The variant with the same headers is replaced, and the least recent ones
+  // are dropped over the limit - with their records in the index.
+  for (const auto& old_variant : old_manifest.direct().variants()) {
+    String old_hash;
+    if (!SameHeaders(old_variant, *variant) &&
+        manifest.direct().variants_size() < kMaxDirectVariants) {
+      manifest.mutable_direct()->add_variants()->CopyFrom(old_variant);
+    } else if (database_ &&
+               GetDirectHash(orig_hash, old_variant, &old_hash) &&
+               old_hash != direct_hash) {
+      database_->Delete(old_hash);
+    }
+  }
+
+  if (shared_) {
+    variant->set_handled_hash(hash.str.string_copy());
+  } else if (!database_->Set(direct_hash, hash)) {
     return;
   }
 
   String error;
-  if (!base::SaveToFile(manifest_path, manifest, &error)) {
+  if (!base::SaveToFile(manifest_path, manifest, &error, true)) {
+    std::lock_guard<std::mutex> index_lock(index_mutex_);
     RemoveEntry(orig_hash);
     LOG(CACHE_ERROR) << "Failed to save manifest to " << manifest_path << ": "
                      << error;
     return;
   }
 
-  utime(manifest_path.c_str(), nullptr);
+  AddToFilter(orig_hash, false);
   new_entries_->Append({time(nullptr), orig_hash});
 }
 
+bool FileCache::MayContain(string::Hash hash) const {
+  if (!filter_ready_) {
+    return true;
+  }
+
+  const auto filter = std::atomic_load(&filter_);
+  if (!filter || filter->MayContain(hash.str)) {
+    return true;
+  }
+
+  STAT(CACHE_FILTER_MISS);
+  return false;
+}
+
+void FileCache::AddToFilter(string::Hash hash, bool indexed) {
+  const String hash_str = hash.str;
+  if (shared_) {
+    return;
+  }
+
+  // Until the filter is built the entries, which aren't indexed, are only
+  // remembered.
+  std::lock_guard<std::mutex> lock(filter_mutex_);
+  if (filter_) {
+    filter_->Add(hash_str);
+  }
+  if (next_filter_) {
+    next_filter_->Add(hash_str);
+  }
+  if (!indexed) {
+    unindexed_.insert(hash_str);
+  }
+  removed_.erase(hash_str);
+}
+
+void FileCache::CountFalsePositive(string::Hash hash) const {
+  if (!filter_ready_) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(filter_mutex_);
+  if (removed_.count(hash.str)) {
+    STAT(CACHE_FILTER_STALE);
+  } else {
+    STAT(CACHE_FILTER_FALSE_POSITIVE);
+  }
+}
+
+void FileCache::RebuildFilter() {
+  // The index doesn't get new entries meanwhile - and the removed ones don't
+  // matter.
+  List<String> keys;
+  if (!entries_->GetKeys(String(), &keys)) {
+    return;
+  }
+
+  SharedPtr<BloomFilter> filter;
+  {
+    std::lock_guard<std::mutex> lock(filter_mutex_);
+    filter.reset(new BloomFilter((keys.size() + unindexed_.size()) * 2));
+    for (const auto& hash_str : unindexed_) {
+      filter->Add(hash_str);
+    }
+    next_filter_ = filter;
+    removed_.clear();
+  }
+
+  // The entries stored meanwhile are added by |AddToFilter()|.
+  for (const auto& key : keys) {
+    filter->Add(key);
+  }
+
+  std::lock_guard<std::mutex> lock(filter_mutex_);
+  std::atomic_store(&filter_, filter);
+  next_filter_.reset();
+}
+
+void FileCache::Touch(string::Hash hash, const String& manifest_path) const {
+  if (read_only_) {
+    return;
+  }
+
+  // The recency is restored from the stored index on startup - so the hits
+  // don't write the inode metadata. Without the stored index the mtime of
+  // manifest is the only persistent trace of the hit.
+  if (!store_index_) {
+    utime(manifest_path.c_str(), nullptr);
+  }
+  new_entries_->Append({time(nullptr), hash});
+}
+
 void FileCache::Clean(UniquePtr<EntryList> list) {
-  entries_->BeginTransaction();
+  HashSet<String> prefixes;
+  {
+    std::lock_guard<std::mutex> index_lock(index_mutex_);
+    prefixes.swap(unreconciled_);
+  }
+  for (const auto& prefix : prefixes) {
+    Reconcile(prefix);
+  }
+
+  // The popular entries are used many times per period - so aggregate them.
+  HashMap<String, SQLite::Usage> used;
   while (auto new_entry = list->Pop()) {
-    const auto& hash = new_entry->second;
-    SQLite::Value entry;
-    if (entries_->Get(hash.str, &entry)) {
-      // Update mtime of an existing entry.
-      CHECK(entries_->Set(
-          hash.str,
-          std::make_tuple(new_entry->first, std::get<SQLite::SIZE>(entry),
-                          kManifestVersion)));
-      LOG(CACHE_VERBOSE) << hash.str << " wasn't used for "
-                         << (new_entry->first - std::get<SQLite::MTIME>(entry))
-                         << " seconds";
-    } else {
-      // Insert new entry.
-      ui64 size = 0u;
-      GetEntrySize(hash, &size);
-      CHECK(entries_->Set(
-          hash.str, std::make_tuple(new_entry->first, size, kManifestVersion)));
-      cache_size_ += size;
-      STAT(CACHE_SIZE_ADDED, size);
+    auto& usage = used[new_entry->second.str];
+    usage.mtime = std::max<ui64>(usage.mtime, new_entry->first);
+    ++usage.hits;
+  }
+
+  std::lock_guard<std::mutex> index_lock(index_mutex_);
+  for (const auto& entry : retry_used_) {
+    auto& usage = used[entry.first];
+    usage.mtime = std::max(usage.mtime, entry.second.mtime);
+    usage.hits += entry.second.hits;
+  }
+  retry_used_.clear();
+
+  // With the shared index another process may hold the write lock past the
+  // busy timeout - then the hits are retried in the next period.
+  const bool begun = entries_->BeginTransaction();
+
+  // Update mtime and hits of the existing entries, and insert the new ones.
+  List<String> missing;
+  bool updated = begun && entries_->Touch(used, &missing);
+
+  List<Pair<String, SQLite::Value>> added;
+  HashMap<String, ui64> shared;
+  ui64 added_size = 0;
+  for (const auto& hash_str : missing) {
+    ui64 size = 0u, shared_size = 0u;
+    GetEntrySize(string::Hash(hash_str), &size, &shared_size);
+    added.emplace_back(hash_str, std::make_tuple(used[hash_str].mtime, size,
+                                                 kManifestVersion));
+    if (shared_size) {
+      shared.emplace(hash_str, shared_size);
     }
+
+    // The blobs are counted, when they are stored.
+    added_size += size - shared_size;
+  }
+  updated = updated && entries_->Set(added);
+  for (const auto& entry : shared) {
+    updated = updated && entries_->SetShared(entry.first, entry.second);
   }
 
-  if (max_size_ == UNLIMITED) {
-    entries_->EndTransaction();
+  if (!updated) {
+    LOG(CACHE_ERROR) << "Failed to update the index - will retry in the next "
+                        "period";
+    if (begun) {
+      entries_->RollbackTransaction();
+    }
+    retry_used_ = std::move(used);
     return;
   }
+  cache_size_ += added_size;
+  if (added_size) {
+    STAT(CACHE_SIZE_ADDED, added_size);
+  }
+
+  if (!shared_) {
+    std::lock_guard<std::mutex> lock(filter_mutex_);
+    for (const auto& entry : used) {
+      unindexed_.erase(entry.first);
+    }
+  }
+
+  // The entries of the shared cache are added by all processes - so only the
+  // elected one evicts them, looking at the total size from the index.
+  if (shared_) {
+    if (!ElectCleaner()) {
+      if (!CommitIndex()) {
+        retry_used_ = std::move(used);
+      }
+      return;
+    }
+    cache_size_ = entries_->TotalSize();
+  }
+
+  // The dead values in the pack take the disk space too - reclaim all of them,
+  // while over the limit, and count the rest against it.
+  if (pack_) {
+    const bool over_limit = max_size_ != UNLIMITED &&
+                            cache_size_ + pack_->DeadSize() > max_size_;
+    pack_->Compact(over_limit ? 0 : 0.5);
+  }
+  const ui64 disk_size = cache_size_ + (pack_ ? pack_->DeadSize() : 0);
+
+  ui64 overuse = 0;
+  if (max_size_ != UNLIMITED && disk_size > max_size_) {
+    overuse = disk_size - static_cast<ui64>(
+                              max_size_ * eviction_policy_.low_watermark);
+  }
+  if (eviction_policy_.min_free_space) {
+    const ui64 free_space = GetFreeSpace();
+    if (free_space < eviction_policy_.min_free_space) {
+      overuse =
+          std::max(overuse, eviction_policy_.min_free_space - free_space);
+    }
+  }
+
+  bool evicted = false;
+  if (overuse) {
+    if (eviction_policy_.order == proto::FREQUENCY) {
+      entries_->AgeHits();
+    } else if (eviction_policy_.order == proto::SLRU) {
+      entries_->LimitProtected(static_cast<ui64>(
+          (disk_size - std::min(disk_size, overuse)) * kProtectedShare));
+    }
+
+    // Stop, if nothing can be removed - e.g. all victims are locked.
+    while (overuse) {
+      const ui64 removed = Evict(overuse);
+      if (!removed) {
+        break;
+      }
+      overuse -= std::min(overuse, removed);
+      evicted = true;
+    }
+  }
+
+  // The evicted values in the pack are dead now.
+  if (pack_ && evicted) {
+    pack_->Compact(0);
+  }
+
+  // The removed entries stay in the filter, and the overfilled one gives too
+  // many false positives - rebuild it, when either gets significant.
+  const auto filter = std::atomic_load(&filter_);
+  if (filter) {
+    bool rebuild = filter->Count() > filter->Capacity();
+    {
+      std::lock_guard<std::mutex> lock(filter_mutex_);
+      rebuild |= removed_.size() * 4 > filter->Count();
+    }
+    if (rebuild) {
+      RebuildFilter();
+    }
+  }
+  if (!CommitIndex()) {
+    retry_used_ = std::move(used);
+  }
+}
+
+bool FileCache::CommitIndex() {
+  if (!entries_->EndTransaction()) {
+    // The entries removed in the transaction are back in the index.
+    LOG(CACHE_ERROR) << "Failed to commit the index - will retry in the next "
+                        "period";
+    cache_size_ = entries_->TotalSize();
+    return false;
+  }
+  return true;
+}
 
-  while (cache_size_ > max_size_) {
-    string::Hash hash;
-    SQLite::Value entry;
-    CHECK(entries_->First(&hash.str, &entry));
+ui64 FileCache::Evict(ui64 size) {
+  List<SQLite::Victim> victims;
+  if (!entries_->GetVictims(eviction_policy_.order, size, &victims)) {
+    return 0;
+  }
 
-    auto manifest_path = CommonPath(hash) + ".manifest";
-    WriteLock lock(this, manifest_path);
+  const ui64 old_size = cache_size_;
+  auto remove = [this](const String& hash_str) {
+    const string::Hash hash(hash_str);
+    WriteLock lock(this, CommonPath(hash) + ".manifest");
     if (lock) {
-      LOG(CACHE_VERBOSE) << "Cache overuse is " << (cache_size_ - max_size_)
-                         << " bytes: removing " << hash.str;
+      LOG(CACHE_VERBOSE) << "Cache overuse: removing " << hash.str;
       DCHECK_O_EVAL(RemoveEntry(hash));
     }
+  };
+
+  if (evictor_) {
+    List<base::ThreadPool::Optional> futures;
+    for (const auto& victim : victims) {
+      futures.emplace_back(
+          evictor_->Push([&remove, &victim] { remove(victim.first); }));
+    }
+    for (auto& future : futures) {
+      if (future) {
+        future->Wait();
+      }
+    }
+  } else {
+    for (const auto& victim : victims) {
+      remove(victim.first);
+    }
+  }
+
+  return old_size - std::min<ui64>(old_size, cache_size_);
+}
+
+bool FileCache::StoreBlob(Immutable blob, String* key) {
+  DCHECK(key);
+
+  key->assign(base::Hexify(KeyHash(blob)));
+  std::lock_guard<std::mutex> index_lock(index_mutex_);
+  std::lock_guard<std::mutex> lock(BlobMutex(*key));
+
+  ui32 refs = 0;
+  if (!entries_->AddBlobRef(*key, blob.size(), &refs)) {
+    return false;
+  }
+
+  // The referenced blob is rewritten, if it's lost.
+  const String blob_path = BlobPath(*key);
+  if (refs > 1 && base::File::Exists(blob_path)) {
+    STAT(CACHE_BLOB_SHARED);
+    return true;
+  }
+
+  String error;
+  const String blob_dir = blob_path.substr(0, blob_path.rfind('/'));
+  if (!base::CreateDirectory(blob_dir, &error) ||
+      !base::File::Write(blob_path, blob, &error)) {
+    LOG(CACHE_ERROR) << "Failed to save blob to " << blob_path << ": "
+                     << error;
+    ui64 size;
+    entries_->ReleaseBlobRef(*key, &size, &refs);
+    return false;
+  }
+
+  if (refs == 1) {
+    cache_size_ += blob.size();
+    STAT(CACHE_SIZE_ADDED, blob.size());
+  }
+  return true;
+}
+
+bool FileCache::ReleaseBlobs(const proto::Manifest& manifest) {
+  const auto& v1 = manifest.v1();
+  bool result = true;
+
+  for (const auto* key : {&v1.err_blob(), &v1.obj_blob(), &v1.dep_blob()}) {
+    if (key->empty()) {
+      continue;
+    }
+
+    std::lock_guard<std::mutex> lock(BlobMutex(*key));
+    ui64 size = 0;
+    ui32 refs = 0;
+    if (!entries_->ReleaseBlobRef(*key, &size, &refs)) {
+      // Keep the blob, since its references are unknown.
+      LOG(CACHE_WARNING) << "Releasing unconsidered blob: " << *key;
+      continue;
+    }
+    if (refs) {
+      continue;
+    }
+
+    String error;
+    const String blob_path = BlobPath(*key);
+    if (base::File::Exists(blob_path) &&
+        !base::File::Delete(blob_path, &error)) {
+      result = false;
+      LOG(CACHE_WARNING) << "Failed to delete " << blob_path << ": " << error;
+      continue;
+    }
+
+    cache_size_ -= size;
+    STAT(CACHE_SIZE_CLEANED, size);
+  }
+
+  return result;
+}
+
+ui64 FileCache::GetFreeSpace() const {
+  struct statvfs buffer;
+  if (statvfs(path_.c_str(), &buffer) == -1) {
+    String error;
+    base::GetLastError(&error);
+    LOG(CACHE_WARNING) << "Failed to get free space on " << path_ << ": "
+                       << error;
+    return std::numeric_limits<ui64>::max();
+  }
+  return static_cast<ui64>(buffer.f_bavail) * buffer.f_frsize;
+}
+
+FileCache::LockFile::~LockFile() {
+  if (fd != -1) {
+    close(fd);
+  }
+}
+
+bool FileCache::LockProcesses(const String& path, short type) const {
+  if (locks_file_.fd == -1) {
+    return true;
+  }
+
+  // The processes may have different paths to the same cache directory, and
+  // may be built with different standard libraries - so the offset is the
+  // fixed hash of the relative path. The offsets of different entries collide
+  // with negligible probability.
+  DCHECK(path.compare(0, path_.size(), path_) == 0);
+  const Immutable digest =
+      KeyHash(Immutable(path.substr(path_.size())), sizeof(ui64));
+  ui64 offset = 0;
+  for (size_t i = 0; i < sizeof(ui64); ++i) {
+    offset = (offset << 8) | static_cast<ui8>(digest[i]);
   }
-  entries_->EndTransaction();
+
+  struct flock lock = {};
+  lock.l_type = type;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = offset & 0x3FFFFFFFFFFFFFFFull;
+  lock.l_len = 1;
+  return fcntl(locks_file_.fd, F_SETLK, &lock) == 0;
+}
+
+bool FileCache::ElectCleaner() {
+  // The lock is kept by the open file description - so taking it again is
+  // harmless.
+  return cleaner_file_.fd != -1 &&
+         flock(cleaner_file_.fd, LOCK_EX | LOCK_NB) == 0;
 }
 
 FileCache::ReadLock::ReadLock(const FileCache* file_cache, const String& path)
@@ -565,6 +1953,9 @@ FileCache::ReadLock::ReadLock(const FileCache* file_cache, const String& path)
 
   auto it = cache_->read_locks_.find(path);
   if (it == cache_->read_locks_.end()) {
+    if (!cache_->LockProcesses(path, F_RDLCK)) {
+      return;
+    }
     it = cache_->read_locks_.emplace(path, 0).first;
   }
   it->second++;
@@ -582,6 +1973,7 @@ void FileCache::ReadLock::Unlock() {
 
     if (it->second == 0) {
       cache_->read_locks_.erase(it);
+      cache_->LockProcesses(path_, F_UNLCK);
     }
 
     locked_ = false;
@@ -597,6 +1989,10 @@ FileCache::WriteLock::WriteLock(const FileCache* file_cache, const String& path)
     return;
   }
 
+  if (!cache_->LockProcesses(path, F_WRLCK)) {
+    return;
+  }
+
   cache_->write_locks_.insert(path);
   locked_ = true;
 }
@@ -608,6 +2004,7 @@ void FileCache::WriteLock::Unlock() {
     auto it = cache_->write_locks_.find(path_);
     CHECK(it != cache_->write_locks_.end());
     cache_->write_locks_.erase(it);
+    cache_->LockProcesses(path_, F_UNLCK);
 
     locked_ = false;
   }
@@ -1,28 +1,50 @@
 #pragma once
 
 #include <base/const_string.h>
-#include <base/locked_list.h>
+#include <base/file/file.h>
+#include <base/sharded_list.h>
 #include <base/thread_pool.h>
+#include <cache/bloom_filter.h>
+#include <cache/codec.h>
 #include <cache/database_leveldb.h>
+#include <cache/database_mapped.h>
 #include <cache/database_sqlite.h>
+#include <cache/hot_tier.h>
 #include <cache/manifest.pb.h>
+#include <cache/pack_store.h>
 
 #include <third_party/gtest/exported/include/gtest/gtest_prod.h>
 
 namespace dist_clang {
 namespace cache {
 
+FORWARD_TEST(FileCacheTest, DeduplicateObjects);
+FORWARD_TEST(FileCacheTest, DirectEntry_TrustHeaderStat);
+FORWARD_TEST(FileCacheTest, DirectEntry_Variants);
 FORWARD_TEST(FileCacheTest, DoubleLocks);
+FORWARD_TEST(FileCacheTest, EvictByFrequency);
 FORWARD_TEST(FileCacheTest, ExceedCacheSize);
 FORWARD_TEST(FileCacheTest, ExceedCacheSize_Sync);
+FORWARD_TEST(FileCacheTest, FilterMisses);
+FORWARD_TEST(FileCacheTest, HotTier);
 FORWARD_TEST(FileCacheTest, LockNonExistentFile);
+FORWARD_TEST(FileCacheTest, LowerLayer);
+FORWARD_TEST(FileCacheTest, MigrateDirectIndex);
+FORWARD_TEST(FileCacheTest, ReconcileIndexInBackground);
 FORWARD_TEST(FileCacheTest, RemoveEntry);
+FORWARD_TEST(FileCacheTest, RestoreEntriesWithMixedCodecs);
 FORWARD_TEST(FileCacheTest, RestoreEntryWithMissingFile);
+FORWARD_TEST(FileCacheTest, RestoreSingleEntry_Pack);
+FORWARD_TEST(FileCacheTest, RestoreSingleEntry_TextManifest);
+FORWARD_TEST(FileCacheTest, SharedCache);
+FORWARD_TEST(FileCacheTest, TrackAccessInMemory);
 FORWARD_TEST(FileCacheTest, UseIndexFromDisk);
 FORWARD_TEST(FileCacheMigratorTest, Version_0_to_1_Direct);
 FORWARD_TEST(FileCacheMigratorTest, Version_0_to_1_Simple);
 FORWARD_TEST(FileCacheMigratorTest, Version_1_to_2_Direct);
 FORWARD_TEST(FileCacheMigratorTest, Version_1_to_2_Simple);
+FORWARD_TEST(FileCacheMigratorTest, Version_2_to_3_Pack);
+FORWARD_TEST(FileCacheMigratorTest, Version_3_to_4_Direct);
 
 enum ExtraFileType {
   SANITIZE_BLACKLIST = 0,
@@ -94,15 +116,83 @@ class FileCache {
     Immutable object;
     Immutable deps;
     Immutable stderr;
+
+    SharedPtr<base::File> object_file;
+    proto::Codec object_codec = proto::NONE;
+    // Set instead of |object| by the lookups with |lazy_object| - for the
+    // entries that are not packed.
+  };
+
+  struct EvictionPolicy {
+    proto::Eviction order = proto::LRU;
+
+    double low_watermark = 1.0;
+    // The full cache is cleaned down to this fraction of its maximum size - so
+    // the next cleanings are not triggered by every new entry.
+
+    ui64 min_free_space = 0;
+    // in bytes. The cache is cleaned also if the disk has less free space.
+    // 0 - disables.
+
+    ui32 threads = 1;
+    // The victims are removed in parallel.
   };
 
-  FileCache(const String& path, ui64 size, bool snappy, bool store_index);
+  FileCache(const String& path, ui64 size, bool snappy, bool store_index,
+            bool mtime, bool pack);
   explicit FileCache(const String& path);
   ~FileCache();
 
   bool Run(ui64 clean_period);
   // |clean_period| is in seconds.
 
+  void SetCodecPolicy(const CodecPolicy& policy) THREAD_UNSAFE;
+  // Overrides the policy derived from the |snappy| flag.
+
+  void SetEvictionPolicy(const EvictionPolicy& policy) THREAD_UNSAFE;
+
+  void SetDirectIndex(proto::DirectIndex direct_index) THREAD_UNSAFE;
+  // Should be called before |Run()|. The contents of LevelDB are migrated to
+  // the mapped table on the first run.
+
+  void SetHotSize(ui64 size) THREAD_UNSAFE;
+  // Keeps the recently used entries in memory - up to |size| bytes.
+
+  void SetDeduplication(bool dedup) THREAD_UNSAFE;
+  // Stores the artifacts with the same contents only once. Requires the
+  // stored index and is not used with the pack store.
+
+  void SetShared(bool shared) THREAD_UNSAFE;
+  // Allows a few processes to use the same cache directory: the entries are
+  // locked across processes, and only one of them enforces the cache size.
+  // Requires the stored index - the pack store, the deduplication and the
+  // direct index aren't used.
+
+  void AddLowerLayer(const String& path, bool promote) THREAD_UNSAFE;
+  // The read-only cache in |path| is checked after this one and the previously
+  // added layers. With |promote| its hits are stored into this cache in
+  // background. The lower layers don't use the direct index and the pack
+  // store - so only the direct entries with the handled hash in manifest, e.g.
+  // the imported ones, and the unpacked entries are found there.
+
+  struct BundleFilter {
+    ui64 since = 0;
+    // Only the entries used since this time are exported. 0 - all of them.
+
+    HashSet<String> hashes;
+    // Only these entries are exported - the direct entries are selected by
+    // the unhandled hash. Empty - all of them.
+  };
+
+  bool Export(const BundleFilter& filter, int fd, ui64* count,
+              String* error = nullptr);
+  // Writes the gzipped stream of the selected entries to |fd| - it's read by
+  // |Import()| of another cache. Should be called after |Run()|.
+
+  bool Import(int fd, ui64* count, String* error = nullptr);
+  // The imported direct variants don't replace the local ones with the same
+  // headers. Should be called after |Run()|.
+
   static string::HandledHash Hash(string::HandledSource code,
                                   const ExtraFiles& extra_files,
                                   string::CommandLine command_line,
@@ -115,11 +205,21 @@ class FileCache {
 
   bool Find(string::HandledSource code, const ExtraFiles& extra_files,
             string::CommandLine command_line, string::Version version,
-            Entry* entry) const;
+            Entry* entry, bool lazy_object = false) const;
 
   bool Find(string::UnhandledSource code, const ExtraFiles& extra_files,
             string::CommandLine command_line, string::Version version,
-            const String& current_dir, Entry* entry) const;
+            const String& current_dir, Entry* entry,
+            bool lazy_object = false) const;
+  // With |lazy_object| the object file isn't loaded into memory - it should be
+  // restored with |RestoreObject()|.
+
+  static bool RestoreObject(const Entry& entry, const String& path,
+                            bool hardlink, String* error = nullptr);
+  // Writes the object file of |entry| to |path| without copying it through
+  // the user space, if possible. The |hardlink| is used only for the
+  // uncompressed objects: the restored file shares the inode with the cache,
+  // so it's safe only if nobody modifies the outputs in place.
 
   void Store(string::UnhandledSource code, const ExtraFiles& extra_files,
              string::CommandLine command_line, string::Version version,
@@ -131,18 +231,36 @@ class FileCache {
              const Entry& entry);
 
  private:
+  FRIEND_TEST(FileCacheTest, DeduplicateObjects);
+  FRIEND_TEST(FileCacheTest, DirectEntry_TrustHeaderStat);
+  FRIEND_TEST(FileCacheTest, DirectEntry_Variants);
   FRIEND_TEST(FileCacheTest, DoubleLocks);
+  FRIEND_TEST(FileCacheTest, EvictByFrequency);
   FRIEND_TEST(FileCacheTest, ExceedCacheSize);
+  FRIEND_TEST(FileCacheTest, FilterMisses);
+  FRIEND_TEST(FileCacheTest, HotTier);
   FRIEND_TEST(FileCacheTest, LockNonExistentFile);
+  FRIEND_TEST(FileCacheTest, LowerLayer);
+  FRIEND_TEST(FileCacheTest, MigrateDirectIndex);
+  FRIEND_TEST(FileCacheTest, ReconcileIndexInBackground);
   FRIEND_TEST(FileCacheTest, RemoveEntry);
+  FRIEND_TEST(FileCacheTest, RestoreEntriesWithMixedCodecs);
   FRIEND_TEST(FileCacheTest, RestoreEntryWithMissingFile);
+  FRIEND_TEST(FileCacheTest, RestoreSingleEntry_Pack);
+  FRIEND_TEST(FileCacheTest, RestoreSingleEntry_TextManifest);
+  FRIEND_TEST(FileCacheTest, SharedCache);
+  FRIEND_TEST(FileCacheTest, TrackAccessInMemory);
   FRIEND_TEST(FileCacheTest, UseIndexFromDisk);
   FRIEND_TEST(FileCacheMigratorTest, Version_0_to_1_Direct);
   FRIEND_TEST(FileCacheMigratorTest, Version_0_to_1_Simple);
   FRIEND_TEST(FileCacheMigratorTest, Version_1_to_2_Direct);
   FRIEND_TEST(FileCacheMigratorTest, Version_1_to_2_Simple);
+  FRIEND_TEST(FileCacheMigratorTest, Version_2_to_3_Pack);
+  FRIEND_TEST(FileCacheMigratorTest, Version_3_to_4_Direct);
 
-  enum : ui32 { kManifestVersion = 2 };
+  enum : ui32 { kManifestVersion = 4 };
+  enum : int { kMaxDirectVariants = 4 };
+  enum : size_t { kBlobMutexes = 16 };
 
   class ReadLock {
    public:
@@ -184,46 +302,182 @@ class FileCache {
     return SecondPath(hash) + "/" + hash.str.string_copy();
   }
 
-  bool FindByHash(string::HandledHash hash, Entry* entry) const;
+  inline String BlobPath(const String& key) const {
+    DCHECK(key.size() >= 2);
+    return path_ + "/blobs/" + key[0] + "/" + key[1] + "/" + key;
+  }
+
+  inline std::mutex& BlobMutex(const String& key) {
+    return blob_mutexes_[std::hash<String>()(key) % kBlobMutexes];
+  }
+
+  bool FindByHash(string::HandledHash hash, Entry* entry,
+                  bool lazy_object = false, bool touch = true) const;
+  // Without |touch| the lookup isn't counted as the use of entry.
+  bool FindInLowerLayers(string::HandledHash hash, Entry* entry,
+                         bool lazy_object) const;
+  bool FindHandledHash(string::UnhandledHash unhandled_hash,
+                       const String& current_dir,
+                       string::HandledHash* hash) const;
+  // Checks the variants of the direct manifest against the current headers.
+  void PromoteVariant(const String& manifest_path,
+                      const proto::Direct::Variant& variant) const;
+  // Moves the hit |variant| to the front of the direct manifest, unless the
+  // manifest is used by someone else - the order is only a hint.
   void DoStore(string::HandledHash hash, Entry entry);
   void DoStore(string::UnhandledHash orig_hash, const List<String>& headers,
                const String& current_dir, const string::HandledHash& hash);
 
   using TimeHashPair = Pair<ui64 /* mtime */, string::Hash>;
-  using EntryList = base::LockedList<TimeHashPair>;
+  using EntryList = base::ShardedList<TimeHashPair>;
+  // Every thread appends the accesses to its own shard - the hits don't
+  // contend on the same list.
   using EntryListDeleter = Fn<void(EntryList* list)>;
 
+  bool ExportEntry(string::Hash hash, proto::BundleEntry* record) const;
+  // Returns |false|, if there is nothing to export.
+  bool ImportDirect(string::UnhandledHash hash, const proto::Direct& direct);
+
   bool Migrate(string::Hash hash, ui32 to_version = kManifestVersion) const;
+  bool MigrateDirectIndex(MappedTable* table);
 
-  bool GetEntrySize(string::Hash hash, ui64* size) const;
+  bool GetEntrySize(string::Hash hash, ui64* size,
+                    ui64* shared = nullptr) const;
   // Sets |0u| if the entry is broken.
-  // Returns |true| if the entry is from index.
+  // Returns |true| if the entry is from index - then the |shared| isn't set.
 
   bool RemoveEntry(string::Hash hash);
   // Returns |false| only if some part of entry can't be physically removed.
+  // Should be called under the |index_mutex_| - the evictors run, while
+  // |Clean()| holds it.
+
+  bool StoreBlob(Immutable blob, String* key);
+  // Adds a reference to the blob with the contents of |blob|, and writes it,
+  // if it's new. Returns the content hash in |key|. Takes the |index_mutex_|.
+  bool ReleaseBlobs(const proto::Manifest& manifest);
+  // Removes the blobs, that aren't referenced anymore. Should be called under
+  // the |index_mutex_|.
+
+  bool LockProcesses(const String& path, short type) const;
+  // Takes the |fcntl()| lock of |type| on the byte of the lock file, which
+  // corresponds to |path|, without waiting. The record locks belong to the
+  // process - so they are taken only by the first in-process lock of |path|.
+  // Always succeeds in the non-shared cache.
+
+  bool ElectCleaner();
+  // Returns |true| if this process enforces the size of the shared cache. The
+  // role goes to another process, when the elected one exits.
+
+  bool MayContain(string::Hash hash) const;
+  // Returns |false| only if the entry is definitely absent. The filter is
+  // trusted after the whole cache directory is reconciled.
+
+  void AddToFilter(string::Hash hash, bool indexed);
+  // The entry, which isn't |indexed| yet, is also added to the rebuilt filter
+  // until |Clean()| puts it into the index.
+
+  void CountFalsePositive(string::Hash hash) const;
+  // The removed entries, which stay in the filter until it's rebuilt, aren't
+  // the false positives of the filter itself.
+
+  void RebuildFilter();
+  // Should be called under the |index_mutex_|.
+
+  void Touch(string::Hash hash, const String& manifest_path) const;
+  // Records the access to the entry - it's flushed to the index in batches by
+  // |Clean()|.
 
   void Clean(UniquePtr<EntryList> list);
 
+  bool CommitIndex();
+  // The cache size is taken from the index, if the transaction is rolled back.
+
+  ui64 Evict(ui64 size);
+  // Removes the entries with the total |size| in the order of the eviction
+  // policy. Returns the size actually removed.
+
+  ui64 GetFreeSpace() const;
+
+  // Brings the index in accordance with the entries in the directory with the
+  // hashes starting with |prefix|.
+  void Reconcile(const String& prefix);
+  void WaitForReconcile();
+
   mutable std::mutex locks_mutex_;
   mutable HashMap<String, ui32> read_locks_;
   mutable HashSet<String> write_locks_;
 
   const String path_;
-  bool snappy_, store_index_;
-  UniquePtr<LevelDB> database_;
+  bool store_index_, mtime_, use_pack_;
+  CodecPolicy codec_policy_;
+  EvictionPolicy eviction_policy_;
+  UniquePtr<PackStore> pack_;
+  UniquePtr<HotTier> hot_;
+  bool dedup_ = false;
+  bool shared_ = false;
+  bool read_only_ = false;
+  // The lower layers are never changed - neither the entries, nor the usage.
+
+  struct LowerLayer {
+    UniquePtr<FileCache> cache;
+    bool promote;
+  };
+  List<LowerLayer> lower_;
+  UniquePtr<base::ThreadPool> promoter_;
+  Fn<void(const string::HandledHash&, const Entry&)> promote_;
+  // Is set in |Run()| - so the promotion may be started by the const lookups.
+  struct LockFile {
+    ~LockFile();
+    int fd = -1;
+  };
+  LockFile locks_file_, cleaner_file_;
+  // Should outlive the |cleaner_| and the |reconciler_|.
+  std::mutex blob_mutexes_[kBlobMutexes];
+  // Serialize the changes of the same blob on disk and in the index.
+  proto::DirectIndex direct_index_ = proto::LEVELDB;
+  UniquePtr<Database<Immutable>> database_;
   UniquePtr<SQLite> entries_;
 
-  ui64 max_size_, cache_size_ = {0u};
+  ui64 max_size_;
+  Atomic<ui64> cache_size_ = {0u};
+  std::mutex index_mutex_;
+  // Guards the transactions on |entries_|.
+  HashMap<String, SQLite::Usage> retry_used_;
+  HashSet<String> unreconciled_;
+  // Guarded by |index_mutex_|. The hits and the prefixes, that failed to get
+  // into the busy index, are retried in the next period.
+
+  SharedPtr<BloomFilter> filter_;
+  // Is replaced with |std::atomic_store()| - so the lookups don't lock. There
+  // is no filter in the shared cache, since the other processes add entries.
+  Atomic<bool> filter_ready_ = {false};
+  mutable std::mutex filter_mutex_;
+  SharedPtr<BloomFilter> next_filter_;
+  HashSet<String> unindexed_;
+  HashSet<String> removed_;
+  // Guarded by |filter_mutex_|. The |next_filter_| is being rebuilt. The
+  // |removed_| entries are still in the filter.
+
   const EntryListDeleter new_entries_deleter_ = [this](EntryList* list) {
     auto task = [this, list] { Clean(UniquePtr<EntryList>(list)); };
     cleaner_.Push(task);
   };
   SharedPtr<EntryList> new_entries_;
 
+  UniquePtr<base::ThreadPool> evictor_;
+  // Should outlive the |cleaner_|.
+
   base::ThreadPool cleaner_{base::ThreadPool::TaskQueue::UNLIMITED, 1};
 
   UniquePtr<base::WorkerPool> resetter_{new base::WorkerPool(true)};
   // Simply resets |new_entries_| periodically.
+
+  UniquePtr<base::ThreadPool> reconciler_;
+  // Is created in |Run()| - the lower layers don't reconcile.
+  List<base::Future<bool>> reconcile_futures_;
+  Atomic<ui32> reconcile_pending_ = {0};
+  Atomic<bool> stop_reconcile_ = {false};
+  TimePoint reconcile_start_;
 };
 
 }  // namespace cache
@@ -4,6 +4,8 @@
 #include <cache/file_cache.h>
 #include <cache/manifest.pb.h>
 
+#include <sys/stat.h>
+
 #include <base/using_log.h>
 
 namespace dist_clang {
@@ -11,7 +13,7 @@ namespace cache {
 
 namespace {
 
-bool Version_0_to_1(const String& common_path, ui32 to_version,
+bool Version_0_to_1(const String& common_path, ui32 to_version, PackStore*,
                     proto::Manifest& manifest, bool& modified) {
   if (manifest.version() != 0 || to_version < 1) {
     return true;
@@ -73,7 +75,7 @@ bool Version_0_to_1(const String& common_path, ui32 to_version,
 
 // Remove old direct cache entries since they contain absolute paths. And we
 // can't distinguish which paths should shortened and which not.
-bool Version_1_to_2(const String& common_path, ui32 to_version,
+bool Version_1_to_2(const String& common_path, ui32 to_version, PackStore*,
                     proto::Manifest& manifest, bool& modified) {
   if (manifest.version() != 1 || to_version < 2) {
     return true;
@@ -88,6 +90,72 @@ bool Version_1_to_2(const String& common_path, ui32 to_version,
   return true;
 }
 
+// Move the separate files of a simple entry into the pack store - if it's
+// enabled.
+bool Version_2_to_3(const String& common_path, ui32 to_version,
+                    PackStore* pack, proto::Manifest& manifest,
+                    bool& modified) {
+  if (manifest.version() != 2 || to_version < 3) {
+    return true;
+  }
+
+  manifest.set_version(3);
+
+  if (!pack || !manifest.has_v1() || manifest.v1().packed()) {
+    return true;
+  }
+
+  const String err_path = common_path + ".stderr";
+  const String obj_path = common_path + ".o";
+  const String dep_path = common_path + ".d";
+  Immutable err{true}, obj{true}, dep{true};
+
+  if ((manifest.v1().err() && !base::File::Read(err_path, &err)) ||
+      (manifest.v1().obj() && !base::File::Read(obj_path, &obj)) ||
+      (manifest.v1().dep() && !base::File::Read(dep_path, &dep))) {
+    return false;
+  }
+
+  Immutable value = PackBlobs({err, obj, dep});
+
+  const String hash = common_path.substr(common_path.find_last_of('/') + 1);
+  if (!pack->Put(hash, value)) {
+    return false;
+  }
+
+  manifest.mutable_v1()->set_packed(true);
+  manifest.mutable_v1()->set_size(value.size());
+
+  base::File::Delete(err_path);
+  base::File::Delete(obj_path);
+  base::File::Delete(dep_path);
+
+  modified = true;
+  return true;
+}
+
+// Move the single list of headers of a direct entry into the first variant.
+bool Version_3_to_4(const String& common_path, ui32 to_version, PackStore*,
+                    proto::Manifest& manifest, bool& modified) {
+  if (manifest.version() != 3 || to_version < 4) {
+    return true;
+  }
+
+  manifest.set_version(4);
+
+  if (!manifest.has_direct() || manifest.direct().variants_size()) {
+    return true;
+  }
+
+  auto* direct = manifest.mutable_direct();
+  auto* variant = direct->add_variants();
+  variant->mutable_headers()->Swap(direct->mutable_headers());
+  variant->mutable_stats()->Swap(direct->mutable_stats());
+
+  modified = true;
+  return true;
+}
+
 }  // namespace
 
 bool FileCache::Migrate(string::Hash hash, ui32 to_version) const {
@@ -111,19 +179,21 @@ bool FileCache::Migrate(string::Hash hash, ui32 to_version) const {
     return false;
   }
 
-#define MIGRATE(from, to)                                          \
-  if (!Version_##from##_to_##to(common_path, to_version, manifest, \
-                                modified)) {                       \
-    LOG(CACHE_ERROR) << "Failed to migrate " << manifest_path      \
-                     << " from version " #from " to " #to;         \
-    return false;                                                  \
-  } else {                                                         \
-    LOG(CACHE_VERBOSE) << "Migrated " << manifest_path             \
-                       << " from version " #from " to " #to;       \
+#define MIGRATE(from, to)                                             \
+  if (!Version_##from##_to_##to(common_path, to_version, pack_.get(), \
+                                manifest, modified)) {                \
+    LOG(CACHE_ERROR) << "Failed to migrate " << manifest_path         \
+                     << " from version " #from " to " #to;            \
+    return false;                                                     \
+  } else {                                                            \
+    LOG(CACHE_VERBOSE) << "Migrated " << manifest_path                \
+                       << " from version " #from " to " #to;          \
   }
 
   MIGRATE(0, 1);
   MIGRATE(1, 2);
+  MIGRATE(2, 3);
+  MIGRATE(3, 4);
 
 #undef MIGRATE
 
@@ -137,12 +207,54 @@ bool FileCache::Migrate(string::Hash hash, ui32 to_version) const {
     // TODO: make a unit-test that we don't rewrite manifest on disk.
     LOG(CACHE_VERBOSE) << "No modifications for " << manifest_path;
     return true;
-  } else if (!base::SaveToFile(manifest_path, manifest)) {
+  } else if (!base::SaveToFile(manifest_path, manifest, nullptr, true)) {
     LOG(CACHE_ERROR) << "Failed to save " << manifest_path;
     return false;
   }
   return true;
 }
 
+bool FileCache::MigrateDirectIndex(MappedTable* table) {
+  DCHECK(table);
+
+  const String leveldb_path = path_ + "/leveldb_direct";
+  struct stat buffer;
+  if (stat(leveldb_path.c_str(), &buffer) == -1 || !S_ISDIR(buffer.st_mode)) {
+    return true;
+  }
+
+  ui64 migrated = 0;
+  {
+    LevelDB leveldb(path_, "direct");
+    auto visitor = [table, &migrated](const String& key, Immutable value) {
+      if (table->Set(key, value)) {
+        ++migrated;
+      }
+    };
+    if (!leveldb.Iterate(visitor) || !table->Commit()) {
+      LOG(CACHE_ERROR) << "Failed to migrate direct index from "
+                       << leveldb_path;
+      return false;
+    }
+  }
+
+  // Remove the LevelDB - to not migrate it again.
+  List<String> files;
+  base::WalkDirectory(leveldb_path,
+                      [&files](const String& file_path, ui64, ui64) {
+                        files.push_back(file_path);
+                      });
+  for (const auto& file_path : files) {
+    base::File::Delete(file_path);
+  }
+  if (!base::RemoveEmptyDirectory(leveldb_path)) {
+    LOG(CACHE_WARNING) << "Failed to remove " << leveldb_path;
+  }
+
+  LOG(CACHE_INFO) << "Migrated " << migrated
+                  << " direct entries from LevelDB";
+  return true;
+}
+
 }  // namespace cache
 }  // namespace dist_clang
@@ -116,5 +116,66 @@ TEST(FileCacheMigratorTest, Version_1_to_2_Direct) {
   EXPECT_FALSE(cache.Migrate(hash, 2));
 }
 
+TEST(FileCacheMigratorTest, Version_2_to_3_Pack) {
+  const base::TemporaryDir tmp_dir;
+  string::Hash hash{"12345678901234567890123456789012-12345678-00000001"_l};
+  FileCache cache(tmp_dir, FileCache::UNLIMITED, false, false, false, true);
+  ASSERT_TRUE(cache.Run(1));
+  cache.WaitForReconcile();
+  const String common_path = cache.CommonPath(hash);
+  const String manifest_path = common_path + ".manifest";
+
+  ASSERT_TRUE(base::CreateDirectory(cache.SecondPath(hash)));
+  ASSERT_TRUE(base::File::Write(common_path + ".o", "12345"_l));
+  ASSERT_TRUE(base::File::Write(common_path + ".stderr", "678"_l));
+
+  proto::Manifest manifest;
+  manifest.set_version(2);
+  manifest.mutable_v1()->set_obj(true);
+  manifest.mutable_v1()->set_err(true);
+  manifest.mutable_v1()->set_size(8);
+
+  ASSERT_TRUE(base::SaveToFile(manifest_path, manifest));
+  manifest.Clear();
+  EXPECT_TRUE(cache.Migrate(hash, 3));
+  ASSERT_TRUE(base::LoadFromFile(manifest_path, &manifest));
+
+  EXPECT_EQ(3u, manifest.version());
+  EXPECT_TRUE(manifest.v1().packed());
+  EXPECT_FALSE(base::File::Exists(common_path + ".o"));
+  EXPECT_FALSE(base::File::Exists(common_path + ".stderr"));
+
+  FileCache::Entry entry;
+  ASSERT_TRUE(cache.FindByHash(string::HandledHash(hash.str), &entry));
+  EXPECT_EQ("12345"_l, entry.object);
+  EXPECT_EQ("678"_l, entry.stderr);
+  EXPECT_TRUE(entry.deps.empty());
+}
+
+TEST(FileCacheMigratorTest, Version_3_to_4_Direct) {
+  const base::TemporaryDir tmp_dir;
+  string::Hash hash{"12345678901234567890123456789012-12345678-00000001"_l};
+  FileCache cache(tmp_dir);
+  const String manifest_path = cache.CommonPath(hash) + ".manifest";
+
+  proto::Manifest manifest;
+  manifest.set_version(3);
+  manifest.mutable_direct()->add_headers()->assign("test1.h");
+  manifest.mutable_direct()->add_headers()->assign("test2.h");
+
+  ASSERT_TRUE(base::CreateDirectory(cache.SecondPath(hash)));
+  ASSERT_TRUE(base::SaveToFile(manifest_path, manifest));
+  manifest.Clear();
+  EXPECT_TRUE(cache.Migrate(hash, 4));
+  ASSERT_TRUE(base::LoadFromFile(manifest_path, &manifest));
+
+  EXPECT_EQ(4u, manifest.version());
+  EXPECT_EQ(0, manifest.direct().headers_size());
+  ASSERT_EQ(1, manifest.direct().variants_size());
+  ASSERT_EQ(2, manifest.direct().variants(0).headers_size());
+  EXPECT_EQ("test1.h", manifest.direct().variants(0).headers(0));
+  EXPECT_EQ("test2.h", manifest.direct().variants(0).headers(1));
+}
+
 }  // namespace cache
 }  // namespace dist_clang
@@ -4,10 +4,15 @@
 #include <base/future.h>
 #include <base/protobuf_utils.h>
 #include <base/temporary_dir.h>
+#include <cache/hash_memo.h>
 
 #include <third_party/gtest/exported/include/gtest/gtest.h>
 #include STL(regex)
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace dist_clang {
 namespace cache {
 
@@ -90,7 +95,7 @@ TEST(FileCacheTest, DoubleLocks) {
 
 TEST(FileCacheTest, RemoveEntry) {
   const base::TemporaryDir tmp_dir;
-  FileCache cache(tmp_dir, 100, false, false);
+  FileCache cache(tmp_dir, 100, false, false, false, false);
 
   string::Hash hash1{"12345678901234567890123456789012-12345678-00000001"_l};
   {
@@ -144,6 +149,7 @@ TEST(FileCacheTest, RemoveEntry) {
   }
 
   ASSERT_TRUE(cache.Run(1));
+  cache.WaitForReconcile();
   EXPECT_TRUE(cache.RemoveEntry(hash1));
   EXPECT_TRUE(cache.RemoveEntry(hash2));
   EXPECT_FALSE(cache.RemoveEntry(hash3));
@@ -192,6 +198,287 @@ TEST(FileCacheTest, RestoreSingleEntry) {
   EXPECT_EQ(expected_stderr, entry2.stderr);
 }
 
+TEST(FileCacheTest, RestoreEntriesWithMixedCodecs) {
+  const base::TemporaryDir tmp_dir;
+  const CommandLine cl("-c"_l);
+  const Version version("3.5 (revision 100000)"_l);
+  const HandledSource code1("int main() { return 0; }"_l);
+  const HandledSource code2("int main() { return 1; }"_l);
+
+  String object_code, deps;
+  for (int i = 0; i < 100; ++i) {
+    object_code += "some object code ";
+    deps += "some/header.h ";
+  }
+  FileCache::Entry entry1, entry2;
+  entry1.object = Immutable(object_code);
+  entry1.deps = Immutable(deps);
+  entry2.object = Immutable(object_code);
+  entry2.deps = Immutable(deps);
+  entry2.stderr = "x"_l;
+
+  {
+    FileCache cache(tmp_dir, FileCache::UNLIMITED, true, false, false, false);
+    ASSERT_TRUE(cache.Run(1));
+    cache.Store(code1, {}, cl, version, entry1);
+  }
+
+  FileCache cache(tmp_dir, FileCache::UNLIMITED, true, false, false, false);
+  CodecPolicy policy;
+  policy.compression.set_codec(proto::LZ4);
+  policy.large_compression.set_codec(proto::ZSTD);
+  policy.large_size = object_code.size();
+  cache.SetCodecPolicy(policy);
+  ASSERT_TRUE(cache.Run(1));
+  cache.Store(code2, {}, cl, version, entry2);
+
+  const String manifest_path =
+      cache.CommonPath(FileCache::Hash(code2, {}, cl, version)) + ".manifest";
+  proto::Manifest manifest;
+  ASSERT_TRUE(base::LoadFromFile(manifest_path, &manifest));
+  EXPECT_EQ(proto::ZSTD, manifest.v1().obj_compression().codec());
+  EXPECT_EQ(proto::LZ4, manifest.v1().dep_compression().codec());
+  // The incompressible artifacts are stored as is.
+  EXPECT_FALSE(manifest.v1().has_err_compression());
+
+  FileCache::Entry entry3, entry4;
+  ASSERT_TRUE(cache.Find(code1, {}, cl, version, &entry3));
+  EXPECT_EQ(object_code, entry3.object.string_copy());
+  EXPECT_EQ(deps, entry3.deps.string_copy());
+  EXPECT_TRUE(entry3.stderr.empty());
+
+  ASSERT_TRUE(cache.Find(code2, {}, cl, version, &entry4));
+  EXPECT_EQ(object_code, entry4.object.string_copy());
+  EXPECT_EQ(deps, entry4.deps.string_copy());
+  EXPECT_EQ("x"_l, entry4.stderr);
+}
+
+TEST(FileCacheTest, RestoreSingleEntry_LazyObject) {
+  const base::TemporaryDir tmp_dir;
+  const String output_path = String(tmp_dir) + "/test.o";
+  const CommandLine cl("-c"_l);
+  const Version version("3.5 (revision 100000)"_l);
+  const HandledSource code1("int main() { return 0; }"_l);
+  const HandledSource code2("int main() { return 1; }"_l);
+
+  String object_code;
+  for (int i = 0; i < 100; ++i) {
+    object_code += "some object code ";
+  }
+  FileCache::Entry entry1;
+  entry1.object = Immutable(object_code);
+  entry1.deps = "some deps"_l;
+
+  FileCache cache(String(tmp_dir) + "/cache", FileCache::UNLIMITED, false,
+                  false, false, false);
+  ASSERT_TRUE(cache.Run(1));
+  cache.Store(code1, {}, cl, version, entry1);
+
+  CodecPolicy policy;
+  policy.compression.set_codec(proto::ZSTD);
+  cache.SetCodecPolicy(policy);
+  cache.Store(code2, {}, cl, version, entry1);
+
+  String error;
+  Immutable content1{true};
+
+  FileCache::Entry entry2;
+  ASSERT_TRUE(cache.Find(code1, {}, cl, version, &entry2, true));
+  EXPECT_TRUE(entry2.object.empty());
+  ASSERT_NE(nullptr, entry2.object_file);
+  EXPECT_EQ(proto::NONE, entry2.object_codec);
+  EXPECT_EQ("some deps"_l, entry2.deps);
+
+  ASSERT_TRUE(FileCache::RestoreObject(entry2, output_path, true, &error))
+      << error;
+  ASSERT_TRUE(base::File::Read(output_path, &content1, &error)) << error;
+  EXPECT_EQ(object_code, content1.string_copy());
+
+  struct stat st;
+  ASSERT_EQ(0, stat(output_path.c_str(), &st));
+  EXPECT_EQ(2u, st.st_nlink);
+
+  // The compressed object can't be hard-linked.
+  FileCache::Entry entry3;
+  ASSERT_TRUE(cache.Find(code2, {}, cl, version, &entry3, true));
+  ASSERT_NE(nullptr, entry3.object_file);
+  EXPECT_EQ(proto::ZSTD, entry3.object_codec);
+
+  Immutable content2;
+  ASSERT_TRUE(FileCache::RestoreObject(entry3, output_path, true, &error))
+      << error;
+  ASSERT_TRUE(base::File::Read(output_path, &content2, &error)) << error;
+  EXPECT_EQ(object_code, content2.string_copy());
+
+  ASSERT_EQ(0, stat(output_path.c_str(), &st));
+  EXPECT_EQ(1u, st.st_nlink);
+}
+
+TEST(FileCacheTest, RestoreSingleEntry_TextManifest) {
+  const base::TemporaryDir tmp_dir;
+  const String path = tmp_dir;
+  const auto expected_object_code = "some object code"_l;
+  FileCache cache(path);
+  ASSERT_TRUE(cache.Run(1));
+  FileCache::Entry entry1, entry2;
+
+  const HandledSource code("int main() { return 0; }"_l);
+  const CommandLine cl("-c"_l);
+  const Version version("3.5 (revision 100000)"_l);
+  const String manifest_path =
+      cache.CommonPath(FileCache::Hash(code, {}, cl, version)) + ".manifest";
+
+  entry1.object = expected_object_code;
+  cache.Store(code, {}, cl, version, entry1);
+
+  // Emulate the manifest from the older version.
+  proto::Manifest manifest;
+  bool is_binary = false;
+  ASSERT_TRUE(
+      base::LoadFromFile(manifest_path, &manifest, nullptr, &is_binary));
+  EXPECT_TRUE(is_binary);
+  ASSERT_TRUE(base::SaveToFile(manifest_path, manifest));
+
+  ASSERT_TRUE(cache.Find(code, {}, cl, version, &entry2));
+  EXPECT_EQ(expected_object_code, entry2.object);
+
+  // The manifest is rewritten in binary format.
+  ASSERT_TRUE(
+      base::LoadFromFile(manifest_path, &manifest, nullptr, &is_binary));
+  EXPECT_TRUE(is_binary);
+}
+
+TEST(FileCacheTest, RestoreSingleEntry_Pack) {
+  const base::TemporaryDir tmp_dir;
+  const String path = tmp_dir;
+  const auto expected_stderr = "some warning"_l;
+  const auto expected_object_code = "some object code"_l;
+  const auto expected_deps = "some deps"_l;
+  FileCache::Entry entry1, entry2, entry3;
+
+  const HandledSource code("int main() { return 0; }"_l);
+  const CommandLine cl("-c"_l);
+  const Version version("3.5 (revision 100000)"_l);
+  const auto hash = FileCache::Hash(code, {}, cl, version);
+
+  {
+    FileCache cache(path, FileCache::UNLIMITED, true, false, false, true);
+    ASSERT_TRUE(cache.Run(1));
+
+    entry1.object = expected_object_code;
+    entry1.deps = expected_deps;
+    entry1.stderr = expected_stderr;
+
+    cache.Store(code, {}, cl, version, entry1);
+    EXPECT_FALSE(base::File::Exists(cache.CommonPath(hash) + ".o"));
+    EXPECT_FALSE(base::File::Exists(cache.CommonPath(hash) + ".d"));
+    EXPECT_FALSE(base::File::Exists(cache.CommonPath(hash) + ".stderr"));
+  }
+
+  // The pack store is restored on the next run.
+  FileCache cache(path, FileCache::UNLIMITED, true, false, false, true);
+  ASSERT_TRUE(cache.Run(1));
+
+  ASSERT_TRUE(cache.Find(code, {}, cl, version, &entry2));
+  EXPECT_EQ(expected_object_code, entry2.object);
+  EXPECT_EQ(expected_deps, entry2.deps);
+  EXPECT_EQ(expected_stderr, entry2.stderr);
+
+  EXPECT_TRUE(cache.RemoveEntry(hash));
+  EXPECT_FALSE(cache.Find(code, {}, cl, version, &entry3));
+}
+
+TEST(FileCacheTest, HotTier) {
+  const base::TemporaryDir tmp_dir;
+  FileCache cache(tmp_dir);
+  cache.SetHotSize(1024);
+  ASSERT_TRUE(cache.Run(1));
+  cache.WaitForReconcile();
+
+  const HandledSource code("int main() { return 0; }"_l);
+  const CommandLine cl("-c"_l);
+  const Version version("3.5 (revision 100000)"_l);
+  const auto hash = FileCache::Hash(code, {}, cl, version);
+
+  FileCache::Entry entry;
+  entry.object = "some object code"_l;
+  entry.deps = "some deps"_l;
+  entry.stderr = "some warning"_l;
+  cache.Store(code, {}, cl, version, entry);
+
+  // The entry is admitted only on the second lookup.
+  FileCache::Entry entry1, entry2, entry3, entry4;
+  ASSERT_TRUE(cache.Find(code, {}, cl, version, &entry1, true));
+  EXPECT_NE(nullptr, entry1.object_file);
+  EXPECT_EQ(0u, cache.hot_->Size());
+  ASSERT_TRUE(cache.Find(code, {}, cl, version, &entry2, true));
+  EXPECT_EQ(nullptr, entry2.object_file);
+  EXPECT_EQ("some object code"_l, entry2.object);
+  EXPECT_NE(0u, cache.hot_->Size());
+
+  // Now the entry is served from memory.
+  ASSERT_TRUE(base::File::Delete(cache.CommonPath(hash) + ".o"));
+  ASSERT_TRUE(cache.Find(code, {}, cl, version, &entry3, true));
+  EXPECT_EQ("some object code"_l, entry3.object);
+  EXPECT_EQ("some deps"_l, entry3.deps);
+  EXPECT_EQ("some warning"_l, entry3.stderr);
+
+  cache.RemoveEntry(hash);
+  EXPECT_EQ(0u, cache.hot_->Size());
+  EXPECT_FALSE(cache.Find(code, {}, cl, version, &entry4, true));
+}
+
+TEST(FileCacheTest, FilterMisses) {
+  const base::TemporaryDir tmp_dir;
+  const HandledSource code1("int main() { return 0; }"_l);
+  const HandledSource code2("int main() { return 1; }"_l);
+  const CommandLine cl("-c"_l);
+  const Version version("3.5 (revision 100000)"_l);
+  const auto hash1 = FileCache::Hash(code1, {}, cl, version);
+  const auto hash2 = FileCache::Hash(code2, {}, cl, version);
+
+  FileCache cache(tmp_dir, FileCache::UNLIMITED, false, true, false, false);
+  ASSERT_TRUE(cache.Run(3600));
+  cache.WaitForReconcile();
+  ASSERT_TRUE(cache.filter_ready_);
+
+  cache.Store(code1, {}, cl, version, {"object"_l, Immutable(), Immutable()});
+
+  // The entry, that appears behind the back of the cache, is never looked up
+  // on disk.
+  ASSERT_TRUE(base::CreateDirectory(cache.SecondPath(hash2)));
+  ASSERT_TRUE(base::File::Copy(cache.CommonPath(hash1) + ".manifest",
+                               cache.CommonPath(hash2) + ".manifest"));
+  ASSERT_TRUE(base::File::Copy(cache.CommonPath(hash1) + ".o",
+                               cache.CommonPath(hash2) + ".o"));
+
+  FileCache::Entry entry1, entry2, entry3;
+  EXPECT_FALSE(cache.Find(code2, {}, cl, version, &entry1));
+  ASSERT_TRUE(cache.Find(code1, {}, cl, version, &entry2));
+  EXPECT_EQ("object"_l, entry2.object);
+
+  // The rebuilt filter keeps the stored entries, that aren't in the index yet.
+  SQLite::Value value;
+  ASSERT_FALSE(cache.entries_->Get(hash1.str, &value));
+  {
+    std::lock_guard<std::mutex> lock(cache.index_mutex_);
+    cache.RebuildFilter();
+  }
+  ASSERT_TRUE(cache.Find(code1, {}, cl, version, &entry3));
+  EXPECT_EQ("object"_l, entry3.object);
+
+  // The removed entry stays in the filter - until it's rebuilt.
+  const auto count = cache.filter_->Count();
+  cache.RemoveEntry(hash1);
+  EXPECT_EQ(1u, cache.removed_.count(hash1.str));
+  {
+    std::lock_guard<std::mutex> lock(cache.index_mutex_);
+    cache.RebuildFilter();
+  }
+  EXPECT_TRUE(cache.removed_.empty());
+  EXPECT_GT(count, cache.filter_->Count());
+}
+
 TEST(FileCacheTest, RestoreSingleEntryWithExtraFile) {
   const base::TemporaryDir tmp_dir;
   const String path = tmp_dir;
@@ -316,9 +603,9 @@ TEST(FileCacheTest, ExceedCacheSize) {
   const CommandLine cl("-c"_l);
   const Version version("3.5 (revision 100000)"_l);
 
-  FileCache cache(cache_path, 138, false, false);
-  // 138 = sizeof(obj_content[0]) + sizeof(obj_content[1]) + 1 + 2 *
-  // <size_of_manifest>. The current typical size of manifest is 66 bytes.
+  FileCache cache(cache_path, 44, false, false, false, false);
+  // 44 = sizeof(obj_content[0]) + sizeof(obj_content[1]) + 1 + 2 *
+  // <size_of_manifest>. The current typical size of manifest is 19 bytes.
 
   ASSERT_TRUE(cache.Run(1));
   auto db_size = cache.database_->SizeOnDisk();
@@ -326,7 +613,7 @@ TEST(FileCacheTest, ExceedCacheSize) {
   {
     FileCache::Entry entry{obj_content[0], String(), String()};
     cache.Store(code[0], {}, cl, version, entry);
-    EXPECT_EQ(68u, base::CalculateDirectorySize(cache_path) - db_size);
+    EXPECT_EQ(21u, base::CalculateDirectorySize(cache_path) - db_size);
   }
 
   std::this_thread::sleep_for(std::chrono::seconds(1));
@@ -334,7 +621,7 @@ TEST(FileCacheTest, ExceedCacheSize) {
   {
     FileCache::Entry entry{obj_content[1], String(), String()};
     cache.Store(code[1], {}, cl, version, entry);
-    EXPECT_EQ(137u, base::CalculateDirectorySize(cache_path) - db_size);
+    EXPECT_EQ(43u, base::CalculateDirectorySize(cache_path) - db_size);
   }
 
   std::this_thread::sleep_for(std::chrono::seconds(1));
@@ -343,7 +630,7 @@ TEST(FileCacheTest, ExceedCacheSize) {
     FileCache::Entry entry{obj_content[2], String(), String()};
     cache.Store(code[2], {}, cl, version, entry);
     std::this_thread::sleep_for(std::chrono::seconds(3));
-    EXPECT_EQ(70u, base::CalculateDirectorySize(cache_path) - db_size);
+    EXPECT_EQ(23u, base::CalculateDirectorySize(cache_path) - db_size);
   }
 
   FileCache::Entry entry;
@@ -352,6 +639,110 @@ TEST(FileCacheTest, ExceedCacheSize) {
   EXPECT_TRUE(cache.Find(code[2], {}, cl, version, &entry));
 }
 
+TEST(FileCacheTest, EvictByFrequency) {
+  const base::TemporaryDir tmp_dir;
+  const CommandLine cl("-c"_l);
+  const Version version("3.5 (revision 100000)"_l);
+  const HandledSource code[] = {HandledSource("int main() { return 0; }"_l),
+                                HandledSource("int main() { return 1; }"_l),
+                                HandledSource("int main() { return 2; }"_l)};
+  const String contents[] = {String(10, '1'), String(10, '2'),
+                             String(1000, '3')};
+
+  FileCache cache(tmp_dir);
+  FileCache::EvictionPolicy policy;
+  policy.order = proto::FREQUENCY;
+  policy.low_watermark = 0.5;
+  policy.threads = 2;
+  cache.SetEvictionPolicy(policy);
+  ASSERT_TRUE(cache.Run(3600));
+  cache.WaitForReconcile();
+
+  // The big entry is the most recent one, but it's never hit.
+  UniquePtr<FileCache::EntryList> stored(new FileCache::EntryList);
+  UniquePtr<FileCache::EntryList> used(new FileCache::EntryList);
+  for (ui32 i = 0; i < 3; ++i) {
+    FileCache::Entry entry{Immutable(contents[i]), Immutable(), Immutable()};
+    cache.Store(code[i], {}, cl, version, entry);
+    stored->Append({i + 1, FileCache::Hash(code[i], {}, cl, version)});
+  }
+  for (ui32 i = 0; i < 2; ++i) {
+    used->Append({i + 1, FileCache::Hash(code[i], {}, cl, version)});
+  }
+  cache.Clean(std::move(stored));
+  cache.Clean(std::move(used));
+
+  // Only the big entry should go, despite the low watermark.
+  cache.max_size_ = cache.cache_size_ - 1;
+  cache.Clean(UniquePtr<FileCache::EntryList>(new FileCache::EntryList));
+
+  FileCache::Entry entry1, entry2, entry3;
+  EXPECT_TRUE(cache.Find(code[0], {}, cl, version, &entry1));
+  EXPECT_TRUE(cache.Find(code[1], {}, cl, version, &entry2));
+  EXPECT_FALSE(cache.Find(code[2], {}, cl, version, &entry3));
+  EXPECT_GT(cache.max_size_ / 2, cache.cache_size_);
+}
+
+TEST(FileCacheTest, DeduplicateObjects) {
+  const base::TemporaryDir tmp_dir;
+  const CommandLine cl("-c"_l);
+  const Version version("3.5 (revision 100000)"_l);
+  const HandledSource code1("int main() { return 0; }"_l);
+  const HandledSource code2("int main() { return 0; } // comment"_l);
+  const auto expected_object_code = "some object code"_l;
+  const auto expected_deps = "some deps"_l;
+
+  FileCache cache(tmp_dir, FileCache::UNLIMITED, false, true, false, false);
+  cache.SetDeduplication(true);
+  ASSERT_TRUE(cache.Run(3600));
+  cache.WaitForReconcile();
+
+  const auto hash1 = FileCache::Hash(code1, {}, cl, version);
+  const auto hash2 = FileCache::Hash(code2, {}, cl, version);
+  {
+    FileCache::Entry entry{expected_object_code, expected_deps, Immutable()};
+    cache.Store(code1, {}, cl, version, entry);
+    cache.Store(code2, {}, cl, version, entry);
+  }
+  UniquePtr<FileCache::EntryList> stored(new FileCache::EntryList);
+  stored->Append({1, hash1});
+  stored->Append({2, hash2});
+  cache.Clean(std::move(stored));
+
+  proto::Manifest manifest1, manifest2;
+  ASSERT_TRUE(
+      base::LoadFromFile(cache.CommonPath(hash1) + ".manifest", &manifest1));
+  ASSERT_TRUE(
+      base::LoadFromFile(cache.CommonPath(hash2) + ".manifest", &manifest2));
+  ASSERT_TRUE(manifest1.v1().has_obj_blob());
+  EXPECT_EQ(manifest1.v1().obj_blob(), manifest2.v1().obj_blob());
+  EXPECT_EQ(manifest1.v1().dep_blob(), manifest2.v1().dep_blob());
+  EXPECT_FALSE(manifest1.v1().has_err_blob());
+  EXPECT_FALSE(base::File::Exists(cache.CommonPath(hash1) + ".o"));
+
+  const String object_path = cache.BlobPath(manifest1.v1().obj_blob());
+  EXPECT_TRUE(base::File::Exists(object_path));
+  EXPECT_EQ(cache.entries_->TotalSize(), cache.cache_size_);
+
+  FileCache::Entry entry1, entry2, entry3;
+  ASSERT_TRUE(cache.Find(code1, {}, cl, version, &entry1));
+  EXPECT_EQ(expected_object_code, entry1.object);
+  EXPECT_EQ(expected_deps, entry1.deps);
+
+  // The blobs are shared - and survive the removal of a single entry.
+  EXPECT_TRUE(cache.RemoveEntry(hash1));
+  EXPECT_TRUE(base::File::Exists(object_path));
+  EXPECT_EQ(cache.entries_->TotalSize(), cache.cache_size_);
+  ASSERT_TRUE(cache.Find(code2, {}, cl, version, &entry2, true));
+  ASSERT_NE(nullptr, entry2.object_file);
+
+  EXPECT_TRUE(cache.RemoveEntry(hash2));
+  EXPECT_FALSE(base::File::Exists(object_path));
+  EXPECT_FALSE(cache.Find(code2, {}, cl, version, &entry3));
+  EXPECT_EQ(0u, cache.cache_size_);
+  EXPECT_EQ(0u, cache.entries_->TotalSize());
+}
+
 TEST(FileCacheTest, RestoreDirectEntry) {
   const base::TemporaryDir tmp_dir;
   const String path = tmp_dir;
@@ -396,6 +787,39 @@ TEST(FileCacheTest, RestoreDirectEntry) {
   EXPECT_EQ(expected_stderr, entry2.stderr);
 }
 
+TEST(FileCacheTest, MigrateDirectIndex) {
+  const base::TemporaryDir tmp_dir;
+  const String path = tmp_dir;
+  const String cache_path = path + "/cache";
+  const String header_path = path + "/test.h";
+  const HandledSource code("int main() { return 0; }"_l);
+  const UnhandledSource orig_code("int main() {}"_l);
+  const CommandLine cl("-c"_l);
+  const Version version("3.5 (revision 100000)"_l);
+
+  ASSERT_TRUE(base::File::Write(header_path, "#define A"_l));
+
+  {
+    FileCache cache(cache_path);
+    ASSERT_TRUE(cache.Run(1));
+
+    FileCache::Entry entry;
+    entry.object = "some object code"_l;
+    cache.Store(code, {}, cl, version, entry);
+    cache.Store(orig_code, {}, cl, version, {header_path}, path,
+                FileCache::Hash(code, {}, cl, version));
+  }
+
+  FileCache cache(cache_path);
+  cache.SetDirectIndex(proto::MAPPED);
+  ASSERT_TRUE(cache.Run(1));
+  EXPECT_FALSE(base::File::Exists(cache_path + "/leveldb_direct/LOG"));
+
+  FileCache::Entry entry;
+  ASSERT_TRUE(cache.Find(orig_code, {}, cl, version, path, &entry));
+  EXPECT_EQ("some object code"_l, entry.object);
+}
+
 TEST(FileCacheTest, RestoreDirectEntryWithExtraFile) {
   const base::TemporaryDir tmp_dir;
   const String path = tmp_dir;
@@ -496,6 +920,67 @@ TEST(FileCacheTest, DirectEntry_ChangedHeaderContents) {
   EXPECT_FALSE(cache.Find(orig_code, {}, cl, version, path, &entry));
 }
 
+TEST(FileCacheTest, DirectEntry_TrustHeaderStat) {
+  const base::TemporaryDir tmp_dir;
+  const String path = tmp_dir;
+  const String header1_path = path + "/test1.h";
+  const String header2_path = path + "/test2.h";
+  const String header2_rel_path = "test2.h";
+  const auto expected_object_code = "some object code"_l;
+  FileCache cache(path, FileCache::UNLIMITED, false, false, true, false);
+  ASSERT_TRUE(cache.Run(1));
+  FileCache::Entry entry1, entry2, entry3;
+
+  const HandledSource code("int main() { return 0; }"_l);
+  const CommandLine cl("-c"_l);
+  const Version version("3.5 (revision 100000)"_l);
+
+  ASSERT_TRUE(base::File::Write(header1_path, "#define A"_l));
+  ASSERT_TRUE(base::File::Write(header2_path, "#define B"_l));
+
+  // Recently modified headers are never trusted - move the clock past that.
+  struct SkipRacyWindow {
+    SkipRacyWindow() {
+      HashMemo::SetClock([] { return (time(nullptr) + 2) * 1000000000ull; });
+    }
+    ~SkipRacyWindow() { HashMemo::SetClock(HashMemo::WallClock()); }
+  } skip_racy_window;
+
+  entry1.object = expected_object_code;
+  cache.Store(code, {}, cl, version, entry1);
+
+  const UnhandledSource orig_code("int main() {}"_l);
+  const List<String> headers = {header1_path, header2_rel_path};
+  cache.Store(orig_code, {}, cl, version, headers, path,
+              FileCache::Hash(code, {}, cl, version));
+
+  const auto orig_hash = FileCache::Hash(orig_code, {}, cl, version);
+  proto::Manifest manifest;
+  ASSERT_TRUE(
+      base::LoadFromFile(cache.CommonPath(orig_hash) + ".manifest", &manifest));
+  ASSERT_EQ(1, manifest.direct().variants_size());
+  ASSERT_EQ(2, manifest.direct().variants(0).stats_size());
+  EXPECT_TRUE(manifest.direct().variants(0).stats(1).has_mtime());
+  EXPECT_TRUE(manifest.direct().variants(0).stats(1).has_inode());
+  EXPECT_TRUE(manifest.direct().variants(0).stats(1).has_ctime());
+
+  ASSERT_TRUE(cache.Find(orig_code, {}, cl, version, path, &entry2));
+  EXPECT_EQ(expected_object_code, entry2.object);
+
+  // Replace the header with another file of the same size and mtime - the
+  // stale hash from the manifest shouldn't be trusted.
+  struct stat header_stat;
+  ASSERT_EQ(0, stat(header2_path.c_str(), &header_stat));
+  ASSERT_TRUE(base::File::Write(header2_path, "#define C"_l));
+  const struct timespec times[] = {header_stat.st_atim, header_stat.st_mtim};
+  ASSERT_EQ(0, utimensat(AT_FDCWD, header2_path.c_str(), times, 0));
+  EXPECT_FALSE(cache.Find(orig_code, {}, cl, version, path, &entry3));
+
+  // Change the header size.
+  ASSERT_TRUE(base::File::Write(header2_path, "#define CC"_l));
+  EXPECT_FALSE(cache.Find(orig_code, {}, cl, version, path, &entry3));
+}
+
 TEST(FileCacheTest, DirectEntry_RewriteManifest) {
   const base::TemporaryDir tmp_dir;
   const String path = tmp_dir;
@@ -543,6 +1028,87 @@ TEST(FileCacheTest, DirectEntry_RewriteManifest) {
   EXPECT_TRUE(cache.Find(orig_code, {}, cl, version, path, &entry2));
 }
 
+TEST(FileCacheTest, DirectEntry_Variants) {
+  const base::TemporaryDir tmp_dir;
+  const String path = tmp_dir;
+  const String header1_path = path + "/test1.h";
+  const String header2_path = path + "/test2.h";
+  FileCache cache(path);
+  ASSERT_TRUE(cache.Run(1));
+  cache.WaitForReconcile();
+
+  const HandledSource code1("int main() { return 1; }"_l);
+  const HandledSource code2("int main() { return 2; }"_l);
+  const UnhandledSource orig_code("int main() {}"_l);
+  const CommandLine cl("-c"_l);
+  const Version version("3.5 (revision 100000)"_l);
+  const auto orig_hash = FileCache::Hash(orig_code, {}, cl, version);
+  const String manifest_path = cache.CommonPath(orig_hash) + ".manifest";
+
+  for (const auto& code : {code1, code2}) {
+    FileCache::Entry entry;
+    entry.object = code.str;
+    cache.Store(code, {}, cl, version, entry);
+  }
+
+  // Two branches with different headers.
+  ASSERT_TRUE(base::File::Write(header1_path, "#define A"_l));
+  cache.Store(orig_code, {}, cl, version, {header1_path}, path,
+              FileCache::Hash(code1, {}, cl, version));
+  ASSERT_TRUE(base::File::Write(header1_path, "#define B"_l));
+  ASSERT_TRUE(base::File::Write(header2_path, "#define C"_l));
+  cache.Store(orig_code, {}, cl, version, {header1_path, header2_path}, path,
+              FileCache::Hash(code2, {}, cl, version));
+
+  // Both variants are hit alternately.
+  for (int i = 0; i < 2; ++i) {
+    FileCache::Entry entry1, entry2;
+    ASSERT_TRUE(base::File::Write(header1_path, "#define A"_l));
+    ASSERT_TRUE(cache.Find(orig_code, {}, cl, version, path, &entry1));
+    EXPECT_EQ(code1.str, entry1.object);
+
+    proto::Manifest manifest;
+    ASSERT_TRUE(base::LoadFromFile(manifest_path, &manifest));
+    ASSERT_EQ(2, manifest.direct().variants_size());
+    EXPECT_EQ(1, manifest.direct().variants(0).headers_size());
+
+    ASSERT_TRUE(base::File::Write(header1_path, "#define B"_l));
+    ASSERT_TRUE(cache.Find(orig_code, {}, cl, version, path, &entry2));
+    EXPECT_EQ(code2.str, entry2.object);
+  }
+
+  // The variant isn't promoted, while the manifest is used by someone else.
+  {
+    const FileCache::ReadLock lock(&cache, manifest_path);
+    ASSERT_TRUE(lock);
+
+    FileCache::Entry entry;
+    ASSERT_TRUE(base::File::Write(header1_path, "#define A"_l));
+    ASSERT_TRUE(cache.Find(orig_code, {}, cl, version, path, &entry));
+    EXPECT_EQ(code1.str, entry.object);
+
+    proto::Manifest manifest;
+    ASSERT_TRUE(base::LoadFromFile(manifest_path, &manifest));
+    EXPECT_EQ(2, manifest.direct().variants(0).headers_size());
+  }
+
+  // The number of variants is bounded, and the same headers replace the
+  // variant.
+  for (int i = 0; i < 2 * FileCache::kMaxDirectVariants; ++i) {
+    ASSERT_TRUE(base::File::Write(header2_path, "#define " + std::to_string(i)));
+    cache.Store(orig_code, {}, cl, version, {header2_path}, path,
+                FileCache::Hash(code1, {}, cl, version));
+  }
+
+  proto::Manifest manifest;
+  ASSERT_TRUE(base::LoadFromFile(manifest_path, &manifest));
+  EXPECT_EQ(FileCache::kMaxDirectVariants, manifest.direct().variants_size());
+
+  FileCache::Entry entry;
+  ASSERT_TRUE(base::File::Write(header1_path, "#define A"_l));
+  EXPECT_TRUE(cache.Find(orig_code, {}, cl, version, path, &entry));
+}
+
 TEST(FileCacheTest, DirectEntry_ChangedOriginalCode) {
   const base::TemporaryDir tmp_dir;
   const String path = tmp_dir;
@@ -642,7 +1208,7 @@ TEST(FileCacheTest, RestoreAndMigrateSnappyEntry) {
   const auto expected_deps = "some deps"_l;
 
   {
-    FileCache cache(path, 1000, true, false);
+    FileCache cache(path, 1000, true, false, false, false);
     ASSERT_TRUE(cache.Run(1));
     FileCache::Entry entry1, entry2;
 
@@ -669,7 +1235,7 @@ TEST(FileCacheTest, RestoreAndMigrateSnappyEntry) {
     EXPECT_EQ(expected_stderr, entry2.stderr);
   }
   {
-    FileCache cache(path, 1000, true, false);
+    FileCache cache(path, 1000, true, false, false, false);
     ASSERT_TRUE(cache.Run(1));
     FileCache::Entry entry;
     const HandledSource code("int main() { return 0; }"_l);
@@ -682,12 +1248,184 @@ TEST(FileCacheTest, RestoreAndMigrateSnappyEntry) {
   }
 }
 
+TEST(FileCacheTest, LowerLayer) {
+  const base::TemporaryDir tmp_dir;
+  const String path = tmp_dir;
+  const String lower_path = path + "/lower";
+  const String local_path = path + "/local";
+  const HandledSource code1("int main() { return 1; }"_l);
+  const HandledSource code2("int main() { return 2; }"_l);
+  const CommandLine cl("-c"_l);
+  const Version version("3.5 (revision 100000)"_l);
+
+  {
+    FileCache lower(lower_path);
+    ASSERT_TRUE(lower.Run(1));
+    lower.Store(code1, {}, cl, version, {"object1"_l, "deps"_l, Immutable()});
+    lower.Store(code2, {}, cl, version, {"object2"_l, "deps"_l, Immutable()});
+  }
+
+  {
+    FileCache cache(local_path);
+    cache.AddLowerLayer(lower_path, false);
+    ASSERT_TRUE(cache.Run(1));
+
+    FileCache::Entry entry;
+    ASSERT_TRUE(cache.Find(code1, {}, cl, version, &entry));
+    EXPECT_EQ("object1"_l, entry.object);
+    EXPECT_FALSE(
+        cache.FindByHash(FileCache::Hash(code1, {}, cl, version), &entry));
+  }
+
+  FileCache cache(local_path);
+  cache.AddLowerLayer(lower_path, true);
+  ASSERT_TRUE(cache.Run(1));
+
+  FileCache::Entry entry1, entry2;
+  ASSERT_TRUE(cache.Find(code2, {}, cl, version, &entry1, true));
+  EXPECT_EQ("object2"_l, entry1.object);
+
+  // Wait for the promotion.
+  cache.promoter_.reset();
+  ASSERT_TRUE(
+      cache.FindByHash(FileCache::Hash(code2, {}, cl, version), &entry2));
+  EXPECT_EQ("object2"_l, entry2.object);
+}
+
+TEST(FileCacheTest, ExportImport) {
+  const base::TemporaryDir tmp_dir;
+  const String path = tmp_dir;
+  const String bundle_path = path + "/bundle";
+  const String header_path = path + "/test.h";
+  const HandledSource code1("int main() { return 1; }"_l);
+  const HandledSource code2("int main() { return 2; }"_l);
+  const UnhandledSource orig_code("int main() {}"_l);
+  const CommandLine cl("-c"_l);
+  const Version version("3.5 (revision 100000)"_l);
+
+  ASSERT_TRUE(base::File::Write(header_path, "#define A"_l));
+  {
+    FileCache cache(path + "/source");
+    ASSERT_TRUE(cache.Run(1));
+    cache.Store(code1, {}, cl, version, {"object1"_l, "deps"_l, Immutable()});
+    cache.Store(code2, {}, cl, version, {"object2"_l, "deps"_l, Immutable()});
+    cache.Store(orig_code, {}, cl, version, {header_path}, path,
+                FileCache::Hash(code1, {}, cl, version));
+  }
+
+  // The reopened cache exports the entries from the index.
+  ui64 count = 0;
+  {
+    FileCache cache(path + "/source");
+    ASSERT_TRUE(cache.Run(1));
+
+    FileCache::BundleFilter filter;
+    filter.hashes.insert(FileCache::Hash(code1, {}, cl, version).str);
+    filter.hashes.insert(FileCache::Hash(orig_code, {}, cl, version).str);
+
+    const int fd = open(bundle_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT_NE(-1, fd);
+    EXPECT_TRUE(cache.Export(filter, fd, &count));
+    close(fd);
+    EXPECT_EQ(2u, count);
+  }
+
+  FileCache cache(path + "/destination");
+  ASSERT_TRUE(cache.Run(1));
+
+  const int fd = open(bundle_path.c_str(), O_RDONLY);
+  ASSERT_NE(-1, fd);
+  EXPECT_TRUE(cache.Import(fd, &count));
+  close(fd);
+  EXPECT_EQ(2u, count);
+
+  FileCache::Entry entry1, entry2, entry3;
+  ASSERT_TRUE(cache.Find(orig_code, {}, cl, version, path, &entry1));
+  EXPECT_EQ("object1"_l, entry1.object);
+  EXPECT_EQ("deps"_l, entry1.deps);
+  EXPECT_TRUE(cache.Find(code1, {}, cl, version, &entry2));
+  EXPECT_FALSE(cache.Find(code2, {}, cl, version, &entry3));
+}
+
+TEST(FileCacheTest, SharedCache) {
+  const base::TemporaryDir tmp_dir;
+  const String path = tmp_dir;
+  const String cache_path = path + "/cache";
+  const String header_path = path + "/test.h";
+  const HandledSource code("int main() { return 0; }"_l);
+  const UnhandledSource orig_code("int main() {}"_l);
+  const CommandLine cl("-c"_l);
+  const Version version("3.5 (revision 100000)"_l);
+
+  FileCache cache1(cache_path, FileCache::UNLIMITED, false, true, false, true);
+  FileCache cache2(cache_path, FileCache::UNLIMITED, false, true, false, false);
+  cache1.SetShared(true);
+  cache2.SetShared(true);
+  ASSERT_TRUE(cache1.Run(3600));
+  ASSERT_TRUE(cache2.Run(3600));
+  cache1.WaitForReconcile();
+  cache2.WaitForReconcile();
+  EXPECT_FALSE(cache1.pack_);
+  EXPECT_FALSE(cache1.database_);
+
+  // The entries stored by one cache are found by another one - also the direct
+  // ones, without the direct index.
+  ASSERT_TRUE(base::File::Write(header_path, "#define A"_l));
+  FileCache::Entry entry1{"object code"_l, "deps"_l, Immutable()};
+  cache1.Store(code, {}, cl, version, entry1);
+  cache1.Store(orig_code, {}, cl, version, {header_path}, path,
+               FileCache::Hash(code, {}, cl, version));
+
+  FileCache::Entry entry2, entry3;
+  ASSERT_TRUE(cache2.Find(code, {}, cl, version, &entry2));
+  EXPECT_EQ(entry1.object, entry2.object);
+  ASSERT_TRUE(cache2.Find(orig_code, {}, cl, version, path, &entry3));
+  EXPECT_EQ(entry1.object, entry3.object);
+
+  // Only one cache enforces the size.
+  EXPECT_TRUE(cache1.ElectCleaner());
+  EXPECT_TRUE(cache1.ElectCleaner());
+  EXPECT_FALSE(cache2.ElectCleaner());
+}
+
+TEST(FileCacheTest, TrackAccessInMemory) {
+  const base::TemporaryDir tmp_dir;
+  const HandledSource code("int main() { return 0; }"_l);
+  const CommandLine cl("-c"_l);
+  const Version version("3.5 (revision 100000)"_l);
+  const auto hash = FileCache::Hash(code, {}, cl, version);
+
+  FileCache cache(tmp_dir, FileCache::UNLIMITED, false, true, false, false);
+  ASSERT_TRUE(cache.Run(3600));
+  cache.WaitForReconcile();
+
+  FileCache::Entry entry1{"int main() {}"_l, Immutable(), Immutable()};
+  cache.Store(code, {}, cl, version, entry1);
+  ASSERT_TRUE(!!cache.new_entries_->Pop());
+
+  const String manifest_path = cache.CommonPath(hash) + ".manifest";
+  const struct timespec times[2] = {{1000, 0}, {1000, 0}};
+  ASSERT_EQ(0, utimensat(AT_FDCWD, manifest_path.c_str(), times, 0));
+
+  // The hit is recorded only in memory - the manifest isn't touched.
+  FileCache::Entry entry2;
+  ASSERT_TRUE(cache.Find(code, {}, cl, version, &entry2));
+  auto access = cache.new_entries_->Pop();
+  ASSERT_TRUE(!!access);
+  EXPECT_EQ(hash.str.string_copy(), access->second.str.string_copy());
+  EXPECT_FALSE(!!cache.new_entries_->Pop());
+
+  struct stat buffer;
+  ASSERT_EQ(0, stat(manifest_path.c_str(), &buffer));
+  EXPECT_EQ(1000, buffer.st_mtime);
+}
+
 TEST(FileCacheTest, UseIndexFromDisk) {
   const base::TemporaryDir tmp_dir;
   string::Hash hash{"12345678901234567890123456789012-12345678-00000001"_l};
 
   {
-    FileCache cache(tmp_dir, FileCache::UNLIMITED, false, true);
+    FileCache cache(tmp_dir, FileCache::UNLIMITED, false, true, false, false);
     const String manifest_path = cache.CommonPath(hash) + ".manifest";
 
     ASSERT_TRUE(base::CreateDirectory(cache.SecondPath(hash)));
@@ -700,19 +1438,65 @@ TEST(FileCacheTest, UseIndexFromDisk) {
     ASSERT_TRUE(base::SaveToFile(manifest_path, manifest));
     manifest.Clear();
     EXPECT_TRUE(cache.Run(1));
+    cache.WaitForReconcile();
     ASSERT_TRUE(base::LoadFromFile(manifest_path, &manifest));
     EXPECT_EQ(FileCache::kManifestVersion, manifest.version());
   }
 
   {
-    FileCache cache(tmp_dir, FileCache::UNLIMITED, false, true);
+    FileCache cache(tmp_dir, FileCache::UNLIMITED, false, true, false, false);
     const String manifest_path = cache.CommonPath(hash) + ".manifest";
 
     ASSERT_TRUE(base::File::Write(manifest_path, "1"_l));
     EXPECT_TRUE(cache.Run(1));
+    cache.WaitForReconcile();
     EXPECT_TRUE(base::File::Exists(manifest_path));
   }
 }
 
+TEST(FileCacheTest, ReconcileIndexInBackground) {
+  const base::TemporaryDir tmp_dir;
+  string::Hash hash1{"12345678901234567890123456789012-12345678-00000001"_l};
+  string::Hash hash2{"12345678901234567890123456789012-12345678-00000002"_l};
+  const auto object_code = "some object code"_l;
+
+  {
+    FileCache cache(tmp_dir, FileCache::UNLIMITED, false, true, false, false);
+    ASSERT_TRUE(cache.Run(1));
+    cache.WaitForReconcile();
+
+    // The index knows about an entry that is already deleted from disk.
+    ASSERT_TRUE(cache.entries_->Set(
+        hash2.str, std::make_tuple(time(nullptr), object_code.size(),
+                                   FileCache::kManifestVersion)));
+  }
+
+  FileCache cache(tmp_dir, FileCache::UNLIMITED, false, true, false, false);
+
+  // The entry on disk is not in the index yet.
+  ASSERT_TRUE(base::CreateDirectory(cache.SecondPath(hash1)));
+  proto::Manifest manifest;
+  manifest.set_version(FileCache::kManifestVersion);
+  manifest.mutable_v1()->set_err(false);
+  manifest.mutable_v1()->set_obj(true);
+  manifest.mutable_v1()->set_dep(false);
+  manifest.mutable_v1()->set_size(object_code.size());
+  const String manifest_path = cache.CommonPath(hash1) + ".manifest";
+  ASSERT_TRUE(base::File::Write(cache.CommonPath(hash1) + ".o", object_code));
+  ASSERT_TRUE(base::SaveToFile(manifest_path, manifest, nullptr, true));
+
+  ASSERT_TRUE(cache.Run(1));
+  // The initial size is taken from the index.
+  EXPECT_EQ(object_code.size(), cache.cache_size_);
+
+  cache.WaitForReconcile();
+
+  SQLite::Value value;
+  EXPECT_TRUE(cache.entries_->Get(hash1.str, &value));
+  EXPECT_FALSE(cache.entries_->Get(hash2.str, &value));
+  EXPECT_EQ(object_code.size() + base::File::Size(manifest_path),
+            cache.cache_size_);
+}
+
 }  // namespace cache
 }  // namespace dist_clang
@@ -0,0 +1,476 @@
+#include <cache/hash_memo.h>
+
+#include <base/assert.h>
+#include <base/c_utils.h>
+#include <base/file/file.h>
+#include <base/hasher.h>
+#include <base/logging.h>
+#include <base/string_utils.h>
+
+#if defined(OS_LINUX)
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/inotify.h>
+#endif
+
+#include <base/using_log.h>
+
+namespace dist_clang {
+
+DEFINE_SINGLETON(cache::HashMemo)
+
+namespace cache {
+
+namespace {
+
+HashMemo::WallClock& GetClock() {
+  static HashMemo::WallClock clock;
+  return clock;
+}
+
+}  // namespace
+
+HashMemo::HashMemo() {}
+
+HashMemo::~HashMemo() {
+  Configure(max_size_, false);
+}
+
+void HashMemo::Configure(ui64 max_size, bool use_inotify) {
+  {
+    UniqueLock lock(entries_mutex_);
+    max_size_ = max_size;
+    while (size_ > max_size_ && !lru_.empty()) {
+      EraseLocked(entries_.find(lru_.back()));
+    }
+  }
+
+  if (use_inotify && max_size != DISABLED && inotify_fd_ == -1) {
+#if defined(OS_LINUX)
+    inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd_ == -1) {
+      String error;
+      base::GetLastError(&error);
+      LOG(CACHE_WARNING) << "Failed to initialize inotify: " << error;
+      return;
+    }
+
+    using namespace std::placeholders;
+    base::WorkerPool::NetWorker worker =
+        std::bind(&HashMemo::DoWatch, this, _1, _2);
+    watcher_.reset(new base::WorkerPool(true));
+    watcher_->AddWorker("Hash Memo Watcher"_l, worker);
+#else
+    LOG(CACHE_WARNING) << "The inotify mode is not supported on this platform";
+#endif
+  } else if ((!use_inotify || max_size == DISABLED) && inotify_fd_ != -1) {
+    watcher_.reset();
+    close(inotify_fd_);
+    inotify_fd_ = -1;
+
+    UniqueLock lock(entries_mutex_);
+    watches_.clear();
+    watched_dirs_.clear();
+    for (auto& entry : entries_) {
+      entry.second.watched = false;
+    }
+  }
+}
+
+bool HashMemo::Hash(const String& path, Immutable* output,
+                    const List<Literal>& skip_list, String* error) {
+  DCHECK(output);
+
+  if (max_size_ == DISABLED) {
+    return base::File::Hash(path, output, skip_list, error);
+  }
+
+  Entry entry;
+  if (!Lookup(path, skip_list, false, &entry) &&
+      !Update(path, skip_list, false, &entry, error)) {
+    return false;
+  }
+
+  for (const char* skip : skip_list) {
+    if (entry.skip_hits[skip]) {
+      if (error) {
+        error->assign("Skip-list hit: " + String(skip));
+      }
+      return false;
+    }
+  }
+
+  output->assign(entry.hash);
+  return true;
+}
+
+bool HashMemo::Read(const String& path, Immutable* output, String* error) {
+  DCHECK(output);
+
+  if (max_size_ == DISABLED) {
+    return base::File::Read(path, output, error);
+  }
+
+  Entry entry;
+  if (!Lookup(path, List<Literal>(), true, &entry) &&
+      !Update(path, List<Literal>(), true, &entry, error)) {
+    return false;
+  }
+
+  output->assign(entry.contents);
+  return true;
+}
+
+void HashMemo::Invalidate(const String& path) {
+  UniqueLock lock(entries_mutex_);
+  auto it = entries_.find(path);
+  if (it != entries_.end()) {
+    EraseLocked(it);
+  }
+}
+
+void HashMemo::Clear() {
+  UniqueLock lock(entries_mutex_);
+  entries_.clear();
+  lru_.clear();
+  size_ = 0;
+}
+
+// static
+HashMemo::Stat HashMemo::GetStat(const struct stat& buffer) {
+  Stat stat;
+  struct timespec mtime, ctime;
+
+#if defined(OS_MACOSX)
+  mtime = buffer.st_mtimespec;
+  ctime = buffer.st_ctimespec;
+#elif defined(OS_LINUX)
+  mtime = buffer.st_mtim;
+  ctime = buffer.st_ctim;
+#else
+#pragma message "Don't know how to get modification time on this platform!"
+  NOTREACHED();
+#endif
+
+  stat.device = buffer.st_dev;
+  stat.inode = buffer.st_ino;
+  stat.size = buffer.st_size;
+  stat.mtime = mtime.tv_sec * 1000000000ull + mtime.tv_nsec;
+  stat.ctime = ctime.tv_sec * 1000000000ull + ctime.tv_nsec;
+
+  return stat;
+}
+
+// static
+bool HashMemo::GetStat(const String& path, Stat* stat, String* error) {
+  DCHECK(stat);
+
+  struct stat buffer;
+  if (::stat(path.c_str(), &buffer) == -1) {
+    base::GetLastError(error);
+    return false;
+  }
+  *stat = GetStat(buffer);
+  return true;
+}
+
+// static
+bool HashMemo::IsRacy(const Stat& stat) {
+  const auto& clock = GetClock();
+  const ui64 now = clock ? clock() : time(nullptr) * 1000000000ull;
+  const ui64 window = 1000000000ull;
+  return stat.mtime + window > now || stat.ctime + window > now;
+}
+
+// static
+void HashMemo::SetClock(WallClock clock) {
+  GetClock() = clock;
+}
+
+// static
+ui64 HashMemo::EntrySize(const String& path, const Entry& entry) {
+  // The path is stored twice: as a key and inside the LRU list.
+  ui64 size = sizeof(Entry) + 2 * path.size() + entry.hash.size() +
+              entry.contents.size();
+  for (const auto& hit : entry.skip_hits) {
+    size += hit.first.size() + sizeof(hit);
+  }
+  return size;
+}
+
+bool HashMemo::Lookup(const String& path, const List<Literal>& skip_list,
+                      bool need_contents, Entry* entry) {
+  DCHECK(entry);
+
+  Stat stat;
+  bool has_stat = false;
+  if (inotify_fd_ == -1) {
+    // Don't hold the lock during the syscall.
+    if (!GetStat(path, &stat)) {
+      Invalidate(path);
+      return false;
+    }
+    has_stat = true;
+  }
+
+  UniqueLock lock(entries_mutex_);
+  auto it = entries_.find(path);
+  if (it == entries_.end()) {
+    return false;
+  }
+
+  if (!has_stat && !it->second.watched) {
+    lock.unlock();
+    if (!GetStat(path, &stat)) {
+      Invalidate(path);
+      return false;
+    }
+    lock.lock();
+
+    it = entries_.find(path);
+    if (it == entries_.end()) {
+      return false;
+    }
+    has_stat = true;
+  }
+
+  if (has_stat && it->second.stat != stat) {
+    LOG(CACHE_VERBOSE) << "Hash memo entry is stale: " << path;
+    EraseLocked(it);
+    return false;
+  }
+
+  if (need_contents && it->second.contents.size() != it->second.stat.size) {
+    return false;
+  }
+
+  for (const char* skip : skip_list) {
+    if (it->second.skip_hits.find(skip) == it->second.skip_hits.end()) {
+      return false;
+    }
+  }
+
+  lru_.splice(lru_.begin(), lru_, it->second.lru);
+  *entry = it->second;
+
+  return true;
+}
+
+bool HashMemo::Update(const String& path, const List<Literal>& skip_list,
+                      bool need_contents, Entry* entry, String* error) {
+  DCHECK(entry);
+
+  // The watch should be added before reading the file - otherwise we may miss
+  // the modification event.
+  const ui64 events = events_;
+  const bool watched = Watch(path);
+
+  base::File file(path);
+  if (!file.IsValid()) {
+    file.GetCreationError(error);
+    return false;
+  }
+
+  struct stat buffer;
+  if (fstat(file.native(), &buffer) == -1) {
+    base::GetLastError(error);
+    return false;
+  }
+
+  Immutable contents;
+  if (!file.Read(&contents, error)) {
+    return false;
+  }
+
+  Entry new_entry;
+  new_entry.stat = GetStat(buffer);
+  base::Hasher hasher(base::Hasher::XXH3_TREE, skip_list);
+  hasher.Update(contents);
+  new_entry.hash = base::Hexify(hasher.Digest());
+  for (const char* skip : skip_list) {
+    new_entry.skip_hits.emplace(skip, false);
+  }
+  for (const char* skip : hasher.skipped()) {
+    new_entry.skip_hits[skip] = true;
+  }
+
+  const bool keep_contents =
+      need_contents && contents.size() <= MAX_CONTENTS_SIZE;
+  if (keep_contents) {
+    new_entry.contents = contents;
+  }
+
+  *entry = new_entry;
+  if (need_contents && !keep_contents) {
+    entry->contents = contents;
+  }
+
+  if (IsRacy(new_entry.stat)) {
+    return true;
+  }
+
+  UniqueLock lock(entries_mutex_);
+
+  auto it = entries_.find(path);
+  if (it != entries_.end()) {
+    if (it->second.stat == new_entry.stat) {
+      new_entry.skip_hits.insert(it->second.skip_hits.begin(),
+                                 it->second.skip_hits.end());
+      if (!keep_contents) {
+        new_entry.contents = it->second.contents;
+      }
+    }
+    EraseLocked(it);
+  }
+
+  // If some inotify events came while we were reading the file, then it's not
+  // safe to trust the watch.
+  new_entry.watched = watched && events == events_;
+
+  const ui64 entry_size = EntrySize(path, new_entry);
+  if (entry_size > max_size_) {
+    return true;
+  }
+
+  lru_.push_front(path);
+  new_entry.lru = lru_.begin();
+  entries_.emplace(path, new_entry);
+  size_ += entry_size;
+
+  while (size_ > max_size_ && !lru_.empty()) {
+    EraseLocked(entries_.find(lru_.back()));
+  }
+
+  return true;
+}
+
+void HashMemo::EraseLocked(HashMap<String, Entry>::iterator it) {
+  DCHECK(it != entries_.end());
+
+  size_ -= EntrySize(it->first, it->second);
+  lru_.erase(it->second.lru);
+  entries_.erase(it);
+}
+
+void HashMemo::EraseDirectoryLocked(const String& dir) {
+  const String prefix = dir + "/";
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    if (it->first.compare(0, prefix.size(), prefix) == 0 &&
+        it->first.find('/', prefix.size()) == String::npos) {
+      auto next = std::next(it);
+      EraseLocked(it);
+      it = next;
+    } else {
+      ++it;
+    }
+  }
+}
+
+bool HashMemo::Watch(const String& path) {
+#if defined(OS_LINUX)
+  if (inotify_fd_ == -1) {
+    return false;
+  }
+
+  const auto slash = path.find_last_of('/');
+  if (slash == String::npos || slash == 0) {
+    return false;
+  }
+  const String dir = path.substr(0, slash);
+
+  // The changes of a symlink target are reported to the watch of its own
+  // directory - so don't trust the watch for it.
+  char resolved_path[PATH_MAX];
+  if (!realpath(path.c_str(), resolved_path) || path != resolved_path) {
+    return false;
+  }
+
+  UniqueLock lock(entries_mutex_);
+  if (watched_dirs_.find(dir) != watched_dirs_.end()) {
+    return true;
+  }
+
+  const auto mask = IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                    IN_DELETE_SELF | IN_MODIFY | IN_MOVE_SELF | IN_MOVED_FROM |
+                    IN_MOVED_TO | IN_ONLYDIR;
+  const int wd = inotify_add_watch(inotify_fd_, dir.c_str(), mask);
+  if (wd == -1) {
+    String error;
+    base::GetLastError(&error);
+    LOG(CACHE_VERBOSE) << "Failed to watch " << dir << ": " << error;
+    return false;
+  }
+
+  watches_[wd] = dir;
+  watched_dirs_[dir] = wd;
+  return true;
+#else
+  return false;
+#endif
+}
+
+void HashMemo::DoWatch(const base::WorkerPool& pool, base::Data& self) {
+#if defined(OS_LINUX)
+  alignas(struct inotify_event) char buffer[64 * 1024];
+  struct pollfd fds[] = {{inotify_fd_, POLLIN, 0}, {self.native(), POLLIN, 0}};
+
+  while (!pool.IsShuttingDown()) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    if (fds[1].revents) {
+      break;
+    }
+
+    ssize_t size = read(inotify_fd_, buffer, sizeof(buffer));
+    if (size <= 0) {
+      continue;
+    }
+
+    ++events_;
+
+    UniqueLock lock(entries_mutex_);
+    for (char* ptr = buffer; ptr < buffer + size;) {
+      const auto* event = reinterpret_cast<struct inotify_event*>(ptr);
+      ptr += sizeof(struct inotify_event) + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        LOG(CACHE_WARNING) << "Hash memo watcher queue is overflown";
+        entries_.clear();
+        lru_.clear();
+        size_ = 0;
+        continue;
+      }
+
+      auto watch = watches_.find(event->wd);
+      if (watch == watches_.end()) {
+        continue;
+      }
+
+      if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+        EraseDirectoryLocked(watch->second);
+        if (event->mask & IN_IGNORED) {
+          watched_dirs_.erase(watch->second);
+          watches_.erase(watch);
+        }
+        continue;
+      }
+
+      if (event->len) {
+        auto it = entries_.find(watch->second + "/" + event->name);
+        if (it != entries_.end()) {
+          EraseLocked(it);
+        }
+      }
+    }
+  }
+#endif
+}
+
+}  // namespace cache
+}  // namespace dist_clang
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <base/const_string.h>
+#include <base/singleton.h>
+#include <base/worker_pool.h>
+
+#include <third_party/gtest/exported/include/gtest/gtest_prod.h>
+
+#include <sys/stat.h>
+
+namespace dist_clang {
+namespace cache {
+
+FORWARD_TEST(HashMemoTest, EvictLeastRecentlyUsed);
+
+// Process-wide memo of file hashes and small file contents. Every entry is
+// keyed by the file path and is valid only while the file's stat data - device,
+// inode, size, mtime and ctime - stays the same. This way the direct cache
+// lookup costs a single |stat()| per unchanged header instead of reading and
+// hashing it.
+//
+// If the inotify mode is enabled, the directories with memoized files are
+// watched and the entries are invalidated on change events - and the lookups
+// don't call |stat()| at all. Only the parent directory of a file is watched:
+// the files behind symlinks are still stat'ed on every lookup, and the rename
+// of any other ancestor directory goes unnoticed - the inotify mode shouldn't
+// be used, if the include directories are moved around.
+class HashMemo {
+ public:
+  enum : ui64 {
+    DISABLED = 0,
+    DEFAULT_SIZE = 64 * 1024 * 1024,
+    // in bytes.
+
+    MAX_CONTENTS_SIZE = 1024 * 1024,
+    // in bytes - don't keep contents of bigger files.
+  };
+
+  struct Stat {
+    ui64 device = 0, inode = 0, size = 0;
+    ui64 mtime = 0, ctime = 0;  // in nanoseconds.
+
+    inline bool operator==(const Stat& other) const {
+      return device == other.device && inode == other.inode &&
+             size == other.size && mtime == other.mtime &&
+             ctime == other.ctime;
+    }
+    inline bool operator!=(const Stat& other) const {
+      return !this->operator==(other);
+    }
+  };
+
+  HashMemo();
+  ~HashMemo();
+
+  void Configure(ui64 max_size, bool use_inotify) THREAD_UNSAFE;
+
+  // Behaves like |base::File::Hash()|.
+  bool Hash(const String& path, Immutable* output,
+            const List<Literal>& skip_list = List<Literal>(),
+            String* error = nullptr) THREAD_SAFE;
+
+  // Behaves like |base::File::Read()|.
+  bool Read(const String& path, Immutable* output,
+            String* error = nullptr) THREAD_SAFE;
+
+  void Invalidate(const String& path) THREAD_SAFE;
+  void Clear() THREAD_SAFE;
+
+  inline ui64 Size() const THREAD_SAFE { return size_; }
+
+  static bool GetStat(const String& path, Stat* stat, String* error = nullptr);
+  static bool IsRacy(const Stat& stat);
+  // The file is modified too recently - the change may be missed by the stat
+  // data comparison, so it shouldn't be trusted.
+
+  using WallClock = Fn<ui64()>;
+  static void SetClock(WallClock clock) THREAD_UNSAFE;
+  // Replaces the current time in nanoseconds, that |IsRacy()| compares with -
+  // for tests. The empty |clock| restores the system one.
+
+ private:
+  FRIEND_TEST(HashMemoTest, EvictLeastRecentlyUsed);
+
+  struct Entry {
+    Stat stat;
+    Immutable hash{true};
+    Immutable contents{true};
+    HashMap<String, bool> skip_hits;
+    bool watched = false;
+    List<String>::iterator lru;
+  };
+
+  static Stat GetStat(const struct stat& buffer);
+
+  static ui64 EntrySize(const String& path, const Entry& entry);
+
+  // Returns |true| if the memoized entry is valid and has everything needed.
+  bool Lookup(const String& path, const List<Literal>& skip_list,
+              bool need_contents, Entry* entry);
+  bool Update(const String& path, const List<Literal>& skip_list,
+              bool need_contents, Entry* entry, String* error);
+
+  void EraseLocked(HashMap<String, Entry>::iterator it);
+  void EraseDirectoryLocked(const String& dir);
+
+  bool Watch(const String& path);
+  void DoWatch(const base::WorkerPool& pool, base::Data& self);
+
+  mutable std::mutex entries_mutex_;
+  HashMap<String, Entry> entries_;
+  List<String> lru_;
+  // Most recently used paths go first.
+
+  Atomic<ui64> size_ = {0};
+  ui64 max_size_ = DEFAULT_SIZE;
+
+  int inotify_fd_ = -1;
+  Atomic<ui64> events_ = {0};
+  // Incremented on every batch of inotify events.
+  HashMap<int, String> watches_;
+  HashMap<String, int> watched_dirs_;
+  UniquePtr<base::WorkerPool> watcher_;
+};
+
+}  // namespace cache
+
+DECLARE_SINGLETON(cache::HashMemo)
+
+}  // namespace dist_clang
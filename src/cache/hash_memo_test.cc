@@ -0,0 +1,147 @@
+#include <cache/hash_memo.h>
+
+#include <base/file/file.h>
+#include <base/file_utils.h>
+#include <base/temporary_dir.h>
+
+#include <third_party/gtest/exported/include/gtest/gtest.h>
+
+#include <unistd.h>
+
+namespace dist_clang {
+namespace cache {
+
+namespace {
+
+// Files modified within the last second are not memoized - so the clock is
+// moved past that window, instead of waiting.
+class SkipRacyWindow {
+ public:
+  SkipRacyWindow() {
+    HashMemo::SetClock([] { return (time(nullptr) + 2) * 1000000000ull; });
+  }
+  ~SkipRacyWindow() { Reset(); }
+
+  void Reset() { HashMemo::SetClock(HashMemo::WallClock()); }
+};
+
+}  // namespace
+
+TEST(HashMemoTest, HashUnchangedAndChangedFile) {
+  const base::TemporaryDir tmp_dir;
+  const String path = String(tmp_dir) + "/header.h";
+  HashMemo memo;
+
+  ASSERT_TRUE(base::File::Write(path, "int a;"_l));
+  SkipRacyWindow skip_racy_window;
+
+  Immutable expected_hash, hash1, hash2, hash3;
+  ASSERT_TRUE(base::File::Hash(path, &expected_hash));
+  ASSERT_TRUE(memo.Hash(path, &hash1));
+  EXPECT_EQ(expected_hash, hash1);
+  EXPECT_NE(0u, memo.Size());
+
+  ASSERT_TRUE(memo.Hash(path, &hash2));
+  EXPECT_EQ(expected_hash, hash2);
+
+  // The size changes, so the stat data mismatches even inside the racy window.
+  skip_racy_window.Reset();
+  ASSERT_TRUE(base::File::Write(path, "int abc;"_l));
+  ASSERT_TRUE(memo.Hash(path, &hash3));
+  EXPECT_NE(expected_hash, hash3);
+  EXPECT_EQ(0u, memo.Size());
+
+  ASSERT_TRUE(base::File::Delete(path));
+  Immutable hash4;
+  EXPECT_FALSE(memo.Hash(path, &hash4));
+}
+
+TEST(HashMemoTest, SkipListHit) {
+  const base::TemporaryDir tmp_dir;
+  const String path = String(tmp_dir) + "/header.h";
+  HashMemo memo;
+
+  ASSERT_TRUE(base::File::Write(path, "const char* a = __DATE__;"_l));
+  SkipRacyWindow skip_racy_window;
+
+  Immutable hash1, hash2, hash3;
+  String error;
+  ASSERT_TRUE(memo.Hash(path, &hash1));
+  EXPECT_FALSE(memo.Hash(path, &hash2, {"__DATE__"_l}, &error));
+  EXPECT_EQ("Skip-list hit: __DATE__", error);
+  EXPECT_TRUE(memo.Hash(path, &hash3, {"__TIME__"_l}));
+  EXPECT_EQ(hash1, hash3);
+}
+
+TEST(HashMemoTest, ReadContents) {
+  const base::TemporaryDir tmp_dir;
+  const String path = String(tmp_dir) + "/blacklist.txt";
+  const String expected_contents = "fun:foo";
+  HashMemo memo;
+
+  ASSERT_TRUE(
+      base::File::Write(path, Immutable::WrapString(expected_contents)));
+  SkipRacyWindow skip_racy_window;
+
+  Immutable hash, contents1, contents2;
+  ASSERT_TRUE(memo.Hash(path, &hash));
+  ASSERT_TRUE(memo.Read(path, &contents1));
+  EXPECT_EQ(expected_contents, contents1.string_copy());
+  ASSERT_TRUE(memo.Read(path, &contents2));
+  EXPECT_EQ(expected_contents, contents2.string_copy());
+}
+
+TEST(HashMemoTest, EvictLeastRecentlyUsed) {
+  const base::TemporaryDir tmp_dir;
+  const String path1 = String(tmp_dir) + "/header1.h";
+  const String path2 = String(tmp_dir) + "/header2.h";
+  HashMemo memo;
+
+  ASSERT_TRUE(base::File::Write(path1, "int a;"_l));
+  ASSERT_TRUE(base::File::Write(path2, "int b;"_l));
+  SkipRacyWindow skip_racy_window;
+
+  Immutable hash1, hash2;
+  ASSERT_TRUE(memo.Hash(path1, &hash1));
+  const ui64 entry_size = memo.Size();
+  memo.Configure(entry_size + entry_size / 2, false);
+
+  ASSERT_TRUE(memo.Hash(path2, &hash2));
+  EXPECT_EQ(1u, memo.entries_.size());
+  EXPECT_EQ(path2, memo.lru_.front());
+  EXPECT_EQ(entry_size, memo.Size());
+
+  memo.Configure(HashMemo::DISABLED, false);
+  EXPECT_EQ(0u, memo.Size());
+  EXPECT_TRUE(memo.entries_.empty());
+}
+
+#if defined(OS_LINUX)
+TEST(HashMemoTest, WatchSymlinkedFile) {
+  const base::TemporaryDir tmp_dir;
+  const String target_dir = String(tmp_dir) + "/target";
+  const String link_dir = String(tmp_dir) + "/link";
+  const String target_path = target_dir + "/header.h";
+  const String link_path = link_dir + "/header.h";
+  HashMemo memo;
+  memo.Configure(HashMemo::DEFAULT_SIZE, true);
+
+  ASSERT_TRUE(base::CreateDirectory(target_dir));
+  ASSERT_TRUE(base::CreateDirectory(link_dir));
+  ASSERT_TRUE(base::File::Write(target_path, "int a;"_l));
+  ASSERT_EQ(0, symlink(target_path.c_str(), link_path.c_str()));
+  SkipRacyWindow skip_racy_window;
+
+  Immutable hash1, hash2;
+  ASSERT_TRUE(memo.Hash(link_path, &hash1));
+  EXPECT_NE(0u, memo.Size());
+
+  // The watch of the link directory doesn't see the change of the target.
+  ASSERT_TRUE(base::File::Write(target_path, "int bc;"_l));
+  ASSERT_TRUE(memo.Hash(link_path, &hash2));
+  EXPECT_NE(hash1, hash2);
+}
+#endif
+
+}  // namespace cache
+}  // namespace dist_clang
@@ -0,0 +1,100 @@
+#include <cache/hot_tier.h>
+
+#include <perf/stat_service.h>
+
+namespace dist_clang {
+namespace cache {
+
+namespace {
+
+// Assume the typical entry size to remember enough missed keys to fill the
+// whole budget.
+const ui64 kTypicalEntrySize = 64 * 1024;
+const ui64 kMinDoorkeeperSize = 1024;
+
+}  // namespace
+
+HotTier::HotTier(ui64 max_size)
+    : max_size_(max_size),
+      max_doorkeeper_size_(
+          std::max(kMinDoorkeeperSize, max_size / kTypicalEntrySize)) {}
+
+bool HotTier::Get(const String& key, Entry* entry) {
+  UniqueLock lock(mutex_);
+  auto it = residents_.find(key);
+  if (it == residents_.end()) {
+    STAT(HOT_CACHE_MISS);
+    return false;
+  }
+
+  lru_.splice(lru_.begin(), lru_, it->second.position);
+  *entry = it->second.entry;
+  STAT(HOT_CACHE_HIT);
+  return true;
+}
+
+bool HotTier::Admit(const String& key) {
+  UniqueLock lock(mutex_);
+  auto it = doorkeeper_.find(key);
+  if (it != doorkeeper_.end()) {
+    doorkeeper_order_.erase(it->second);
+    doorkeeper_.erase(it);
+    return true;
+  }
+
+  doorkeeper_order_.push_front(key);
+  doorkeeper_.emplace(key, doorkeeper_order_.begin());
+  if (doorkeeper_order_.size() > max_doorkeeper_size_) {
+    doorkeeper_.erase(doorkeeper_order_.back());
+    doorkeeper_order_.pop_back();
+  }
+  return false;
+}
+
+void HotTier::Put(const String& key, const Entry& entry) {
+  if (entry.Size() > max_size_) {
+    return;
+  }
+
+  UniqueLock lock(mutex_);
+  RemoveLocked(key);
+
+  lru_.push_front(key);
+  residents_.emplace(key, Resident{entry, lru_.begin()});
+  size_ += entry.Size();
+
+  while (size_ > max_size_) {
+    const String victim = lru_.back();
+    RemoveLocked(victim);
+  }
+}
+
+void HotTier::Remove(const String& key) {
+  UniqueLock lock(mutex_);
+  RemoveLocked(key);
+
+  auto it = doorkeeper_.find(key);
+  if (it != doorkeeper_.end()) {
+    doorkeeper_order_.erase(it->second);
+    doorkeeper_.erase(it);
+  }
+}
+
+ui64 HotTier::Size() const {
+  UniqueLock lock(mutex_);
+  return size_;
+}
+
+void HotTier::RemoveLocked(const String& key) {
+  auto it = residents_.find(key);
+  if (it == residents_.end()) {
+    return;
+  }
+
+  size_ -= it->second.entry.Size();
+  lru_.erase(it->second.position);
+  residents_.erase(it);
+}
+
+}  // namespace cache
+}  // namespace dist_clang
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <base/attributes.h>
+#include <base/const_string.h>
+
+#include <third_party/gtest/exported/include/gtest/gtest_prod.h>
+
+namespace dist_clang {
+namespace cache {
+
+FORWARD_TEST(HotTierTest, ScanResistance);
+
+// In-memory tier of the most recently used cache entries in the decompressed
+// form - to not read, decompress and verify the popular entries on every hit.
+//
+// The admission is scan-resistant: an entry is admitted only on the second
+// miss, while its key is still remembered by the bounded "doorkeeper" list of
+// the recently missed keys. So the stream of unique lookups doesn't evict the
+// hot entries. The resident entries are evicted in LRU order when the total
+// size exceeds the budget.
+class HotTier {
+ public:
+  struct Entry {
+    Immutable object;
+    Immutable deps;
+    Immutable stderr;
+
+    inline ui64 Size() const {
+      return object.size() + deps.size() + stderr.size();
+    }
+  };
+
+  explicit HotTier(ui64 max_size);
+  // |max_size| is in bytes.
+
+  bool Get(const String& key, Entry* entry) THREAD_SAFE;
+
+  bool Admit(const String& key) THREAD_SAFE;
+  // Should be called after |Get()| misses. Returns |true| if the entry should
+  // be put after the lookup on disk.
+
+  void Put(const String& key, const Entry& entry) THREAD_SAFE;
+  void Remove(const String& key) THREAD_SAFE;
+
+  ui64 Size() const THREAD_SAFE;
+
+ private:
+  FRIEND_TEST(HotTierTest, ScanResistance);
+
+  using KeyList = List<String>;
+
+  struct Resident {
+    Entry entry;
+    KeyList::iterator position;
+  };
+
+  void RemoveLocked(const String& key);
+
+  const ui64 max_size_;
+  const ui64 max_doorkeeper_size_;
+  // in keys.
+
+  mutable std::mutex mutex_;
+  HashMap<String, Resident> residents_;
+  KeyList lru_;  // the most recent entries are in front.
+  ui64 size_ = 0;
+
+  HashMap<String, KeyList::iterator> doorkeeper_;
+  KeyList doorkeeper_order_;  // the most recent keys are in front.
+};
+
+}  // namespace cache
+}  // namespace dist_clang
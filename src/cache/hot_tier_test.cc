@@ -0,0 +1,62 @@
+#include <cache/hot_tier.h>
+
+#include <third_party/gtest/exported/include/gtest/gtest.h>
+
+namespace dist_clang {
+namespace cache {
+
+TEST(HotTierTest, EvictLeastRecentlyUsed) {
+  HotTier tier(10);
+  HotTier::Entry entry1{"1234"_l, Immutable(), Immutable()};
+  HotTier::Entry entry2{"12"_l, "34"_l, Immutable()};
+  HotTier::Entry entry3{"12345"_l, Immutable(), Immutable()};
+  HotTier::Entry entry, entry4, entry5, entry6, entry7, entry8;
+
+  tier.Put("key1", entry1);
+  tier.Put("key2", entry2);
+  EXPECT_EQ(8u, tier.Size());
+
+  // Make the "key2" the least recently used.
+  ASSERT_TRUE(tier.Get("key1", &entry));
+  EXPECT_EQ("1234"_l, entry.object);
+
+  tier.Put("key3", entry3);
+  EXPECT_EQ(9u, tier.Size());
+  EXPECT_FALSE(tier.Get("key2", &entry4));
+  EXPECT_TRUE(tier.Get("key1", &entry5));
+  EXPECT_TRUE(tier.Get("key3", &entry6));
+
+  // Too big to fit at all.
+  tier.Put("key4", {"12345678901"_l, Immutable(), Immutable()});
+  EXPECT_FALSE(tier.Get("key4", &entry7));
+  EXPECT_EQ(9u, tier.Size());
+
+  tier.Remove("key1");
+  EXPECT_FALSE(tier.Get("key1", &entry8));
+  EXPECT_EQ(5u, tier.Size());
+}
+
+TEST(HotTierTest, ScanResistance) {
+  HotTier tier(1024);
+
+  EXPECT_FALSE(tier.Admit("hot"));
+  EXPECT_TRUE(tier.Admit("hot"));
+
+  // The scan of unique keys doesn't get admitted.
+  for (ui32 i = 0; i < tier.max_doorkeeper_size_; ++i) {
+    EXPECT_FALSE(tier.Admit("key" + std::to_string(i)));
+  }
+
+  // The doorkeeper forgets the oldest keys.
+  EXPECT_FALSE(tier.Admit("warm"));
+  EXPECT_FALSE(tier.Admit("key0"));
+  EXPECT_TRUE(tier.Admit("warm"));
+
+  // The removal forgets the key too.
+  EXPECT_FALSE(tier.Admit("cold"));
+  tier.Remove("cold");
+  EXPECT_FALSE(tier.Admit("cold"));
+}
+
+}  // namespace cache
+}  // namespace dist_clang
@@ -0,0 +1,702 @@
+#include <cache/pack_store.h>
+
+#include <base/assert.h>
+#include <base/c_utils.h>
+#include <base/file/file.h>
+#include <base/file_utils.h>
+#include <base/logging.h>
+
+#include STL(algorithm)
+#include STL(regex)
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <base/using_log.h>
+
+namespace dist_clang {
+
+namespace {
+
+enum : ui32 {
+  kValueMagic = 0x4b434150,      // "PACK"
+  kTombstoneMagic = 0x44414544,  // "DEAD"
+};
+
+struct Header {
+  ui32 magic;
+  ui32 key_size;
+  ui64 value_size;
+};
+
+static_assert(sizeof(Header) == 16, "Header should be tightly packed");
+
+bool WriteAll(int fd, const char* data, size_t size, String* error) {
+  while (size) {
+    const ssize_t written = write(fd, data, size);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      base::GetLastError(error);
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+// Makes the created and renamed files in |path| survive a crash.
+bool SyncDirectory(const String& path, String* error) {
+  const int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    base::GetLastError(error);
+    return false;
+  }
+  const bool synced = fsync(fd) != -1;
+  if (!synced) {
+    base::GetLastError(error);
+  }
+  close(fd);
+  return synced;
+}
+
+}  // namespace
+
+namespace cache {
+
+PackStore::Segment::~Segment() {
+  if (fd != -1) {
+    close(fd);
+  }
+}
+
+PackStore::PackStore(const String& path, ui64 segment_size)
+    : path_(path), segment_size_(segment_size) {}
+
+PackStore::~PackStore() {
+  UniqueLock lock(mutex_);
+  index_.clear();
+  segments_.clear();
+  active_.reset();
+}
+
+bool PackStore::Open(String* error) {
+  if (!base::CreateDirectory(path_, error)) {
+    return false;
+  }
+
+  Vector<ui32> ids;
+  if (DIR* dir = opendir(path_.c_str())) {
+    std::regex regex("^([0-9]+)\\.pack$");
+    std::cmatch match;
+    while (struct dirent* entry = readdir(dir)) {
+      if (std::regex_search(entry->d_name, match, regex)) {
+        ids.push_back(std::stoul(match[1]));
+      }
+    }
+    closedir(dir);
+  } else {
+    base::GetLastError(error);
+    return false;
+  }
+  std::sort(ids.begin(), ids.end());
+
+  UniqueLock lock(mutex_);
+
+  for (ui32 id : ids) {
+    SegmentPtr segment(new Segment);
+    segment->id = id;
+    segment->fd = open(SegmentPath(id).c_str(), O_RDWR | O_CLOEXEC);
+    if (segment->fd == -1) {
+      base::GetLastError(error);
+      return false;
+    }
+
+    segment->size = lseek(segment->fd, 0, SEEK_END);
+    segments_.emplace(id, segment);
+
+    if (base::File::Exists(IndexPath(id))) {
+      String load_error;
+      if (LoadIndex(segment, &load_error)) {
+        segment->sealed = true;
+        continue;
+      }
+      LOG(CACHE_WARNING) << "Failed to load index of " << SegmentPath(id)
+                         << ": " << load_error;
+      // Nothing is replayed from the broken index - so the scan doesn't count
+      // any record twice.
+    }
+
+    if (!ScanSegment(segment, error)) {
+      return false;
+    }
+  }
+
+  // Only the last segment may stay active - others are sealed right away.
+  for (auto& segment : segments_) {
+    const auto& last = segments_.rbegin()->second;
+    if (!segment.second->sealed && segment.second != last) {
+      active_ = segment.second;
+      if (!SealLocked(error)) {
+        return false;
+      }
+    }
+  }
+
+  if (!segments_.empty() && !segments_.rbegin()->second->sealed) {
+    active_ = segments_.rbegin()->second;
+  } else if (!CreateSegmentLocked(error)) {
+    return false;
+  }
+
+  Vector<ui32> dead_segments;
+  for (const auto& segment : segments_) {
+    if (segment.second->sealed && !segment.second->live_values) {
+      dead_segments.push_back(segment.first);
+    }
+  }
+  for (ui32 id : dead_segments) {
+    DropSegmentLocked(id);
+  }
+
+  LOG(CACHE_INFO) << "Pack store " << path_ << " has " << index_.size()
+                  << " values in " << segments_.size() << " segments";
+
+  return true;
+}
+
+bool PackStore::Put(const String& key, Immutable value, String* error) {
+  UniqueLock lock(mutex_);
+
+  Location location;
+  if (!AppendLocked(key, value.data(), value.size(), false, &location,
+                    error)) {
+    return false;
+  }
+
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    KillLocked(key, it->second);
+    it->second = location;
+  } else {
+    index_.emplace(key, location);
+  }
+  ++segments_[location.segment]->live_values;
+
+  return true;
+}
+
+bool PackStore::Get(const String& key, Immutable* value, String* error) const {
+  DCHECK(value);
+
+  Location location;
+  SegmentPtr segment;
+  {
+    UniqueLock lock(mutex_);
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+      if (error) {
+        error->assign("No such key: " + key);
+      }
+      return false;
+    }
+    location = it->second;
+    segment = segments_.at(location.segment);
+  }
+
+  // The segment may be dropped concurrently - but we still hold the descriptor.
+  UniquePtr<char[]> buffer(new char[location.size + 1]);
+  ui64 read_size = 0;
+  while (read_size < location.size) {
+    auto size = pread(segment->fd, buffer.get() + read_size,
+                      location.size - read_size, location.offset + read_size);
+    if (size <= 0) {
+      if (size == -1 && errno == EINTR) {
+        continue;
+      }
+      if (size == -1) {
+        base::GetLastError(error);
+      } else if (error) {
+        error->assign("Unexpected end of segment " +
+                      SegmentPath(location.segment));
+      }
+      return false;
+    }
+    read_size += size;
+  }
+  buffer[location.size] = '\0';
+
+  value->assign(Immutable(buffer, location.size));
+  return true;
+}
+
+bool PackStore::Remove(const String& key) {
+  UniqueLock lock(mutex_);
+
+  auto it = index_.find(key);
+  if (it == index_.end()) {
+    return false;
+  }
+
+  const Location location = it->second;
+  String error;
+  if (!AppendLocked(key, nullptr, 0, true, nullptr, &error)) {
+    // Not a big deal: the value will be resurrected after restart - and the
+    // caller should be ready to see the value without an entry.
+    LOG(CACHE_WARNING) << "Failed to write tombstone for " << key << ": "
+                       << error;
+  }
+
+  index_.erase(it);
+  KillLocked(key, location);
+
+  return true;
+}
+
+ui64 PackStore::Compact(float min_dead_ratio) {
+  List<Pair<String, Location>> values;
+  HashMap<ui32, SegmentPtr> candidates;
+  ui64 reclaimed = 0;
+
+  {
+    UniqueLock lock(mutex_);
+    for (const auto& segment : segments_) {
+      const auto& ptr = segment.second;
+      if (ptr->sealed && ptr->dead_size &&
+          ptr->dead_size >= min_dead_ratio * ptr->size) {
+        candidates.emplace(segment.first, ptr);
+      }
+    }
+    for (const auto& value : index_) {
+      if (candidates.count(value.second.segment)) {
+        values.emplace_back(value.first, value.second);
+      }
+    }
+  }
+
+  for (const auto& value : values) {
+    const auto& segment = candidates[value.second.segment];
+
+    // Read outside the lock - only the active segment is ever written to.
+    String error;
+    UniquePtr<char[]> buffer(new char[value.second.size + 1]);
+    if (pread(segment->fd, buffer.get(), value.second.size,
+              value.second.offset) != static_cast<ssize_t>(value.second.size)) {
+      base::GetLastError(&error);
+      LOG(CACHE_WARNING) << "Failed to read " << value.first << " from "
+                         << SegmentPath(segment->id) << ": " << error;
+      continue;
+    }
+
+    UniqueLock lock(mutex_);
+    auto it = index_.find(value.first);
+    if (it == index_.end() || !(it->second == value.second)) {
+      continue;  // The value is removed or overwritten concurrently.
+    }
+
+    Location location;
+    if (!AppendLocked(value.first, buffer.get(), value.second.size, false,
+                      &location, &error)) {
+      LOG(CACHE_WARNING) << "Failed to move " << value.first << ": " << error;
+      break;
+    }
+    ++segments_[location.segment]->live_values;
+    it->second = location;
+
+    KillLocked(value.first, value.second);
+    if (!segments_.count(segment->id)) {
+      reclaimed += segment->size;
+    }
+  }
+
+  if (reclaimed) {
+    LOG(CACHE_VERBOSE) << "Pack store " << path_ << " compaction reclaimed "
+                       << reclaimed << " bytes";
+  }
+
+  return reclaimed;
+}
+
+ui64 PackStore::Size() const {
+  UniqueLock lock(mutex_);
+  ui64 size = 0;
+  for (const auto& segment : segments_) {
+    size += segment.second->size;
+  }
+  return size;
+}
+
+ui64 PackStore::DeadSize() const {
+  UniqueLock lock(mutex_);
+  ui64 size = 0;
+  for (const auto& segment : segments_) {
+    size += segment.second->dead_size;
+  }
+  return size;
+}
+
+String PackStore::SegmentPath(ui32 id) const {
+  return path_ + "/" + std::to_string(id) + ".pack";
+}
+
+String PackStore::IndexPath(ui32 id) const {
+  return path_ + "/" + std::to_string(id) + ".index";
+}
+
+bool PackStore::LoadIndex(const SegmentPtr& segment, String* error) {
+  Immutable contents;
+  if (!base::File::Read(IndexPath(segment->id), &contents, error)) {
+    return false;
+  }
+
+  // The records are replayed only after the whole index is parsed.
+  Vector<Record> records;
+  const char* data = contents.data();
+  const char* end = data + contents.size();
+  while (data < end) {
+    Header header;
+    ui64 offset;
+    if (end - data < static_cast<ssize_t>(sizeof(header) + sizeof(offset))) {
+      if (error) {
+        error->assign("Truncated index record");
+      }
+      return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    memcpy(&offset, data + sizeof(header), sizeof(offset));
+    data += sizeof(header) + sizeof(offset);
+
+    if ((header.magic != kValueMagic && header.magic != kTombstoneMagic) ||
+        static_cast<ui64>(end - data) < header.key_size ||
+        offset + header.value_size > segment->size) {
+      if (error) {
+        error->assign("Malformed index record");
+      }
+      return false;
+    }
+
+    Record record;
+    record.key.assign(data, header.key_size);
+    record.offset = offset;
+    record.size = header.value_size;
+    record.tombstone = header.magic == kTombstoneMagic;
+    data += header.key_size;
+
+    records.push_back(std::move(record));
+  }
+
+  for (const auto& record : records) {
+    Replay(segment, record);
+  }
+
+  return true;
+}
+
+bool PackStore::ScanSegment(const SegmentPtr& segment, String* error) {
+  ui64 offset = 0;
+  while (offset < segment->size) {
+    Header header;
+    if (segment->size - offset < sizeof(header) ||
+        pread(segment->fd, &header, sizeof(header), offset) != sizeof(header) ||
+        (header.magic != kValueMagic && header.magic != kTombstoneMagic) ||
+        offset + sizeof(header) + header.key_size + header.value_size >
+            segment->size) {
+      break;
+    }
+
+    Record record;
+    record.key.resize(header.key_size);
+    if (pread(segment->fd, &record.key[0], header.key_size,
+              offset + sizeof(header)) !=
+        static_cast<ssize_t>(header.key_size)) {
+      break;
+    }
+    record.offset = offset + sizeof(header) + header.key_size;
+    record.size = header.value_size;
+    record.tombstone = header.magic == kTombstoneMagic;
+
+    offset = record.offset + record.size;
+    Replay(segment, record);
+    segment->records.push_back(std::move(record));
+  }
+
+  if (offset < segment->size) {
+    // Most probably, the daemon was killed in the middle of append.
+    LOG(CACHE_WARNING) << "Truncating the torn tail of "
+                       << SegmentPath(segment->id) << " at " << offset;
+    if (ftruncate(segment->fd, offset) == -1) {
+      base::GetLastError(error);
+      return false;
+    }
+    segment->size = offset;
+  }
+
+  return true;
+}
+
+void PackStore::Replay(const SegmentPtr& segment, const Record& record) {
+  auto it = index_.find(record.key);
+
+  if (record.tombstone) {
+    if (it != index_.end()) {
+      KillLocked(record.key, it->second);
+      index_.erase(it);
+    }
+    segment->dead_size += sizeof(Header) + record.key.size();
+    segment->tombstones.push_back(record.key);
+    return;
+  }
+
+  Location location;
+  location.segment = segment->id;
+  location.offset = record.offset;
+  location.size = record.size;
+
+  if (it != index_.end()) {
+    if (it->second == location) {
+      return;
+    }
+    KillLocked(record.key, it->second);
+    it->second = location;
+  } else {
+    index_.emplace(record.key, location);
+  }
+  ++segment->live_values;
+}
+
+bool PackStore::AppendLocked(const String& key, const char* value, ui64 size,
+                             bool tombstone, Location* location,
+                             String* error) {
+  DCHECK(active_);
+
+  const ui64 record_size = sizeof(Header) + key.size() + size;
+  if (active_->size && active_->size + record_size > segment_size_) {
+    if (!SealLocked(error) || !CreateSegmentLocked(error)) {
+      return false;
+    }
+  }
+
+  Header header;
+  header.magic = tombstone ? kTombstoneMagic : kValueMagic;
+  header.key_size = key.size();
+  header.value_size = size;
+
+  struct iovec iov[] = {
+      {&header, sizeof(header)},
+      {const_cast<char*>(key.data()), key.size()},
+      {const_cast<char*>(value), size},
+  };
+  auto written = pwritev(active_->fd, iov, size ? 3 : 2, active_->size);
+  if (written != static_cast<ssize_t>(record_size)) {
+    if (written == -1) {
+      base::GetLastError(error);
+    } else if (error) {
+      error->assign("Partial write to " + SegmentPath(active_->id));
+    }
+    // Don't leave the partial record - otherwise the next ones will be lost on
+    // the next scan.
+    DCHECK_O_EVAL(ftruncate(active_->fd, active_->size) == 0);
+    return false;
+  }
+
+  Record record;
+  record.key = key;
+  record.offset = active_->size + sizeof(Header) + key.size();
+  record.size = size;
+  record.tombstone = tombstone;
+
+  active_->size += record_size;
+  if (tombstone) {
+    active_->dead_size += record_size;
+    active_->tombstones.push_back(key);
+  }
+
+  if (location) {
+    location->segment = active_->id;
+    location->offset = record.offset;
+    location->size = size;
+  }
+
+  active_->records.push_back(std::move(record));
+  return true;
+}
+
+bool PackStore::SealLocked(String* error) {
+  DCHECK(active_);
+
+  // The index shouldn't outlive the records, that it describes.
+  if (fdatasync(active_->fd) == -1) {
+    base::GetLastError(error);
+    return false;
+  }
+
+  String index;
+  for (const auto& record : active_->records) {
+    Header header;
+    header.magic = record.tombstone ? kTombstoneMagic : kValueMagic;
+    header.key_size = record.key.size();
+    header.value_size = record.size;
+    index.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    index.append(reinterpret_cast<const char*>(&record.offset),
+                 sizeof(record.offset));
+    index.append(record.key);
+  }
+
+  const String index_path = IndexPath(active_->id);
+  const String tmp_path = index_path + ".tmp";
+  const int fd =
+      open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    base::GetLastError(error);
+    return false;
+  }
+  bool written = WriteAll(fd, index.data(), index.size(), error);
+  if (written && fdatasync(fd) == -1) {
+    base::GetLastError(error);
+    written = false;
+  }
+  close(fd);
+  if (!written || !base::File::Move(tmp_path, index_path, error)) {
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  if (!SyncDirectory(path_, error)) {
+    return false;
+  }
+
+  active_->sealed = true;
+  active_->records.clear();
+  active_->records.shrink_to_fit();
+
+  return true;
+}
+
+bool PackStore::CreateSegmentLocked(String* error) {
+  SegmentPtr segment(new Segment);
+  segment->id = segments_.empty() ? 1 : segments_.rbegin()->first + 1;
+  segment->fd = open(SegmentPath(segment->id).c_str(),
+                     O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (segment->fd == -1) {
+    base::GetLastError(error);
+    return false;
+  }
+  if (!SyncDirectory(path_, error)) {
+    return false;
+  }
+
+  segments_.emplace(segment->id, segment);
+  active_ = segment;
+  return true;
+}
+
+void PackStore::KillLocked(const String& key, const Location& location) {
+  auto it = segments_.find(location.segment);
+  DCHECK(it != segments_.end());
+
+  auto& segment = it->second;
+  DCHECK(segment->live_values > 0);
+  segment->dead_size += sizeof(Header) + key.size() + location.size;
+  --segment->live_values;
+
+  // Don't drop anything while opening the store - wait for all records.
+  if (segment->sealed && !segment->live_values && active_) {
+    DropSegmentLocked(segment->id);
+  }
+}
+
+void PackStore::DropSegmentLocked(ui32 id) {
+  auto it = segments_.find(id);
+  DCHECK(it != segments_.end());
+
+  const SegmentPtr segment = it->second;
+  DCHECK(segment != active_);
+  segments_.erase(it);
+
+  // The tombstones still matter, if the older segments may contain the dead
+  // values - move them to the active segment.
+  if (!segments_.empty() && segments_.begin()->first < id) {
+    for (const auto& key : segment->tombstones) {
+      String error;
+      if (!index_.count(key) &&
+          !AppendLocked(key, nullptr, 0, true, nullptr, &error)) {
+        LOG(CACHE_WARNING) << "Failed to move tombstone for " << key << ": "
+                           << error;
+      }
+    }
+  }
+
+  // The moved values and the tombstones should reach the disk before their
+  // source is gone - otherwise keep the files until the next |Open()|.
+  if (active_ && fdatasync(active_->fd) == -1) {
+    String error;
+    base::GetLastError(&error);
+    LOG(CACHE_WARNING) << "Failed to sync " << SegmentPath(active_->id)
+                       << " - keeping " << SegmentPath(id) << ": " << error;
+    return;
+  }
+
+  String error;
+  if (!base::File::Delete(IndexPath(id), &error) &&
+      base::File::Exists(IndexPath(id))) {
+    LOG(CACHE_WARNING) << "Failed to delete " << IndexPath(id) << ": "
+                       << error;
+  }
+  if (!base::File::Delete(SegmentPath(id), &error)) {
+    LOG(CACHE_WARNING) << "Failed to delete " << SegmentPath(id) << ": "
+                       << error;
+  }
+
+  LOG(CACHE_VERBOSE) << "Dropped segment " << SegmentPath(id);
+}
+
+Immutable PackBlobs(const List<Immutable>& blobs) {
+  String sizes;
+  for (const auto& blob : blobs) {
+    const ui64 size = blob.size();
+    sizes.append(reinterpret_cast<const char*>(&size), sizeof(size));
+  }
+
+  Immutable::Rope rope = {Immutable(std::move(sizes))};
+  rope.insert(rope.end(), blobs.begin(), blobs.end());
+  return Immutable(std::move(rope));
+}
+
+bool UnpackBlobs(const Immutable& value, const List<Immutable*>& blobs) {
+  if (value.size() < blobs.size() * sizeof(ui64)) {
+    return false;
+  }
+
+  // The blobs are the slices of the single value - nothing is copied.
+  Immutable contents = value;
+  Vector<ui64> sizes(blobs.size());
+  memcpy(sizes.data(), contents.data(), blobs.size() * sizeof(ui64));
+
+  ui64 offset = blobs.size() * sizeof(ui64);
+  for (ui64 size : sizes) {
+    if (size > contents.size() - offset) {
+      return false;
+    }
+    offset += size;
+  }
+  if (offset != contents.size()) {
+    return false;
+  }
+
+  offset = blobs.size() * sizeof(ui64);
+  auto size = sizes.begin();
+  for (auto* blob : blobs) {
+    if (*size) {
+      blob->assign(Immutable(contents, offset, *size));
+    }
+    offset += *size++;
+  }
+
+  return true;
+}
+
+}  // namespace cache
+}  // namespace dist_clang
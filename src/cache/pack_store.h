@@ -0,0 +1,118 @@
+#pragma once
+
+#include <base/attributes.h>
+#include <base/const_string.h>
+
+#include <third_party/gtest/exported/include/gtest/gtest_prod.h>
+
+namespace dist_clang {
+namespace cache {
+
+FORWARD_TEST(PackStoreTest, CompactDeadSpace);
+FORWARD_TEST(PackStoreTest, DropDeadSegment);
+
+// Log-structured blob store: all values are appended to the pack segments -
+// the files of a limited size - instead of creating a separate file per value.
+// The index of live values is kept in memory and is rebuilt from the segments
+// on |Open()|. Every sealed segment has a compact ".index" file, so there is no
+// need to scan the segments themselves.
+//
+// The removal appends a tombstone record. A segment without live values is
+// deleted at once, and the segments with a lot of dead space are compacted:
+// their live values are moved to the active segment.
+class PackStore {
+ public:
+  enum : ui64 {
+    DEFAULT_SEGMENT_SIZE = 64 * 1024 * 1024,
+    // in bytes.
+  };
+
+  explicit PackStore(const String& path,
+                     ui64 segment_size = DEFAULT_SEGMENT_SIZE);
+  ~PackStore();
+
+  bool Open(String* error = nullptr) THREAD_UNSAFE;
+
+  bool Put(const String& key, Immutable value,
+           String* error = nullptr) THREAD_SAFE;
+  bool Get(const String& key, Immutable* value,
+           String* error = nullptr) const THREAD_SAFE;
+  bool Remove(const String& key) THREAD_SAFE;
+  // Returns |false| if there is no such key.
+
+  ui64 Compact(float min_dead_ratio = 0.5) THREAD_SAFE;
+  // Compacts the sealed segments with enough dead space - with zero ratio, all
+  // the segments with any dead space. Returns the number of reclaimed bytes.
+
+  ui64 Size() const THREAD_SAFE;
+  // The size of all segments on disk.
+  ui64 DeadSize() const THREAD_SAFE;
+  // The size of the removed and overwritten values, which still take the disk
+  // space until their segments are compacted.
+
+ private:
+  FRIEND_TEST(PackStoreTest, CompactDeadSpace);
+  FRIEND_TEST(PackStoreTest, DropDeadSegment);
+
+  struct Record {
+    String key;
+    ui64 offset = 0;  // of the value.
+    ui64 size = 0;
+    bool tombstone = false;
+  };
+
+  struct Segment {
+    ~Segment();
+
+    ui32 id = 0;
+    int fd = -1;
+    ui64 size = 0;       // in bytes.
+    ui64 dead_size = 0;  // in bytes.
+    ui64 live_values = 0;
+    bool sealed = false;
+    List<String> tombstones;
+    Vector<Record> records;
+    // Only for the active segment - to write the ".index" file on seal.
+  };
+  using SegmentPtr = SharedPtr<Segment>;
+
+  struct Location {
+    ui32 segment = 0;
+    ui64 offset = 0;
+    ui64 size = 0;
+
+    inline bool operator==(const Location& other) const {
+      return segment == other.segment && offset == other.offset &&
+             size == other.size;
+    }
+  };
+
+  String SegmentPath(ui32 id) const;
+  String IndexPath(ui32 id) const;
+
+  bool LoadIndex(const SegmentPtr& segment, String* error);
+  bool ScanSegment(const SegmentPtr& segment, String* error);
+  void Replay(const SegmentPtr& segment, const Record& record);
+
+  bool AppendLocked(const String& key, const char* value, ui64 size,
+                    bool tombstone, Location* location, String* error);
+  bool SealLocked(String* error);
+  bool CreateSegmentLocked(String* error);
+  void KillLocked(const String& key, const Location& location);
+  void DropSegmentLocked(ui32 id);
+
+  const String path_;
+  const ui64 segment_size_;
+
+  mutable std::mutex mutex_;
+  HashMap<String, Location> index_;
+  std::map<ui32, SegmentPtr> segments_;
+  SegmentPtr active_;
+};
+
+// The value of a few blobs: their sizes followed by their contents.
+Immutable PackBlobs(const List<Immutable>& blobs);
+bool UnpackBlobs(const Immutable& value, const List<Immutable*>& blobs);
+
+}  // namespace cache
+}  // namespace dist_clang
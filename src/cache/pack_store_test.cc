@@ -0,0 +1,206 @@
+#include <cache/pack_store.h>
+
+#include <base/file/file.h>
+#include <base/temporary_dir.h>
+
+#include <third_party/gtest/exported/include/gtest/gtest.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace dist_clang {
+namespace cache {
+
+TEST(PackStoreTest, PutGetRemove) {
+  const base::TemporaryDir tmp_dir;
+  PackStore store(tmp_dir);
+  ASSERT_TRUE(store.Open());
+
+  Immutable value1, value2, value3;
+  EXPECT_FALSE(store.Get("key", &value1));
+
+  ASSERT_TRUE(store.Put("key", "value"_l));
+  ASSERT_TRUE(store.Get("key", &value1));
+  EXPECT_EQ("value"_l, value1);
+
+  ASSERT_TRUE(store.Put("key", "new value"_l));
+  ASSERT_TRUE(store.Get("key", &value2));
+  EXPECT_EQ("new value"_l, value2);
+
+  EXPECT_TRUE(store.Remove("key"));
+  EXPECT_FALSE(store.Remove("key"));
+  EXPECT_FALSE(store.Get("key", &value3));
+}
+
+TEST(PackStoreTest, ReopenRestoresIndex) {
+  const base::TemporaryDir tmp_dir;
+
+  {
+    // Small segments - to test the sealed indices too.
+    PackStore store(tmp_dir, 64);
+    ASSERT_TRUE(store.Open());
+    ASSERT_TRUE(store.Put("key1", "value1"_l));
+    ASSERT_TRUE(store.Put("key2", "value2"_l));
+    ASSERT_TRUE(store.Put("key3", "value3"_l));
+    ASSERT_TRUE(store.Put("key2", "value22"_l));
+    ASSERT_TRUE(store.Remove("key3"));
+    ASSERT_TRUE(store.Put("key4", "value4"_l));
+  }
+
+  PackStore store(tmp_dir, 64);
+  ASSERT_TRUE(store.Open());
+
+  Immutable value1, value2, value3, value4;
+  ASSERT_TRUE(store.Get("key1", &value1));
+  EXPECT_EQ("value1"_l, value1);
+  ASSERT_TRUE(store.Get("key2", &value2));
+  EXPECT_EQ("value22"_l, value2);
+  EXPECT_FALSE(store.Get("key3", &value3));
+  ASSERT_TRUE(store.Get("key4", &value4));
+  EXPECT_EQ("value4"_l, value4);
+}
+
+TEST(PackStoreTest, TruncateTornTail) {
+  const base::TemporaryDir tmp_dir;
+
+  {
+    PackStore store(tmp_dir);
+    ASSERT_TRUE(store.Open());
+    ASSERT_TRUE(store.Put("key1", "value1"_l));
+  }
+
+  // Emulate the crash in the middle of append.
+  const String segment_path = String(tmp_dir) + "/1.pack";
+  const ui64 size = base::File::Size(segment_path);
+  int fd = open(segment_path.c_str(), O_WRONLY | O_APPEND);
+  ASSERT_NE(-1, fd);
+  ASSERT_EQ(5, write(fd, "PACK\x10", 5));
+  close(fd);
+
+  PackStore store(tmp_dir);
+  ASSERT_TRUE(store.Open());
+  EXPECT_EQ(size, base::File::Size(segment_path));
+
+  Immutable value1, value2;
+  ASSERT_TRUE(store.Get("key1", &value1));
+  EXPECT_EQ("value1"_l, value1);
+  ASSERT_TRUE(store.Put("key2", "value2"_l));
+  ASSERT_TRUE(store.Get("key2", &value2));
+  EXPECT_EQ("value2"_l, value2);
+}
+
+TEST(PackStoreTest, ScanSegmentWithBrokenIndex) {
+  const base::TemporaryDir tmp_dir;
+
+  {
+    PackStore store(tmp_dir, 128);
+    ASSERT_TRUE(store.Open());
+    ASSERT_TRUE(store.Put("key1", "value1"_l));
+    ASSERT_TRUE(store.Put("key2", "value2"_l));
+    ASSERT_TRUE(store.Remove("key1"));
+    ASSERT_TRUE(store.Put("key3", "value3"_l));
+    ASSERT_TRUE(store.Put("key4", "value4"_l));
+    ASSERT_TRUE(store.Put("key5", "value5"_l));
+  }
+
+  ui64 dead_size = 0;
+  {
+    PackStore store(tmp_dir, 128);
+    ASSERT_TRUE(store.Open());
+    dead_size = store.DeadSize();
+  }
+
+  // Cut the last record of the index - the records before it shouldn't be
+  // counted twice by the scan.
+  const String index_path = String(tmp_dir) + "/1.index";
+  ASSERT_EQ(0, truncate(index_path.c_str(), base::File::Size(index_path) - 1));
+
+  PackStore store(tmp_dir, 128);
+  ASSERT_TRUE(store.Open());
+  EXPECT_EQ(dead_size, store.DeadSize());
+
+  Immutable value1, value4;
+  EXPECT_FALSE(store.Get("key1", &value1));
+  ASSERT_TRUE(store.Get("key4", &value4));
+  EXPECT_EQ("value4"_l, value4);
+}
+
+TEST(PackStoreTest, DropDeadSegment) {
+  const base::TemporaryDir tmp_dir;
+  PackStore store(tmp_dir, 32);
+  ASSERT_TRUE(store.Open());
+
+  // Every value takes a separate segment.
+  ASSERT_TRUE(store.Put("key1", "value1"_l));
+  ASSERT_TRUE(store.Put("key2", "value2"_l));
+  ASSERT_EQ(2u, store.segments_.size());
+  ASSERT_EQ(2u, store.active_->id);
+
+  EXPECT_TRUE(store.Remove("key1"));
+  EXPECT_EQ(0u, store.segments_.count(1));
+  EXPECT_FALSE(base::File::Exists(String(tmp_dir) + "/1.pack"));
+  EXPECT_FALSE(base::File::Exists(String(tmp_dir) + "/1.index"));
+
+  Immutable value;
+  ASSERT_TRUE(store.Get("key2", &value));
+  EXPECT_EQ("value2"_l, value);
+}
+
+TEST(PackStoreTest, CompactDeadSpace) {
+  const base::TemporaryDir tmp_dir;
+
+  {
+    PackStore store(tmp_dir, 128);
+    ASSERT_TRUE(store.Open());
+
+    ASSERT_TRUE(store.Put("key1", "value1"_l));
+    ASSERT_TRUE(store.Put("key2", "value2"_l));
+    ASSERT_TRUE(store.Put("key3", "value3"_l));
+    ASSERT_TRUE(store.Put("key4", "value4"_l));
+    ASSERT_TRUE(store.Put("key5", "value5"_l));
+    ASSERT_EQ(1u, store.segments_.begin()->first);
+    ASSERT_TRUE(store.segments_.begin()->second->sealed);
+
+    EXPECT_TRUE(store.Remove("key1"));
+    EXPECT_TRUE(store.Remove("key2"));
+    EXPECT_EQ(0u, store.Compact(0.9));
+    EXPECT_NE(0u, store.DeadSize());
+
+    EXPECT_NE(0u, store.Compact(0.5));
+    EXPECT_EQ(0u, store.segments_.count(1));
+
+    // The segments without dead space are never rewritten.
+    const auto segment_count = store.segments_.size();
+    EXPECT_EQ(0u, store.Compact(0));
+    EXPECT_EQ(segment_count, store.segments_.size());
+  }
+
+  PackStore store(tmp_dir, 128);
+  ASSERT_TRUE(store.Open());
+
+  Immutable value1, value2, value3, value4, value5;
+  EXPECT_FALSE(store.Get("key1", &value1));
+  EXPECT_FALSE(store.Get("key2", &value2));
+  ASSERT_TRUE(store.Get("key3", &value3));
+  EXPECT_EQ("value3"_l, value3);
+  ASSERT_TRUE(store.Get("key4", &value4));
+  EXPECT_EQ("value4"_l, value4);
+  ASSERT_TRUE(store.Get("key5", &value5));
+  EXPECT_EQ("value5"_l, value5);
+}
+
+TEST(PackStoreTest, PackBlobs) {
+  const Immutable value = PackBlobs({"123"_l, Immutable(), "45"_l});
+  Immutable blob1, blob2, blob3;
+
+  ASSERT_TRUE(UnpackBlobs(value, {&blob1, &blob2, &blob3}));
+  EXPECT_EQ("123"_l, blob1);
+  EXPECT_TRUE(blob2.empty());
+  EXPECT_EQ("45"_l, blob3);
+
+  Immutable blob4, blob5;
+  EXPECT_FALSE(UnpackBlobs(value, {&blob4, &blob5}));
+}
+
+}  // namespace cache
+}  // namespace dist_clang
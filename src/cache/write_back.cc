@@ -0,0 +1,57 @@
+#include <cache/write_back.h>
+
+#include <base/assert.h>
+#include <perf/stat_service.h>
+
+namespace dist_clang {
+namespace cache {
+
+WriteBack::WriteBack(ui64 max_size, ui32 concurrency)
+    : max_size_(max_size), pool_(base::ThreadPool::TaskQueue::UNLIMITED,
+                                 concurrency) {
+  CHECK(concurrency);
+}
+
+void WriteBack::Run() {
+  pool_.Run();
+}
+
+bool WriteBack::Push(const String& key, ui64 size, const Update& update) {
+  {
+    UniqueLock lock(keys_mutex_);
+    if (!keys_.insert(key).second) {
+      STAT(CACHE_WRITE_BACK_COALESCED);
+      return false;
+    }
+
+    if (size_ + size > max_size_) {
+      keys_.erase(key);
+      STAT(CACHE_WRITE_BACK_DROPPED);
+      return false;
+    }
+    size_ += size;
+  }
+
+  auto task = [this, key, size, update] {
+    update();
+
+    UniqueLock lock(keys_mutex_);
+    keys_.erase(key);
+    size_ -= size;
+    STAT(CACHE_WRITE_BACK_DONE);
+  };
+
+  if (!pool_.Push(std::move(task))) {
+    UniqueLock lock(keys_mutex_);
+    keys_.erase(key);
+    size_ -= size;
+    STAT(CACHE_WRITE_BACK_DROPPED);
+    return false;
+  }
+
+  STAT(CACHE_WRITE_BACK_QUEUED);
+  return true;
+}
+
+}  // namespace cache
+}  // namespace dist_clang
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <base/attributes.h>
+#include <base/thread_pool.h>
+
+namespace dist_clang {
+namespace cache {
+
+// Bounded stage that stores the new cache entries off the critical path: the
+// client gets its result as soon as the output file is in place, and the
+// compression and writing of the entry happen later in the own worker pool.
+//
+// The memory taken by the pending entries is limited - the updates above the
+// limit are dropped, since the cache is only an optimization. The updates with
+// the same key are coalesced while the first one is still pending. All the
+// pending updates are completed on destruction.
+class WriteBack {
+ public:
+  using Update = Fn<void(void)>;
+
+  WriteBack(ui64 max_size, ui32 concurrency);
+  // |max_size| is in bytes.
+
+  void Run() THREAD_UNSAFE;
+
+  bool Push(const String& key, ui64 size, const Update& update) THREAD_SAFE;
+  // Returns |false| if the update is coalesced or dropped.
+
+  inline ui64 Size() const { return size_; }
+  // The total size of the pending updates.
+  inline ui64 Count() const { return pool_.TaskCount(); }
+
+ private:
+  const ui64 max_size_;
+
+  std::mutex keys_mutex_;
+  HashSet<String> keys_;
+  Atomic<ui64> size_ = {0};
+
+  base::ThreadPool pool_;
+  // Should be the last member - to be destroyed first, while the rest is still
+  // valid for the pending updates.
+};
+
+}  // namespace cache
+}  // namespace dist_clang
@@ -0,0 +1,62 @@
+#include <cache/write_back.h>
+
+#include <third_party/gtest/exported/include/gtest/gtest.h>
+
+namespace dist_clang {
+namespace cache {
+
+TEST(WriteBackTest, CoalesceAndDrop) {
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool blocked = true;
+  Atomic<ui32> done = {0};
+
+  auto block = [&] {
+    UniqueLock lock(mutex);
+    condition.wait(lock, [&] { return !blocked; });
+    ++done;
+  };
+
+  {
+    WriteBack write_back(100, 1);
+    write_back.Run();
+
+    EXPECT_TRUE(write_back.Push("key1", 60, block));
+    EXPECT_EQ(60u, write_back.Size());
+
+    // The same key is still pending.
+    EXPECT_FALSE(write_back.Push("key1", 10, block));
+    // Over the memory limit.
+    EXPECT_FALSE(write_back.Push("key2", 50, block));
+    EXPECT_TRUE(write_back.Push("key3", 40, block));
+    EXPECT_EQ(100u, write_back.Size());
+    EXPECT_EQ(2u, write_back.Count());
+
+    UniqueLock lock(mutex);
+    blocked = false;
+    condition.notify_all();
+  }
+
+  // All pending updates are completed on destruction.
+  EXPECT_EQ(2u, done);
+}
+
+TEST(WriteBackTest, PushAfterCompletion) {
+  Atomic<ui32> done = {0};
+
+  {
+    WriteBack write_back(100, 2);
+    write_back.Run();
+
+    EXPECT_TRUE(write_back.Push("key", 100, [&] { ++done; }));
+    while (write_back.Count()) {
+      std::this_thread::yield();
+    }
+    EXPECT_TRUE(write_back.Push("key", 100, [&] { ++done; }));
+  }
+
+  EXPECT_EQ(2u, done);
+}
+
+}  // namespace cache
+}  // namespace dist_clang
@@ -23,16 +23,32 @@ Absorber::Absorber(const proto::Configuration& configuration)
 
   workers_.reset(new base::WorkerPool);
   tasks_.reset(new Queue(config->pool_capacity()));
+  channels_.reset(new ChannelQueue);
+  free_channel_readers_ = config->absorber().channels();
 
   {
     Worker worker = std::bind(&Absorber::DoExecute, this, _1);
     workers_->AddWorker("Execute Worker"_l, worker,
                         config->absorber().local().threads());
   }
+
+  if (config->absorber().channels()) {
+    Worker worker = std::bind(&Absorber::DoReadChannel, this, _1);
+    workers_->AddWorker("Channel Reader"_l, worker,
+                        config->absorber().channels());
+  }
 }
 
 Absorber::~Absorber() {
   tasks_->Close();
+  channels_->Close();
+  {
+    std::lock_guard<std::mutex> lock(active_channels_mutex_);
+    closing_ = true;
+    for (const auto& connection : active_channels_) {
+      connection->Shutdown();
+    }
+  }
   workers_.reset();
 }
 
@@ -71,7 +87,12 @@ bool Absorber::HandleNewMessage(net::ConnectionPtr connection,
     Message execute(message->ReleaseExtension(proto::Remote::extension));
     DCHECK(!execute->flags().compiler().has_path());
     if (execute->has_source()) {
-      return tasks_->Push(Task{connection, std::move(execute)});
+      if (message->HasExtension(proto::Tag::extension)) {
+        const auto& tag = message->GetExtension(proto::Tag::extension);
+        return OpenChannel(
+            Task{connection, std::move(execute), tag.request_id()});
+      }
+      return tasks_->Push(Task{connection, std::move(execute), 0});
     }
   }
 
@@ -79,6 +100,61 @@ bool Absorber::HandleNewMessage(net::ConnectionPtr connection,
   return false;
 }
 
+bool Absorber::OpenChannel(Task&& task) {
+  auto connection = std::get<CONNECTION>(task);
+
+  // Every channel takes a reader for its whole life.
+  ui32 free_readers = free_channel_readers_;
+  do {
+    if (!free_readers) {
+      net::proto::Status status;
+      status.set_code(net::proto::Status::OVERLOAD);
+      status.set_description("Too many channels");
+      ReportStatus(task, status);
+      return false;
+    }
+  } while (!free_channel_readers_.compare_exchange_weak(free_readers,
+                                                        free_readers - 1));
+
+  if (!tasks_->TryPush(task)) {
+    net::proto::Status status;
+    status.set_code(net::proto::Status::OVERLOAD);
+    status.set_description("Too many tasks");
+    ReportStatus(task, status);
+  }
+
+  if (!channels_->Push(connection)) {
+    ++free_channel_readers_;
+    return false;
+  }
+
+  return true;
+}
+
+bool Absorber::SendReply(const Task& task, Universal reply) {
+  const auto& connection = std::get<CONNECTION>(task);
+  const ui64 request_id = std::get<REQUEST_ID>(task);
+  if (!request_id) {
+    return connection->SendAsync(std::move(reply));
+  }
+
+  reply->MutableExtension(proto::Tag::extension)->set_request_id(request_id);
+  if (!connection->SendSync(std::move(reply))) {
+    // The other workers shouldn't wait for the send timeout too - and the
+    // reader frees the channel.
+    connection->Shutdown();
+    return false;
+  }
+  return true;
+}
+
+bool Absorber::ReportStatus(const Task& task,
+                            const net::proto::Status& status) {
+  Universal reply(new net::proto::Universal);
+  reply->MutableExtension(net::proto::Status::extension)->CopyFrom(status);
+  return SendReply(task, std::move(reply));
+}
+
 cache::ExtraFiles Absorber::GetExtraFiles(const proto::Remote* message) {
   DCHECK(message);
 
@@ -125,11 +201,11 @@ void Absorber::DoExecute(const base::WorkerPool& pool) {
       break;
     }
 
-    if (task->first->IsClosed()) {
+    if (std::get<CONNECTION>(*task)->IsClosed()) {
       continue;
     }
 
-    proto::Remote* incoming = task->second.get();
+    proto::Remote* incoming = std::get<MESSAGE>(*task).get();
     auto source = Immutable::WrapString(incoming->source());
     auto extra_files = GetExtraFiles(incoming);
 
@@ -165,21 +241,21 @@ void Absorber::DoExecute(const base::WorkerPool& pool) {
       status->set_code(net::proto::Status::OK);
       status->set_description(entry.stderr);
 
-      task->first->SendAsync(std::move(outgoing));
+      SendReply(*task, std::move(outgoing));
       continue;
     }
 
     // Check that we have a compiler of a requested version.
     net::proto::Status status;
     if (!SetupCompiler(incoming->mutable_flags(), &status)) {
-      task->first->ReportStatus(status);
+      ReportStatus(*task, status);
       continue;
     }
 
     base::TemporaryDir temp_dir;
     if (!PrepareExtraFilesForCompiler(extra_files, temp_dir.GetPath(),
                                       incoming->mutable_flags(), &status)) {
-      task->first->ReportStatus(status);
+      ReportStatus(*task, status);
       continue;
     }
 
@@ -228,7 +304,69 @@ void Absorber::DoExecute(const base::WorkerPool& pool) {
                         entry);
     }
 
-    task->first->SendAsync(std::move(outgoing));
+    SendReply(*task, std::move(outgoing));
+  }
+}
+
+void Absorber::DoReadChannel(const base::WorkerPool& pool) {
+  while (!pool.IsShuttingDown()) {
+    auto&& optional = channels_->Pop();
+    if (!optional) {
+      break;
+    }
+
+    net::ConnectionPtr connection = *optional;
+    String error;
+    // The channel waits for the next requests as long as the emitter is alive.
+    if (!connection->ReadTimeout(0, &error) ||
+        !connection->KeepAlive(conf()->absorber().channel_keepalive(),
+                               &error)) {
+      LOG(WARNING) << "Failed to set up the reads of channel: " << error;
+      connection->Shutdown();
+      ++free_channel_readers_;
+      continue;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(active_channels_mutex_);
+      if (closing_) {
+        break;
+      }
+      active_channels_.insert(connection);
+    }
+
+    while (true) {
+      Universal message(new net::proto::Universal);
+      net::proto::Status status;
+      if (!connection->ReadSync(message.get(), &status)) {
+        LOG(VERBOSE) << "Channel is closed: " << status.description();
+        break;
+      }
+
+      if (!message->IsInitialized() ||
+          !message->HasExtension(proto::Tag::extension) ||
+          !message->HasExtension(proto::Remote::extension)) {
+        LOG(WARNING) << "Malformed request in channel";
+        break;
+      }
+
+      Task task{connection,
+                Message(message->ReleaseExtension(proto::Remote::extension)),
+                message->GetExtension(proto::Tag::extension).request_id()};
+      if (!tasks_->TryPush(task)) {
+        status.set_code(net::proto::Status::OVERLOAD);
+        status.set_description("Too many tasks");
+        ReportStatus(task, status);
+      }
+    }
+
+    // The emitter fails the requests without the reply.
+    connection->Shutdown();
+    {
+      std::lock_guard<std::mutex> lock(active_channels_mutex_);
+      active_channels_.erase(connection);
+    }
+    ++free_channel_readers_;
   }
 }
 
@@ -15,10 +15,18 @@ class Absorber : public CompilationDaemon {
   bool Initialize() override;
 
  private:
+  enum TaskIndex {
+    CONNECTION = 0,
+    MESSAGE = 1,
+    REQUEST_ID = 2,
+  };
+
   using Message = UniquePtr<proto::Remote>;
-  using Task = Pair<net::ConnectionPtr, Message>;
+  using Task = Tuple<net::ConnectionPtr, Message, ui64>;
+  // The request id is 0, if the task doesn't come from a channel.
   using Queue = base::LockedQueue<Task>;
   using Optional = Queue::Optional;
+  using ChannelQueue = base::LockedQueue<net::ConnectionPtr>;
 
   bool HandleNewMessage(net::ConnectionPtr connection, Universal message,
                         const net::proto::Status& status) override;
@@ -30,9 +38,27 @@ class Absorber : public CompilationDaemon {
                                     base::proto::Flags* flags,
                                     net::proto::Status* status);
 
+  bool OpenChannel(Task&& task);
+  // The first request of the channel comes through the event loop - the rest
+  // are read by the own reader of the channel.
+
+  bool SendReply(const Task& task, Universal reply);
+  bool ReportStatus(const Task& task, const net::proto::Status& status);
+  // The reply to the channel is tagged, and keeps the channel open.
+
   void DoExecute(const base::WorkerPool& pool);
+  void DoReadChannel(const base::WorkerPool& pool);
 
   UniquePtr<Queue> tasks_;
+  UniquePtr<ChannelQueue> channels_;
+  Atomic<ui32> free_channel_readers_ = {0};
+
+  std::mutex active_channels_mutex_;
+  HashSet<net::ConnectionPtr> active_channels_;
+  bool closing_ = false;
+  // The active channels are shut down on destruction - to interrupt the
+  // readers.
+
   UniquePtr<base::WorkerPool> workers_;
 };
 
@@ -632,5 +632,123 @@ TEST_F(AbsorberTest, BadMessageStatus) {
       << "Daemon must not store references to the connection";
 }
 
+TEST_F(AbsorberTest, ChannelRepliesAreTagged) {
+  const String expected_host = "fake_host";
+  const ui16 expected_port = 12345;
+  const ui64 expected_request_id = 7;
+  const String compiler_version = "fake_compiler_version";
+  const String compiler_path = "fake_compiler_path";
+
+  conf.mutable_absorber()->mutable_local()->set_host(expected_host);
+  conf.mutable_absorber()->mutable_local()->set_port(expected_port);
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+
+  listen_callback = [&](const String& host, ui16 port, String*) {
+    EXPECT_EQ(expected_host, host);
+    EXPECT_EQ(expected_port, port);
+    return true;
+  };
+  connect_callback = [&](net::TestConnection* connection) {
+    // The channel has no more requests.
+    connection->AbortOnRead();
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      EXPECT_TRUE(message.HasExtension(proto::Tag::extension));
+      EXPECT_EQ(expected_request_id,
+                message.GetExtension(proto::Tag::extension).request_id());
+
+      EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+      const auto& status = message.GetExtension(net::proto::Status::extension);
+      EXPECT_EQ(net::proto::Status::OK, status.code());
+      EXPECT_TRUE(message.HasExtension(proto::Result::extension));
+
+      send_condition.notify_all();
+    });
+  };
+
+  absorber.reset(new Absorber(conf));
+  ASSERT_TRUE(absorber->Initialize());
+
+  auto connection = test_service->TriggerListen(expected_host, expected_port);
+  {
+    auto message(
+        CreateMessage("fake_source"_l, "fake_action"_l, compiler_version));
+    message->MutableExtension(proto::Tag::extension)
+        ->set_request_id(expected_request_id);
+
+    SharedPtr<net::TestConnection> test_connection =
+        std::static_pointer_cast<net::TestConnection>(connection);
+    EXPECT_TRUE(
+        test_connection->TriggerReadAsync(std::move(message), StatusOK()));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [this] { return send_count == 1; }));
+  }
+
+  absorber.reset();
+
+  EXPECT_EQ(1u, run_count);
+  EXPECT_EQ(1u, send_count);
+  EXPECT_EQ(1, connection.use_count())
+      << "Daemon must not store references to the connection";
+}
+
+TEST_F(AbsorberTest, TooManyChannels) {
+  const String expected_host = "fake_host";
+  const ui16 expected_port = 12345;
+  const ui64 expected_request_id = 7;
+  const String compiler_version = "fake_compiler_version";
+  const String compiler_path = "fake_compiler_path";
+
+  conf.mutable_absorber()->mutable_local()->set_host(expected_host);
+  conf.mutable_absorber()->mutable_local()->set_port(expected_port);
+  conf.mutable_absorber()->set_channels(0);
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+
+  listen_callback = [&](const String& host, ui16 port, String*) {
+    EXPECT_EQ(expected_host, host);
+    EXPECT_EQ(expected_port, port);
+    return true;
+  };
+  connect_callback = [&](net::TestConnection* connection) {
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      EXPECT_TRUE(message.HasExtension(proto::Tag::extension));
+      EXPECT_EQ(expected_request_id,
+                message.GetExtension(proto::Tag::extension).request_id());
+
+      EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+      const auto& status = message.GetExtension(net::proto::Status::extension);
+      EXPECT_EQ(net::proto::Status::OVERLOAD, status.code());
+    });
+  };
+
+  absorber.reset(new Absorber(conf));
+  ASSERT_TRUE(absorber->Initialize());
+
+  auto connection = test_service->TriggerListen(expected_host, expected_port);
+  {
+    auto message(
+        CreateMessage("fake_source"_l, "fake_action"_l, compiler_version));
+    message->MutableExtension(proto::Tag::extension)
+        ->set_request_id(expected_request_id);
+
+    SharedPtr<net::TestConnection> test_connection =
+        std::static_pointer_cast<net::TestConnection>(connection);
+    EXPECT_FALSE(
+        test_connection->TriggerReadAsync(std::move(message), StatusOK()));
+    absorber.reset();
+  }
+
+  EXPECT_EQ(0u, run_count);
+  EXPECT_EQ(1u, read_count);
+  EXPECT_EQ(1u, send_count);
+  EXPECT_EQ(1, connection.use_count())
+      << "Daemon must not store references to the connection";
+}
+
 }  // namespace daemon
 }  // namespace dist_clang
@@ -1,12 +1,16 @@
 #include <base/c_utils.h>
+#include <base/file/file.h>
 #include <base/logging.h>
+#include <base/string_utils.h>
 #include <daemon/absorber.h>
 #include <daemon/collector.h>
+#include <daemon/compilation_daemon.h>
 #include <daemon/configuration.h>
 #include <daemon/emitter.h>
 
 #include STL(iostream)
 
+#include <fcntl.h>
 #include <signal.h>
 #include <unistd.h>
 
@@ -22,6 +26,72 @@ void signal_handler(int sig) {
   CHECK(false);
 }
 
+// Exports or imports the configured cache.
+bool RunBundle(const daemon::Configuration& configuration) {
+  const auto& config = configuration.config();
+  if (!config.has_cache()) {
+    LOG(ERROR) << "The cache isn't configured";
+    return false;
+  }
+
+  auto cache = daemon::CompilationDaemon::CreateCache(config.cache());
+  if (!cache || !cache->Run(config.cache().clean_period())) {
+    LOG(ERROR) << "Failed to open the cache in " << config.cache().path();
+    return false;
+  }
+
+  const bool is_export = !configuration.export_bundle().empty();
+  const String& path = is_export ? configuration.export_bundle()
+                                 : configuration.import_bundle();
+  int fd = is_export ? STDOUT_FILENO : STDIN_FILENO;
+  if (path != "-") {
+    fd = is_export ? open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)
+                   : open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+      String error;
+      base::GetLastError(&error);
+      LOG(ERROR) << "Failed to open bundle " << path << ": " << error;
+      return false;
+    }
+  }
+
+  String error;
+  ui64 count = 0;
+  bool result;
+  if (is_export) {
+    cache::FileCache::BundleFilter filter;
+    if (configuration.bundle_since()) {
+      filter.since = time(nullptr) - configuration.bundle_since();
+    }
+    if (!configuration.bundle_hashes().empty()) {
+      Immutable hashes;
+      if (!base::File::Read(configuration.bundle_hashes(), &hashes, &error)) {
+        LOG(ERROR) << "Failed to read hashes from "
+                   << configuration.bundle_hashes() << ": " << error;
+        return false;
+      }
+      List<String> lines;
+      base::SplitString<'\n'>(hashes, lines);
+      filter.hashes.insert(lines.begin(), lines.end());
+    }
+    result = cache->Export(filter, fd, &count, &error);
+  } else {
+    result = cache->Import(fd, &count, &error);
+  }
+
+  if (path != "-") {
+    close(fd);
+  }
+  if (!result) {
+    LOG(ERROR) << "Failed to process bundle " << path << ": " << error;
+    return false;
+  }
+
+  LOG(INFO) << (is_export ? "Exported " : "Imported ") << count
+            << " cache entries";
+  return true;
+}
+
 }  // namespace
 
 int main(int argc, char* argv[]) {
@@ -31,6 +101,11 @@ int main(int argc, char* argv[]) {
   daemon::Configuration configuration(argc, argv);
   UniquePtr<daemon::BaseDaemon> daemon, collector;
 
+  if (!configuration.export_bundle().empty() ||
+      !configuration.import_bundle().empty()) {
+    return RunBundle(configuration) ? 0 : 1;
+  }
+
   if (configuration.daemonize()) {
 // The function |daemon()| is deprecated on Mac. Use launchd instead.
 #if !defined(OS_MACOSX)
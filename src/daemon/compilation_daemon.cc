@@ -2,9 +2,11 @@
 
 #include <base/assert.h>
 #include <base/file/file.h>
+#include <base/file_utils.h>
 #include <base/logging.h>
 #include <base/process_impl.h>
 #include <base/string_utils.h>
+#include <cache/hash_memo.h>
 
 #include <base/using_log.h>
 
@@ -30,6 +32,113 @@ inline String GetRelativePath(const String& current_dir, const String& input) {
              : input;
 }
 
+// Returns |true| if |path| is modified or changed at the |time| or later - or
+// if it can't be stat'ed.
+bool IsChangedSince(const String& path,
+                    std::chrono::system_clock::time_point time) {
+  const auto to_time_point = [](Pair<time_t> file_time) {
+    return std::chrono::system_clock::time_point(
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(
+            std::chrono::seconds(file_time.first) +
+            std::chrono::nanoseconds(file_time.second)));
+  };
+
+  String error;
+  const auto mtime = base::GetModificationTime(path, &error);
+  const auto ctime = base::GetChangeTime(path, &error);
+  if (!error.empty()) {
+    return true;
+  }
+  return to_time_point(std::max(mtime, ctime)) >= time;
+}
+
+inline bool IsUnderDir(const String& dir, const String& path) {
+  return path.compare(0, dir.size(), dir) == 0 &&
+         (path.size() == dir.size() || path[dir.size()] == '/');
+}
+
+// Returns |path| relative to |current_dir|, if it's under |base_dir| -
+// otherwise returns |path| untouched. The directories must not end with '/'.
+String RebasePath(const String& base_dir, const String& current_dir,
+                  const String& path) {
+  if (!IsUnderDir(base_dir, path)) {
+    return path;
+  }
+
+  List<String> dir_parts, path_parts;
+  base::SplitString<'/'>(current_dir, dir_parts);
+  base::SplitString<'/'>(path, path_parts);
+
+  auto dir_it = dir_parts.begin();
+  auto path_it = path_parts.begin();
+  while (dir_it != dir_parts.end() && path_it != path_parts.end() &&
+         *dir_it == *path_it) {
+    ++dir_it;
+    ++path_it;
+  }
+
+  List<String> parts;
+  for (; dir_it != dir_parts.end(); ++dir_it) {
+    parts.push_back("..");
+  }
+  parts.insert(parts.end(), path_it, path_parts.end());
+
+  return parts.empty() ? String(".")
+                       : base::JoinString<'/'>(parts.begin(), parts.end());
+}
+
+// Handles the separate paths, and the joined ones like "-I/path" or
+// "-fprofile-instr-use=/path". The macro definitions are left as is.
+// The options longer than "-I", that may take the path joined - like
+// "-isystem/usr/include".
+const char* const kJoinedPathOptions[] = {
+    "-idirafter", "-imacros", "-include", "-iprefix", "-iquote", "-isysroot",
+    "-isystem", "-iwithprefix", "-iwithprefixbefore",
+};
+
+void RebaseArgs(const String& base_dir, const String& current_dir,
+                google::protobuf::RepeatedPtrField<String>* args) {
+  bool is_macro = false;
+  for (auto& arg : *args) {
+    if (is_macro || arg.empty()) {
+      is_macro = false;
+      continue;
+    }
+    if (arg == "-D" || arg == "-U") {
+      is_macro = true;
+      continue;
+    }
+    if (arg[0] == '-' && (arg[1] == 'D' || arg[1] == 'U')) {
+      continue;
+    }
+
+    size_t pos = String::npos;
+    if (arg[0] == '/') {
+      pos = 0;
+    } else if (arg[0] == '-' && arg.size() > 2 && arg[2] == '/') {
+      pos = 2;
+    } else if (arg[0] == '-' && arg[1] == 'i') {
+      for (const char* option : kJoinedPathOptions) {
+        const size_t size = strlen(option);
+        if (arg.size() > size && arg[size] == '/' &&
+            arg.compare(0, size, option) == 0) {
+          pos = size;
+          break;
+        }
+      }
+    }
+    if (pos == String::npos && (pos = arg.find('=')) != String::npos) {
+      pos = (pos + 1 < arg.size() && arg[pos + 1] == '/') ? pos + 1
+                                                          : String::npos;
+    }
+
+    if (pos != String::npos) {
+      arg = arg.substr(0, pos) +
+            RebasePath(base_dir, current_dir, arg.substr(pos));
+    }
+  }
+}
+
 inline CommandLine CommandLineForSimpleCache(const base::proto::Flags& flags) {
   String command_line =
       base::JoinString<' '>(flags.other().begin(), flags.other().end());
@@ -67,6 +176,26 @@ inline CommandLine CommandLineForDirectCache(const String& current_dir,
   return CommandLine(command_line);
 }
 
+cache::FileCache::Entry CopyEntry(const cache::FileCache::Entry& entry) {
+  cache::FileCache::Entry copy;
+  copy.object = Immutable(entry.object.string_copy());
+  copy.deps = Immutable(entry.deps.string_copy());
+  copy.stderr = Immutable(entry.stderr.string_copy());
+  return copy;
+}
+
+ExtraFiles CopyExtraFiles(const ExtraFiles& extra_files) {
+  ExtraFiles copy;
+  for (const auto& file : extra_files) {
+    copy.emplace(file.first, Immutable(file.second.string_copy()));
+  }
+  return copy;
+}
+
+inline ui64 EntrySize(const cache::FileCache::Entry& entry) {
+  return entry.object.size() + entry.deps.size() + entry.stderr.size();
+}
+
 bool ParseDeps(String deps, List<String>& headers) {
   base::Replace(deps, "\\\n", "");
 
@@ -92,13 +221,64 @@ inline String GetFullPath(const String& current_dir, const String& path) {
 
 namespace daemon {
 
+// static
+UniquePtr<cache::FileCache> CompilationDaemon::CreateCache(
+    const proto::Configuration::Cache& cache_conf) {
+  const double low_watermark = cache_conf.low_watermark();
+  if (low_watermark <= 0 || low_watermark > 1) {
+    LOG(ERROR) << "Cache low watermark should be in (0, 1]: " << low_watermark;
+    return nullptr;
+  }
+
+  base::Singleton<cache::HashMemo>::Get().Configure(
+      cache_conf.hash_memo_size(), cache_conf.hash_memo_inotify());
+  UniquePtr<cache::FileCache> cache(new cache::FileCache(
+      cache_conf.path(), cache_conf.size(), cache_conf.snappy(),
+      cache_conf.store_index(), cache_conf.mtime(), cache_conf.pack()));
+
+  if (cache_conf.has_compression() || cache_conf.large_object_size()) {
+    cache::CodecPolicy policy;
+    if (cache_conf.has_compression()) {
+      policy.compression = cache_conf.compression();
+    } else if (cache_conf.snappy()) {
+      policy.compression.set_codec(cache::proto::SNAPPY);
+    }
+    policy.large_compression = cache_conf.large_compression();
+    policy.large_size = cache_conf.large_object_size();
+    cache->SetCodecPolicy(policy);
+  }
+  cache->SetHotSize(cache_conf.hot_size());
+  cache->SetDirectIndex(cache_conf.direct_index());
+  cache->SetDeduplication(cache_conf.dedup());
+  cache->SetShared(cache_conf.shared());
+  for (const auto& layer : cache_conf.lower()) {
+    cache->AddLowerLayer(layer.path(), layer.promote());
+  }
+
+  cache::FileCache::EvictionPolicy eviction;
+  eviction.order = cache_conf.eviction();
+  eviction.low_watermark = cache_conf.low_watermark();
+  eviction.min_free_space = cache_conf.min_free_space();
+  eviction.threads = cache_conf.eviction_threads();
+  cache->SetEvictionPolicy(eviction);
+
+  return cache;
+}
+
 bool CompilationDaemon::Initialize() {
   if (conf_->has_cache() && !conf_->cache().disabled()) {
-    cache_.reset(new cache::FileCache(
-        conf_->cache().path(), conf_->cache().size(), conf_->cache().snappy(),
-        conf_->cache().store_index()));
+    const auto& cache_conf = conf_->cache();
+    cache_ = CreateCache(cache_conf);
+    if (!cache_) {
+      return false;
+    }
+
     if (!cache_->Run(conf_->cache().clean_period())) {
       cache_.reset();
+    } else if (cache_conf.write_back_threads()) {
+      write_back_.reset(new cache::WriteBack(cache_conf.write_back_size(),
+                                             cache_conf.write_back_threads()));
+      write_back_->Run();
     }
   }
   if (!UpdateConfiguration(*conf_)) {
@@ -251,7 +431,8 @@ bool CompilationDaemon::ReadExtraFiles(const base::proto::Flags& flags,
   Immutable sanitize_blacklist_contents;
   const String sanitize_blacklist =
       GetFullPath(current_dir, flags.sanitize_blacklist());
-  if (!base::File::Read(sanitize_blacklist, &sanitize_blacklist_contents)) {
+  if (!base::Singleton<cache::HashMemo>::Get().Read(
+          sanitize_blacklist, &sanitize_blacklist_contents)) {
     LOG(CACHE_ERROR) << "Failed to read sanitize blacklist file"
                      << sanitize_blacklist;
     return false;
@@ -263,7 +444,8 @@ bool CompilationDaemon::ReadExtraFiles(const base::proto::Flags& flags,
 
 bool CompilationDaemon::SearchSimpleCache(
     const base::proto::Flags& flags, const HandledSource& source,
-    const ExtraFiles& extra_files, cache::FileCache::Entry* entry) const {
+    const ExtraFiles& extra_files, cache::FileCache::Entry* entry,
+    bool lazy_object) const {
   if (!cache_) {
     return false;
   }
@@ -271,7 +453,8 @@ bool CompilationDaemon::SearchSimpleCache(
   const Version version(flags.compiler().version());
   const auto command_line = CommandLineForSimpleCache(flags);
 
-  if (!cache_->Find(source, extra_files, command_line, version, entry)) {
+  if (!cache_->Find(source, extra_files, command_line, version, entry,
+                    lazy_object)) {
     LOG(CACHE_INFO) << "Cache miss: " << flags.input();
     return false;
   }
@@ -281,7 +464,7 @@ bool CompilationDaemon::SearchSimpleCache(
 
 bool CompilationDaemon::SearchDirectCache(
     const base::proto::Flags& flags, const String& current_dir,
-    cache::FileCache::Entry* entry) const {
+    cache::FileCache::Entry* entry, bool lazy_object) const {
   auto config = conf();
   DCHECK(config->has_emitter() && !config->has_absorber());
   DCHECK(flags.has_input());
@@ -305,7 +488,7 @@ bool CompilationDaemon::SearchDirectCache(
   }
 
   if (!cache_->Find(code, extra_files, command_line, version, current_dir,
-                    entry)) {
+                    entry, lazy_object)) {
     LOG(CACHE_INFO) << "Direct cache miss: " << flags.input();
     return false;
   }
@@ -323,12 +506,27 @@ void CompilationDaemon::UpdateSimpleCache(
     return;
   }
 
-  cache_->Store(source, extra_files, command_line, version, entry);
+  if (!write_back_) {
+    cache_->Store(source, extra_files, command_line, version, entry);
+    return;
+  }
+
+  // The object may be mapped from the output file, that the client is free to
+  // change, and the source may wrap the message, that is freed right after the
+  // call - so copy everything.
+  const auto hash = cache_->Hash(source, extra_files, command_line, version);
+  const HandledSource code(source.str.string_copy());
+  const auto files = CopyExtraFiles(extra_files);
+  auto copy = std::make_shared<cache::FileCache::Entry>(CopyEntry(entry));
+  write_back_->Push(hash.str, EntrySize(*copy), [=] {
+    cache_->Store(code, files, command_line, version, *copy);
+  });
 }
 
 void CompilationDaemon::UpdateDirectCache(
     const base::proto::Local* message, const HandledSource& source,
-    const ExtraFiles& extra_files, const cache::FileCache::Entry& entry) {
+    const ExtraFiles& extra_files, const cache::FileCache::Entry& entry,
+    const List<String>& known_headers) {
   const auto& flags = message->flags();
   auto config = conf();
   DCHECK(config->has_emitter() && !config->has_absorber());
@@ -338,7 +536,7 @@ void CompilationDaemon::UpdateDirectCache(
     return;
   }
 
-  if (entry.deps.empty()) {
+  if (entry.deps.empty() && known_headers.empty()) {
     LOG(CACHE_WARNING) << "Can't update direct cache without deps : "
                        << flags.input();
     return;
@@ -350,16 +548,80 @@ void CompilationDaemon::UpdateDirectCache(
   const auto command_line =
       CommandLineForDirectCache(message->current_dir(), flags);
   const String input_path = GetFullPath(message->current_dir(), flags.input());
-  List<String> headers;
+  List<String> headers = known_headers;
   UnhandledSource original_code;
 
-  if (ParseDeps(entry.deps, headers) &&
-      base::File::Read(input_path, &original_code.str)) {
-    cache_->Store(original_code, extra_files, command_line, version, headers,
-                  message->current_dir(), hash);
-  } else {
+  if ((headers.empty() && !ParseDeps(entry.deps, headers)) ||
+      !base::File::Read(input_path, &original_code.str)) {
     LOG(CACHE_ERROR) << "Failed to parse deps or read input " << input_path;
+    return;
+  }
+
+  const String current_dir = message->current_dir();
+  if (!write_back_) {
+    cache_->Store(original_code, extra_files, command_line, version, headers,
+                  current_dir, hash);
+    return;
+  }
+
+  // The input is read now, since the direct manifest should match the code,
+  // that was actually compiled.
+  const UnhandledSource code(original_code.str.string_copy());
+  const auto files = CopyExtraFiles(extra_files);
+  write_back_->Push("direct:" + hash.str.string_copy(), code.str.size(), [=] {
+    cache_->Store(code, files, command_line, version, headers, current_dir,
+                  hash);
+  });
+}
+
+void CompilationDaemon::UpdateDependCache(
+    const base::proto::Local* message, const ExtraFiles& extra_files,
+    const cache::FileCache::Entry& entry,
+    std::chrono::system_clock::time_point compile_start) {
+  const auto& flags = message->flags();
+  auto config = conf();
+  DCHECK(config->has_emitter() && !config->has_absorber());
+
+  if (!cache_ || !config->cache().depend()) {
+    return;
+  }
+
+  List<String> headers;
+  if (entry.deps.empty() || !ParseDeps(entry.deps, headers)) {
+    LOG(CACHE_WARNING) << "Can't update depend cache without deps : "
+                       << flags.input();
+    return;
   }
+
+  // The preprocessed source is defined by the flags of the preprocessor and
+  // the contents of the input and all headers - they are in the deps.
+  const String& current_dir = message->current_dir();
+  Immutable::Rope source_rope = {
+      "depend\n"_l, CommandLineForDirectCache(current_dir, flags).str,
+      "\n"_l,
+  };
+  for (const auto& header : headers) {
+    const String header_path = GetFullPath(current_dir, header);
+    Immutable header_hash;
+    String error;
+    if (IsChangedSince(header_path, compile_start)) {
+      LOG(CACHE_WARNING) << "Header " << header_path
+                         << " is changed during the compilation of "
+                         << flags.input();
+      return;
+    }
+    if (!base::Singleton<cache::HashMemo>::Get().Hash(
+            header_path, &header_hash, {"__DATE__"_l, "__TIME__"_l},
+            &error)) {
+      LOG(CACHE_ERROR) << "Failed to hash " << header_path << ": " << error;
+      return;
+    }
+    source_rope.push_back(header_hash);
+  }
+
+  const HandledSource source((Immutable(source_rope)));
+  UpdateSimpleCache(flags, source, extra_files, entry);
+  UpdateDirectCache(message, source, extra_files, entry, headers);
 }
 
 // static
@@ -409,5 +671,79 @@ base::ProcessPtr CompilationDaemon::CreateProcess(
   return CreateProcess(flags, base::Process::SAME_UID, cwd_path);
 }
 
+// static
+void CompilationDaemon::RebaseFlags(const String& base_dir,
+                                    const String& current_dir,
+                                    base::proto::Flags* flags) {
+  DCHECK(flags);
+
+  if (base_dir.empty() || base_dir == "/" ||
+      !IsUnderDir(base_dir, current_dir)) {
+    return;
+  }
+
+  RebaseArgs(base_dir, current_dir, flags->mutable_other());
+  RebaseArgs(base_dir, current_dir, flags->mutable_non_cached());
+  RebaseArgs(base_dir, current_dir, flags->mutable_cc_only());
+  if (flags->has_input()) {
+    flags->set_input(RebasePath(base_dir, current_dir, flags->input()));
+  }
+
+  // The debug info gets the same relative paths - for every directory from
+  // the |base_dir| to the |current_dir|. The more specific maps go last, since
+  // Clang applies the last matching one.
+  List<String> parts;
+  base::SplitString<'/'>(current_dir.substr(base_dir.size()), parts);
+  String dir = base_dir;
+  for (auto part = parts.begin();; ++part) {
+    flags->add_non_direct("-fdebug-prefix-map=" + dir + "=" +
+                          RebasePath(base_dir, current_dir, dir));
+    if (part == parts.end()) {
+      break;
+    }
+    dir += "/" + *part;
+  }
+}
+
+// static
+Immutable CompilationDaemon::RebaseSource(const String& base_dir,
+                                          const String& current_dir,
+                                          const Immutable& source) {
+  if (base_dir.empty() || base_dir == "/" ||
+      !IsUnderDir(base_dir, current_dir) ||
+      source.find(("\"" + base_dir).c_str()) == String::npos) {
+    return source;
+  }
+
+  // The line markers look like: # 12 "/path/to/file.h" 1
+  const String text = source.string_copy();
+  String result;
+  result.reserve(text.size());
+
+  for (size_t begin = 0; begin < text.size();) {
+    size_t end = text.find('\n', begin);
+    end = (end == String::npos) ? text.size() : end + 1;
+
+    size_t open = String::npos, close = String::npos;
+    if (text.compare(begin, 2, "# ") == 0 ||
+        text.compare(begin, 6, "#line ") == 0) {
+      open = text.find('"', begin);
+      close = open < end ? text.find('"', open + 1) : String::npos;
+    }
+    if (close < end) {
+      result.append(text, begin, open + 1 - begin);
+      result += RebasePath(base_dir, current_dir,
+                           text.substr(open + 1, close - open - 1));
+      result.append(text, close, end - close);
+    } else {
+      result.append(text, begin, end - begin);
+    }
+
+    begin = end;
+  }
+
+  return Immutable(std::move(result));
+}
+
 }  // namespace daemon
 }  // namespace dist_clang
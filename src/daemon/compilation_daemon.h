@@ -2,22 +2,43 @@
 
 #include <base/process_forward.h>
 #include <cache/file_cache.h>
+#include <cache/write_back.h>
 #include <daemon/base_daemon.h>
 
+#include <third_party/gtest/exported/include/gtest/gtest_prod.h>
+
 namespace dist_clang {
 namespace daemon {
 
+FORWARD_TEST(CompilationDaemonTest, WriteBackOwnsSource);
+
 class CompilationDaemon : public BaseDaemon {
  public:
   bool Initialize() override;
   bool UpdateConfiguration(const proto::Configuration& configuration) override;
 
+  static UniquePtr<cache::FileCache> CreateCache(
+      const proto::Configuration::Cache& cache_conf);
+  // Configures the cache, but doesn't run it. Returns |nullptr| on the invalid
+  // configuration.
+
   static base::ProcessPtr CreateProcess(const base::proto::Flags& flags,
                                         ui32 user_id,
                                         Immutable cwd_path = Immutable());
   static base::ProcessPtr CreateProcess(const base::proto::Flags& flags,
                                         Immutable cwd_path = Immutable());
 
+  static void RebaseFlags(const String& base_dir, const String& current_dir,
+                          base::proto::Flags* flags);
+  // Rewrites the absolute paths under |base_dir| in the flags relative to
+  // |current_dir| and adds the matching debug prefix maps. Does nothing, if
+  // the |current_dir| isn't under the |base_dir|.
+
+  static Immutable RebaseSource(const String& base_dir,
+                                const String& current_dir,
+                                const Immutable& source);
+  // The same for the paths in the line markers of the preprocessed source.
+
  protected:
   explicit CompilationDaemon(const proto::Configuration& configuration);
 
@@ -35,11 +56,13 @@ class CompilationDaemon : public BaseDaemon {
   bool SearchSimpleCache(const base::proto::Flags& flags,
                          const cache::string::HandledSource& source,
                          const cache::ExtraFiles& extra_files,
-                         cache::FileCache::Entry* entry) const;
+                         cache::FileCache::Entry* entry,
+                         bool lazy_object = false) const;
 
   bool SearchDirectCache(const base::proto::Flags& flags,
                          const String& current_dir,
-                         cache::FileCache::Entry* entry) const;
+                         cache::FileCache::Entry* entry,
+                         bool lazy_object = false) const;
 
   void UpdateSimpleCache(const base::proto::Flags& flags,
                          const cache::string::HandledSource& source,
@@ -49,15 +72,33 @@ class CompilationDaemon : public BaseDaemon {
   void UpdateDirectCache(const base::proto::Local* message,
                          const cache::string::HandledSource& source,
                          const cache::ExtraFiles& extra_files,
-                         const cache::FileCache::Entry& entry);
+                         const cache::FileCache::Entry& entry,
+                         const List<String>& headers = List<String>());
+  // Both methods store the entry in background, if the write-back is enabled:
+  // the |entry|, the |source| and the input file are copied, so the caller may
+  // overwrite or free them right after the call. The |headers| are taken from
+  // the deps of the |entry|, if not known from the preprocessing.
+
+  void UpdateDependCache(const base::proto::Local* message,
+                         const cache::ExtraFiles& extra_files,
+                         const cache::FileCache::Entry& entry,
+                         std::chrono::system_clock::time_point compile_start);
+  // Stores the entry of the compilation without the preprocessed source - the
+  // headers are taken from the deps of the |entry|, and stand for the source
+  // in both caches. Nothing is stored, if any header is changed since the
+  // |compile_start| - the object may not match its current contents.
 
   inline SharedPtr<const proto::Configuration> conf() const { return conf_; }
 
  private:
+  FRIEND_TEST(CompilationDaemonTest, WriteBackOwnsSource);
+
   using PluginNameMap = HashMap<String /* name */, String /* path */>;
 
   SharedPtr<const proto::Configuration> conf_;
   UniquePtr<cache::FileCache> cache_;
+  UniquePtr<cache::WriteBack> write_back_;
+  // Should be destroyed before |cache_| - to complete the pending updates.
 };
 
 }  // namespace daemon
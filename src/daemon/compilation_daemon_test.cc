@@ -1,6 +1,7 @@
 #include <daemon/compilation_daemon.h>
 
 #include <base/process.h>
+#include <base/temporary_dir.h>
 
 #include <third_party/gtest/exported/include/gtest/gtest.h>
 
@@ -62,5 +63,150 @@ TEST(CompilationDaemonTest, CreateProcessFromFlags) {
   }
 }
 
+TEST(CompilationDaemonTest, RebaseFlags) {
+  const List<String> expected_other = {
+      "-cc1",
+      "-isystem",
+      "../third_party/include",
+      "-fprofile-instr-use=default.profdata",
+      "-isystem",
+      "/usr/include",
+      "-isystem../gen",
+      "-iquote../src",
+      "-idirafter../../include",
+      "-isysroot/usr/sdk",
+      "-iwithprefixbefore../include",
+  };
+  const List<String> expected_non_cached = {
+      "-I../include", "-D", "ROOT=/base/repo", "-DDATA=/base/repo/data",
+      "-includeconfig.h", "-include-pch", "prefix.pch",
+  };
+  const List<String> expected_non_direct = {
+      "-fdebug-compilation-dir",
+      "/base/repo/out",
+      "-fdebug-prefix-map=/base=../..",
+      "-fdebug-prefix-map=/base/repo=..",
+      "-fdebug-prefix-map=/base/repo/out=.",
+  };
+
+  base::proto::Flags flags;
+  flags.add_other()->assign("-cc1");
+  flags.add_other()->assign("-isystem");
+  flags.add_other()->assign("/base/repo/third_party/include");
+  flags.add_other()->assign(
+      "-fprofile-instr-use=/base/repo/out/default.profdata");
+  flags.add_other()->assign("-isystem");
+  flags.add_other()->assign("/usr/include");
+  flags.add_other()->assign("-isystem/base/repo/gen");
+  flags.add_other()->assign("-iquote/base/repo/src");
+  flags.add_other()->assign("-idirafter/base/include");
+  flags.add_other()->assign("-isysroot/usr/sdk");
+  flags.add_other()->assign("-iwithprefixbefore/base/repo/include");
+  flags.add_non_cached()->assign("-I/base/repo/include");
+  flags.add_non_cached()->assign("-D");
+  flags.add_non_cached()->assign("ROOT=/base/repo");
+  flags.add_non_cached()->assign("-DDATA=/base/repo/data");
+  flags.add_non_cached()->assign("-include/base/repo/out/config.h");
+  flags.add_non_cached()->assign("-include-pch");
+  flags.add_non_cached()->assign("/base/repo/out/prefix.pch");
+  flags.add_non_direct()->assign("-fdebug-compilation-dir");
+  flags.add_non_direct()->assign("/base/repo/out");
+  flags.set_input("/base/repo/src/test.cc");
+
+  CompilationDaemon::RebaseFlags("/base", "/base/repo/out", &flags);
+  EXPECT_EQ(expected_other,
+            List<String>(flags.other().begin(), flags.other().end()));
+  EXPECT_EQ(expected_non_cached, List<String>(flags.non_cached().begin(),
+                                              flags.non_cached().end()));
+  EXPECT_EQ(expected_non_direct, List<String>(flags.non_direct().begin(),
+                                              flags.non_direct().end()));
+  EXPECT_EQ("../src/test.cc", flags.input());
+
+  // Nothing changes outside of the base directory.
+  base::proto::Flags other_flags;
+  other_flags.set_input("/base/repo/src/test.cc");
+  CompilationDaemon::RebaseFlags("/base", "/home/user", &other_flags);
+  EXPECT_EQ("/base/repo/src/test.cc", other_flags.input());
+  EXPECT_EQ(0, other_flags.non_direct_size());
+}
+
+TEST(CompilationDaemonTest, RebaseSource) {
+  const Immutable source(
+      "# 1 \"/base/repo/src/test.cc\"\n"
+      "# 1 \"/usr/include/stdio.h\" 1 3\n"
+      "const char* file = \"/base/repo/src/test.cc\";\n"
+      "#line 7 \"/base/repo/out/gen.h\"\n"_l);
+  const String expected_source =
+      "# 1 \"../src/test.cc\"\n"
+      "# 1 \"/usr/include/stdio.h\" 1 3\n"
+      "const char* file = \"/base/repo/src/test.cc\";\n"
+      "#line 7 \"gen.h\"\n";
+
+  EXPECT_EQ(expected_source,
+            String(CompilationDaemon::RebaseSource("/base", "/base/repo/out",
+                                                   source)));
+  EXPECT_EQ(String(source),
+            String(CompilationDaemon::RebaseSource("/base", "/home/user",
+                                                   source)));
+}
+
+TEST(CompilationDaemonTest, WriteBackOwnsSource) {
+  class TestDaemon : public CompilationDaemon {
+   public:
+    explicit TestDaemon(const proto::Configuration& configuration)
+        : CompilationDaemon(configuration) {}
+
+   private:
+    bool HandleNewMessage(net::ConnectionPtr, Universal,
+                          const net::proto::Status&) override {
+      return false;
+    }
+  };
+
+  const base::TemporaryDir temp_dir;
+  const String expected_source = "int main() { return 0; }";
+  const String expected_object = "object code";
+
+  proto::Configuration conf;
+
+  base::proto::Flags flags;
+  flags.mutable_compiler()->set_version("fake_compiler_version");
+  flags.set_action("fake_action");
+
+  TestDaemon daemon(conf);
+  daemon.cache_.reset(new cache::FileCache(temp_dir));
+  ASSERT_TRUE(daemon.cache_->Run(1));
+  daemon.write_back_.reset(new cache::WriteBack(1024 * 1024, 1));
+  daemon.write_back_->Run();
+
+  // The single writer is busy, until the source is freed.
+  std::mutex mutex;
+  UniqueLock lock(mutex);
+  daemon.write_back_->Push("block", 0, [&mutex] {
+    std::lock_guard<std::mutex> lock(mutex);
+  });
+
+  {
+    // Like the source of the remote message in the absorber.
+    UniquePtr<String> buffer(new String(expected_source));
+    cache::FileCache::Entry entry;
+    entry.object = Immutable(expected_object);
+    daemon.UpdateSimpleCache(
+        flags, cache::string::HandledSource(Immutable::WrapString(*buffer)),
+        cache::ExtraFiles(), entry);
+
+    buffer->assign(buffer->size(), 'x');
+    buffer.reset();
+  }
+  lock.unlock();
+  daemon.write_back_.reset();
+
+  cache::FileCache::Entry entry;
+  ASSERT_TRUE(daemon.SearchSimpleCache(
+      flags, cache::string::HandledSource(Immutable(expected_source)),
+      cache::ExtraFiles(), &entry));
+  EXPECT_EQ(expected_object, entry.object.string_copy());
+}
+
 }  // namespace daemon
 }  // namespace dist_clang
@@ -16,6 +16,16 @@ namespace daemon {
 
 DEFINE_string(config, String(), "Path to the configuration file");
 DEFINE_bool(daemon, false, "Daemonize after start");
+DEFINE_string(export_bundle, String(),
+              "Export the cache entries into the bundle file ('-' - stdout) "
+              "and exit");
+DEFINE_string(import_bundle, String(),
+              "Import the cache entries from the bundle file ('-' - stdin) "
+              "and exit");
+DEFINE_uint64(bundle_since, 0,
+              "Export only the entries used in this number of seconds");
+DEFINE_string(bundle_hashes, String(),
+              "Export only the entries with the hashes listed in this file");
 
 Configuration::Configuration(int argc, char* argv[]) {
   gflags::SetUsageMessage("Daemon from Clang distributed system.");
@@ -30,6 +40,10 @@ Configuration::Configuration(int argc, char* argv[]) {
                << error;
   }
   daemonize_ = FLAGS_daemon;
+  export_bundle_ = FLAGS_export_bundle;
+  import_bundle_ = FLAGS_import_bundle;
+  bundle_since_ = FLAGS_bundle_since;
+  bundle_hashes_ = FLAGS_bundle_hashes;
 }
 
 Configuration::~Configuration() {
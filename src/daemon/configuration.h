@@ -16,9 +16,17 @@ class Configuration {
   inline const proto::Configuration& config() const { return config_; }
   inline const bool daemonize() const { return daemonize_; }
 
+  // The cache is exported or imported instead of running the daemon.
+  inline const String& export_bundle() const { return export_bundle_; }
+  inline const String& import_bundle() const { return import_bundle_; }
+  inline ui64 bundle_since() const { return bundle_since_; }
+  inline const String& bundle_hashes() const { return bundle_hashes_; }
+
  private:
   proto::Configuration config_;
   bool daemonize_ = false;
+  String export_bundle_, import_bundle_, bundle_hashes_;
+  ui64 bundle_since_ = 0;
 };
 
 }  // namespace daemon
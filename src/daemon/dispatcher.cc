@@ -0,0 +1,161 @@
+#include <daemon/dispatcher.h>
+
+#include <base/assert.h>
+
+#include STL(algorithm)
+
+namespace dist_clang {
+namespace daemon {
+
+namespace {
+
+// The weight of the new sample in the moving averages.
+const double kSmoothing = 0.2;
+
+// in seconds.
+const ui32 kMaxBackoff = 64;
+
+inline double Seconds(Clock::duration duration) {
+  return std::chrono::duration<double>(duration).count();
+}
+
+}  // namespace
+
+Dispatcher::Execution::Execution(Dispatcher* WEAK_PTR dispatcher, ui32 path,
+                                 ui64 size)
+    : dispatcher_(dispatcher), path_(path), size_(size) {
+  DCHECK(dispatcher_);
+}
+
+Dispatcher::Execution::~Execution() {
+  if (!finished_) {
+    Finish(outcome_);
+  }
+}
+
+void Dispatcher::Execution::Finish(Outcome outcome) {
+  DCHECK(!finished_);
+  finished_ = true;
+  dispatcher_->Done(path_, size_, round_trip_, Clock::now() - start_, outcome);
+}
+
+Dispatcher::Dispatcher(ui32 local_slots, float local_weight) {
+  paths_.emplace_back(local_slots, local_weight);
+}
+
+ui32 Dispatcher::AddRemote(ui32 slots, float weight) {
+  paths_.emplace_back(slots, weight);
+  return paths_.size() - 1;
+}
+
+ui32 Dispatcher::Assign(ui64 size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto now = Clock::now();
+
+  ui32 best = LOCAL;
+  double best_cost = 0;
+  bool found = false;
+  for (ui32 i = 0; i < paths_.size(); ++i) {
+    const auto& path = paths_[i];
+    if (!path.slots) {
+      continue;
+    }
+
+    // The local path wins the ties - it doesn't use the network.
+    const double cost = path.weight * DoExpectedTime(path, size, now);
+    if (!found || cost < best_cost) {
+      best = i;
+      best_cost = cost;
+      found = true;
+    }
+  }
+
+  ++paths_[best].in_flight;
+  return best;
+}
+
+void Dispatcher::AssignTo(ui32 path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  DCHECK(path < paths_.size());
+  ++paths_[path].in_flight;
+}
+
+void Dispatcher::Done(ui32 path_index, ui64 size, Clock::duration round_trip,
+                      Clock::duration total, Outcome outcome) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  DCHECK(path_index < paths_.size());
+  auto& path = paths_[path_index];
+
+  DCHECK(path.in_flight);
+  --path.in_flight;
+
+  if (outcome == CANCELLED) {
+    return;
+  }
+
+  if (outcome == FAILED) {
+    const ui32 backoff =
+        std::min(kMaxBackoff, 1u << std::min(path.failures, 6u));
+    path.blocked_until = Clock::now() + std::chrono::seconds(backoff);
+    ++path.failures;
+    return;
+  }
+
+  path.failures = 0;
+
+  const double total_time = Seconds(total);
+  const double round_trip_time = Seconds(round_trip);
+  Update(&path.round_trip, round_trip_time, !path.samples);
+  Update(&path.task_time, total_time, !path.samples);
+  Update(&task_time_, total_time, !samples_);
+  ++path.samples;
+  ++samples_;
+
+  if (size && total_time > round_trip_time) {
+    const double throughput = size / (total_time - round_trip_time);
+    Update(&path.throughput, throughput, path.throughput == 0);
+    Update(&throughput_, throughput, throughput_ == 0);
+  }
+}
+
+double Dispatcher::ExpectedTime(ui32 path, ui64 size) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  DCHECK(path < paths_.size());
+  return DoExpectedTime(paths_[path], size, Clock::now());
+}
+
+void Dispatcher::Update(double* value, double sample, bool first) const {
+  DCHECK(value);
+  if (first) {
+    *value = sample;
+  } else {
+    *value += kSmoothing * (sample - *value);
+  }
+}
+
+double Dispatcher::DoExpectedTime(const Path& path, ui64 size,
+                                  TimePoint now) const {
+  // Without any completed task the paths differ only in the load - in the
+  // units of a task time.
+  const double task_time =
+      path.samples ? path.task_time : samples_ ? task_time_ : 1.0;
+  const double throughput = path.throughput ? path.throughput : throughput_;
+
+  double service = task_time;
+  if (size && throughput) {
+    service = path.round_trip + size / throughput;
+  }
+
+  // The tasks ahead, that don't have a free slot, are waited for.
+  const ui32 backlog =
+      path.in_flight >= path.slots ? path.in_flight + 1 - path.slots : 0;
+  double wait = path.slots ? backlog * task_time / path.slots : 0;
+  if (path.blocked_until > now) {
+    wait += Seconds(path.blocked_until - now);
+  }
+
+  return wait + service;
+}
+
+}  // namespace daemon
+}  // namespace dist_clang
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <base/aliases.h>
+#include <base/attributes.h>
+
+#include STL(mutex)
+
+namespace dist_clang {
+namespace daemon {
+
+// Chooses the path of every compilation - the local one or one of the remotes
+// - with the lowest expected completion time. The expectation of a path is
+// learned from its completed tasks: the round-trip time, the throughput in
+// bytes of the source per second and the time of a task - and takes the tasks
+// in flight into account, that are assigned to the path and not done yet.
+//
+// The failed path isn't chosen for a while - the period doubles with every
+// failure in a row.
+class Dispatcher {
+ public:
+  enum : ui32 { LOCAL = 0 };
+
+  enum Outcome {
+    SUCCEEDED,
+    FAILED,
+    CANCELLED,
+    // Tells nothing about the path - e.g. the client has gone.
+  };
+
+  // Reports the task as done on destruction - as cancelled, unless another
+  // outcome is set.
+  class Execution {
+   public:
+    Execution(Dispatcher* WEAK_PTR dispatcher, ui32 path, ui64 size);
+    ~Execution();
+
+    Execution(const Execution&) = delete;
+
+    inline void SetRoundTrip(Clock::duration round_trip) {
+      round_trip_ = round_trip;
+    }
+    inline void SetSize(ui64 size) { size_ = size; }
+    inline void SetOutcome(Outcome outcome) { outcome_ = outcome; }
+
+    void Finish(Outcome outcome);
+    // Reports right away - e.g. before the task is dispatched again.
+
+   private:
+    Dispatcher* WEAK_PTR dispatcher_;
+    const ui32 path_;
+    ui64 size_;
+    const TimePoint start_ = Clock::now();
+    Clock::duration round_trip_ = Clock::duration::zero();
+    Outcome outcome_ = CANCELLED;
+    bool finished_ = false;
+  };
+
+  Dispatcher(ui32 local_slots, float local_weight);
+  // No local slots - the local path is never chosen.
+
+  ui32 AddRemote(ui32 slots, float weight) THREAD_UNSAFE;
+  // Returns the path of the new remote.
+
+  ui32 Assign(ui64 size) THREAD_SAFE;
+  // The |size| of the source in bytes - 0, if not known yet.
+
+  void AssignTo(ui32 path) THREAD_SAFE;
+  // Puts the task on the |path| without the choice - e.g. the failed tasks are
+  // always compiled locally.
+
+  void Done(ui32 path, ui64 size, Clock::duration round_trip,
+            Clock::duration total, Outcome outcome) THREAD_SAFE;
+
+  double ExpectedTime(ui32 path, ui64 size) const THREAD_SAFE;
+  // in seconds, without the weight of the path.
+
+ private:
+  struct Path {
+    Path(ui32 slots, float weight) : slots(slots), weight(weight) {}
+
+    const ui32 slots;
+    const float weight;
+
+    ui32 in_flight = 0;
+    ui32 samples = 0;
+    double round_trip = 0, throughput = 0, task_time = 0;
+    // in seconds and bytes per second. The throughput is 0, while there are
+    // no completed tasks of the known size.
+
+    ui32 failures = 0;
+    TimePoint blocked_until;
+  };
+
+  void Update(double* value, double sample, bool first) const;
+  double DoExpectedTime(const Path& path, ui64 size, TimePoint now) const;
+
+  mutable std::mutex mutex_;
+  Vector<Path> paths_;
+
+  ui32 samples_ = 0;
+  double throughput_ = 0, task_time_ = 0;
+  // Of all paths - for the paths without the completed tasks yet.
+};
+
+}  // namespace daemon
+}  // namespace dist_clang
@@ -0,0 +1,86 @@
+#include <daemon/dispatcher.h>
+
+#include <third_party/gtest/exported/include/gtest/gtest.h>
+
+namespace dist_clang {
+namespace daemon {
+
+using namespace std::chrono;
+
+TEST(DispatcherTest, SpreadsByLoadWithoutHistory) {
+  Dispatcher dispatcher(2, 1.0f);
+  const ui32 remote = dispatcher.AddRemote(2, 1.0f);
+
+  // The local path wins the ties.
+  EXPECT_EQ(Dispatcher::LOCAL, dispatcher.Assign(0));
+  EXPECT_EQ(Dispatcher::LOCAL, dispatcher.Assign(0));
+  EXPECT_EQ(remote, dispatcher.Assign(0));
+  EXPECT_EQ(remote, dispatcher.Assign(0));
+  EXPECT_EQ(Dispatcher::LOCAL, dispatcher.Assign(0));
+}
+
+TEST(DispatcherTest, PrefersFasterPath) {
+  Dispatcher dispatcher(4, 1.0f);
+  const ui32 remote = dispatcher.AddRemote(4, 1.0f);
+
+  // The local compilation of 1MB takes 4 seconds, the remote one - 1 second
+  // with the round-trip of 100ms.
+  dispatcher.AssignTo(Dispatcher::LOCAL);
+  dispatcher.Done(Dispatcher::LOCAL, 1000000, seconds(0), seconds(4),
+                  Dispatcher::SUCCEEDED);
+  dispatcher.AssignTo(remote);
+  dispatcher.Done(remote, 1000000, milliseconds(100), seconds(1),
+                  Dispatcher::SUCCEEDED);
+
+  EXPECT_NEAR(4.0, dispatcher.ExpectedTime(Dispatcher::LOCAL, 1000000), 1e-6);
+  EXPECT_NEAR(1.0, dispatcher.ExpectedTime(remote, 1000000), 1e-6);
+  EXPECT_EQ(remote, dispatcher.Assign(1000000));
+
+  // When the remote slots are busy, the rest waits in the queue of the remote
+  // - until the wait is longer than the local compilation.
+  for (ui32 i = 0; i < 4; ++i) {
+    EXPECT_EQ(remote, dispatcher.Assign(1000000));
+  }
+  ui32 local = 0;
+  for (ui32 i = 0; i < 20; ++i) {
+    local += dispatcher.Assign(1000000) == Dispatcher::LOCAL;
+  }
+  EXPECT_LT(0u, local);
+}
+
+TEST(DispatcherTest, RespectsWeight) {
+  Dispatcher dispatcher(1, 1.0f);
+  const ui32 remote = dispatcher.AddRemote(1, 0.5f);
+
+  EXPECT_EQ(remote, dispatcher.Assign(0));
+}
+
+TEST(DispatcherTest, AvoidsFailedPath) {
+  Dispatcher dispatcher(0, 1.0f);
+  const ui32 first = dispatcher.AddRemote(2, 1.0f);
+  const ui32 second = dispatcher.AddRemote(2, 1.0f);
+
+  // The local path has no slots.
+  ASSERT_EQ(first, dispatcher.Assign(0));
+  dispatcher.Done(first, 0, seconds(0), seconds(0), Dispatcher::FAILED);
+  EXPECT_LT(0.5, dispatcher.ExpectedTime(first, 0) -
+                     dispatcher.ExpectedTime(second, 0));
+
+  EXPECT_EQ(second, dispatcher.Assign(0));
+  EXPECT_EQ(second, dispatcher.Assign(0));
+}
+
+TEST(DispatcherTest, CancelledTaskLeavesNoSample) {
+  Dispatcher dispatcher(1, 1.0f);
+
+  dispatcher.AssignTo(Dispatcher::LOCAL);
+  {
+    Dispatcher::Execution execution(&dispatcher, Dispatcher::LOCAL, 100);
+  }
+
+  // Without any sample the time is in the units of a task.
+  EXPECT_NEAR(1.0, dispatcher.ExpectedTime(Dispatcher::LOCAL, 100), 1e-6);
+}
+
+}  // namespace daemon
+}  // namespace dist_clang
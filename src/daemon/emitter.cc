@@ -9,6 +9,10 @@
 #include <perf/stat_reporter.h>
 #include <perf/stat_service.h>
 
+#include STL(algorithm)
+
+#include <unistd.h>
+
 #include <base/using_log.h>
 
 using namespace std::placeholders;
@@ -35,40 +39,9 @@ inline String GetDepsPath(const base::proto::Local* WEAK_PTR message) {
   }
 }
 
-inline bool GenerateSource(const base::proto::Local* WEAK_PTR message,
-                           cache::string::HandledSource* source) {
-  base::proto::Flags pp_flags;
-
-  DCHECK(message);
-  pp_flags.CopyFrom(message->flags());
-  pp_flags.clear_cc_only();
-  pp_flags.set_output("-");
-  pp_flags.set_action("-E");
-
-  // Clang plugins can't affect source code.
-  pp_flags.mutable_compiler()->clear_plugins();
-
-  // Sanitize blacklist can't affect source code
-  pp_flags.clear_sanitize_blacklist();
-
-  base::ProcessPtr process;
-  if (message->has_user_id()) {
-    process = daemon::CompilationDaemon::CreateProcess(
-        pp_flags, message->user_id(), Immutable(message->current_dir()));
-  } else {
-    process = daemon::CompilationDaemon::CreateProcess(
-        pp_flags, Immutable(message->current_dir()));
-  }
-
-  if (!process->Run(10)) {
-    return false;
-  }
-
-  if (source) {
-    source->str.assign(process->stdout());
-  }
-
-  return true;
+inline ui64 MicrosecondsSince(const TimePoint& time_point) {
+  using namespace std::chrono;
+  return duration_cast<microseconds>(Clock::now() - time_point).count();
 }
 
 }  // namespace
@@ -82,14 +55,33 @@ Emitter::Emitter(const proto::Configuration& configuration)
   CHECK(config->has_emitter());
 
   workers_.reset(new base::WorkerPool);
-  all_tasks_.reset(new Queue);
   cache_tasks_.reset(new Queue);
   failed_tasks_.reset(new Queue);
 
+  const ui32 stage_queue_size =
+      config->has_cache() ? config->cache().stage_queue_size() : 0;
+  preprocess_tasks_.reset(new Queue(stage_queue_size));
+  simple_tasks_.reset(new Queue(stage_queue_size));
+
+  // All paths are known before any worker starts.
+  const bool local = !config->emitter().only_failed();
+  dispatcher_.reset(new Dispatcher(local ? config->emitter().threads() : 0,
+                                   config->emitter().local_weight()));
+  path_tasks_.emplace_back(new Queue);
+  Vector<ui32> remote_paths;
+  for (const auto& remote : config->emitter().remotes()) {
+    if (!remote.disabled()) {
+      remote_paths.push_back(
+          dispatcher_->AddRemote(remote.threads(), remote.weight()));
+      path_tasks_.emplace_back(new Queue);
+      DCHECK(remote_paths.back() == path_tasks_.size() - 1);
+    }
+  }
+
   local_tasks_.reset(new QueueAggregator);
   local_tasks_->Aggregate(failed_tasks_.get());
-  if (!config->emitter().only_failed()) {
-    local_tasks_->Aggregate(all_tasks_.get());
+  if (local) {
+    local_tasks_->Aggregate(path_tasks_[Dispatcher::LOCAL].get());
   }
 
   {
@@ -99,15 +91,42 @@ Emitter::Emitter(const proto::Configuration& configuration)
   }
 
   if (config->has_cache() && !config->cache().disabled()) {
-    Worker worker = std::bind(&Emitter::DoCheckCache, this, _1);
-    if (config->cache().has_threads()) {
-      workers_->AddWorker("Cache Worker"_l, worker, config->cache().threads());
-    } else {
-      workers_->AddWorker("Cache Worker"_l, worker,
-                          std::thread::hardware_concurrency());
-    }
+    const auto& cache = config->cache();
+    const ui32 default_threads = std::thread::hardware_concurrency();
+
+    Worker worker = std::bind(&Emitter::DoCheckDirectCache, this, _1);
+    workers_->AddWorker("Direct Cache Worker"_l, worker,
+                        cache.has_threads() ? cache.threads() : default_threads);
+
+    worker = std::bind(&Emitter::DoPreprocess, this, _1);
+    workers_->AddWorker("Preprocess Worker"_l, worker,
+                        cache.has_preprocess_threads()
+                            ? cache.preprocess_threads()
+                            : default_threads);
+
+    worker = std::bind(&Emitter::DoCheckSimpleCache, this, _1);
+    workers_->AddWorker(
+        "Simple Cache Worker"_l, worker,
+        cache.has_simple_threads() ? cache.simple_threads() : default_threads);
+  }
+
+  if (config->has_cache() && !config->cache().disabled() &&
+      config->emitter().preprocessors()) {
+    preprocessors_.reset(
+        new PreprocessorPool(config->emitter().preprocessors()));
+  }
+
+  if (std::any_of(config->emitter().remotes().begin(),
+                  config->emitter().remotes().end(), [](const auto& remote) {
+                    return !remote.disabled() && remote.channels();
+                  })) {
+    channel_replies_.reset(new base::ThreadPool(
+        base::ThreadPool::TaskQueue::UNLIMITED,
+        std::thread::hardware_concurrency()));
+    channel_replies_->Run();
   }
 
+  auto remote_path = remote_paths.begin();
   for (const auto& remote : config->emitter().remotes()) {
     if (!remote.disabled()) {
       auto resolver = [
@@ -119,18 +138,37 @@ Emitter::Emitter(const proto::Configuration& configuration)
         optional->Wait();
         return optional->GetValue();
       };
-      Worker worker = std::bind(&Emitter::DoRemoteExecute, this, _1, resolver);
-      workers_->AddWorker("Remote Execute Worker"_l, worker, remote.threads());
+      const ui32 path = *remote_path++;
+      if (remote.channels()) {
+        // The threads of the remote are shared by its channels.
+        const ui32 max_in_flight =
+            std::max(1u, remote.threads() / remote.channels());
+        Worker worker = std::bind(&Emitter::DoRemoteChannel, this, _1,
+                                  resolver, path, max_in_flight);
+        workers_->AddWorker("Remote Channel Worker"_l, worker,
+                            remote.channels());
+      } else {
+        Worker worker =
+            std::bind(&Emitter::DoRemoteExecute, this, _1, resolver, path);
+        workers_->AddWorker("Remote Execute Worker"_l, worker,
+                            remote.threads());
+      }
     }
   }
 }
 
 Emitter::~Emitter() {
-  all_tasks_->Close();
+  for (auto& queue : path_tasks_) {
+    queue->Close();
+  }
   cache_tasks_->Close();
+  preprocess_tasks_->Close();
+  simple_tasks_->Close();
   failed_tasks_->Close();
   local_tasks_->Close();
   workers_.reset();
+  // The channels fail their requests on destruction - with the workers.
+  channel_replies_.reset();
 }
 
 bool Emitter::Initialize() {
@@ -159,6 +197,21 @@ bool Emitter::Initialize() {
     }
   }
 
+  if (config->has_cache() && config->cache().depend()) {
+    if (!config->cache().direct()) {
+      LOG(ERROR) << "The flag \"cache.depend\" requires \"cache.direct\"";
+      return false;
+    }
+
+    // The remote compilations don't give the deps of the original source.
+    for (const auto& remote : config->emitter().remotes()) {
+      if (!remote.disabled()) {
+        LOG(ERROR) << "The flag \"cache.depend\" can't be used with remotes";
+        return false;
+      }
+    }
+  }
+
   return CompilationDaemon::Initialize();
 }
 
@@ -179,13 +232,15 @@ bool Emitter::HandleNewMessage(net::ConnectionPtr connection, Universal message,
   if (message->HasExtension(base::proto::Local::extension)) {
     Message execute(message->ReleaseExtension(base::proto::Local::extension));
     if (config->has_cache() && !config->cache().disabled()) {
-      return cache_tasks_->Push(std::make_tuple(connection, std::move(execute),
-                                                HandledSource(),
-                                                cache::ExtraFiles{}));
+      RebaseFlags(config->cache().base_dir(), execute->current_dir(),
+                  execute->mutable_flags());
+      return cache_tasks_->Push(std::make_tuple(
+          connection, std::move(execute), HandledSource(), cache::ExtraFiles{},
+          List<String>(), Clock::now()));
     } else {
-      return all_tasks_->Push(std::make_tuple(connection, std::move(execute),
-                                              HandledSource(),
-                                              cache::ExtraFiles{}));
+      return Dispatch(std::make_tuple(connection, std::move(execute),
+                                      HandledSource(), cache::ExtraFiles{},
+                                      List<String>(), Clock::now()));
     }
   }
 
@@ -203,15 +258,150 @@ void Emitter::SetExtraFiles(const cache::ExtraFiles& extra_files,
   }
 }
 
-void Emitter::DoCheckCache(const base::WorkerPool& pool) {
-  using namespace cache::string;
+bool Emitter::GenerateSource(const base::proto::Local* WEAK_PTR message,
+                             cache::string::HandledSource* source,
+                             List<String>* headers) {
+  base::proto::Flags pp_flags;
+
+  DCHECK(message);
+  DCHECK(headers);
+  pp_flags.CopyFrom(message->flags());
+  pp_flags.clear_cc_only();
+  pp_flags.set_output("-");
+  pp_flags.set_action("-E");
 
+  // Clang plugins can't affect source code.
+  pp_flags.mutable_compiler()->clear_plugins();
+
+  // Sanitize blacklist can't affect source code
+  pp_flags.clear_sanitize_blacklist();
+
+  // The preprocessor in the daemon's process reads the headers with the
+  // daemon's credentials - so the other users are served by the compiler
+  // process, that runs with their own. Also, unlike the process, the run in
+  // the daemon's process isn't limited in time.
+  const String& base_dir = conf()->cache().base_dir();
+  const bool same_user =
+      !message->has_user_id() || message->user_id() == geteuid();
+  if (preprocessors_ && same_user && PreprocessorPool::IsCompatible(pp_flags)) {
+    Immutable output;
+    String error;
+    if (preprocessors_->Run(pp_flags, message->current_dir(), &output,
+                            headers, &error)) {
+      if (source) {
+        source->str.assign(
+            RebaseSource(base_dir, message->current_dir(), output));
+      }
+      STAT(PREPROCESS_IN_PROCESS);
+      return true;
+    }
+
+    // The compiler process reports the actual errors.
+    LOG(VERBOSE) << "In-process preprocessing failed: " << error;
+    STAT(PREPROCESS_FALLBACK);
+  }
+
+  base::ProcessPtr process;
+  if (message->has_user_id()) {
+    process = CreateProcess(pp_flags, message->user_id(),
+                            Immutable(message->current_dir()));
+  } else {
+    process = CreateProcess(pp_flags, Immutable(message->current_dir()));
+  }
+
+  if (!process->Run(10)) {
+    return false;
+  }
+
+  if (source) {
+    source->str.assign(
+        RebaseSource(base_dir, message->current_dir(), process->stdout()));
+  }
+
+  return true;
+}
+
+bool Emitter::RestoreFromCache(Task& task,
+                               const cache::FileCache::Entry& entry) {
+  base::proto::Local* incoming = std::get<MESSAGE>(task).get();
+  String error;
+  const String output_path = GetOutputPath(incoming);
+
+  // The hard-link would change the owner of the cached file too.
+  const bool hardlink = conf()->cache().hardlink() && !incoming->has_user_id();
+  if (!cache::FileCache::RestoreObject(entry, output_path, hardlink, &error)) {
+    LOG(ERROR) << "Failed to write file from cache: " << output_path << " : "
+               << error;
+    return false;
+  }
+  if (incoming->has_user_id() &&
+      !base::ChangeOwner(output_path, incoming->user_id(), &error)) {
+    LOG(ERROR) << "Failed to change owner for " << output_path << " : "
+               << error;
+  }
+
+  if (incoming->flags().has_deps_file()) {
+    DCHECK(!entry.deps.empty());
+
+    const String deps_path = GetDepsPath(incoming);
+
+    if (!base::File::Write(deps_path, entry.deps, &error)) {
+      LOG(ERROR) << "Failed to write file from cache: " << deps_path << " : "
+                 << error;
+      return false;
+    }
+  }
+
+  // The source is empty after the direct cache hit.
+  const auto& source = std::get<SOURCE>(task);
+  if (!source.str.empty()) {
+    UpdateDirectCache(incoming, source, std::get<EXTRA_FILES>(task), entry,
+                      std::get<HEADERS>(task));
+  }
+
+  net::proto::Status status;
+  status.set_code(net::proto::Status::OK);
+  status.set_description(entry.stderr);
+  std::get<CONNECTION>(task)->ReportStatus(status);
+  LOG(INFO) << "Cache hit: " << incoming->flags().input();
+
+  return true;
+}
+
+bool Emitter::Dispatch(Task&& task) {
+  const ui32 path = dispatcher_->Assign(std::get<SOURCE>(task).str.size());
+  return path_tasks_[path]->Push(std::move(task));
+}
+
+void Emitter::PushFailed(Task&& task) {
+  dispatcher_->AssignTo(Dispatcher::LOCAL);
+  failed_tasks_->Push(std::move(task));
+}
+
+void Emitter::PushToStage(Queue* WEAK_PTR stage, Task&& task) {
+  DCHECK(stage);
+
+  std::get<QUEUED>(task) = Clock::now();
+  if (!stage->TryPush(task)) {
+    // The compilation is a cheaper wait than the whole queue of the stage.
+    STAT(STAGE_QUEUE_OVERFLOW);
+    Dispatch(std::move(task));
+  }
+}
+
+void Emitter::DoCheckDirectCache(const base::WorkerPool& pool) {
   while (!pool.IsShuttingDown()) {
     Optional&& task = cache_tasks_->Pop();
     if (!task) {
       break;
     }
 
+    STAT(DIRECT_STAGE_TASKS);
+    STAT(DIRECT_STAGE_WAIT, MicrosecondsSince(std::get<QUEUED>(*task)));
+    perf::Counter<perf::StatReporter> counter(
+        perf::proto::Metric::DIRECT_STAGE_TIME,
+        perf::StatReporter::MICROSECONDS);
+
     if (std::get<CONNECTION>(*task)->IsClosed()) {
       continue;
     }
@@ -219,84 +409,103 @@ void Emitter::DoCheckCache(const base::WorkerPool& pool) {
     base::proto::Local* incoming = std::get<MESSAGE>(*task).get();
     cache::FileCache::Entry entry;
 
-    auto RestoreFromCache = [&](const HandledSource& source,
-                                const cache::ExtraFiles& extra_files) {
-      String error;
-      const String output_path = GetOutputPath(incoming);
-
-      if (!base::File::Write(output_path, entry.object, &error)) {
-        LOG(ERROR) << "Failed to write file from cache: " << output_path
-                   << " : " << error;
-        return false;
-      }
-      if (incoming->has_user_id() &&
-          !base::ChangeOwner(output_path, incoming->user_id(), &error)) {
-        LOG(ERROR) << "Failed to change owner for " << output_path << " : "
-                   << error;
-      }
+    if (SearchDirectCache(incoming->flags(), incoming->current_dir(), &entry,
+                          true) &&
+        RestoreFromCache(*task, entry)) {
+      STAT(DIRECT_CACHE_HIT);
+      continue;
+    }
 
-      if (incoming->flags().has_deps_file()) {
-        DCHECK(!entry.deps.empty());
+    STAT(DIRECT_CACHE_MISS);
 
-        const String deps_path = GetDepsPath(incoming);
+    // Check that we have a compiler of a requested version.
+    net::proto::Status status;
+    if (!SetupCompiler(incoming->mutable_flags(), &status)) {
+      std::get<CONNECTION>(*task)->ReportStatus(status);
+      continue;
+    }
 
-        if (!base::File::Write(deps_path, entry.deps, &error)) {
-          LOG(ERROR) << "Failed to write file from cache: " << deps_path
-                     << " : " << error;
-          return false;
-        }
+    // In the depend mode the headers are taken from the deps of the
+    // compilation itself - there is nothing to preprocess.
+    if (conf()->cache().depend() && incoming->flags().has_deps_file()) {
+      if (!ReadExtraFiles(incoming->flags(), incoming->current_dir(),
+                          &std::get<EXTRA_FILES>(*task))) {
+        PushFailed(std::move(*task));
+      } else {
+        Dispatch(std::move(*task));
       }
+      continue;
+    }
 
-      if (!source.str.empty()) {
-        UpdateDirectCache(incoming, source, extra_files, entry);
-      }
+    PushToStage(preprocess_tasks_.get(), std::move(*task));
+  }
+}
 
-      net::proto::Status status;
-      status.set_code(net::proto::Status::OK);
-      status.set_description(entry.stderr);
-      std::get<CONNECTION>(*task)->ReportStatus(status);
-      LOG(INFO) << "Cache hit: " << incoming->flags().input();
+void Emitter::DoPreprocess(const base::WorkerPool& pool) {
+  while (!pool.IsShuttingDown()) {
+    Optional&& task = preprocess_tasks_->Pop();
+    if (!task) {
+      break;
+    }
 
-      return true;
-    };
+    STAT(PREPROCESS_STAGE_TASKS);
+    STAT(PREPROCESS_STAGE_WAIT, MicrosecondsSince(std::get<QUEUED>(*task)));
+    perf::Counter<perf::StatReporter> counter(
+        perf::proto::Metric::PREPROCESS_STAGE_TIME,
+        perf::StatReporter::MICROSECONDS);
 
-    if (SearchDirectCache(incoming->flags(), incoming->current_dir(), &entry) &&
-        RestoreFromCache(HandledSource(), cache::ExtraFiles{})) {
-      STAT(DIRECT_CACHE_HIT);
+    if (std::get<CONNECTION>(*task)->IsClosed()) {
       continue;
     }
 
-    STAT(DIRECT_CACHE_MISS);
+    base::proto::Local* incoming = std::get<MESSAGE>(*task).get();
 
-    // Check that we have a compiler of a requested version.
-    net::proto::Status status;
-    if (!SetupCompiler(incoming->mutable_flags(), &status)) {
-      std::get<CONNECTION>(*task)->ReportStatus(status);
+    if (!GenerateSource(incoming, &std::get<SOURCE>(*task),
+                        &std::get<HEADERS>(*task))) {
+      PushFailed(std::move(*task));
       continue;
     }
 
-    auto& source = std::get<SOURCE>(*task);
-    if (!GenerateSource(incoming, &source)) {
-      failed_tasks_->Push(std::move(*task));
+    if (!ReadExtraFiles(incoming->flags(), incoming->current_dir(),
+                        &std::get<EXTRA_FILES>(*task))) {
+      PushFailed(std::move(*task));
       continue;
     }
 
-    auto& extra_files = std::get<EXTRA_FILES>(*task);
-    if (!ReadExtraFiles(incoming->flags(), incoming->current_dir(),
-                        &extra_files)) {
-      failed_tasks_->Push(std::move(*task));
+    PushToStage(simple_tasks_.get(), std::move(*task));
+  }
+}
+
+void Emitter::DoCheckSimpleCache(const base::WorkerPool& pool) {
+  while (!pool.IsShuttingDown()) {
+    Optional&& task = simple_tasks_->Pop();
+    if (!task) {
+      break;
+    }
+
+    STAT(SIMPLE_STAGE_TASKS);
+    STAT(SIMPLE_STAGE_WAIT, MicrosecondsSince(std::get<QUEUED>(*task)));
+    perf::Counter<perf::StatReporter> counter(
+        perf::proto::Metric::SIMPLE_STAGE_TIME,
+        perf::StatReporter::MICROSECONDS);
+
+    if (std::get<CONNECTION>(*task)->IsClosed()) {
       continue;
     }
 
-    if (SearchSimpleCache(incoming->flags(), source, extra_files, &entry) &&
-        RestoreFromCache(source, extra_files)) {
+    base::proto::Local* incoming = std::get<MESSAGE>(*task).get();
+    cache::FileCache::Entry entry;
+
+    if (SearchSimpleCache(incoming->flags(), std::get<SOURCE>(*task),
+                          std::get<EXTRA_FILES>(*task), &entry, true) &&
+        RestoreFromCache(*task, entry)) {
       STAT(SIMPLE_CACHE_HIT);
       continue;
     }
 
     STAT(SIMPLE_CACHE_MISS);
 
-    all_tasks_->Push(std::move(*task));
+    Dispatch(std::move(*task));
   }
 }
 
@@ -307,6 +516,10 @@ void Emitter::DoLocalExecute(const base::WorkerPool& pool) {
       break;
     }
 
+    // Every local task is assigned to the local path - the failed ones too.
+    Dispatcher::Execution execution(dispatcher_.get(), Dispatcher::LOCAL,
+                                    std::get<SOURCE>(*task).str.size());
+
     if (std::get<CONNECTION>(*task)->IsClosed()) {
       continue;
     }
@@ -326,6 +539,7 @@ void Emitter::DoLocalExecute(const base::WorkerPool& pool) {
         incoming->has_user_id() ? incoming->user_id() : base::Process::SAME_UID;
     base::ProcessPtr process = CreateProcess(
         incoming->flags(), uid, Immutable(incoming->current_dir()));
+    const auto compile_start = std::chrono::system_clock::now();
     if (!process->Run(base::Process::UNLIMITED, &error)) {
       status.set_code(net::proto::Status::EXECUTION);
       if (!process->stderr().empty()) {
@@ -345,108 +559,195 @@ void Emitter::DoLocalExecute(const base::WorkerPool& pool) {
 
       const auto& source = std::get<SOURCE>(*task);
       const auto& extra_files = std::get<EXTRA_FILES>(*task);
+      const auto& headers = std::get<HEADERS>(*task);
 
-      if (!source.str.empty()) {
+      const bool depend =
+          conf()->cache().depend() && incoming->flags().has_deps_file();
+      if (!source.str.empty() || depend) {
         cache::FileCache::Entry entry;
         if (base::File::Read(GetOutputPath(incoming), &entry.object) &&
             (!incoming->flags().has_deps_file() ||
              base::File::Read(GetDepsPath(incoming), &entry.deps))) {
           entry.stderr = process->stderr();
-          UpdateSimpleCache(incoming->flags(), source, extra_files, entry);
-          UpdateDirectCache(incoming, source, extra_files, entry);
+          if (!source.str.empty()) {
+            UpdateSimpleCache(incoming->flags(), source, extra_files, entry);
+            UpdateDirectCache(incoming, source, extra_files, entry, headers);
+          } else {
+            UpdateDependCache(incoming, extra_files, entry, compile_start);
+          }
         }
       }
 
       STAT(LOCAL_TASK_DONE);
+      execution.SetOutcome(Dispatcher::SUCCEEDED);
     }
 
     std::get<CONNECTION>(*task)->ReportStatus(status);
   }
 }
 
-void Emitter::DoRemoteExecute(const base::WorkerPool& pool,
-                              ResolveFn resolver) {
-  net::EndPointPtr end_point;
-  ui32 sleep_period = 1;
-  auto Sleep = [&sleep_period]() mutable {
-    LOG(INFO) << "Sleeping for " << sleep_period
-              << " seconds before next attempt";
-    std::this_thread::sleep_for(std::chrono::seconds(sleep_period));
-    if (sleep_period < static_cast<ui32>(-1) / 2) {
-      sleep_period <<= 1;
+UniquePtr<proto::Remote> Emitter::PrepareRemoteTask(Task& task) {
+  base::proto::Local* incoming = std::get<MESSAGE>(task).get();
+  auto& source = std::get<SOURCE>(task);
+  auto& extra_files = std::get<EXTRA_FILES>(task);
+  auto& headers = std::get<HEADERS>(task);
+
+  // Check that we have a compiler of a requested version.
+  net::proto::Status status;
+  if (!SetupCompiler(incoming->mutable_flags(), &status)) {
+    std::get<CONNECTION>(task)->ReportStatus(status);
+    return UniquePtr<proto::Remote>();
+  }
+
+  if (source.str.empty() && !GenerateSource(incoming, &source, &headers)) {
+    PushFailed(std::move(task));
+    return UniquePtr<proto::Remote>();
+  }
+
+  UniquePtr<proto::Remote> outgoing(new proto::Remote);
+  outgoing->mutable_flags()->CopyFrom(incoming->flags());
+  outgoing->set_source(Immutable(source.str).string_copy(false));
+  SetExtraFiles(extra_files, outgoing.get());
+
+  // Filter outgoing flags.
+  auto* flags = outgoing->mutable_flags();
+  auto& plugins = *flags->mutable_compiler()->mutable_plugins();
+  for (auto& plugin : plugins) {
+    plugin.clear_path();
+  }
+  flags->mutable_compiler()->clear_path();
+  flags->clear_output();
+  flags->clear_input();
+  flags->clear_non_cached();
+  flags->clear_deps_file();
+
+  return outgoing;
+}
+
+Dispatcher::Outcome Emitter::FinishRemoteTask(Task& task, Universal reply) {
+  base::proto::Local* incoming = std::get<MESSAGE>(task).get();
+  const auto& source = std::get<SOURCE>(task);
+  const auto& extra_files = std::get<EXTRA_FILES>(task);
+  const auto& headers = std::get<HEADERS>(task);
+
+  if (reply->HasExtension(net::proto::Status::extension)) {
+    const auto& status = reply->GetExtension(net::proto::Status::extension);
+    if (status.code() != net::proto::Status::OK) {
+      LOG(WARNING) << "Remote compilation failed with error(s):" << std::endl
+                   << status.description();
+      // The overloaded remote shouldn't get the new tasks for a while.
+      return status.code() == net::proto::Status::OVERLOAD
+                 ? Dispatcher::FAILED
+                 : Dispatcher::CANCELLED;
     }
-  };
+  }
 
-  while (!pool.IsShuttingDown()) {
-    if (!end_point) {
-      end_point = resolver();
-      if (!end_point) {
-        Sleep();
-        continue;
+  const String output_path = GetOutputPath(incoming);
+  if (reply->HasExtension(proto::Result::extension)) {
+    auto* result = reply->MutableExtension(proto::Result::extension);
+    if (base::File::Write(output_path, Immutable::WrapString(result->obj()))) {
+      String error;
+      if (incoming->has_user_id() &&
+          !base::ChangeOwner(output_path, incoming->user_id(), &error)) {
+        LOG(ERROR) << "Failed to change owner for " << output_path << ": "
+                   << error;
       }
+
+      net::proto::Status status;
+      status.set_code(net::proto::Status::OK);
+      LOG(INFO) << "Remote compilation successful: "
+                << incoming->flags().input();
+
+      cache::FileCache::Entry entry;
+      auto GenerateEntry = [&] {
+        String error;
+
+        entry.object = result->release_obj();
+        if (result->has_deps()) {
+          entry.deps = result->release_deps();
+        } else if (incoming->flags().has_deps_file() &&
+                   !base::File::Read(GetDepsPath(incoming), &entry.deps,
+                                     &error)) {
+          LOG(CACHE_WARNING) << "Can't read deps file "
+                             << GetDepsPath(incoming) << " : " << error;
+          return false;
+        }
+        entry.stderr = Immutable(status.description());
+
+        return true;
+      };
+
+      if (GenerateEntry()) {
+        UpdateSimpleCache(incoming->flags(), source, extra_files, entry);
+        UpdateDirectCache(incoming, source, extra_files, entry, headers);
+      }
+
+      std::get<CONNECTION>(task)->ReportStatus(status);
+      STAT(REMOTE_TASK_DONE);
+      return Dispatcher::SUCCEEDED;
     }
+  } else {
+    LOG(WARNING) << "Remote compilation successful, but no results returned: "
+                 << output_path;
+  }
 
-    Optional&& task = all_tasks_->Pop();
+  return Dispatcher::FAILED;
+}
+
+void Emitter::DoRemoteExecute(const base::WorkerPool& pool,
+                              ResolveFn resolver, ui32 path) {
+  net::EndPointPtr end_point;
+
+  // The failures are reported to the dispatcher, that doesn't choose this
+  // remote for a while - instead of sleeping here with the assigned tasks.
+  while (!pool.IsShuttingDown()) {
+    Optional&& task = path_tasks_[path]->Pop();
     if (!task) {
       break;
     }
 
+    Dispatcher::Execution execution(dispatcher_.get(), path,
+                                    std::get<SOURCE>(*task).str.size());
+
     if (std::get<CONNECTION>(*task)->IsClosed()) {
       continue;
     }
 
-    base::proto::Local* incoming = std::get<MESSAGE>(*task).get();
-    auto& source = std::get<SOURCE>(*task);
-    auto& extra_files = std::get<EXTRA_FILES>(*task);
-
-    // Check that we have a compiler of a requested version.
-    net::proto::Status status;
-    if (!SetupCompiler(incoming->mutable_flags(), &status)) {
-      std::get<CONNECTION>(*task)->ReportStatus(status);
-      continue;
+    if (!end_point) {
+      end_point = resolver();
+      if (!end_point) {
+        execution.SetOutcome(Dispatcher::FAILED);
+        PushFailed(std::move(*task));
+        continue;
+      }
     }
 
-    UniquePtr<proto::Remote> outgoing(new proto::Remote);
-    if (source.str.empty() && !GenerateSource(incoming, &source)) {
-      failed_tasks_->Push(std::move(*task));
+    auto outgoing = PrepareRemoteTask(*task);
+    if (!outgoing) {
       continue;
     }
+    execution.SetSize(std::get<SOURCE>(*task).str.size());
 
     String error;
+    const auto connect_start = Clock::now();
     auto connection = Connect(end_point, &error);
     if (!connection) {
       LOG(WARNING) << "Failed to connect to " << end_point->Print() << ": "
                    << error;
       // Put into |failed_tasks_| to prevent hanging around in case all
       // remotes are unreachable at once.
-      failed_tasks_->Push(std::move(*task));
-      Sleep();
-
+      execution.SetOutcome(Dispatcher::FAILED);
+      PushFailed(std::move(*task));
       continue;
     }
-
-    sleep_period = 1;
-
-    outgoing->mutable_flags()->CopyFrom(incoming->flags());
-    outgoing->set_source(Immutable(source.str).string_copy(false));
-    SetExtraFiles(extra_files, outgoing.get());
-
-    // Filter outgoing flags.
-    auto* flags = outgoing->mutable_flags();
-    auto& plugins = *flags->mutable_compiler()->mutable_plugins();
-    for (auto& plugin : plugins) {
-      plugin.clear_path();
-    }
-    flags->mutable_compiler()->clear_path();
-    flags->clear_output();
-    flags->clear_input();
-    flags->clear_non_cached();
-    flags->clear_deps_file();
+    // The connection takes a single round-trip.
+    execution.SetRoundTrip(Clock::now() - connect_start);
 
     perf::Counter<perf::StatReporter, false> counter(
         perf::proto::Metric::REMOTE_TIME_WASTED);
     if (!connection->SendSync(std::move(outgoing))) {
-      all_tasks_->Push(std::move(*task));
+      execution.Finish(Dispatcher::FAILED);
+      Dispatch(std::move(*task));
       counter.ReportOnDestroy(true);
       continue;
     }
@@ -455,75 +756,133 @@ void Emitter::DoRemoteExecute(const base::WorkerPool& pool,
     if (!connection->ReadSync(reply.get())) {
       // Put into |failed_tasks_| in case an oversized protobuf message comes
       // from a remote end.
-      failed_tasks_->Push(std::move(*task));
+      execution.SetOutcome(Dispatcher::FAILED);
+      PushFailed(std::move(*task));
       counter.ReportOnDestroy(true);
       continue;
     }
 
-    if (reply->HasExtension(net::proto::Status::extension)) {
-      const auto& status = reply->GetExtension(net::proto::Status::extension);
-      if (status.code() != net::proto::Status::OK) {
-        LOG(WARNING) << "Remote compilation failed with error(s):" << std::endl
-                     << status.description();
-        failed_tasks_->Push(std::move(*task));
-        counter.ReportOnDestroy(true);
-        continue;
-      }
+    const auto outcome = FinishRemoteTask(*task, std::move(reply));
+    execution.SetOutcome(outcome);
+    if (outcome != Dispatcher::SUCCEEDED) {
+      // In case this task has crashed the remote end, we will try only local
+      // compilation next time.
+      PushFailed(std::move(*task));
+      counter.ReportOnDestroy(true);
+    }
+  }
+}
+
+void Emitter::DoRemoteChannel(const base::WorkerPool& pool, ResolveFn resolver,
+                              ui32 path, ui32 max_in_flight) {
+  using Counter = perf::Counter<perf::StatReporter, false>;
+
+  net::EndPointPtr end_point;
+  UniquePtr<RemoteChannel> channel;
+  Clock::duration round_trip = Clock::duration::zero();
+  SharedPtr<Atomic<bool>> channel_failed;
+  // The broken channel is a single failure of the remote - not the failure of
+  // every request in flight.
+
+  while (!pool.IsShuttingDown()) {
+    // Don't take the task, that can't be sent right away - the other paths
+    // may take it meanwhile.
+    if (channel && !channel->WaitForSlot(max_in_flight)) {
+      channel.reset();
     }
 
-    const String output_path = GetOutputPath(incoming);
-    if (reply->HasExtension(proto::Result::extension)) {
-      auto* result = reply->MutableExtension(proto::Result::extension);
-      if (base::File::Write(output_path,
-                            Immutable::WrapString(result->obj()))) {
-        if (incoming->has_user_id() &&
-            !base::ChangeOwner(output_path, incoming->user_id(), &error)) {
-          LOG(ERROR) << "Failed to change owner for " << output_path << ": "
-                     << error;
-        }
+    Optional&& task = path_tasks_[path]->Pop();
+    if (!task) {
+      break;
+    }
 
-        net::proto::Status status;
-        status.set_code(net::proto::Status::OK);
-        LOG(INFO) << "Remote compilation successful: "
-                  << incoming->flags().input();
+    // The execution lasts until the reply comes - maybe after the next tasks
+    // are sent.
+    auto execution = std::make_shared<Dispatcher::Execution>(
+        dispatcher_.get(), path, std::get<SOURCE>(*task).str.size());
 
-        cache::FileCache::Entry entry;
-        auto GenerateEntry = [&] {
-          String error;
-
-          entry.object = result->release_obj();
-          if (result->has_deps()) {
-            entry.deps = result->release_deps();
-          } else if (incoming->flags().has_deps_file() &&
-                     !base::File::Read(GetDepsPath(incoming), &entry.deps,
-                                       &error)) {
-            LOG(CACHE_WARNING) << "Can't read deps file "
-                               << GetDepsPath(incoming) << " : " << error;
-            return false;
-          }
-          entry.stderr = Immutable(status.description());
+    if (std::get<CONNECTION>(*task)->IsClosed()) {
+      continue;
+    }
+
+    if (!end_point) {
+      end_point = resolver();
+      if (!end_point) {
+        execution->SetOutcome(Dispatcher::FAILED);
+        PushFailed(std::move(*task));
+        continue;
+      }
+    }
 
-          return true;
-        };
+    auto outgoing = PrepareRemoteTask(*task);
+    if (!outgoing) {
+      continue;
+    }
+    execution->SetSize(std::get<SOURCE>(*task).str.size());
 
-        if (GenerateEntry()) {
-          UpdateSimpleCache(incoming->flags(), source, extra_files, entry);
-          UpdateDirectCache(incoming, source, extra_files, entry);
-        }
+    if (!channel || channel->IsBroken()) {
+      channel.reset();
 
-        std::get<CONNECTION>(*task)->ReportStatus(status);
-        STAT(REMOTE_TASK_DONE);
+      String error;
+      const auto connect_start = Clock::now();
+      auto connection = Connect(end_point, &error);
+      // The reader of the channel shouldn't wait for the next replies, when
+      // the small one comes.
+      if (!connection || !connection->ReadLowWatermark(1, &error)) {
+        LOG(WARNING) << "Failed to open channel to " << end_point->Print()
+                     << ": " << error;
+        execution->SetOutcome(Dispatcher::FAILED);
+        PushFailed(std::move(*task));
         continue;
       }
-    } else {
-      LOG(WARNING) << "Remote compilation successful, but no results returned: "
-                   << output_path;
+      // The requests over the channel don't take the round-trip of their own.
+      round_trip = Clock::now() - connect_start;
+      channel.reset(new RemoteChannel(connection));
+      channel_failed = std::make_shared<Atomic<bool>>(false);
     }
+    execution->SetRoundTrip(round_trip);
+
+    auto shared_task = std::make_shared<Task>(std::move(*task));
+    auto counter =
+        std::make_shared<Counter>(perf::proto::Metric::REMOTE_TIME_WASTED);
+    auto finish = [this, shared_task, execution,
+                   counter](RemoteChannel::Reply reply) {
+      const auto outcome = FinishRemoteTask(*shared_task, std::move(reply));
+      execution->SetOutcome(outcome);
+      if (outcome != Dispatcher::SUCCEEDED) {
+        PushFailed(std::move(*shared_task));
+        counter->ReportOnDestroy(true);
+      }
+    };
+    auto callback = [this, finish, shared_task, execution, counter,
+                     channel_failed](RemoteChannel::Reply reply) {
+      if (reply) {
+        // Don't hold up the other replies of the channel.
+        auto shared_reply =
+            std::make_shared<RemoteChannel::Reply>(std::move(reply));
+        if (!channel_replies_->Push(
+                [finish, shared_reply] { finish(std::move(*shared_reply)); })) {
+          finish(std::move(*shared_reply));
+        }
+        return;
+      }
+
+      // The broken channel tells nothing about the task - but the remote may
+      // be broken by this task.
+      execution->SetOutcome(channel_failed->exchange(true)
+                                ? Dispatcher::CANCELLED
+                                : Dispatcher::FAILED);
+      PushFailed(std::move(*shared_task));
+      counter->ReportOnDestroy(true);
+    };
 
-    // In case this task has crashed the remote end, we will try only local
-    // compilation next time.
-    failed_tasks_->Push(std::move(*task));
-    counter.ReportOnDestroy(true);
+    if (!channel->Send(std::move(outgoing), callback)) {
+      execution->Finish(channel_failed->exchange(true) ? Dispatcher::CANCELLED
+                                                       : Dispatcher::FAILED);
+      Dispatch(std::move(*shared_task));
+      counter->ReportOnDestroy(true);
+      channel.reset();
+    }
   }
 }
 
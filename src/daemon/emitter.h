@@ -1,8 +1,12 @@
 #pragma once
 
 #include <base/queue_aggregator.h>
+#include <base/thread_pool.h>
 #include <base/worker_pool.h>
 #include <daemon/compilation_daemon.h>
+#include <daemon/dispatcher.h>
+#include <daemon/preprocessor_pool.h>
+#include <daemon/remote_channel.h>
 
 namespace dist_clang {
 namespace daemon {
@@ -20,11 +24,15 @@ class Emitter : public CompilationDaemon {
     MESSAGE = 1,
     SOURCE = 2,
     EXTRA_FILES = 3,
+    HEADERS = 4,
+    QUEUED = 5,
   };
 
   using Message = UniquePtr<base::proto::Local>;
   using Task = Tuple<net::ConnectionPtr, Message, cache::string::HandledSource,
-                     cache::ExtraFiles>;
+                     cache::ExtraFiles, List<String>, TimePoint>;
+  // The headers are known, if the source is preprocessed in-process. The time
+  // point is when the task is queued for the current stage of the cache checks.
   using Queue = base::LockedQueue<Task>;
   using QueueAggregator = base::QueueAggregator<Task>;
   using Optional = Queue::Optional;
@@ -36,12 +44,46 @@ class Emitter : public CompilationDaemon {
   void SetExtraFiles(const cache::ExtraFiles& extra_files,
                      proto::Remote* message);
 
-  void DoCheckCache(const base::WorkerPool&);
+  // The cache checks are the stages with their own queues and workers - so
+  // the preprocessing doesn't hold up the direct cache hits.
+  void DoCheckDirectCache(const base::WorkerPool&);
+  void DoPreprocess(const base::WorkerPool&);
+  void DoCheckSimpleCache(const base::WorkerPool&);
   void DoLocalExecute(const base::WorkerPool&);
-  void DoRemoteExecute(const base::WorkerPool&, ResolveFn resolver);
+  void DoRemoteExecute(const base::WorkerPool&, ResolveFn resolver, ui32 path);
+  void DoRemoteChannel(const base::WorkerPool&, ResolveFn resolver, ui32 path,
+                       ui32 max_in_flight);
+  // Sends up to |max_in_flight| tasks over the own channel - without waiting
+  // for the replies.
 
-  UniquePtr<Queue> all_tasks_, cache_tasks_, failed_tasks_;
+  UniquePtr<proto::Remote> PrepareRemoteTask(Task& task);
+  // Returns null, if the task is already reported or pushed to the failed.
+  Dispatcher::Outcome FinishRemoteTask(Task& task, Universal reply);
+  // Reports the successful task. Otherwise the caller handles the task.
+
+  bool GenerateSource(const base::proto::Local* WEAK_PTR message,
+                      cache::string::HandledSource* source,
+                      List<String>* headers);
+
+  bool RestoreFromCache(Task& task, const cache::FileCache::Entry& entry);
+
+  void PushToStage(Queue* WEAK_PTR stage, Task&& task);
+  // The task is compiled right away, if the |stage| is full.
+
+  bool Dispatch(Task&& task);
+  void PushFailed(Task&& task);
+  // The failed tasks are compiled locally - without the dispatcher's choice.
+
+  UniquePtr<Queue> cache_tasks_, failed_tasks_;
+  UniquePtr<Queue> preprocess_tasks_, simple_tasks_;
+  Vector<UniquePtr<Queue>> path_tasks_;
+  // The tasks assigned to the paths of the |dispatcher_|.
+  UniquePtr<Dispatcher> dispatcher_;
   UniquePtr<QueueAggregator> local_tasks_;
+  UniquePtr<PreprocessorPool> preprocessors_;
+  UniquePtr<base::ThreadPool> channel_replies_;
+  // Finishes the tasks with the replies from the channels - so the readers of
+  // the channels only dispatch the replies.
   UniquePtr<base::WorkerPool> workers_;
 };
 
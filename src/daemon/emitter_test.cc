@@ -6,6 +6,11 @@
 #include <daemon/common_daemon_test.h>
 #include <net/test_connection.h>
 
+#include <clang/Basic/Version.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace dist_clang {
 namespace daemon {
 
@@ -38,6 +43,31 @@ TEST(EmitterConfigurationTest, OnlyFailedWithoutRemotes) {
   ASSERT_FALSE(emitter.Initialize());
 }
 
+TEST(EmitterConfigurationTest, DependWithoutDirect) {
+  proto::Configuration conf;
+  conf.mutable_emitter()->set_socket_path("/tmp/test.socket");
+  conf.mutable_cache()->set_path("/tmp/test_cache");
+  conf.mutable_cache()->set_depend(true);
+
+  Emitter emitter(conf);
+  ASSERT_FALSE(emitter.Initialize());
+}
+
+TEST(EmitterConfigurationTest, DependWithRemotes) {
+  proto::Configuration conf;
+  conf.mutable_emitter()->set_socket_path("/tmp/test.socket");
+  conf.mutable_cache()->set_path("/tmp/test_cache");
+  conf.mutable_cache()->set_direct(true);
+  conf.mutable_cache()->set_depend(true);
+
+  auto* remote = conf.mutable_emitter()->add_remotes();
+  remote->set_host("fake_host");
+  remote->set_port(12345);
+
+  Emitter emitter(conf);
+  ASSERT_FALSE(emitter.Initialize());
+}
+
 class EmitterTest : public CommonDaemonTest {
  protected:
   UniquePtr<Emitter> emitter;
@@ -927,6 +957,100 @@ TEST_F(EmitterTest, StoreSimpleCacheForLocalResult) {
   // TODO: check that removal of original files doesn't fail cache filling.
 }
 
+TEST_F(EmitterTest, PreprocessOtherUserInProcess) {
+  const base::TemporaryDir temp_dir;
+  const String socket_path = "/tmp/test.socket";
+  const auto expected_code = net::proto::Status::OK;
+  const String compiler_version = clang::getClangFullVersion();
+  const String compiler_path = "fake_compiler_path";
+  const auto object_code = "fake_object_code"_l;
+  const auto input_path = "test.cc"_l;
+  const auto output_path = "test.o"_l;
+  const auto action = "fake_action"_l;
+  const ui32 user_id = geteuid() + 1;
+
+  conf.mutable_emitter()->set_socket_path(socket_path);
+  conf.mutable_emitter()->set_preprocessors(1);
+  conf.mutable_cache()->set_path(temp_dir);
+  conf.mutable_cache()->set_direct(false);
+  conf.mutable_cache()->set_clean_period(1);
+
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+
+  ASSERT_TRUE(base::File::Write(String(temp_dir) + "/test.cc",
+                                "int value = 42;\n"_l));
+
+  listen_callback = [&](const String& host, ui16 port, String*) {
+    EXPECT_EQ(socket_path, host);
+    EXPECT_EQ(0u, port);
+    return !::testing::Test::HasNonfatalFailure();
+  };
+
+  connect_callback = [&](net::TestConnection* connection) {
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+      const auto& status = message.GetExtension(net::proto::Status::extension);
+      EXPECT_EQ(expected_code, status.code()) << status.description();
+
+      send_condition.notify_all();
+    });
+  };
+
+  // The source is preprocessed by the process with the credentials of the
+  // user - even though the in-process preprocessor is compatible.
+  run_callback = [&](base::TestProcess* process) {
+    EXPECT_EQ(user_id, process->uid_);
+    if (run_count == 1) {
+      EXPECT_NE(process->args_.end(), std::find(process->args_.begin(),
+                                                process->args_.end(), "-E"_l));
+      process->stdout_ = "int value = 42;"_l;
+    } else if (run_count == 2) {
+      EXPECT_TRUE(base::File::Write(process->cwd_path_ + "/"_l + output_path,
+                                    object_code));
+    }
+  };
+
+  emitter.reset(new Emitter(conf));
+  ASSERT_TRUE(emitter->Initialize());
+
+  auto connection = test_service->TriggerListen(socket_path);
+  {
+    SharedPtr<net::TestConnection> test_connection =
+        std::static_pointer_cast<net::TestConnection>(connection);
+
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* extension = message->MutableExtension(base::proto::Local::extension);
+    extension->set_current_dir(temp_dir);
+    extension->set_user_id(user_id);
+
+    extension->mutable_flags()->set_input(input_path);
+    extension->mutable_flags()->set_output(output_path);
+    extension->mutable_flags()->mutable_compiler()->set_version(
+        compiler_version);
+    extension->mutable_flags()->add_other()->assign("-cc1");
+    extension->mutable_flags()->set_action(action);
+    extension->mutable_flags()->set_language("c++");
+
+    net::proto::Status status;
+    status.set_code(net::proto::Status::OK);
+
+    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(lock, std::chrono::seconds(1),
+                                        [this] { return send_count == 1; }));
+  }
+
+  emitter.reset();
+
+  EXPECT_EQ(2u, run_count);
+  EXPECT_EQ(1u, send_count);
+  EXPECT_EQ(1, connection.use_count())
+      << "Daemon must not store references to the connection";
+}
+
 TEST_F(EmitterTest, StoreSimpleCacheForRemoteResult) {
   const base::TemporaryDir temp_dir;
   const String socket_path = "/tmp/test.socket";
@@ -1426,6 +1550,150 @@ TEST_F(EmitterTest, StoreDirectCacheForLocalResult) {
   //       - deps file is in cache, but not requested.
 }
 
+TEST_F(EmitterTest, StoreDependCacheForLocalResult) {
+  // Prepare environment.
+  const base::TemporaryDir temp_dir;
+  const auto path = Immutable(String(temp_dir));
+  const auto input_path = path + "/test.cc"_l;
+  const auto header1_path = path + "/header1.h"_l;
+  const auto header2_path = path + "/header2.h"_l;
+
+  ASSERT_TRUE(base::File::Write(input_path, "int main() {}"_l));
+  ASSERT_TRUE(base::File::Write(header1_path, "#define A"_l));
+  ASSERT_TRUE(base::File::Write(header2_path, "#define B"_l));
+
+  // The timestamps of the filesystem may be coarser than the clock - so the
+  // header is changed during the compilation with an explicit mtime.
+  auto set_mtime = [&header2_path](std::chrono::seconds shift) {
+    const struct timespec times[] = {
+        {0, UTIME_NOW}, {time(nullptr) + shift.count(), 0}};
+    return utimensat(AT_FDCWD, header2_path.c_str(), times, 0) == 0;
+  };
+
+  // Prepare configuration.
+  const String socket_path = "/tmp/test.socket";
+  const String compiler_version = "fake_compiler_version";
+  const String compiler_path = "fake_compiler_path";
+
+  conf.mutable_emitter()->set_socket_path(socket_path);
+  conf.mutable_cache()->set_path(temp_dir);
+  conf.mutable_cache()->set_direct(true);
+  conf.mutable_cache()->set_depend(true);
+  conf.mutable_cache()->set_clean_period(1);
+
+  auto* version = conf.add_versions();
+  version->set_version(compiler_version);
+  version->set_path(compiler_path);
+
+  // Prepare callbacks.
+  const auto deps_path = "test.d"_l;
+  const auto output_path = "test.o"_l;
+  const auto action = "fake_action"_l;
+  const auto object_code = "fake_object_code"_l;
+  const auto deps_contents = "test.o: test.cc header1.h header2.h"_l;
+
+  listen_callback = [&](const String& host, ui16 port, String*) {
+    EXPECT_EQ(socket_path, host);
+    EXPECT_EQ(0u, port);
+    return !::testing::Test::HasNonfatalFailure();
+  };
+
+  connect_callback = [&](net::TestConnection* connection) {
+    connection->CallOnSend([&](const net::Connection::Message& message) {
+      EXPECT_TRUE(message.HasExtension(net::proto::Status::extension));
+      const auto& status = message.GetExtension(net::proto::Status::extension);
+      EXPECT_EQ(net::proto::Status::OK, status.code()) << status.description();
+
+      send_condition.notify_all();
+    });
+  };
+
+  // There is no preprocessing in the depend mode - every run is a compilation.
+  run_callback = [&](base::TestProcess* process) {
+    EXPECT_EQ((Immutable::Rope{action, "-dependency-file"_l, deps_path,
+                               "-o"_l, output_path, input_path}),
+              process->args_)
+        << process->PrintArgs();
+    EXPECT_TRUE(base::File::Write(process->cwd_path_ + "/"_l + output_path,
+                                  object_code));
+    EXPECT_TRUE(base::File::Write(process->cwd_path_ + "/"_l + deps_path,
+                                  deps_contents));
+
+    // The header, changed during the compilation, may be not the one the
+    // object is compiled with.
+    if (run_count == 2) {
+      EXPECT_TRUE(base::File::Write(header2_path, "#define C"_l));
+      EXPECT_TRUE(set_mtime(std::chrono::hours(1)));
+    }
+  };
+
+  emitter.reset(new Emitter(conf));
+  ASSERT_TRUE(emitter->Initialize());
+
+  List<net::ConnectionPtr> connections;
+  auto compile = [&] {
+    auto connection = test_service->TriggerListen(socket_path);
+    connections.push_back(connection);
+    SharedPtr<net::TestConnection> test_connection =
+        std::static_pointer_cast<net::TestConnection>(connection);
+
+    net::Connection::ScopedMessage message(new net::Connection::Message);
+    auto* extension = message->MutableExtension(base::proto::Local::extension);
+    extension->set_current_dir(temp_dir);
+
+    extension->mutable_flags()->set_input(input_path);
+    extension->mutable_flags()->set_output(output_path);
+    extension->mutable_flags()->set_deps_file(deps_path);
+    extension->mutable_flags()->mutable_compiler()->set_version(
+        compiler_version);
+    extension->mutable_flags()->set_action(action);
+
+    net::proto::Status status;
+    status.set_code(net::proto::Status::OK);
+
+    const auto expected_send_count = send_count + 1;
+    EXPECT_TRUE(test_connection->TriggerReadAsync(std::move(message), status));
+
+    UniqueLock lock(send_mutex);
+    EXPECT_TRUE(send_condition.wait_for(
+        lock, std::chrono::seconds(1),
+        [&] { return send_count == expected_send_count; }));
+  };
+
+  // The first compilation is stored, and the second one hits the cache.
+  compile();
+  EXPECT_EQ(1u, run_count);
+  compile();
+  EXPECT_EQ(1u, run_count);
+
+  // The edited header makes a miss - and the entry isn't stored, since the
+  // other header is changed during the compilation.
+  ASSERT_TRUE(base::File::Write(header1_path, "#define AA"_l));
+  compile();
+  EXPECT_EQ(2u, run_count);
+  ASSERT_TRUE(set_mtime(-std::chrono::hours(1)));
+  compile();
+  EXPECT_EQ(3u, run_count);
+
+  // The last compilation is stored.
+  compile();
+  EXPECT_EQ(3u, run_count);
+
+  emitter.reset();
+
+  Immutable cache_output;
+  EXPECT_TRUE(base::File::Read(path + "/"_l + output_path, &cache_output));
+  EXPECT_EQ(object_code, cache_output);
+
+  EXPECT_EQ(1u, listen_count);
+  EXPECT_EQ(5u, connect_count);
+  EXPECT_EQ(5u, send_count);
+  for (const auto& connection : connections) {
+    EXPECT_EQ(1, connection.use_count())
+        << "Daemon must not store references to the connection";
+  }
+}
+
 TEST_F(EmitterTest, StoreDirectCacheForRemoteResult) {
   // Prepare environment.
   const base::TemporaryDir temp_dir;
@@ -0,0 +1,263 @@
+#include <daemon/preprocessor_pool.h>
+
+#include <base/assert.h>
+#include <cache/hash_memo.h>
+
+#include <clang/Basic/FileSystemStatCache.h>
+#include <clang/Basic/Version.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/CompilerInvocation.h>
+#include <clang/Frontend/FrontendActions.h>
+#include <clang/Frontend/TextDiagnosticPrinter.h>
+#include <clang/Frontend/Utils.h>
+
+namespace dist_clang {
+namespace daemon {
+
+namespace {
+
+// Prints the preprocessed source into the string instead of the output file.
+class PrintToStringAction : public clang::PreprocessorFrontendAction {
+ public:
+  explicit PrintToStringAction(String* output) : output_(output) {}
+
+ protected:
+  void ExecuteAction() override {
+    auto& compiler = getCompilerInstance();
+    llvm::raw_string_ostream stream(*output_);
+    clang::DoPrintPreprocessedInput(compiler.getPreprocessor(), &stream,
+                                    compiler.getPreprocessorOutputOpts());
+  }
+
+ private:
+  String* WEAK_PTR output_;
+};
+
+// Like the "-MD" flag - the system headers are listed too.
+class HeaderCollector : public clang::DependencyCollector {
+ public:
+  bool needSystemDependencies() override { return true; }
+};
+
+}  // namespace
+
+// The directory can't get a new entry without the change of its mtime - so
+// the failed lookup is still valid, while the stat data of the directory is
+// the same.
+class MissingPaths {
+ public:
+  enum : ui64 { MAX_SIZE = 1024 * 1024 };
+  // in paths - everything is forgotten above it.
+
+  bool Find(const String& dir, const cache::HashMemo::Stat& stat,
+            const String& name) const THREAD_SAFE {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = dirs_.find(dir);
+    return it != dirs_.end() && it->second.stat == stat &&
+           it->second.names.count(name);
+  }
+
+  void Add(const String& dir, const cache::HashMemo::Stat& stat,
+           const String& name) THREAD_SAFE {
+    if (cache::HashMemo::IsRacy(stat)) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (size_ >= MAX_SIZE) {
+      dirs_.clear();
+      size_ = 0;
+    }
+
+    auto& entry = dirs_[dir];
+    if (entry.stat != stat) {
+      size_ -= entry.names.size();
+      entry.names.clear();
+      entry.stat = stat;
+    }
+    if (entry.names.insert(name).second) {
+      ++size_;
+    }
+  }
+
+ private:
+  struct Dir {
+    cache::HashMemo::Stat stat;
+    HashSet<String> names;
+  };
+
+  mutable std::mutex mutex_;
+  HashMap<String, Dir> dirs_;
+  ui64 size_ = 0;
+};
+
+namespace {
+
+// The stat cache of a single run - the directories are checked once per run.
+class StatCache : public clang::FileSystemStatCache {
+ public:
+  explicit StatCache(MissingPaths* missing_paths)
+      : missing_paths_(missing_paths) {}
+
+ protected:
+  LookupResult getStat(const char* path, clang::FileData& data, bool is_file,
+                       std::unique_ptr<clang::vfs::File>* file,
+                       clang::vfs::FileSystem& fs) override {
+    const String full_path(path);
+    const auto slash = full_path.find_last_of('/');
+    if (full_path.empty() || full_path[0] != '/' ||
+        slash == full_path.size() - 1) {
+      return statChained(path, data, is_file, file, fs);
+    }
+
+    const String dir = slash ? full_path.substr(0, slash) : String("/");
+    // The directory isn't a file - and vice versa.
+    const String name = full_path.substr(slash + 1) + (is_file ? "" : "/");
+
+    auto it = dirs_.find(dir);
+    if (it == dirs_.end()) {
+      cache::HashMemo::Stat stat;
+      it = dirs_.emplace(dir, std::make_pair(
+                                  cache::HashMemo::GetStat(dir, &stat), stat))
+               .first;
+    }
+    if (!it->second.first) {
+      return statChained(path, data, is_file, file, fs);
+    }
+
+    if (missing_paths_->Find(dir, it->second.second, name)) {
+      return CacheMissing;
+    }
+
+    const auto result = statChained(path, data, is_file, file, fs);
+    if (result == CacheMissing) {
+      missing_paths_->Add(dir, it->second.second, name);
+    }
+    return result;
+  }
+
+ private:
+  MissingPaths* WEAK_PTR missing_paths_;
+  HashMap<String, Pair<bool, cache::HashMemo::Stat>> dirs_;
+};
+
+}  // namespace
+
+PreprocessorPool::PreprocessorPool(ui32 size)
+    : missing_paths_(new MissingPaths), size_(size), free_slots_(size) {
+  CHECK(size);
+}
+
+PreprocessorPool::~PreprocessorPool() {
+  UniqueLock lock(slots_mutex_);
+  slots_condition_.wait(lock, [this] { return free_slots_ == size_; });
+}
+
+// static
+bool PreprocessorPool::IsCompatible(const base::proto::Flags& flags) {
+  return flags.compiler().version() == clang::getClangFullVersion() &&
+         flags.compiler().plugins_size() == 0 && flags.other_size() &&
+         flags.other(0) == "-cc1" && flags.has_input();
+}
+
+bool PreprocessorPool::Run(const base::proto::Flags& flags,
+                           const String& current_dir, Immutable* source,
+                           List<String>* headers, String* error) {
+  DCHECK(source);
+  DCHECK(headers);
+  DCHECK(IsCompatible(flags));
+
+  {
+    UniqueLock lock(slots_mutex_);
+    slots_condition_.wait(lock, [this] { return free_slots_ > 0; });
+    --free_slots_;
+  }
+
+  const bool result = DoRun(flags, current_dir, source, headers, error);
+
+  {
+    std::lock_guard<std::mutex> lock(slots_mutex_);
+    ++free_slots_;
+  }
+  slots_condition_.notify_all();
+
+  return result;
+}
+
+bool PreprocessorPool::DoRun(const base::proto::Flags& flags,
+                             const String& current_dir, Immutable* source,
+                             List<String>* headers, String* error) {
+  // The same order as in |CompilationDaemon::CreateProcess()| - without the
+  // outputs and the "-cc1" itself.
+  Vector<const char*> args;
+  for (auto it = std::next(flags.other().begin()); it != flags.other().end();
+       ++it) {
+    args.push_back(it->c_str());
+  }
+  args.push_back(flags.action().c_str());
+  for (const auto& arg : flags.non_direct()) {
+    args.push_back(arg.c_str());
+  }
+  for (const auto& arg : flags.non_cached()) {
+    args.push_back(arg.c_str());
+  }
+  if (flags.has_language()) {
+    args.push_back("-x");
+    args.push_back(flags.language().c_str());
+  }
+  args.push_back(flags.input().c_str());
+
+  String diagnostics;
+  llvm::raw_string_ostream diagnostics_stream(diagnostics);
+  llvm::IntrusiveRefCntPtr<clang::DiagnosticOptions> diagnostic_options(
+      new clang::DiagnosticOptions);
+  auto diagnostics_engine = clang::CompilerInstance::createDiagnostics(
+      diagnostic_options.get(),
+      new clang::TextDiagnosticPrinter(diagnostics_stream,
+                                       diagnostic_options.get()));
+
+  llvm::IntrusiveRefCntPtr<clang::CompilerInvocation> invocation(
+      new clang::CompilerInvocation);
+  if (!clang::CompilerInvocation::CreateFromArgs(
+          *invocation, args.data(), args.data() + args.size(),
+          *diagnostics_engine)) {
+    if (error) {
+      error->assign("Failed to parse flags: " + diagnostics_stream.str());
+    }
+    return false;
+  }
+
+  // The daemon doesn't change its working directory for every run.
+  invocation->getFileSystemOpts().WorkingDir = current_dir;
+  // Otherwise the number of warnings is printed to the daemon's stderr.
+  invocation->getDiagnosticOpts().ShowCarets = false;
+
+  clang::CompilerInstance compiler;
+  compiler.setInvocation(invocation.get());
+  compiler.setDiagnostics(diagnostics_engine.get());
+  compiler.createFileManager();
+  compiler.getFileManager().addStatCache(
+      std::unique_ptr<clang::FileSystemStatCache>(
+          new StatCache(missing_paths_.get())));
+
+  auto collector = std::make_shared<HeaderCollector>();
+  compiler.addDependencyCollector(collector);
+
+  String output;
+  PrintToStringAction action(&output);
+  if (!compiler.ExecuteAction(action) ||
+      diagnostics_engine->hasErrorOccurred()) {
+    if (error) {
+      error->assign(diagnostics_stream.str());
+    }
+    return false;
+  }
+
+  source->assign(Immutable(std::move(output)));
+  headers->assign(collector->getDependencies().begin(),
+                  collector->getDependencies().end());
+  return true;
+}
+
+}  // namespace daemon
+}  // namespace dist_clang
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <base/attributes.h>
+#include <base/base.pb.h>
+#include <base/const_string.h>
+
+#include STL(condition_variable)
+
+namespace dist_clang {
+namespace daemon {
+
+class MissingPaths;
+
+// Preprocesses the sources in the daemon's process with the linked Clang
+// frontend - without the fork, exec and the driver startup of the compiler
+// process for every cache lookup. Only the compilers of the same version, as
+// the linked frontend, are handled.
+//
+// The file manager of every run is new, since it trusts the file entries once
+// seen. The results of the failed lookups of the header search are kept
+// between the runs instead - while the stat data of the looked up directory
+// stays the same.
+class PreprocessorPool {
+ public:
+  explicit PreprocessorPool(ui32 size);
+  ~PreprocessorPool();
+
+  static bool IsCompatible(const base::proto::Flags& flags);
+
+  bool Run(const base::proto::Flags& flags, const String& current_dir,
+           Immutable* source, List<String>* headers,
+           String* error = nullptr) THREAD_SAFE;
+  // Blocks while all |size| preprocessors are busy. The |headers| are all the
+  // files read by the preprocessor - with the input, as in the deps file. The
+  // flags should be for the preprocessing - see |IsCompatible()|.
+  //
+  // The run has no timeout, and the files are read with the credentials of
+  // the daemon - the caller should use the compiler process, if it matters.
+
+ private:
+  bool DoRun(const base::proto::Flags& flags, const String& current_dir,
+             Immutable* source, List<String>* headers, String* error);
+
+  const UniquePtr<MissingPaths> missing_paths_;
+
+  const ui32 size_;
+  std::mutex slots_mutex_;
+  std::condition_variable slots_condition_;
+  ui32 free_slots_;
+};
+
+}  // namespace daemon
+}  // namespace dist_clang
@@ -0,0 +1,60 @@
+#include <daemon/preprocessor_pool.h>
+
+#include <base/file/file.h>
+#include <base/temporary_dir.h>
+
+#include <clang/Basic/Version.h>
+#include <third_party/gtest/exported/include/gtest/gtest.h>
+
+namespace dist_clang {
+namespace daemon {
+
+TEST(PreprocessorPoolTest, Preprocess) {
+  const base::TemporaryDir temp_dir;
+  const String header_path = String(temp_dir) + "/header.h";
+  ASSERT_TRUE(base::File::Write(header_path, "#define VALUE 42\n"_l));
+  ASSERT_TRUE(base::File::Write(String(temp_dir) + "/test.cc",
+                                "#include \"header.h\"\n"
+                                "#if __has_include(\"missing.h\")\n"
+                                "#error missing.h is found\n"
+                                "#endif\n"
+                                "int value = VALUE;\n"_l));
+
+  base::proto::Flags flags;
+  flags.mutable_compiler()->set_version(clang::getClangFullVersion());
+  flags.add_other()->assign("-cc1");
+  flags.set_action("-E");
+  flags.set_language("c++");
+  flags.set_input("test.cc");
+  ASSERT_TRUE(PreprocessorPool::IsCompatible(flags));
+
+  PreprocessorPool pool(2);
+
+  // The file manager isn't shared between the runs.
+  for (ui32 i = 0; i < 2; ++i) {
+    Immutable source;
+    List<String> headers;
+    String error;
+    ASSERT_TRUE(pool.Run(flags, temp_dir, &source, &headers, &error))
+        << error;
+    EXPECT_NE(String::npos, source.find("int value = 42;"));
+    ASSERT_EQ(2u, headers.size());
+    EXPECT_EQ("test.cc", headers.front());
+  }
+
+  // The failed lookups aren't trusted after the directory is changed.
+  ASSERT_TRUE(base::File::Write(String(temp_dir) + "/missing.h", ""_l));
+  {
+    Immutable source;
+    List<String> headers;
+    String error;
+    EXPECT_FALSE(pool.Run(flags, temp_dir, &source, &headers, &error));
+    EXPECT_NE(String::npos, error.find("missing.h is found")) << error;
+  }
+
+  flags.mutable_compiler()->set_version("clang version 0.0.0");
+  EXPECT_FALSE(PreprocessorPool::IsCompatible(flags));
+}
+
+}  // namespace daemon
+}  // namespace dist_clang
@@ -0,0 +1,133 @@
+#include <daemon/remote_channel.h>
+
+#include <base/assert.h>
+#include <base/logging.h>
+#include <net/connection.h>
+
+#include <base/using_log.h>
+
+namespace dist_clang {
+namespace daemon {
+
+RemoteChannel::RemoteChannel(net::ConnectionPtr connection)
+    : connection_(connection) {
+  DCHECK(connection_);
+  reader_ = base::Thread("Channel Reader"_l, &RemoteChannel::DoRead, this);
+}
+
+RemoteChannel::~RemoteChannel() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closing_ = true;
+  }
+  condition_.notify_all();
+
+  // The reader may wait for the replies.
+  connection_->Shutdown();
+  reader_.join();
+}
+
+bool RemoteChannel::Send(UniquePtr<proto::Remote> message, Callback callback) {
+  ui64 request_id;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (broken_) {
+      return false;
+    }
+    request_id = next_id_++;
+    pending_.emplace(request_id, callback);
+  }
+  condition_.notify_all();
+
+  net::Connection::ScopedMessage outgoing(new net::proto::Universal);
+  outgoing->SetAllocatedExtension(proto::Remote::extension, message.release());
+  outgoing->MutableExtension(proto::Tag::extension)->set_request_id(request_id);
+
+  net::proto::Status status;
+  if (connection_->SendSync(std::move(outgoing), &status)) {
+    return true;
+  }
+
+  LOG(WARNING) << "Failed to send request to channel: "
+               << status.description();
+
+  bool callback_is_taken;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    callback_is_taken = !pending_.erase(request_id);
+  }
+  Break();
+
+  // The reader has failed the request already.
+  return callback_is_taken;
+}
+
+bool RemoteChannel::WaitForSlot(ui32 max_in_flight) {
+  UniqueLock lock(mutex_);
+  condition_.wait(lock, [this, max_in_flight] {
+    return broken_ || pending_.size() < max_in_flight;
+  });
+  return !broken_;
+}
+
+void RemoteChannel::DoRead() {
+  while (true) {
+    {
+      UniqueLock lock(mutex_);
+      condition_.wait(lock, [this] {
+        return closing_ || broken_ || !pending_.empty();
+      });
+      if (closing_ || broken_) {
+        break;
+      }
+    }
+
+    Reply reply(new net::proto::Universal);
+    net::proto::Status status;
+    if (!connection_->ReadSync(reply.get(), &status)) {
+      LOG(WARNING) << "Failed to read reply from channel: "
+                   << status.description();
+      break;
+    }
+
+    if (!reply->HasExtension(proto::Tag::extension)) {
+      LOG(WARNING) << "Reply from channel without request id";
+      break;
+    }
+
+    Callback callback;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it =
+          pending_.find(reply->GetExtension(proto::Tag::extension).request_id());
+      if (it == pending_.end()) {
+        LOG(WARNING) << "Reply from channel for unknown request";
+        continue;
+      }
+      callback = std::move(it->second);
+      pending_.erase(it);
+    }
+    condition_.notify_all();
+
+    callback(std::move(reply));
+  }
+
+  Break();
+}
+
+void RemoteChannel::Break() {
+  HashMap<ui64, Callback> pending;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    broken_ = true;
+    pending.swap(pending_);
+  }
+  condition_.notify_all();
+
+  for (auto& request : pending) {
+    request.second(Reply());
+  }
+}
+
+}  // namespace daemon
+}  // namespace dist_clang
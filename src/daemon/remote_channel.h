@@ -0,0 +1,57 @@
+#pragma once
+
+#include <base/attributes.h>
+#include <base/thread.h>
+#include <daemon/remote.pb.h>
+#include <net/connection_forward.h>
+
+#include STL(condition_variable)
+
+namespace dist_clang {
+namespace daemon {
+
+// A long-lived connection to an absorber, that carries many requests at once -
+// without the handshake and the new compression stream for every task. The
+// requests are tagged, and the replies come in any order. The replies are read
+// by the own thread of the channel, that runs the callbacks too - so the
+// callbacks should pass the long work to the other threads.
+class RemoteChannel {
+ public:
+  using Reply = UniquePtr<net::proto::Universal>;
+  using Callback = Fn<void(Reply reply)>;
+  // The |reply| is null, if the channel is broken before the reply comes.
+
+  explicit RemoteChannel(net::ConnectionPtr connection);
+  ~RemoteChannel();
+
+  RemoteChannel(const RemoteChannel&) = delete;
+
+  bool Send(UniquePtr<proto::Remote> message, Callback callback) THREAD_SAFE;
+  // Returns |false| only if the |callback| will never be called - the channel
+  // is broken before the request is sent.
+
+  bool WaitForSlot(ui32 max_in_flight) THREAD_SAFE;
+  // Blocks while there are |max_in_flight| requests without the reply.
+  // Returns |false|, if the channel is broken.
+
+  inline bool IsBroken() const THREAD_SAFE { return broken_; }
+
+ private:
+  void DoRead();
+  void Break();
+  // Fails all requests without the reply.
+
+  net::ConnectionPtr connection_;
+
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  HashMap<ui64, Callback> pending_;
+  ui64 next_id_ = 1;
+  Atomic<bool> broken_ = {false};
+  bool closing_ = false;
+
+  base::Thread reader_;
+};
+
+}  // namespace daemon
+}  // namespace dist_clang
@@ -0,0 +1,122 @@
+#include <daemon/remote_channel.h>
+
+#include <net/test_connection.h>
+
+#include <third_party/gtest/exported/include/gtest/gtest.h>
+
+namespace dist_clang {
+namespace daemon {
+
+namespace {
+
+// Serves the replies to the reader of the channel - in the order of |Reply()|.
+class ReplyQueue {
+ public:
+  void Reply(ui64 request_id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    replies_.push_back(request_id);
+    condition_.notify_all();
+  }
+
+  void Read(net::proto::Universal* message) {
+    UniqueLock lock(mutex_);
+    condition_.wait(lock, [this] { return !replies_.empty(); });
+    // The zero id makes the broken reply - without the tag.
+    if (replies_.front()) {
+      message->MutableExtension(proto::Tag::extension)
+          ->set_request_id(replies_.front());
+      message->MutableExtension(net::proto::Status::extension)
+          ->set_code(net::proto::Status::OK);
+    }
+    replies_.pop_front();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  List<ui64> replies_;
+};
+
+}  // namespace
+
+TEST(RemoteChannelTest, RepliesOutOfOrder) {
+  auto connection = std::make_shared<net::TestConnection>();
+  ReplyQueue replies;
+  Vector<ui64> sent;
+  connection->CallOnSend([&sent](const net::proto::Universal& message) {
+    ASSERT_TRUE(message.HasExtension(proto::Remote::extension));
+    ASSERT_TRUE(message.HasExtension(proto::Tag::extension));
+    sent.push_back(message.GetExtension(proto::Tag::extension).request_id());
+  });
+  connection->CallOnRead(
+      [&replies](net::proto::Universal* message) { replies.Read(message); });
+
+  std::mutex mutex;
+  std::condition_variable condition;
+  Vector<ui32> done;
+  auto callback = [&](ui32 index) {
+    return [&, index](RemoteChannel::Reply reply) {
+      EXPECT_TRUE(!!reply);
+      std::lock_guard<std::mutex> lock(mutex);
+      done.push_back(index);
+      condition.notify_all();
+    };
+  };
+
+  {
+    RemoteChannel channel(connection);
+    ASSERT_TRUE(channel.Send(UniquePtr<proto::Remote>(new proto::Remote),
+                             callback(1)));
+    ASSERT_TRUE(channel.Send(UniquePtr<proto::Remote>(new proto::Remote),
+                             callback(2)));
+    ASSERT_EQ(2u, sent.size());
+    EXPECT_NE(sent[0], sent[1]);
+
+    replies.Reply(sent[1]);
+    replies.Reply(sent[0]);
+
+    UniqueLock lock(mutex);
+    condition.wait(lock, [&done] { return done.size() == 2; });
+    EXPECT_TRUE(channel.WaitForSlot(1));
+    EXPECT_FALSE(channel.IsBroken());
+  }
+
+  EXPECT_EQ((Vector<ui32>{2, 1}), done);
+}
+
+TEST(RemoteChannelTest, BrokenChannelFailsRequests) {
+  auto connection = std::make_shared<net::TestConnection>();
+  ReplyQueue replies;
+  connection->CallOnRead(
+      [&replies](net::proto::Universal* message) { replies.Read(message); });
+
+  std::mutex mutex;
+  std::condition_variable condition;
+  ui32 failed = 0;
+  auto callback = [&](RemoteChannel::Reply reply) {
+    EXPECT_FALSE(!!reply);
+    std::lock_guard<std::mutex> lock(mutex);
+    ++failed;
+    condition.notify_all();
+  };
+
+  RemoteChannel channel(connection);
+  ASSERT_TRUE(
+      channel.Send(UniquePtr<proto::Remote>(new proto::Remote), callback));
+  ASSERT_TRUE(
+      channel.Send(UniquePtr<proto::Remote>(new proto::Remote), callback));
+
+  replies.Reply(0);
+  {
+    UniqueLock lock(mutex);
+    condition.wait(lock, [&failed] { return failed == 2; });
+  }
+
+  EXPECT_TRUE(channel.IsBroken());
+  EXPECT_FALSE(channel.WaitForSlot(1));
+  EXPECT_FALSE(
+      channel.Send(UniquePtr<proto::Remote>(new proto::Remote), callback));
+}
+
+}  // namespace daemon
+}  // namespace dist_clang
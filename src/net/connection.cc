@@ -15,6 +15,7 @@ bool Connection::SendAsync(ScopedMessage message, SendCallback callback) {
 
 template <>
 bool Connection::SendSync(ScopedMessage message, Status* status) {
+  std::lock_guard<std::mutex> lock(send_mutex_);
   message_ = std::move(message);
   return SendSyncImpl(status);
 }
@@ -3,6 +3,8 @@
 #include <net/connection_forward.h>
 #include <net/universal.pb.h>
 
+#include STL(mutex)
+
 namespace dist_clang {
 namespace net {
 
@@ -29,8 +31,11 @@ class Connection : public std::enable_shared_from_this<Connection> {
     return SendAsyncImpl(callback);
   }
 
+  // The sync sends from a few threads at once are serialized - while there is
+  // no async send in progress.
   template <class M>
   bool SendSync(UniquePtr<M> message, Status* status = nullptr) {
+    std::lock_guard<std::mutex> lock(send_mutex_);
     message_.reset(new Message);
     message_->SetAllocatedExtension(M::extension, message.release());
     return SendSyncImpl(status);
@@ -43,9 +48,17 @@ class Connection : public std::enable_shared_from_this<Connection> {
 
   virtual bool SendTimeout(ui32 sec_timeout, String* error = nullptr) = 0;
   virtual bool ReadTimeout(ui32 sec_timeout, String* error = nullptr) = 0;
+  virtual bool ReadLowWatermark(ui32 bytes_min, String* error = nullptr) = 0;
+  virtual bool KeepAlive(ui32 sec_idle, String* error = nullptr) = 0;
+  // Detects the dead peer of the idle connection - e.g. when its host is gone.
+
+  // Interrupts the sync operations in progress in the other threads - the
+  // connection fails after that.
+  virtual void Shutdown() = 0;
 
  protected:
   ScopedMessage message_;
+  std::mutex send_mutex_;
 
  private:
   virtual bool SendAsyncImpl(SendCallback callback) = 0;
@@ -153,6 +153,19 @@ bool ConnectionImpl::ReadTimeout(ui32 sec_timeout, String* error) {
   return true;
 }
 
+bool ConnectionImpl::ReadLowWatermark(ui32 bytes_min, String* error) {
+  return fd_.ReadLowWatermark(bytes_min, error);
+}
+
+bool ConnectionImpl::KeepAlive(ui32 sec_idle, String* error) {
+  return fd_.KeepAlive(sec_idle, error);
+}
+
+void ConnectionImpl::Shutdown() {
+  // Doesn't touch the streams - they may be in use by the other threads.
+  shutdown(fd_.native(), SHUT_RDWR);
+}
+
 bool ConnectionImpl::SendAsyncImpl(SendCallback callback) {
   auto shared = std::static_pointer_cast<ConnectionImpl>(shared_from_this());
   send_callback_ = std::bind(callback, shared_from_this(), _1);
@@ -39,6 +39,10 @@ class ConnectionImpl : public Connection {
 
   bool SendTimeout(ui32 sec_timeout, String* error) override;
   bool ReadTimeout(ui32 sec_timeout, String* error) override;
+  bool ReadLowWatermark(ui32 bytes_min, String* error) override;
+  bool KeepAlive(ui32 sec_idle, String* error) override;
+
+  void Shutdown() override;
 
  private:
   friend class EventLoop;
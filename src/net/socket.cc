@@ -3,7 +3,11 @@
 #include <base/c_utils.h>
 #include <net/end_point.h>
 
+#include STL(algorithm)
+
 #include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 
 namespace dist_clang {
@@ -104,5 +108,30 @@ bool Socket::ReadLowWatermark(ui64 bytes_min, String* error) {
   return true;
 }
 
+bool Socket::KeepAlive(ui32 sec_idle, String* error) {
+  const int enable = 1, probes = 3;
+  const int idle = std::max(1u, sec_idle);
+  const int interval = std::max(1, idle / probes);
+#if defined(OS_MACOSX)
+  const int idle_option = TCP_KEEPALIVE;
+#else
+  const int idle_option = TCP_KEEPIDLE;
+#endif  // defined(OS_MACOSX)
+
+  if (setsockopt(native(), SOL_SOCKET, SO_KEEPALIVE, &enable,
+                 sizeof(enable)) == -1 ||
+      setsockopt(native(), IPPROTO_TCP, idle_option, &idle, sizeof(idle)) ==
+          -1 ||
+      setsockopt(native(), IPPROTO_TCP, TCP_KEEPINTVL, &interval,
+                 sizeof(interval)) == -1 ||
+      setsockopt(native(), IPPROTO_TCP, TCP_KEEPCNT, &probes,
+                 sizeof(probes)) == -1) {
+    base::GetLastError(error);
+    return false;
+  }
+
+  return true;
+}
+
 }  // namespace net
 }  // namespace dist_clang
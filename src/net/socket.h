@@ -25,6 +25,9 @@ class Socket final : public base::Data {
   bool SendTimeout(ui32 sec_timeout, String* error = nullptr);
   bool ReadTimeout(ui32 sec_timeout, String* error = nullptr);
   bool ReadLowWatermark(ui64 bytes_min, String* error = nullptr);
+  bool KeepAlive(ui32 sec_idle, String* error = nullptr);
+  // The peer is probed after |sec_idle| seconds of silence - and the socket
+  // fails, if the peer doesn't answer a few probes.
 
  private:
   friend class Passive;
@@ -22,6 +22,14 @@ class TestConnection : public Connection {
   inline bool ReadTimeout(ui32 sec_timeout, String* error) override {
     return true;
   }
+  inline bool ReadLowWatermark(ui32 bytes_min, String* error) override {
+    return true;
+  }
+  inline bool KeepAlive(ui32 sec_idle, String* error) override {
+    return true;
+  }
+
+  inline void Shutdown() override {}
 
   void AbortOnSend();
   void AbortOnRead();
@@ -3,15 +3,21 @@
 namespace dist_clang {
 namespace perf {
 
-StatReporter::StatReporter(proto::Metric::Name name) : name_(name) {}
+StatReporter::StatReporter(proto::Metric::Name name, Unit unit)
+    : name_(name), unit_(unit) {}
 
 void StatReporter::Report(const TimePoint& start, const TimePoint& end) const {
   // TODO: implement different types of metrics. Right now just report the time
-  //       difference in milliseconds.
+  //       difference.
   using namespace std::chrono;
 
-  base::Singleton<StatService>::Get().Add(
-      name_, duration_cast<milliseconds>(end - start).count());
+  if (unit_ == MICROSECONDS) {
+    base::Singleton<StatService>::Get().Add(
+        name_, duration_cast<microseconds>(end - start).count());
+  } else {
+    base::Singleton<StatService>::Get().Add(
+        name_, duration_cast<milliseconds>(end - start).count());
+  }
 }
 
 }  // namespace perf
@@ -8,12 +8,15 @@ namespace perf {
 
 class StatReporter : public Reporter {
  public:
-  explicit StatReporter(proto::Metric::Name name);
+  enum Unit { MILLISECONDS, MICROSECONDS };
+
+  explicit StatReporter(proto::Metric::Name name, Unit unit = MILLISECONDS);
 
  private:
   void Report(const TimePoint& start, const TimePoint& end) const override;
 
   const proto::Metric::Name name_;
+  const Unit unit_;
 };
 
 }  // namespace perf